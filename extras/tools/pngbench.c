@@ -0,0 +1,829 @@
+/* pngbench.c
+ *
+ * This code is released under the libpng license.
+ * For conditions of distribution and use, see the disclaimer
+ * and license in png.h
+ *
+ * Benchmark decoding, transforms and encoding over a set of PNG files.  Each
+ * file is first re-encoded in memory twice, without interlacing and with
+ * Adam7, and every case below is run on both:
+ *
+ *    decode/lowlevel     png_read_image with no transforms
+ *    decode/simplified   png_image_finish_read to the image's own format
+ *    decode/progressive  png_process_data, fed 64KB at a time
+ *    transform/<name>    png_read_image with one png_set_<name> transform,
+ *                        only where it applies to the image format
+ *    encode/<filter>-<level>  png_write_png with one filter (or all) at a
+ *                        zlib level
+ *
+ * Each case is run 'runs' times and the fastest is kept; the order of the
+ * cases and files is fixed, so two runs on the same machine are comparable.
+ * Throughput is in MB/s of the raw image (height times png_get_rowbytes) for
+ * every case.  The allocations are those made through libpng's memory
+ * functions (the simplified API does not allow replacing them, so none are
+ * reported for it); 'alloc_peak' is the most bytes outstanding at one time.
+ * The peak RSS is that of the whole process so far.
+ *
+ *    pngbench [--runs N] [--json file] [--verbose] {file.png}
+ *
+ * The png_bench CMake target runs this over extras/contrib/testpngs and two
+ * large images made by genpng, writing png_bench.json in the build directory.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
+#include <time.h>
+
+#ifdef _WIN32
+#  include <windows.h>
+#  include <psapi.h>
+#else
+#  include <sys/resource.h>
+#endif
+
+#include <png.h>
+
+typedef struct
+{
+   png_bytep   data;
+   size_t      size;
+   size_t      max;
+} buffer;
+
+typedef struct
+{
+   png_const_bytep data;
+   size_t      size;
+   size_t      pos;
+} source;
+
+/* A case: how to run it is decided by 'kind'. */
+enum { DECODE, SIMPLIFIED, PROGRESSIVE, TRANSFORM, ENCODE };
+
+typedef struct
+{
+   const char *name;
+   int         kind;
+   int         arg;     /* transform index, or encode filter mask */
+   int         level;   /* zlib level for ENCODE */
+} bench_case;
+
+/* The transforms, each with the image formats it applies to. */
+enum
+{
+   T_EXPAND, T_EXPAND_16, T_STRIP_16, T_SCALE_16, T_PACKING, T_GRAY_TO_RGB,
+   T_RGB_TO_GRAY, T_GAMMA, T_ALPHA_MODE, T_BACKGROUND, T_STRIP_ALPHA,
+   T_BGR, T_SWAP, T_QUANTIZE
+};
+
+#define FILTERS_ALL (PNG_FILTER_NONE | PNG_FILTER_SUB | PNG_FILTER_UP | \
+   PNG_FILTER_AVG | PNG_FILTER_PAETH)
+
+static const bench_case cases[] =
+{
+   { "decode/lowlevel",       DECODE,      0, 0 },
+   { "decode/simplified",     SIMPLIFIED,  0, 0 },
+   { "decode/progressive",    PROGRESSIVE, 0, 0 },
+   { "transform/expand",      TRANSFORM,   T_EXPAND, 0 },
+   { "transform/expand_16",   TRANSFORM,   T_EXPAND_16, 0 },
+   { "transform/strip_16",    TRANSFORM,   T_STRIP_16, 0 },
+   { "transform/scale_16",    TRANSFORM,   T_SCALE_16, 0 },
+   { "transform/packing",     TRANSFORM,   T_PACKING, 0 },
+   { "transform/gray_to_rgb", TRANSFORM,   T_GRAY_TO_RGB, 0 },
+   { "transform/rgb_to_gray", TRANSFORM,   T_RGB_TO_GRAY, 0 },
+   { "transform/gamma",       TRANSFORM,   T_GAMMA, 0 },
+   { "transform/alpha_mode",  TRANSFORM,   T_ALPHA_MODE, 0 },
+   { "transform/background",  TRANSFORM,   T_BACKGROUND, 0 },
+   { "transform/strip_alpha", TRANSFORM,   T_STRIP_ALPHA, 0 },
+   { "transform/bgr",         TRANSFORM,   T_BGR, 0 },
+   { "transform/swap",        TRANSFORM,   T_SWAP, 0 },
+   { "transform/quantize",    TRANSFORM,   T_QUANTIZE, 0 },
+   { "encode/none-6",         ENCODE,      PNG_FILTER_NONE, 6 },
+   { "encode/sub-6",          ENCODE,      PNG_FILTER_SUB, 6 },
+   { "encode/up-6",           ENCODE,      PNG_FILTER_UP, 6 },
+   { "encode/avg-6",          ENCODE,      PNG_FILTER_AVG, 6 },
+   { "encode/paeth-6",        ENCODE,      PNG_FILTER_PAETH, 6 },
+   { "encode/all-1",          ENCODE,      FILTERS_ALL, 1 },
+   { "encode/all-6",          ENCODE,      FILTERS_ALL, 6 },
+   { "encode/all-9",          ENCODE,      FILTERS_ALL, 9 }
+};
+
+#define NCASES ((int)((sizeof cases) / (sizeof cases[0])))
+
+typedef struct
+{
+   double      seconds;
+   double      raw;
+   double      allocs;
+   int         images;
+} totals;
+
+/* Memory accounting through png_create_*_struct_2; each block starts with
+ * its size.
+ */
+typedef union
+{
+   size_t      size;
+   double      align_d;
+   void       *align_p;
+} mem_header;
+
+static size_t mem_allocs, mem_current, mem_peak;
+
+static png_voidp PNGCBAPI
+bench_malloc(png_const_structrp png_ptr, size_t size)
+{
+   mem_header *h = (mem_header*)malloc(sizeof (mem_header) + size);
+
+   (void)png_ptr;
+
+   if (h == NULL)
+      return NULL;
+
+   h->size = size;
+   ++mem_allocs;
+   mem_current += size;
+
+   if (mem_current > mem_peak)
+      mem_peak = mem_current;
+
+   return h + 1;
+}
+
+static void PNGCBAPI
+bench_free(png_const_structrp png_ptr, png_voidp ptr)
+{
+   (void)png_ptr;
+
+   if (ptr != NULL)
+   {
+      mem_header *h = (mem_header*)ptr - 1;
+
+      mem_current -= h->size;
+      free(h);
+   }
+}
+
+static void
+mem_reset(void)
+{
+   mem_allocs = mem_current = mem_peak = 0;
+}
+
+static double
+now(void)
+{
+   struct timespec ts;
+
+   timespec_get(&ts, TIME_UTC);
+   return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+/* The peak resident set size of the process in KB. */
+static unsigned long
+peak_rss_kb(void)
+{
+#ifdef _WIN32
+   PROCESS_MEMORY_COUNTERS pmc;
+
+   if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof pmc))
+      return (unsigned long)(pmc.PeakWorkingSetSize / 1024);
+
+   return 0;
+#else
+   struct rusage ru;
+
+   if (getrusage(RUSAGE_SELF, &ru) != 0)
+      return 0;
+
+#  ifdef __APPLE__
+      return (unsigned long)(ru.ru_maxrss / 1024); /* bytes */
+#  else
+      return (unsigned long)ru.ru_maxrss;
+#  endif
+#endif
+}
+
+static void PNGCBAPI
+bench_error(png_structrp png_ptr, png_const_charp message)
+{
+   (void)message;
+   png_longjmp(png_ptr, 1);
+}
+
+static void PNGCBAPI
+bench_warning(png_structrp png_ptr, png_const_charp message)
+{
+   (void)png_ptr;
+   (void)message;
+}
+
+static void PNGCBAPI
+read_source(png_structrp png_ptr, png_bytep data, size_t size)
+{
+   source *s = (source*)png_get_io_ptr(png_ptr);
+
+   if (size > s->size - s->pos)
+      png_error(png_ptr, "read beyond end of data");
+
+   memcpy(data, s->data + s->pos, size);
+   s->pos += size;
+}
+
+static void PNGCBAPI
+write_buffer(png_structrp png_ptr, png_const_bytep data, size_t size)
+{
+   buffer *b = (buffer*)png_get_io_ptr(png_ptr);
+
+   if (size > b->max - b->size)
+   {
+      size_t max = b->max < 65536 ? 65536 : b->max;
+      png_bytep p;
+
+      while (size > max - b->size)
+         max *= 2;
+
+      p = (png_bytep)realloc(b->data, max);
+      if (p == NULL)
+         png_error(png_ptr, "out of memory");
+
+      b->data = p;
+      b->max = max;
+   }
+
+   memcpy(b->data + b->size, data, size);
+   b->size += size;
+}
+
+static void PNGCBAPI
+flush_buffer(png_structrp png_ptr)
+{
+   (void)png_ptr;
+}
+
+/* The image being measured: the source file decoded with png_read_png, for
+ * the encode cases, and the re-encoded variant used by the decode cases.
+ */
+typedef struct
+{
+   png_structrp src_ptr;
+   png_infop   src_info;
+   png_uint_32 width;
+   png_uint_32 height;
+   int         bit_depth;
+   int         color_type;
+   int         has_trns;
+   double      raw;          /* bytes of the raw image */
+   buffer      file;         /* the variant being measured */
+} image;
+
+static int
+transform_applies(const image *im, int t)
+{
+   int ct = im->color_type, bd = im->bit_depth;
+   int alpha = (ct & PNG_COLOR_MASK_ALPHA) != 0;
+
+   switch (t)
+   {
+      case T_EXPAND:      return ct == PNG_COLOR_TYPE_PALETTE || bd < 8 ||
+                             im->has_trns;
+      case T_EXPAND_16:   return bd < 16;
+      case T_STRIP_16:
+      case T_SCALE_16:
+      case T_SWAP:        return bd == 16;
+      case T_PACKING:     return bd < 8;
+      case T_GRAY_TO_RGB: return (ct & PNG_COLOR_MASK_COLOR) == 0;
+      case T_RGB_TO_GRAY:
+      case T_BGR:         return (ct & PNG_COLOR_MASK_COLOR) != 0;
+      case T_GAMMA:       return 1;
+      case T_ALPHA_MODE:
+      case T_BACKGROUND:  return alpha || im->has_trns;
+      case T_STRIP_ALPHA: return alpha;
+      case T_QUANTIZE:    return (ct == PNG_COLOR_TYPE_RGB ||
+                             ct == PNG_COLOR_TYPE_RGB_ALPHA) && bd == 8;
+      default:            return 0;
+   }
+}
+
+static void
+set_transform(png_structrp png_ptr, int t)
+{
+   switch (t)
+   {
+      case T_EXPAND:      png_set_expand(png_ptr); break;
+      case T_EXPAND_16:   png_set_expand_16(png_ptr); break;
+      case T_STRIP_16:    png_set_strip_16(png_ptr); break;
+      case T_SCALE_16:    png_set_scale_16(png_ptr); break;
+      case T_PACKING:     png_set_packing(png_ptr); break;
+      case T_GRAY_TO_RGB: png_set_gray_to_rgb(png_ptr); break;
+      case T_RGB_TO_GRAY:
+         png_set_rgb_to_gray_fixed(png_ptr, PNG_ERROR_ACTION_NONE, -1, -1);
+         break;
+      case T_GAMMA:       png_set_gamma_fixed(png_ptr, 220000, 45455); break;
+      case T_ALPHA_MODE:
+         png_set_alpha_mode_fixed(png_ptr, PNG_ALPHA_PREMULTIPLIED,
+             PNG_DEFAULT_sRGB);
+         break;
+      case T_BACKGROUND:
+      {
+         png_color_16 bg;
+
+         memset(&bg, 0, sizeof bg);
+         bg.red = bg.green = bg.blue = bg.gray = 0x80;
+         png_set_background_fixed(png_ptr, &bg, PNG_BACKGROUND_GAMMA_SCREEN,
+             0, PNG_FP_1);
+         break;
+      }
+      case T_STRIP_ALPHA: png_set_strip_alpha(png_ptr); break;
+      case T_BGR:         png_set_bgr(png_ptr); break;
+      case T_SWAP:        png_set_swap(png_ptr); break;
+      case T_QUANTIZE:
+      {
+         /* A 6x6x6 color cube. */
+         png_color palette[216];
+         int i;
+
+         for (i = 0; i < 216; ++i)
+         {
+            palette[i].red = (png_byte)(51 * (i / 36));
+            palette[i].green = (png_byte)(51 * (i / 6 % 6));
+            palette[i].blue = (png_byte)(51 * (i % 6));
+         }
+
+         png_set_quantize(png_ptr, palette, 216, 216, NULL, 0);
+         break;
+      }
+   }
+}
+
+/* The progressive reader's state. */
+typedef struct
+{
+   png_bytep   pixels;
+   png_bytepp  rows;
+} progressive;
+
+static void PNGCBAPI
+progressive_info(png_structrp png_ptr, png_infop info_ptr)
+{
+   progressive *p = (progressive*)png_get_progressive_ptr(png_ptr);
+   png_uint_32 height = png_get_image_height(png_ptr, info_ptr);
+   size_t row_bytes;
+   png_uint_32 y;
+
+   (void)png_set_interlace_handling(png_ptr);
+   png_read_update_info(png_ptr, info_ptr);
+   row_bytes = png_get_rowbytes(png_ptr, info_ptr);
+
+   p->pixels = (png_bytep)calloc(height, row_bytes);
+   p->rows = (png_bytepp)malloc(height * sizeof (png_bytep));
+
+   if (p->pixels == NULL || p->rows == NULL)
+      png_error(png_ptr, "out of memory");
+
+   for (y = 0; y < height; ++y)
+      p->rows[y] = p->pixels + y * row_bytes;
+}
+
+static void PNGCBAPI
+progressive_row(png_structrp png_ptr, png_bytep new_row, png_uint_32 row_num,
+    int pass)
+{
+   progressive *p = (progressive*)png_get_progressive_ptr(png_ptr);
+
+   (void)pass;
+   png_progressive_combine_row(png_ptr, p->rows[row_num], new_row);
+}
+
+static void PNGCBAPI
+progressive_end(png_structrp png_ptr, png_infop info_ptr)
+{
+   (void)png_ptr;
+   (void)info_ptr;
+}
+
+/* Run one case once, returning the seconds taken or a negative value if the
+ * case failed.  'out' gets the encoded data of ENCODE cases.
+ */
+static double
+run_case(const image *im, const bench_case *c, buffer *out)
+{
+   png_structrp png_ptr = NULL;
+   png_infop info_ptr = NULL;
+   /* Assigned after the setjmp and freed by the error path. */
+   png_bytep volatile pixels = NULL;
+   png_bytepp volatile rows = NULL;
+   progressive prog = { NULL, NULL };
+   double start = now();
+   int write = c->kind == ENCODE;
+
+   if (c->kind == SIMPLIFIED)
+   {
+      png_image simple;
+      png_bytep buf;
+
+      memset(&simple, 0, sizeof simple);
+      simple.version = PNG_IMAGE_VERSION;
+
+      if (!png_image_begin_read_from_memory(&simple, im->file.data,
+          im->file.size))
+         return -1;
+
+      /* Adding or removing channels is measured by the transform cases. */
+      simple.format &= ~PNG_FORMAT_FLAG_COLORMAP;
+      buf = (png_bytep)malloc(PNG_IMAGE_SIZE(simple));
+
+      if (buf == NULL ||
+          !png_image_finish_read(&simple, NULL, buf, 0, NULL))
+      {
+         free(buf);
+         png_image_free(&simple);
+         return -1;
+      }
+
+      free(buf);
+      return now() - start;
+   }
+
+   if (write)
+      png_ptr = png_create_write_struct_2(PNG_LIBPNG_VER_STRING, NULL,
+          bench_error, bench_warning, NULL, bench_malloc, bench_free);
+
+   else
+      png_ptr = png_create_read_struct_2(PNG_LIBPNG_VER_STRING, NULL,
+          bench_error, bench_warning, NULL, bench_malloc, bench_free);
+
+   if (png_ptr == NULL)
+      return -1;
+
+   if (!write)
+      info_ptr = png_create_info_struct(png_ptr);
+
+   if (setjmp(png_jmpbuf(png_ptr)))
+   {
+      if (write)
+         png_destroy_write_struct((png_structpp)&png_ptr, NULL);
+
+      else
+         png_destroy_read_struct((png_structpp)&png_ptr, &info_ptr, NULL);
+
+      free(rows);
+      free(pixels);
+      free(prog.rows);
+      free(prog.pixels);
+      return -1;
+   }
+
+   png_set_benign_errors(png_ptr, 1);
+
+   if (write)
+   {
+      out->size = 0;
+      png_set_write_fn(png_ptr, out, write_buffer, flush_buffer);
+      png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, c->arg);
+      png_set_compression_level(png_ptr, c->level);
+      png_write_png(png_ptr, im->src_info, PNG_TRANSFORM_IDENTITY, NULL);
+      png_destroy_write_struct((png_structpp)&png_ptr, NULL);
+      return now() - start;
+   }
+
+   if (c->kind == PROGRESSIVE)
+   {
+      size_t pos;
+
+      png_set_progressive_read_fn(png_ptr, &prog, progressive_info,
+          progressive_row, progressive_end);
+
+      for (pos = 0; pos < im->file.size; pos += 65536)
+      {
+         size_t n = im->file.size - pos;
+
+         png_process_data(png_ptr, info_ptr, im->file.data + pos,
+             n < 65536 ? n : 65536);
+      }
+   }
+
+   else
+   {
+      source src;
+      size_t row_bytes;
+      png_uint_32 y;
+
+      src.data = im->file.data;
+      src.size = im->file.size;
+      src.pos = 0;
+      png_set_read_fn(png_ptr, &src, read_source);
+      png_read_info(png_ptr, info_ptr);
+
+      if (c->kind == TRANSFORM)
+         set_transform(png_ptr, c->arg);
+
+      (void)png_set_interlace_handling(png_ptr);
+      png_read_update_info(png_ptr, info_ptr);
+      row_bytes = png_get_rowbytes(png_ptr, info_ptr);
+
+      pixels = (png_bytep)malloc(im->height * row_bytes);
+      rows = (png_bytepp)malloc(im->height * sizeof (png_bytep));
+
+      if (pixels == NULL || rows == NULL)
+         png_error(png_ptr, "out of memory");
+
+      for (y = 0; y < im->height; ++y)
+         rows[y] = pixels + y * row_bytes;
+
+      png_read_image(png_ptr, rows);
+      png_read_end(png_ptr, NULL);
+   }
+
+   png_destroy_read_struct((png_structpp)&png_ptr, &info_ptr, NULL);
+   free(rows);
+   free(pixels);
+   free(prog.rows);
+   free(prog.pixels);
+   return now() - start;
+}
+
+/* Decode 'name' into 'im' and make its first variant. */
+static int
+load_image(const char *name, image *im)
+{
+   FILE *fp = fopen(name, "rb");
+   png_uint_32 width, height;
+   int bit_depth, color_type;
+
+   memset(im, 0, sizeof *im);
+
+   if (fp == NULL)
+   {
+      perror(name);
+      return 0;
+   }
+
+   im->src_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL,
+       bench_error, bench_warning);
+   im->src_info = png_create_info_struct(im->src_ptr);
+
+   if (im->src_info == NULL || setjmp(png_jmpbuf(im->src_ptr)))
+   {
+      fprintf(stderr, "pngbench: %s: cannot be read\n", name);
+      png_destroy_read_struct((png_structpp)&im->src_ptr, &im->src_info,
+          NULL);
+      fclose(fp);
+      return 0;
+   }
+
+   png_set_benign_errors(im->src_ptr, 1);
+   png_init_io(im->src_ptr, fp);
+   png_read_png(im->src_ptr, im->src_info, PNG_TRANSFORM_IDENTITY, NULL);
+   fclose(fp);
+
+   png_get_IHDR(im->src_ptr, im->src_info, &width, &height, &bit_depth,
+       &color_type, NULL, NULL, NULL);
+   im->width = width;
+   im->height = height;
+   im->bit_depth = bit_depth;
+   im->color_type = color_type;
+   im->has_trns =
+      png_get_valid(im->src_ptr, im->src_info, PNG_INFO_tRNS) != 0;
+   im->raw = (double)height *
+      (double)png_get_rowbytes(im->src_ptr, im->src_info);
+
+   return 1;
+}
+
+/* Re-encode the image in memory with 'interlace' for the decode cases. */
+static int
+make_variant(image *im, int interlace)
+{
+   static const bench_case encode = { "", ENCODE, FILTERS_ALL, 6 };
+
+   png_set_IHDR(im->src_ptr, im->src_info, im->width, im->height,
+       im->bit_depth, im->color_type, interlace, PNG_COMPRESSION_TYPE_BASE,
+       PNG_FILTER_TYPE_BASE);
+
+   return run_case(im, &encode, &im->file) >= 0;
+}
+
+static void
+json_string(FILE *fp, const char *s)
+{
+   putc('"', fp);
+
+   for (; *s != 0; ++s)
+   {
+      if (*s == '"' || *s == '\\')
+         putc('\\', fp);
+
+      putc(*s, fp);
+   }
+
+   putc('"', fp);
+}
+
+/* Measure every case on 'im' with 'interlace', adding to 'sum'. */
+static int
+measure(const char *name, image *im, int interlace, int runs, int verbose,
+    FILE *json, int *first, totals *sum)
+{
+   buffer out = { NULL, 0, 0 };
+   int i;
+
+   for (i = 0; i < NCASES; ++i)
+   {
+      const bench_case *c = cases + i;
+      double best = 0;
+      size_t allocs = 0, peak = 0;
+      int run;
+
+      if (c->kind == TRANSFORM && !transform_applies(im, c->arg))
+         continue;
+
+      for (run = 0; run < runs; ++run)
+      {
+         double t;
+
+         mem_reset();
+         t = run_case(im, c, &out);
+
+         if (t < 0)
+         {
+            fprintf(stderr, "pngbench: %s: %s failed\n", name, c->name);
+            break;
+         }
+
+         if (run == 0 || t < best)
+            best = t;
+
+         allocs = mem_allocs;
+         peak = mem_peak;
+      }
+
+      if (run < runs)
+         continue;
+
+      if (best <= 0)
+         best = 1e-9;
+
+      sum[2*i + interlace].seconds += best;
+      sum[2*i + interlace].raw += im->raw;
+      sum[2*i + interlace].allocs += (double)allocs;
+      sum[2*i + interlace].images += 1;
+
+      if (verbose)
+         printf("%-24s %-5s %9.3f ms %8.1f MB/s %7lu allocs  %s\n", c->name,
+             interlace ? "adam7" : "none", 1e3 * best, im->raw / best / 1e6,
+             (unsigned long)allocs, name);
+
+      if (json != NULL)
+      {
+         fprintf(json, "%s\n    {\"file\": ", *first ? "" : ",");
+         json_string(json, name);
+         fprintf(json, ", \"width\": %lu, \"height\": %lu, "
+             "\"bit_depth\": %d, \"color_type\": %d, \"interlace\": \"%s\", "
+             "\"case\": \"%s\", \"seconds\": %.9f, \"mbps\": %.3f",
+             (unsigned long)im->width, (unsigned long)im->height,
+             im->bit_depth, im->color_type, interlace ? "adam7" : "none",
+             c->name, best, im->raw / best / 1e6);
+
+         if (c->kind == ENCODE)
+            fprintf(json, ", \"bytes\": %lu", (unsigned long)out.size);
+
+         if (c->kind == SIMPLIFIED)
+            fprintf(json, ", \"allocs\": null, \"alloc_peak\": null");
+
+         else
+            fprintf(json, ", \"allocs\": %lu, \"alloc_peak\": %lu",
+                (unsigned long)allocs, (unsigned long)peak);
+
+         fprintf(json, ", \"peak_rss_kb\": %lu}", peak_rss_kb());
+         *first = 0;
+      }
+   }
+
+   free(out.data);
+   return 1;
+}
+
+int
+main(int argc, char **argv)
+{
+   static totals sum[2*NCASES];
+   const char *json_name = NULL;
+   FILE *json = NULL;
+   int runs = 3, verbose = 0, nfiles = 0, first = 1;
+   int i;
+
+   while (--argc > 0)
+   {
+      const char *arg = *++argv;
+
+      if (strcmp(arg, "--runs") == 0 && argc > 1)
+      {
+         --argc;
+         runs = atoi(*++argv);
+
+         if (runs < 1)
+            runs = 1;
+      }
+
+      else if (strcmp(arg, "--json") == 0 && argc > 1)
+      {
+         --argc;
+         json_name = *++argv;
+      }
+
+      else if (strcmp(arg, "--verbose") == 0)
+         verbose = 1;
+
+      else if (arg[0] == '-')
+      {
+         fprintf(stderr,
+             "usage: pngbench [--runs N] [--json file] [--verbose] "
+             "{file.png}\n");
+         return 1;
+      }
+
+      else
+         break;
+   }
+
+   if (json_name != NULL)
+   {
+      json = fopen(json_name, "w");
+
+      if (json == NULL)
+      {
+         perror(json_name);
+         return 1;
+      }
+
+      fprintf(json, "{\n  \"libpng\": \"%s\",\n  \"runs\": %d,\n"
+          "  \"results\": [", PNG_LIBPNG_VER_STRING, runs);
+   }
+
+   for (; argc > 0; --argc, ++argv)
+   {
+      image im;
+      int interlace;
+
+      if (!load_image(*argv, &im))
+         continue;
+
+      for (interlace = 0; interlace < 2; ++interlace)
+      {
+         if (!make_variant(&im, interlace))
+            fprintf(stderr, "pngbench: %s: cannot be re-encoded\n", *argv);
+
+         else
+            measure(*argv, &im, interlace, runs, verbose, json, &first, sum);
+      }
+
+      free(im.file.data);
+      png_destroy_read_struct((png_structpp)&im.src_ptr, &im.src_info, NULL);
+      ++nfiles;
+   }
+
+   printf("%d files, best of %d runs\n%-24s %10s %10s %12s\n", nfiles, runs,
+       "case", "none MB/s", "adam7 MB/s", "allocs/image");
+
+   for (i = 0; i < NCASES; ++i)
+   {
+      const totals *t = sum + 2*i;
+
+      if (t[0].images == 0 && t[1].images == 0)
+         continue;
+
+      printf("%-24s %10.1f %10.1f %12.1f\n", cases[i].name,
+          t[0].seconds > 0 ? t[0].raw / t[0].seconds / 1e6 : 0,
+          t[1].seconds > 0 ? t[1].raw / t[1].seconds / 1e6 : 0,
+          cases[i].kind == SIMPLIFIED ? 0 :
+          (t[0].allocs + t[1].allocs) / (t[0].images + t[1].images));
+   }
+
+   printf("peak RSS %lu KB\n", peak_rss_kb());
+
+   if (json != NULL)
+   {
+      fprintf(json, "\n  ],\n  \"totals\": [");
+
+      for (i = 0, first = 1; i < 2*NCASES; ++i)
+      {
+         const totals *t = sum + i;
+
+         if (t->images == 0)
+            continue;
+
+         fprintf(json, "%s\n    {\"case\": \"%s\", \"interlace\": \"%s\", "
+             "\"images\": %d, \"mbps\": %.3f}", first ? "" : ",",
+             cases[i/2].name, i & 1 ? "adam7" : "none", t->images,
+             t->raw / t->seconds / 1e6);
+         first = 0;
+      }
+
+      fprintf(json, "\n  ],\n  \"peak_rss_kb\": %lu\n}\n", peak_rss_kb());
+      fclose(json);
+   }
+
+   return nfiles > 0 ? 0 : 1;
+}
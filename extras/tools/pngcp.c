@@ -161,6 +161,8 @@ typedef enum
 #define NOWRITE         0x200 /* Do not write an output file */
 #define IGNORE_INDEX    0x400 /* Ignore out of range palette indices (BAD!) */
 #define FIX_INDEX       0x800 /* 'Fix' out of range palette indices (OK) */
+#define RECOMPRESS     0x1000 /* Keep the filtered rows, only recompress */
+#define REFILTER       0x2000 /* Recompress, choosing the filters again */
 #define OPTION     0x80000000 /* Used for handling options */
 #define LIST       0x80000001 /* Used for handling options */
 
@@ -313,6 +315,8 @@ static const option options[] =
 #  ifdef FIX_INDEX
       S(fix-palette-index, FIX_INDEX)
 #  endif /* FIX_INDEX */
+   S(recompress, RECOMPRESS)
+   S(refilter, REFILTER)
 #  undef S
 
    /* OPTION settings, these and LIST settings are read on demand */
@@ -403,6 +407,10 @@ struct display
    size_t read_size;
    png_struct*      read_pp;
    png_infop        ip;
+
+   /* --recompress reads the file again for each write */
+   FILE            *recompress_fp;
+   png_infop        recompress_ip;
 #  if PNG_LIBPNG_VER < 10700
       png_textp     text_ptr; /* stash of text chunks */
       int           num_text;
@@ -490,6 +498,8 @@ display_init(struct display *dp)
    dp->fp = NULL;
    dp->read_pp = NULL;
    dp->ip = NULL;
+   dp->recompress_fp = NULL;
+   dp->recompress_ip = NULL;
    dp->write_pp = NULL;
    dp->min_windowBits = -1; /* this is an OPTIND, so -1 won't match anything */
 #  if PNG_LIBPNG_VER < 10700
@@ -503,7 +513,7 @@ static void
 display_clean_read(struct display *dp)
 {
    if (dp->read_pp != NULL)
-      png_destroy_read_struct(&dp->read_pp, NULL, NULL);
+      png_destroy_read_struct(&dp->read_pp, &dp->recompress_ip, NULL);
 
    if (dp->fp != NULL)
    {
@@ -511,6 +521,13 @@ display_clean_read(struct display *dp)
       dp->fp = NULL;
       (void)fclose(fp);
    }
+
+   if (dp->recompress_fp != NULL)
+   {
+      FILE *fp = dp->recompress_fp;
+      dp->recompress_fp = NULL;
+      (void)fclose(fp);
+   }
 }
 
 static void
@@ -1743,6 +1760,10 @@ static void
 read_png(struct display *dp, const char *filename)
 {
    display_clean_read(dp); /* safety */
+
+   if ((dp->options & (RECOMPRESS|REFILTER)) != 0 && filename == NULL)
+      display_log(dp, USER_ERROR, "--recompress cannot read from stdin");
+
    display_start_read(dp, filename);
 
    dp->read_pp = png_create_read_struct(PNG_LIBPNG_VER_STRING, dp,
@@ -1781,7 +1802,10 @@ read_png(struct display *dp, const char *filename)
 
    /* Now read the PNG. */
    start_timer(dp, PNGCP_TIME_READ);
-   png_read_png(dp->read_pp, dp->ip, 0U/*transforms*/, NULL/*params*/);
+   if ((dp->options & (RECOMPRESS|REFILTER)) != 0)
+      png_read_info(dp->read_pp, dp->ip); /* the image is read by write_png */
+   else
+      png_read_png(dp->read_pp, dp->ip, 0U/*transforms*/, NULL/*params*/);
    end_timer(dp, PNGCP_TIME_READ);
    dp->w = png_get_image_width(dp->read_pp, dp->ip);
    dp->h = png_get_image_height(dp->read_pp, dp->ip);
@@ -1806,7 +1830,8 @@ read_png(struct display *dp, const char *filename)
    }
 
 #ifdef FIX_INDEX
-   if (dp->ct == PNG_COLOR_TYPE_PALETTE && (dp->options & FIX_INDEX) != 0)
+   if (dp->ct == PNG_COLOR_TYPE_PALETTE && (dp->options & FIX_INDEX) != 0 &&
+       (dp->options & (RECOMPRESS|REFILTER)) == 0)
    {
       int max = png_get_palette_max(dp->read_pp, dp->ip);
       png_colorp palette = NULL;
@@ -1952,6 +1977,49 @@ set_text_compression(struct display *dp)
 #  undef SET
 }
 
+static void
+recompress_png(struct display *dp)
+{
+   /* Read the file again and pass its image data, inflated but not decoded,
+    * to the write struct.  The other chunks are copied unchanged.
+    */
+   dp->recompress_fp = fopen(dp->filename, "rb");
+   if (dp->recompress_fp == NULL)
+      display_log(dp, USER_ERROR, "%s: file open failed (%s)", dp->filename,
+            strerror(errno));
+
+   dp->read_pp = png_create_read_struct(PNG_LIBPNG_VER_STRING, dp,
+      display_error, display_warning);
+   if (dp->read_pp == NULL)
+      display_log(dp, LIBPNG_ERROR, "failed to create read struct");
+
+   png_set_benign_errors(dp->read_pp, 1/*allowed*/);
+
+   dp->recompress_ip = png_create_info_struct(dp->read_pp);
+   if (dp->recompress_ip == NULL)
+      png_error(dp->read_pp, "failed to create info struct");
+
+   png_init_io(dp->read_pp, dp->recompress_fp);
+   png_set_user_limits(dp->read_pp, 0x7fffffff, 0x7fffffff);
+
+   png_rewrite_recompress(dp->read_pp, dp->recompress_ip, dp->write_pp,
+      NULL/*rewrite_fn*/, NULL/*rewrite_arg*/,
+      (dp->options & REFILTER) != 0 ? PNG_RECOMPRESS_REFILTER : 0);
+
+   /* Not display_clean_read; dp->fp is the output file. */
+   png_destroy_read_struct(&dp->read_pp, &dp->recompress_ip, NULL);
+   {
+      FILE *fp = dp->recompress_fp;
+      long size = ftell(fp);
+
+      if (size > 0)
+         dp->read_size = (size_t)size;
+
+      dp->recompress_fp = NULL;
+      (void)fclose(fp);
+   }
+}
+
 static void
 write_png(struct display *dp, const char *destname)
 {
@@ -2027,7 +2095,10 @@ write_png(struct display *dp, const char *destname)
    /* This just uses the 'read' info_struct directly, it contains the image. */
    dp->write_size = 0U;
    start_timer(dp, PNGCP_TIME_WRITE);
-   png_write_png(dp->write_pp, dp->ip, 0U/*transforms*/, NULL/*params*/);
+   if ((dp->options & (RECOMPRESS|REFILTER)) != 0)
+      recompress_png(dp);
+   else
+      png_write_png(dp->write_pp, dp->ip, 0U/*transforms*/, NULL/*params*/);
    end_timer(dp, PNGCP_TIME_WRITE);
 
    /* Make sure the file was written ok: */
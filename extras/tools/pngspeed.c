@@ -0,0 +1,408 @@
+/* pngspeed.c
+ *
+ * This code is released under the libpng license.
+ * For conditions of distribution and use, see the disclaimer
+ * and license in png.h
+ *
+ * Measure the encode speed and the compression of each png_set_encode_speed
+ * tier.  The images are the PNG files given on the command line, decoded to
+ * 8 bits per component, and optionally a synthetic screen shot.  Each image is
+ * encoded to memory 'runs' times at each tier and the fastest time is kept.
+ * The output gives, for each tier, the throughput in MB/s of raw image data,
+ * the compressed size as a fraction of the raw size and, for a screen shot,
+ * the time for one frame.
+ *
+ *    pngspeed [--runs N] [--screen WxH] [--verbose] {file.png}
+ *
+ * The table in the manual was produced with a 1920x1080 screen shot and all
+ * the PNG files in data and extras/contrib/testpngs.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <png.h>
+
+#define TIERS 5
+
+static const char *tier_name[TIERS] =
+{
+   "realtime", "fast", "default", "small", "archive"
+};
+
+typedef struct
+{
+   png_bytep   data;
+   size_t      size;
+   size_t      max;
+} buffer;
+
+typedef struct
+{
+   double      seconds;
+   double      raw;
+   double      compressed;
+} totals;
+
+static double
+now(void)
+{
+   struct timespec ts;
+
+   timespec_get(&ts, TIME_UTC);
+   return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+static void
+write_buffer(png_structrp png_ptr, png_const_bytep data, size_t size)
+{
+   buffer *b = (buffer*)png_get_io_ptr(png_ptr);
+
+   if (size > b->max - b->size)
+   {
+      size_t max = b->max < 65536 ? 65536 : b->max;
+      png_bytep p;
+
+      while (size > max - b->size)
+         max *= 2;
+
+      p = (png_bytep)realloc(b->data, max);
+      if (p == NULL)
+         png_error(png_ptr, "out of memory");
+
+      b->data = p;
+      b->max = max;
+   }
+
+   memcpy(b->data + b->size, data, size);
+   b->size += size;
+}
+
+static void
+flush_buffer(png_structrp png_ptr)
+{
+   (void)png_ptr;
+}
+
+/* Encode the image once at 'tier', returning the seconds taken or a negative
+ * value on error.
+ */
+static double
+encode(png_const_bytep pixels, png_uint_32 width, png_uint_32 height,
+    int channels, int tier, buffer *out)
+{
+   static const int color_type[5] = { 0, PNG_COLOR_TYPE_GRAY,
+       PNG_COLOR_TYPE_GRAY_ALPHA, PNG_COLOR_TYPE_RGB, PNG_COLOR_TYPE_RGBA };
+   size_t row_bytes = (size_t)width * channels;
+   png_structrp png_ptr;
+   png_infop info_ptr;
+   double start;
+   png_uint_32 y;
+
+   out->size = 0;
+   start = now();
+
+   png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+   info_ptr = png_create_info_struct(png_ptr);
+
+   if (png_ptr == NULL || info_ptr == NULL || setjmp(png_jmpbuf(png_ptr)))
+   {
+      png_destroy_write_struct((png_structpp)&png_ptr, &info_ptr);
+      return -1;
+   }
+
+   png_set_write_fn(png_ptr, out, write_buffer, flush_buffer);
+   png_set_IHDR(png_ptr, info_ptr, width, height, 8, color_type[channels],
+       PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+   png_set_encode_speed(png_ptr, tier);
+   png_write_info(png_ptr, info_ptr);
+
+   for (y = 0; y < height; ++y)
+      png_write_row(png_ptr, pixels + y * row_bytes);
+
+   png_write_end(png_ptr, info_ptr);
+   png_destroy_write_struct((png_structpp)&png_ptr, &info_ptr);
+
+   return now() - start;
+}
+
+/* Encode the image at every tier, adding to 'sum'.  Returns 0 on error. */
+static int
+measure(const char *name, png_const_bytep pixels, png_uint_32 width,
+    png_uint_32 height, int channels, int runs, int verbose, totals *sum)
+{
+   size_t raw = (size_t)width * height * channels;
+   buffer out = { NULL, 0, 0 };
+   int tier;
+
+   for (tier = 0; tier < TIERS; ++tier)
+   {
+      double best = 0;
+      int run;
+
+      for (run = 0; run < runs; ++run)
+      {
+         double t = encode(pixels, width, height, channels, tier + 1, &out);
+
+         if (t < 0)
+         {
+            fprintf(stderr, "pngspeed: %s: encode failed\n", name);
+            free(out.data);
+            return 0;
+         }
+
+         if (run == 0 || t < best)
+            best = t;
+      }
+
+      sum[tier].seconds += best;
+      sum[tier].raw += (double)raw;
+      sum[tier].compressed += (double)out.size;
+
+      if (verbose)
+         printf("%-9s %9.2f ms %8.1f MB/s  ratio %.4f  %s\n",
+             tier_name[tier], 1e3 * best, raw / best / 1e6,
+             (double)out.size / raw, name);
+   }
+
+   free(out.data);
+   return 1;
+}
+
+/* A desktop: a vertical gradient background, windows with title bars and
+ * lines of text drawn from a small set of glyphs, and a photograph-like area
+ * with smooth color and some noise.
+ */
+static png_bytep
+screen_shot(png_uint_32 width, png_uint_32 height)
+{
+   png_bytep pixels = (png_bytep)malloc((size_t)width * height * 3);
+   png_byte glyphs[32][10];
+   unsigned int seed = 1;
+   png_uint_32 x, y;
+   int i, j;
+
+   if (pixels == NULL)
+      return NULL;
+
+   for (i = 0; i < 32; ++i)
+      for (j = 0; j < 10; ++j)
+      {
+         seed = seed * 1103515245U + 12345U;
+         glyphs[i][j] = (png_byte)((seed >> 16) & 0x7e);
+      }
+
+   for (y = 0; y < height; ++y)
+   {
+      png_bytep row = pixels + (size_t)y * width * 3;
+
+      for (x = 0; x < width; ++x)
+      {
+         png_bytep p = row + 3 * x;
+         int r = 40 + (int)(80 * y / height), g = 70, b = 110 + (int)(y % 7);
+
+         /* Two windows, each with a title bar. */
+         if (x >= width / 16 && x < width / 2 && y >= height / 10 &&
+             y < 9 * height / 10)
+         {
+            if (y < height / 10 + 24)
+               r = 60, g = 90, b = 160;
+
+            else
+            {
+               /* Text: 10 pixel high glyphs on 16 pixel lines. */
+               png_uint_32 line = (y - height / 10 - 24) / 16;
+               png_uint_32 gy = (y - height / 10 - 24) % 16;
+               png_uint_32 column = (x - width / 16) / 8;
+
+               r = g = b = 250;
+
+               if (gy < 10 && (line * 7 + column * 3) % 23 != 0 &&
+                   column % 40 < 32 + line % 8)
+               {
+                  unsigned int c = (line * 31 + column * 17 +
+                      (line * column) % 5) % 32;
+
+                  if ((glyphs[c][gy] >> ((x - width / 16) % 8)) & 1)
+                     r = g = b = 30;
+               }
+            }
+         }
+
+         else if (x >= 9 * width / 16 && x < 15 * width / 16 &&
+             y >= height / 5 && y < 4 * height / 5)
+         {
+            if (y < height / 5 + 24)
+               r = 200, g = 200, b = 205;
+
+            else
+            {
+               seed = seed * 1103515245U + 12345U;
+               r = (int)(128 + 100 * (x % 256) / 256) + (int)(seed >> 29);
+               g = (int)(60 + 150 * (y % 300) / 300) + (int)((seed >> 26) & 3);
+               b = (int)(90 + ((x + y) & 63)) + (int)((seed >> 24) & 3);
+            }
+         }
+
+         p[0] = (png_byte)r;
+         p[1] = (png_byte)g;
+         p[2] = (png_byte)b;
+      }
+   }
+
+   return pixels;
+}
+
+static png_bytep
+read_file(const char *name, png_uint_32 *width, png_uint_32 *height,
+    int *channels)
+{
+   png_image image;
+   png_bytep pixels;
+
+   memset(&image, 0, sizeof image);
+   image.version = PNG_IMAGE_VERSION;
+
+   if (!png_image_begin_read_from_file(&image, name))
+   {
+      fprintf(stderr, "pngspeed: %s: %s\n", name, image.message);
+      return NULL;
+   }
+
+   /* 8-bit components without a color-map; BGR and alpha first are
+    * irrelevant to the encoder.
+    */
+   image.format &= PNG_FORMAT_FLAG_COLOR | PNG_FORMAT_FLAG_ALPHA;
+   pixels = (png_bytep)malloc(PNG_IMAGE_SIZE(image));
+
+   if (pixels == NULL ||
+       !png_image_finish_read(&image, NULL, pixels, 0, NULL))
+   {
+      fprintf(stderr, "pngspeed: %s: %s\n", name,
+          pixels == NULL ? "out of memory" : image.message);
+      free(pixels);
+      png_image_free(&image);
+      return NULL;
+   }
+
+   *width = image.width;
+   *height = image.height;
+   *channels = (int)PNG_IMAGE_SAMPLE_CHANNELS(image.format);
+   return pixels;
+}
+
+static void
+print_totals(const char *title, const totals *sum, int frame)
+{
+   int tier;
+
+   printf("\n%s\n%-9s %10s %8s%s\n", title, "tier", "MB/s", "ratio",
+       frame ? "  ms/frame" : "");
+
+   for (tier = 0; tier < TIERS; ++tier)
+   {
+      printf("%-9s %10.1f %8.4f", tier_name[tier],
+          sum[tier].raw / sum[tier].seconds / 1e6,
+          sum[tier].compressed / sum[tier].raw);
+
+      if (frame)
+         printf("  %9.2f", 1e3 * sum[tier].seconds);
+
+      printf("\n");
+   }
+}
+
+int
+main(int argc, char **argv)
+{
+   totals files[TIERS], screen[TIERS];
+   png_uint_32 screen_width = 0, screen_height = 0;
+   int runs = 5, verbose = 0, nfiles = 0;
+
+   memset(files, 0, sizeof files);
+   memset(screen, 0, sizeof screen);
+
+   while (--argc > 0)
+   {
+      const char *arg = *++argv;
+
+      if (strcmp(arg, "--runs") == 0 && argc > 1)
+      {
+         --argc;
+         runs = atoi(*++argv);
+
+         if (runs < 1)
+            runs = 1;
+      }
+
+      else if (strcmp(arg, "--screen") == 0 && argc > 1)
+      {
+         unsigned int w, h;
+
+         --argc;
+         if (sscanf(*++argv, "%ux%u", &w, &h) != 2 || w == 0 || h == 0)
+         {
+            fprintf(stderr, "pngspeed: %s: invalid screen size\n", *argv);
+            return 1;
+         }
+
+         screen_width = w;
+         screen_height = h;
+      }
+
+      else if (strcmp(arg, "--verbose") == 0)
+         verbose = 1;
+
+      else if (arg[0] == '-')
+      {
+         fprintf(stderr,
+             "usage: pngspeed [--runs N] [--screen WxH] [--verbose] "
+             "{file.png}\n");
+         return 1;
+      }
+
+      else
+      {
+         png_uint_32 width, height;
+         int channels;
+         png_bytep pixels = read_file(arg, &width, &height, &channels);
+
+         if (pixels == NULL)
+            return 1;
+
+         if (!measure(arg, pixels, width, height, channels, runs, verbose,
+             files))
+            return 1;
+
+         free(pixels);
+         ++nfiles;
+      }
+   }
+
+   if (screen_width > 0)
+   {
+      png_bytep pixels = screen_shot(screen_width, screen_height);
+      char title[64];
+
+      if (pixels == NULL ||
+          !measure("screen", pixels, screen_width, screen_height, 3, runs,
+          verbose, screen))
+         return 1;
+
+      free(pixels);
+      sprintf(title, "screen shot %lux%lu RGB",
+          (unsigned long)screen_width, (unsigned long)screen_height);
+      print_totals(title, screen, 1);
+   }
+
+   if (nfiles > 0)
+   {
+      char title[64];
+
+      sprintf(title, "%d files", nfiles);
+      print_totals(title, files, 0);
+   }
+
+   return 0;
+}
@@ -0,0 +1,26 @@
+#pragma once
+#ifndef PNG_ADAM7_H
+#define PNG_ADAM7_H
+
+#include <png/png.h>
+
+/* Parallel encoding of interlaced images for png_write_image.  The seven
+ * passes are extracted and filtered from the whole image, then deflated, in
+ * bands on worker threads, and the bands are joined into one IDAT stream.
+ */
+
+typedef struct png_adam7_def png_adam7, *png_adam7p;
+typedef const png_adam7 *png_const_adam7p;
+
+/* Write all the rows of 'image'.  Returns 0, having written nothing, if the
+ * image cannot be written this way (it is small, not interlaced, has
+ * transformations or flushing, is being written by one of the tiers with
+ * their own encoder, or memory ran out); png_write_row must then be used.
+ */
+int
+png_adam7_write_image (png_structrp png_ptr, png_bytepp image);
+
+void
+png_adam7_destroy (png_structrp png_ptr, png_adam7p adam7);
+
+#endif /* PNG_ADAM7_H */
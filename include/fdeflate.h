@@ -0,0 +1,30 @@
+#pragma once
+#ifndef PNG_FDEFLATE_H
+#define PNG_FDEFLATE_H
+
+#include <png/png.h>
+
+/* A fast deflate encoder for IDAT, used by the PNG_ENCODE_SPEED_REALTIME
+ * tier of png_set_encode_speed.  It does one hash probe per position and
+ * writes fixed Huffman codes, so it trades some compression for a speed that
+ * zlib does not reach even at level 1.
+ */
+
+typedef struct png_fast_deflate_def png_fast_deflate, *png_fast_deflatep;
+
+/* Allocate the encoder state and write the zlib header. */
+png_fast_deflatep
+png_fast_deflate_create (png_structrp png_ptr);
+
+void
+png_fast_deflate_destroy (png_structrp png_ptr, png_fast_deflatep fd);
+
+/* Compress 'len' bytes, writing the output with png_write_IDAT_bytes.
+ * 'flush' is Z_NO_FLUSH, Z_SYNC_FLUSH or Z_FINISH; after Z_FINISH the
+ * stream, including the Adler-32, is complete.
+ */
+void
+png_fast_deflate_data (png_structrp png_ptr, png_fast_deflatep fd,
+  png_const_bytep data, size_t len, int flush);
+
+#endif /* PNG_FDEFLATE_H */
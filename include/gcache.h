@@ -0,0 +1,44 @@
+#pragma once
+#ifndef PNG_GCACHE_H
+#define PNG_GCACHE_H
+
+#include <png/png.h>
+
+/* A cache of gamma tables for png_structs that run one after another on the
+ * same thread, as the jobs of one worker of png_image_batch_read do.  With
+ * png_ptr->gamma_cache set, png_build_gamma_table takes tables with the same
+ * parameters from the cache instead of building them, and gives the tables it
+ * builds to the cache; png_destroy_gamma_table leaves those to the cache.  It
+ * is not locked, so it must only be used by one png_struct at a time.  Since
+ * the cache frees the tables itself the png_struct must use the default
+ * allocator.
+ */
+typedef struct png_gamma_cache_def png_gamma_cache, *png_gamma_cachep;
+
+/* Table kinds: an 8-bit table, a 16-bit table, and a 16-bit to 8-bit table
+ * (which has the layout of a 16-bit table).
+ */
+#define PNG_GAMMA_TABLE_8     0
+#define PNG_GAMMA_TABLE_16    1
+#define PNG_GAMMA_TABLE_16TO8 2
+
+/* Returns NULL if out of memory. */
+png_gamma_cachep
+png_gamma_cache_create (void);
+
+void
+png_gamma_cache_destroy (png_gamma_cachep cache);
+
+/* A png_bytep for an 8-bit table, otherwise a png_uint_16pp; NULL if there is
+ * no such table.
+ */
+png_voidp
+png_gamma_cache_find (png_gamma_cachep cache, int kind, unsigned int shift,
+  png_fixed_point gamma_val);
+
+/* Returns 1 if the cache took 'table', 0 if it is full. */
+int
+png_gamma_cache_add (png_gamma_cachep cache, int kind, unsigned int shift,
+  png_fixed_point gamma_val, png_voidp table);
+
+#endif /* PNG_GCACHE_H */
@@ -0,0 +1,37 @@
+#pragma once
+#ifndef PNG_ICCACHE_H
+#define PNG_ICCACHE_H
+
+#include <png/png.h>
+
+/* A process-wide cache of the ICC profiles read from iCCP chunks.  An entry
+ * is keyed on the compressed chunk data (after the keyword and compression
+ * method) and holds the decompressed profile and its Adler-32, so a profile
+ * seen before is copied instead of being decompressed and checksummed again.
+ * Access is serialized with a mutex, so png_structs on any thread share it;
+ * the mutex is not held while the application allocator is called.
+ * PNG_ICC_CACHE_SIZE is the initial limit on the bytes kept, compressed plus
+ * decompressed; png_set_icc_cache_size changes it.
+ */
+#ifndef PNG_ICC_CACHE_SIZE
+#  define PNG_ICC_CACHE_SIZE (1024*1024)
+#endif
+
+/* The current limit; 0 when the cache is disabled. */
+size_t
+png_icc_cache_limit (void);
+
+/* Look up the compressed profile 'data'.  On a hit the profile is copied to
+ * png_read_buffer and returned with its length and Adler-32; otherwise, or if
+ * the buffer cannot be allocated, NULL is returned.
+ */
+png_bytep
+png_icc_cache_find (png_structrp png_ptr, png_const_bytep data, size_t size,
+  png_uint_32 *profile_length, png_uint_32 *adler);
+
+/* Remember a profile that passed all the checks. */
+void
+png_icc_cache_add (png_const_bytep data, size_t size, png_const_bytep profile,
+  png_uint_32 profile_length, png_uint_32 adler);
+
+#endif /* PNG_ICCACHE_H */
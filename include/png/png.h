@@ -630,6 +630,21 @@ typedef png_unknown_chunk * png_unknown_chunkp;
 typedef const png_unknown_chunk * png_const_unknown_chunkp;
 typedef png_unknown_chunk * * png_unknown_chunkpp;
 
+/* png_chunk_location records where a chunk was found in the datastream.  An
+ * array of these is built by png_read_metadata; see below.
+ */
+typedef struct png_chunk_location_t
+{
+   png_byte name[5];   /* Textual chunk name with '\0' terminator */
+   png_uint_32 length; /* Length of the chunk data */
+   png_off_t offset;   /* Offset of the chunk length field from the start of
+                        * the PNG signature */
+}
+png_chunk_location;
+
+typedef png_chunk_location * png_chunk_locationp;
+typedef const png_chunk_location * png_const_chunk_locationp;
+
 /* Flag values for the unknown chunk location byte. */
 #define PNG_HAVE_IHDR  0x01
 #define PNG_HAVE_PLTE  0x02
@@ -766,6 +781,12 @@ typedef PNG_CALLBACK(void, *png_error_ptr, (png_struct*, png_const_charp));
 typedef PNG_CALLBACK(void, *png_read_ptr, (png_struct*, png_bytep, size_t));
 typedef PNG_CALLBACK(void, *png_write_ptr, (png_struct*, png_const_bytep, size_t));
 typedef PNG_CALLBACK (void, *png_flush_ptr, (png_struct*));
+/* The seek callback moves the input to the given offset, measured in bytes
+ * from the start of the PNG signature.  It returns non-zero on success and 0
+ * if the input cannot be repositioned, in which case libpng reads and discards
+ * the data instead.
+ */
+typedef PNG_CALLBACK(int, *png_seek_ptr, (png_struct*, png_off_t));
 typedef PNG_CALLBACK(void, *png_read_status_ptr, (png_struct*, png_uint_32,
     int));
 typedef PNG_CALLBACK(void, *png_write_status_ptr, (png_struct*, png_uint_32,
@@ -899,6 +920,42 @@ png_sig_cmp (png_const_bytep sig, size_t start, size_t num_to_check);
  */
 #define png_check_sig(sig, n) !png_sig_cmp((sig), 0, (n))
 
+/* A summary of the image header, filled in by png_probe_header. */
+typedef struct png_header_summary
+{
+   png_uint_32 width;
+   png_uint_32 height;
+   png_byte bit_depth;
+   png_byte color_type;
+   png_byte interlace_type;
+   png_byte flags;           /* PNG_HEADER_ values below */
+} png_header_summary;
+
+#define PNG_HEADER_HAVE_PLTE  0x01 /* PLTE precedes the first IDAT */
+#define PNG_HEADER_HAVE_tRNS  0x02 /* tRNS precedes the first IDAT */
+#define PNG_HEADER_HAVE_acTL  0x04 /* the image is an APNG animation */
+#define PNG_HEADER_HAVE_ALPHA 0x08 /* alpha channel or tRNS */
+#define PNG_HEADER_COMPLETE   0x10 /* the scan reached the first IDAT, so the
+                                    * flags above are final */
+
+/* png_probe_header return values */
+#define PNG_PROBE_OK         1
+#define PNG_PROBE_NOT_PNG    0  /* bad or missing signature */
+#define PNG_PROBE_TRUNCATED (-1) /* too little data for the IHDR chunk */
+#define PNG_PROBE_INVALID   (-2) /* IHDR missing, damaged or invalid */
+
+/* Examine the start of a PNG datastream held in memory without creating a
+ * png_struct.  The signature and IHDR are checked (IHDR with the same rules as
+ * png_read_info, using the default user limits) and the chunk headers are then
+ * scanned up to the first IDAT.  No memory is allocated and no longjmp is
+ * used, so this is safe to call on untrusted data of any size.  The summary is
+ * only valid when PNG_PROBE_OK is returned; if the buffer ends before the
+ * first IDAT PNG_HEADER_COMPLETE is not set.
+ */
+int PNGAPI
+png_probe_header (png_const_voidp data, size_t size,
+  png_header_summary *summary);
+
 /* Allocate and initialize png_ptr struct for reading, and any other memory. */
 png_struct* PNGAPI
 png_create_read_struct (png_const_charp user_png_ver, png_voidp error_ptr, png_error_ptr error_fn,
@@ -1270,6 +1327,13 @@ void PNGAPI
 png_set_quantize (png_structrp png_ptr, png_colorp palette, int num_palette, int maximum_colors,
     png_const_uint_16p histogram, int full_quantize);
 
+/* Dither RGB images quantized with full_quantize set: each pixel is mapped to
+ * the nearest palette color and the difference is diffused to the neighbouring
+ * pixels (Floyd-Steinberg).  Off by default.
+ */
+void PNGAPI
+png_set_quantize_dither (png_structrp png_ptr, int dither);
+
 /* The threshold on gamma processing is configurable but hard-wired into the
  * library.  The following is the floating point variant.
  */
@@ -1300,6 +1364,61 @@ png_set_flush (png_structrp png_ptr, int nrows);
 void PNGAPI
 png_write_flush (png_structrp png_ptr);
 
+/* Incremental encoding of a sequence of similar images.  An encode cache keeps
+ * the compressed image data of the last image written with it, in bands of
+ * 'band_rows' rows (0 selects 32).  Each band ends with a zlib full flush,
+ * which costs a few bytes and loses the compression history at band
+ * boundaries.  When the next image is written with png_set_encode_cache and
+ * the rows that changed, any band whose rows (and the row before it) are
+ * unchanged is copied rather than filtered and compressed again.  All rows
+ * must still be passed to png_write_row.  The cached data is discarded if the
+ * image size, format, transformations, filters or compression settings
+ * change.  The cache is not tied to a png_struct and is allocated with
+ * malloc; it must only be used by one png_struct at a time.  While an image is
+ * written its data is kept in the png_struct's memory (so it counts against
+ * png_set_mem_budget) and copied to the cache when the image is complete.
+ */
+typedef struct png_encode_cache_def png_encode_cache;
+typedef png_encode_cache * png_encode_cachep;
+typedef const png_encode_cache * png_const_encode_cachep;
+
+png_encode_cachep PNGAPI
+png_create_encode_cache (png_uint_32 band_rows);
+
+void PNGAPI
+png_destroy_encode_cache (png_encode_cachep cache);
+
+/* Use 'cache' for the image about to be written, where rows first_row to
+ * first_row+num_rows-1 differ from the image last written with the cache.
+ * Call before the first row is written.  Interlaced images ignore the cache.
+ */
+void PNGAPI
+png_set_encode_cache (png_structrp png_ptr, png_encode_cachep cache,
+  png_uint_32 first_row, png_uint_32 num_rows);
+
+/* The iCCP, zTXt and compressed iTXt chunks written by png_write_info, and
+ * those left for png_write_end, are compressed together on worker threads.
+ * A compress cache keeps the compressed data for later images, so a profile
+ * or XMP packet that every image carries is compressed once.  Entries are
+ * matched on the whole of the uncompressed data and the text compression
+ * settings.  'max_bytes' (0 selects 4MB) limits the uncompressed plus
+ * compressed bytes kept; the least recently used entries are dropped first.
+ * The cache is allocated with malloc, outside png_set_mem_budget, and is not
+ * tied to a png_struct, but it must only be used by one png_struct at a time.
+ */
+typedef struct png_compress_cache_def png_compress_cache;
+typedef png_compress_cache * png_compress_cachep;
+
+png_compress_cachep PNGAPI
+png_create_compress_cache (size_t max_bytes);
+
+void PNGAPI
+png_destroy_compress_cache (png_compress_cachep cache);
+
+/* Call before png_write_info. */
+void PNGAPI
+png_set_compress_cache (png_structrp png_ptr, png_compress_cachep cache);
+
 /* Optional update palette with requested transformations */
 void PNGAPI
 png_start_read_image (png_structrp png_ptr);
@@ -1344,6 +1463,148 @@ png_write_end (png_structrp png_ptr, png_inforp info_ptr);
 void PNGAPI
 png_read_end (png_structrp png_ptr, png_inforp info_ptr);
 
+/* Read all the chunks from the signature to IEND into info_ptr without
+ * decoding the image.  The IDAT data is skipped, using the seek function if
+ * one has been set with png_set_seek_fn, so neither it nor its CRC is checked.
+ * Ancillary chunks marked PNG_HANDLE_CHUNK_NEVER with
+ * png_set_keep_unknown_chunks are skipped in the same way.  This is used
+ * instead of png_read_info/png_read_end; the image cannot be read afterwards.
+ */
+void PNGAPI
+png_read_metadata (png_structrp png_ptr, png_inforp info_ptr);
+
+/* The result of png_read_verify.  The counts reflect the progress made so far,
+ * so after a png_error they show where the problem was found.
+ */
+typedef struct png_verify_result
+{
+   png_uint_32 flags;            /* PNG_VERIFY_ values below */
+   png_uint_32 rows;             /* rows (of all passes) inflated */
+   png_uint_32 filter_count[5];  /* rows using each filter type */
+   png_off_t image_bytes;        /* inflated image data, with filter bytes */
+   png_off_t file_bytes;         /* length of the whole datastream */
+   int palette_max;              /* largest palette index found, -1 if the
+                                  * check was not requested or not needed */
+} png_verify_result;
+
+#define PNG_VERIFY_COMPLETE      0x01 /* result: the datastream is intact */
+#define PNG_VERIFY_PALETTE_INDEX 0x02 /* flags argument: check palette indices;
+                                       * result: an index was out of range */
+
+/* Check the integrity of a PNG datastream without decoding it.  All chunk
+ * CRCs are checked, the IDAT stream is inflated one row at a time (checking
+ * the Adler-32), filter types and the amount of image data are validated and,
+ * if PNG_VERIFY_PALETTE_INDEX is passed in flags, palette indices are
+ * checked against the PLTE chunk.  Any error is reported through png_error
+ * so a setjmp (or error callback) is required as for any other read.
+ * Transformations are never run and no image buffers are needed.  Call this
+ * instead of png_read_info/png_read_end, or after png_read_info (in which case
+ * the earlier chunks have been checked with the application's CRC settings.)
+ * The CRC, Adler-32 and benign error settings are the application's again
+ * when this returns or longjmps/throws with an error.
+ */
+void PNGAPI
+png_read_verify (png_structrp png_ptr, png_inforp info_ptr,
+  png_verify_result *result, int flags);
+
+/* Return the number of chunks found by png_read_metadata and, if 'locations'
+ * is not NULL, a pointer to an array giving the name, length and offset of
+ * each one in file order.  The array belongs to png_ptr.
+ */
+png_uint_32 PNGAPI
+png_get_chunk_locations (png_const_structrp png_ptr,
+  png_const_chunk_locationp *locations);
+
+/* Build an index of inflate checkpoints for a non-interlaced image, to be
+ * called straight after png_read_info.  The whole of the image data is read;
+ * a checkpoint is recorded about every 'span' bytes of inflated data (0 gives
+ * a default of 1MB) and each one costs up to 32K plus a row of storage.  The
+ * index is returned in '*index' (free it with png_free) and may be saved with
+ * the file; it is only valid for the exact file it was built from.  After
+ * this call png_struct can only be used for png_read_end.
+ */
+void PNGAPI
+png_read_build_index (png_structrp png_ptr, size_t span, png_bytepp index,
+  size_t *index_size);
+
+/* Read rows y0 to y1-1 of a non-interlaced image into 'rows', decoding from the
+ * nearest checkpoint in 'index' rather than from the start of the image.  A
+ * seek function (png_set_seek_fn) is required.  Call after png_read_info and
+ * any transformation setup; png_read_update_info may be called first.  The
+ * function may be called repeatedly, in any row order, but may not be mixed
+ * with png_read_row and afterwards the input is left within the image data, so
+ * png_read_end cannot be used.  CRCs of the IDAT chunks are not checked.
+ */
+void PNGAPI
+png_read_indexed_rows (png_structrp png_ptr, png_const_bytep index,
+  size_t index_size, png_uint_32 y0, png_uint_32 y1, png_bytepp rows);
+
+/* Copy the PNG datastream read by read_ptr to write_ptr chunk by chunk,
+ * without decoding or recompressing the image.  IHDR is read into info_ptr
+ * and written again; every other chunk is copied.  Ancillary chunks marked
+ * PNG_HANDLE_CHUNK_NEVER with png_set_keep_unknown_chunks on read_ptr are
+ * skipped unread.  rewrite_fn, if not NULL, is called before each other
+ * chunk is written, with the chunk name, data and length; for the IDAT
+ * chunks it is called once with NULL data before the first, and for IEND
+ * with NULL data.  It may write new chunks with png_write_chunk on write_ptr,
+ * which go before the chunk, and it returns PNG_REWRITE_DROP to remove an
+ * ancillary chunk or PNG_REWRITE_KEEP.  Critical chunks are always kept.
+ *
+ * If idat_size is 0 the IDAT chunks are copied unchanged, CRCs included,
+ * after each CRC is checked.  On Linux, with the default stdio I/O on both
+ * structs and the critical chunk CRC action set to PNG_CRC_QUIET_USE, the
+ * kernel copies them without reading them.  Otherwise the image data is
+ * written in IDAT chunks of idat_size bytes (the last may be shorter), so
+ * many small chunks can be combined.  Errors are reported through the
+ * struct where they happen, so both need a setjmp.
+ */
+#define PNG_REWRITE_KEEP 0
+#define PNG_REWRITE_DROP 1
+
+typedef PNG_CALLBACK(int, *png_rewrite_ptr, (png_struct*, png_voidp,
+    png_const_bytep, png_const_bytep, png_uint_32));
+
+void PNGAPI
+png_rewrite_chunks (png_structrp read_ptr, png_inforp info_ptr,
+  png_structrp write_ptr, png_rewrite_ptr rewrite_fn, png_voidp rewrite_arg,
+  png_uint_32 idat_size);
+
+/* As png_rewrite_chunks, but the image data is decompressed and compressed
+ * again with the settings of write_ptr (compression level, strategy, encode
+ * speed, IDAT size...)  The rows keep the filters chosen by the original
+ * encoder, so neither side filters or transforms the pixels, unless flags
+ * has PNG_RECOMPRESS_REFILTER, when the rows are unfiltered and new filters
+ * are chosen by write_ptr's png_set_filter setting.  Refiltering is implied
+ * by PNG_ENCODE_SPEED_ARCHIVE and SMALLEST.  Any transformations set on either
+ * struct are ignored.
+ */
+#define PNG_RECOMPRESS_REFILTER 1
+
+void PNGAPI
+png_rewrite_recompress (png_structrp read_ptr, png_inforp info_ptr,
+  png_structrp write_ptr, png_rewrite_ptr rewrite_fn, png_voidp rewrite_arg,
+  int flags);
+
+/* Decode the image through the transformations set on read_ptr and encode
+ * the rows with write_ptr as they are produced, so that nothing bigger than
+ * a row is held.  The rows are passed straight from the read struct's row
+ * buffer to png_write_row, with write_ptr's own transformations, if any,
+ * applied there.  info_ptr is read with png_read_info (unless that has been
+ * done), updated by png_read_update_info and written with png_write_info,
+ * and the chunks after the image go through png_read_end and png_write_end.
+ *
+ * interlace_type is PNG_INTERLACE_NONE or PNG_INTERLACE_ADAM7, or negative
+ * to keep the input's.  Changing it needs the whole image, so in that case
+ * the transformed image is buffered in info_ptr's row pointers, freed before
+ * returning.  That buffer, height times (rowbytes plus a pointer), is
+ * allocated through read_ptr, so png_set_mem_budget on read_ptr limits it:
+ * an image that would not fit in what is left of the budget is rejected with
+ * png_error before any row is allocated.  Without a budget there is no limit.
+ */
+void PNGAPI
+png_transcode (png_structrp read_ptr, png_inforp info_ptr,
+  png_structrp write_ptr, int interlace_type);
+
 /* Free any memory associated with the png_info_struct */
 void PNGAPI
 png_destroy_info_struct (png_const_structrp png_ptr, png_infopp info_ptr_ptr);
@@ -1442,6 +1703,29 @@ png_set_compression_window_bits (png_structrp png_ptr, int window_bits);
 void PNGAPI
 png_set_compression_method (png_structrp png_ptr, int method);
 
+/* Set the row filters and IDAT compression settings together for one of the
+ * speed tiers below; call before the first row is written.  The settings can
+ * still be adjusted with the functions above afterwards.  REALTIME uses the
+ * Up filter and a fast built-in deflate encoder instead of zlib; FAST is the
+ * Sub filter at zlib level 1; DEFAULT restores the libpng defaults; SMALL uses
+ * level 9.  ARCHIVE and SMALLEST keep the whole image in memory and at the
+ * end compress it with several filter strategies and zlib strategies at level
+ * 9 on worker threads, writing the smallest result.  ARCHIVE tries no
+ * filtering, the usual heuristic and a lowest-entropy choice per row; SMALLEST
+ * adds each single filter and a trial compression of every row with each
+ * filter.  png_set_flush has no effect with these two.  The libpng manual
+ * lists measured speeds and sizes for each tier.
+ */
+#define PNG_ENCODE_SPEED_REALTIME 1
+#define PNG_ENCODE_SPEED_FAST     2
+#define PNG_ENCODE_SPEED_DEFAULT  3
+#define PNG_ENCODE_SPEED_SMALL    4
+#define PNG_ENCODE_SPEED_ARCHIVE  5
+#define PNG_ENCODE_SPEED_SMALLEST 6
+
+void PNGAPI
+png_set_encode_speed (png_structrp png_ptr, int speed);
+
 /* Also set zlib parameters for compressing non-IDAT chunks */
 void PNGAPI
 png_set_text_compression_level (png_structrp png_ptr, int level);
@@ -1506,6 +1790,13 @@ png_set_write_fn (png_structrp png_ptr, png_voidp io_ptr, png_write_ptr write_da
 void PNGAPI
 png_set_read_fn (png_structrp png_ptr, png_voidp io_ptr, png_read_ptr read_data_fn);
 
+/* Supply a function to reposition the input.  This is optional; when it is
+ * set libpng uses it to skip data it does not need (see png_read_metadata)
+ * instead of reading and discarding that data.  Pass NULL to remove it.
+ */
+void PNGAPI
+png_set_seek_fn (png_structrp png_ptr, png_seek_ptr seek_fn);
+
 /* Return the user pointer associated with the I/O functions */
 png_voidp PNGAPI
 png_get_io_ptr (png_const_structrp png_ptr);
@@ -2179,6 +2470,100 @@ png_set_chunk_malloc_max (png_structrp png_ptr, size_t user_chunk_cache_max);
 size_t PNGAPI 
 png_get_chunk_malloc_max (png_const_structrp png_ptr);
 
+/* Memory allocated through a png_struct, including zlib's, counted once
+ * png_set_mem_budget has been called.  Blocks allocated earlier (such as the
+ * png_struct itself) are not included.
+ */
+typedef struct png_mem_stats
+{
+   size_t current;      /* bytes allocated now */
+   size_t peak;         /* most bytes allocated at one time */
+   png_off_t allocs;    /* number of allocations */
+   size_t budget;       /* the limit, 0 if there is none */
+} png_mem_stats;
+
+/* Count the memory allocated through png_ptr and fail any allocation that
+ * would take the total over max_bytes (0 for no limit): png_malloc then calls
+ * png_error with "Memory budget exceeded", as it does when out of memory.
+ * Unlike png_set_chunk_malloc_max this covers all the buffers of the read or
+ * write, including those the worker threads use, so call it as soon as the
+ * png_struct is created.  It does not cover the caches that outlive a
+ * png_struct (the encode, compress and ICC profile caches) nor the gamma
+ * tables png_image_batch_read shares between its images.  Calling it again
+ * changes the limit.
+ */
+void PNGAPI
+png_set_mem_budget (png_structrp png_ptr, size_t max_bytes);
+
+/* Fill in *stats and return 1, or return 0 if png_set_mem_budget has not been
+ * called.
+ */
+int PNGAPI
+png_get_mem_stats (png_const_structrp png_ptr, png_mem_stats *stats);
+
+/* Bound the work done reading one image, so that a small but expensive file
+ * cannot hold a thread for long: the total bytes produced by inflate (image
+ * data and compressed chunks), the number of chunks, the number of pixels
+ * passed through the read transformations, and the time in milliseconds from
+ * this call.  The time is checked at each row and chunk.  Exceeding a limit
+ * calls png_error.  0 means no limit; all 0 removes the limits.  Calling this
+ * again starts the counts and the clock again.
+ */
+void PNGAPI
+png_set_work_limits (png_structrp png_ptr, png_off_t max_inflated_bytes,
+  png_uint_32 max_chunks, png_off_t max_pixels, png_uint_32 max_milliseconds);
+
+/* Profiles read from iCCP chunks are kept in a cache shared by all the
+ * png_structs of the process (access is thread safe).  A chunk whose
+ * compressed data matches a cached profile is not decompressed again, nor is
+ * its checksum recomputed for the sRGB check.  This sets the most bytes kept,
+ * compressed and decompressed, and returns the previous limit; 0 disables the
+ * cache and frees what it holds.  The default is 1MB.
+ */
+size_t PNGAPI
+png_set_icc_cache_size (size_t max_bytes);
+
+/* Time and bytes spent in each stage of reading or writing, for finding where
+ * a slow decode goes.  'bytes' is the data handled by the stage: read or
+ * written through the I/O callbacks, checksummed, produced by inflate,
+ * consumed by deflate, or the length of the rows unfiltered, filtered,
+ * transformed or combined.
+ */
+typedef struct png_stage_stats
+{
+   png_off_t calls;
+   png_off_t bytes;
+   png_off_t nanoseconds;
+} png_stage_stats;
+
+#define PNG_STAT_READ_DATA       0 /* the read callback */
+#define PNG_STAT_CRC             1 /* chunk CRCs, reading and writing */
+#define PNG_STAT_INFLATE         2 /* IDAT and compressed chunk data */
+#define PNG_STAT_UNFILTER        3 /* rows with a filter other than None */
+#define PNG_STAT_READ_TRANSFORM  4
+#define PNG_STAT_COMBINE_ROW     5 /* copying rows out, with interlacing */
+#define PNG_STAT_WRITE_DATA      6 /* the write callback */
+#define PNG_STAT_DEFLATE         7 /* IDAT data compressed by zlib */
+#define PNG_STAT_FILTER          8 /* filtering and filter selection */
+#define PNG_STAT_WRITE_TRANSFORM 9
+#define PNG_STAT_COUNT          10
+
+/* Turn the counters on, zeroing them, or off.  Call it as soon as the
+ * png_struct is created to count everything; with the counters off the only
+ * cost is one pointer test per stage.  IDAT data compressed by the realtime,
+ * archive and smallest png_set_encode_speed tiers is not counted under
+ * PNG_STAT_DEFLATE.
+ */
+void PNGAPI
+png_set_stats (png_structrp png_ptr, int enable);
+
+/* Copy the counters of the first 'count' stages (at most PNG_STAT_COUNT) to
+ * stats[], indexed by PNG_STAT_ value.  Returns the number copied, 0 if the
+ * counters are off.
+ */
+int PNGAPI
+png_get_stats (png_const_structrp png_ptr, png_stage_stats *stats, int count);
+
 png_uint_32 PNGAPI
 png_get_pixels_per_inch (png_const_structrp png_ptr, png_const_inforp info_ptr);
 
@@ -2710,6 +3095,29 @@ typedef struct
     * because that call initializes the 'flags' field.
     */
 
+#define PNG_IMAGE_FLAG_QUANTIZE 0x08
+   /* On write reduce an 8-bit RGB (or BGR) image without alpha to a palette
+    * image.  The palette is chosen from the image colors by median cut; the
+    * number of entries is at most 'colormap_entries', or 256 if that is 0 or
+    * larger.  The pixels are mapped to the nearest palette color.  The work is
+    * shared between threads.  The flag is ignored for other formats.
+    */
+
+#define PNG_IMAGE_FLAG_QUANTIZE_DITHER 0x10
+   /* With PNG_IMAGE_FLAG_QUANTIZE apply Floyd-Steinberg dithering when mapping
+    * the pixels to the palette.  The error is carried down the whole image,
+    * so this part of the work is done on one thread.
+    */
+
+#define PNG_IMAGE_FLAG_REDUCE 0x20
+   /* On write examine an 8-bit image and write it in the smallest PNG format
+    * that represents it exactly: without an all-opaque alpha channel, as gray
+    * if all the pixels are gray, with fewer bits per pixel for gray levels that
+    * allow it, or as a palette image (with tRNS as needed) if there are at
+    * most 256 distinct pixel values.  16-bit (linear) and color-mapped images
+    * are written unchanged.
+    */
+
 /* READ APIs
  * ---------
  *
@@ -2772,6 +3180,38 @@ png_image_free (png_imagep image);
     * NULL.  May be called at any time after the structure is initialized.
     */
 
+/* Batch read: many PNG files in memory are decoded on worker threads.  Each
+ * job is png_image_begin_read_from_memory then png_image_finish_read into a
+ * buffer supplied in advance.  The caller sets 'image' as for
+ * png_image_begin_read_from_memory (zero it and set 'version') and also sets
+ * image.format to the format wanted, which is kept over the header read.  If
+ * the image needs more than buffer_size bytes, the job fails with
+ * image.width, height and format set, so the caller can allocate
+ * PNG_IMAGE_BUFFER_SIZE bytes and run it again.
+ */
+typedef struct
+{
+   png_const_voidp  memory;      /* the PNG file */
+   size_t           memory_size;
+   png_image        image;       /* in and out, see above */
+   png_voidp        buffer;      /* for the image */
+   size_t           buffer_size; /* bytes at buffer */
+   png_int_32       row_stride;  /* these are as for png_image_finish_read */
+   png_const_colorp background;
+   png_voidp        colormap;    /* PNG_IMAGE_COLORMAP_SIZE bytes, 256 entries */
+   int              status;      /* set: nonzero if the job succeeded */
+} png_image_batch_job;
+
+int PNGAPI
+png_image_batch_read (png_image_batch_job *jobs, size_t count);
+   /* Run 'count' jobs and return the number that succeeded; a failed job has
+    * its message in image.message.  Jobs are handed to the threads one at a
+    * time, largest file first, so a large image does not hold up the end of
+    * the batch.  Each thread keeps the gamma tables it builds for the later
+    * jobs it runs.  The jobs must not share buffers.  The threads are kept
+    * for later calls; a child process made with fork() starts its own.
+    */
+
 /* WRITE APIS
  * ----------
  * For write you must initialize a png_image structure to describe the image to
@@ -2975,6 +3415,22 @@ png_set_option (png_structrp png_ptr, int option, int onoff);
 
 #ifdef __cplusplus
 }
+
+#include <stdexcept>
+
+namespace png {
+
+/* The exception thrown by png_error when libpng is built with the
+ * PNG_EXCEPTIONS option and the application has not called png_jmpbuf.
+ * what() returns the libpng error message.
+ */
+class error : public std::runtime_error
+{
+public:
+   explicit error (const char *message) : std::runtime_error(message) {}
+};
+
+} /* namespace png */
 #endif
 
 /* Do not put anything past this line */
@@ -492,6 +492,11 @@
  */
 typedef png_int_32 png_fixed_point;
 
+/* Typedef for byte offsets within a PNG datastream; this is wide enough for
+ * streams larger than 4GB.
+ */
+typedef unsigned long long png_off_t;
+
 /* Add typedefs for pointers */
 typedef void                  * png_voidp;
 typedef const void            * png_const_voidp;
@@ -0,0 +1,254 @@
+/* pngcxx.h - C++ interface to libpng
+ *
+ * This code is released under the libpng license.
+ * For conditions of distribution and use, see the disclaimer
+ * and license in png.h
+ *
+ * png::reader and png::writer own a png_struct and its png_info and destroy
+ * them when they go out of scope.  They are move-only.  Errors are thrown as
+ * png::error whether or not libpng was built with PNG_EXCEPTIONS, so no
+ * setjmp is needed.
+ *
+ * Rows are decoded straight into the caller's buffer and encoded straight
+ * from it; neither class allocates per row or per image.  Metadata is
+ * returned as png::view, a pointer and a count into the png_info, valid
+ * until the object is destroyed.  When compiled as C++20 the row functions
+ * also take std::span, and a png::view converts to std::span.
+ *
+ * Anything not wrapped here is available through get() and info(), for
+ * example png_set_expand(reader.get()) before the first row is read.
+ */
+#ifndef PNGCXX_H
+#define PNGCXX_H
+
+#include "png.h"
+
+#if (defined(_MSVC_LANG) && _MSVC_LANG >= 202002L) || __cplusplus >= 202002L
+#  if __has_include(<span>)
+#     include <span>
+#     define PNG_CXX_SPAN
+#  endif
+#endif
+
+namespace png {
+
+/* Memory for the png_struct and everything libpng allocates with it.
+ * allocate may return nullptr or throw std::bad_alloc on failure; libpng
+ * then reports its usual out of memory error.
+ */
+class allocator
+{
+public:
+   virtual ~allocator () {}
+   virtual void *allocate (size_t size) = 0;
+   virtual void deallocate (void *ptr) = 0;
+};
+
+/* Input for a reader.  read must supply exactly 'length' bytes or throw. */
+class source
+{
+public:
+   virtual ~source () {}
+   virtual void read (png_bytep data, size_t length) = 0;
+};
+
+/* Output for a writer. */
+class sink
+{
+public:
+   virtual ~sink () {}
+   virtual void write (png_const_bytep data, size_t length) = 0;
+   virtual void flush () {}
+};
+
+/* A non-owning array, the metadata counterpart of std::span. */
+template <typename T>
+class view
+{
+public:
+   view () : data_(nullptr), size_(0) {}
+   view (T *data, size_t size) : data_(data), size_(data != nullptr ? size : 0)
+   {}
+
+   T *data () const { return data_; }
+   size_t size () const { return size_; }
+   bool empty () const { return size_ == 0; }
+   T *begin () const { return data_; }
+   T *end () const { return data_ + size_; }
+   T &operator[] (size_t i) const { return data_[i]; }
+
+private:
+   T *data_;
+   size_t size_;
+};
+
+class reader
+{
+public:
+   explicit reader (FILE *fp, allocator *alloc = nullptr);
+   reader (const void *data, size_t size, allocator *alloc = nullptr);
+   explicit reader (source &in, allocator *alloc = nullptr);
+#ifdef PNG_CXX_SPAN
+   explicit reader (std::span<const png_byte> data, allocator *alloc = nullptr)
+      : reader(data.data(), data.size(), alloc) {}
+#endif
+
+   reader (reader &&other) noexcept;
+   reader &operator= (reader &&other) noexcept;
+   reader (const reader &) = delete;
+   reader &operator= (const reader &) = delete;
+   ~reader ();
+
+   png_struct *get () const { return png_ptr_; }
+   png_info *info () const { return info_ptr_; }
+
+   /* Reads up to the image data.  Set transforms after this. */
+   void read_info ();
+
+   png_uint_32 width () const
+      { return png_get_image_width(png_ptr_, info_ptr_); }
+   png_uint_32 height () const
+      { return png_get_image_height(png_ptr_, info_ptr_); }
+   int bit_depth () const { return png_get_bit_depth(png_ptr_, info_ptr_); }
+   int color_type () const { return png_get_color_type(png_ptr_, info_ptr_); }
+   int channels () const { return png_get_channels(png_ptr_, info_ptr_); }
+   int interlace_type () const
+      { return png_get_interlace_type(png_ptr_, info_ptr_); }
+
+   /* The first of these fixes the transforms; the values describe the rows
+    * as they will be delivered.  passes() is 7 for an interlaced image, in
+    * which case read_row must be called passes() * height() times.
+    */
+   size_t rowbytes ();
+   int passes ();
+
+   /* 'size' is checked against rowbytes(), and for read_image against
+    * stride * (height() - 1) + rowbytes().  A stride of 0 means rowbytes().
+    */
+   void read_row (png_bytep row, size_t size);
+   void read_image (png_bytep image, size_t size, size_t stride = 0);
+#ifdef PNG_CXX_SPAN
+   void read_row (std::span<png_byte> row) { read_row(row.data(), row.size()); }
+   void read_image (std::span<png_byte> image, size_t stride = 0)
+      { read_image(image.data(), image.size(), stride); }
+#endif
+
+   /* Reads the chunks after the image data, adding any text to text(). */
+   void read_end ();
+
+   view<const png_text> text () const
+   {
+      png_textp text = nullptr;
+      int num_text = png_get_text(png_ptr_, info_ptr_, &text, nullptr);
+      return view<const png_text>(text, (size_t)num_text);
+   }
+
+   view<const png_color> palette () const
+   {
+      png_colorp palette = nullptr;
+      int num_palette = 0;
+      png_get_PLTE(png_ptr_, info_ptr_, &palette, &num_palette);
+      return view<const png_color>(palette, (size_t)num_palette);
+   }
+
+   view<const png_byte> trans_alpha () const
+   {
+      png_bytep trans_alpha = nullptr;
+      int num_trans = 0;
+      png_get_tRNS(png_ptr_, info_ptr_, &trans_alpha, &num_trans, nullptr);
+      return view<const png_byte>(trans_alpha, (size_t)num_trans);
+   }
+
+   view<const png_byte> icc_profile () const
+   {
+      png_charp name;
+      int compression;
+      png_bytep profile = nullptr;
+      png_uint_32 proflen = 0;
+      png_get_iCCP(png_ptr_, info_ptr_, &name, &compression, &profile,
+          &proflen);
+      return view<const png_byte>(profile, proflen);
+   }
+
+   view<const png_byte> exif () const
+   {
+      png_bytep exif = nullptr;
+      png_uint_32 num_exif = 0;
+      png_get_eXIf_1(png_ptr_, info_ptr_, &num_exif, &exif);
+      return view<const png_byte>(exif, num_exif);
+   }
+
+   struct state;
+
+private:
+   void start ();
+
+   png_struct *png_ptr_;
+   png_info *info_ptr_;
+   state *state_;
+};
+
+class writer
+{
+public:
+   explicit writer (FILE *fp, allocator *alloc = nullptr);
+   explicit writer (sink &out, allocator *alloc = nullptr);
+
+   writer (writer &&other) noexcept;
+   writer &operator= (writer &&other) noexcept;
+   writer (const writer &) = delete;
+   writer &operator= (const writer &) = delete;
+   ~writer ();
+
+   png_struct *get () const { return png_ptr_; }
+   png_info *info () const { return info_ptr_; }
+
+   void set_header (png_uint_32 width, png_uint_32 height, int bit_depth,
+       int color_type, int interlace_type = PNG_INTERLACE_NONE)
+   {
+      png_set_IHDR(png_ptr_, info_ptr_, width, height, bit_depth, color_type,
+          interlace_type, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+   }
+
+   /* libpng copies the data; the arguments need not outlive the call. */
+   void set_palette (view<const png_color> palette)
+      { png_set_PLTE(png_ptr_, info_ptr_, palette.data(),
+          (int)palette.size()); }
+   void set_text (view<const png_text> text)
+      { png_set_text(png_ptr_, info_ptr_, text.data(), (int)text.size()); }
+   void set_icc_profile (png_const_charp name, view<const png_byte> profile)
+      { png_set_iCCP(png_ptr_, info_ptr_, name, PNG_COMPRESSION_TYPE_BASE,
+          profile.data(), (png_uint_32)profile.size()); }
+
+   /* Writes the chunks before the image data; the first row does this if the
+    * application has not.  Set the header and metadata before this.
+    */
+   void write_info ();
+
+   /* As for the reader, with passes() * height() calls to write_row for an
+    * interlaced image.
+    */
+   int passes ();
+   void write_row (png_const_bytep row, size_t size);
+   void write_image (png_const_bytep image, size_t size, size_t stride = 0);
+#ifdef PNG_CXX_SPAN
+   void write_row (std::span<const png_byte> row)
+      { write_row(row.data(), row.size()); }
+   void write_image (std::span<const png_byte> image, size_t stride = 0)
+      { write_image(image.data(), image.size(), stride); }
+#endif
+
+   /* Writes IEND; the output is incomplete without it. */
+   void finish ();
+
+   struct state;
+
+private:
+   png_struct *png_ptr_;
+   png_info *info_ptr_;
+   state *state_;
+};
+
+} /* namespace png */
+
+#endif /* PNGCXX_H */
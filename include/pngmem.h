@@ -28,4 +28,9 @@ png_voidp
 png_realloc_array (png_const_structrp png_ptr, png_const_voidp array, int old_elements,
                    int add_elements, size_t element_size);
 
+/* The allocation accounting of png_set_mem_budget, NULL until that is called.
+ * It is released by png_destroy_png_struct.
+ */
+typedef struct png_mem_account_def png_mem_account, *png_mem_accountp;
+
 #endif
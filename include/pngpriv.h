@@ -565,7 +565,7 @@
 /* Flags for the png_ptr->flags rather than declaring a byte for each one */
 #define PNG_FLAG_ZLIB_CUSTOM_STRATEGY     0x0001U
 #define PNG_FLAG_ZSTREAM_INITIALIZED      0x0002U /* Added to libpng-1.6.0 */
-                                  /*      0x0004U    unused */
+#define PNG_FLAG_ZSTREAM_RAW              0x0004U /* IDAT read without header */
 #define PNG_FLAG_ZSTREAM_ENDED            0x0008U /* Added to libpng-1.6.0 */
                                   /*      0x0010U    unused */
                                   /*      0x0020U    unused */
@@ -606,10 +606,6 @@
 
 /* Save typing and make code easier to understand */
 
-#define PNG_COLOR_DIST(c1, c2) (abs((int)((c1).red) - (int)((c2).red)) + \
-   abs((int)((c1).green) - (int)((c2).green)) + \
-   abs((int)((c1).blue) - (int)((c2).blue)))
-
 /* Added to libpng-1.6.0: scale a 16-bit value in the range 0..65535 to 0..255
  * by dividing by 257 *with rounding*.  This macro is exact for the given range.
  * See the discourse in pngrtran.c png_do_scale_16_to_8.  The values in the
@@ -736,6 +732,7 @@
 #define png_IEND PNG_U32( 73,  69,  78,  68)
 #define png_IHDR PNG_U32( 73,  72,  68,  82)
 #define png_PLTE PNG_U32( 80,  76,  84,  69)
+#define png_acTL PNG_U32( 97,  99,  84,  76) /* APNG animation control */
 #define png_bKGD PNG_U32( 98,  75,  71,  68)
 #define png_cHRM PNG_U32( 99,  72,  82,  77)
 #define png_eXIf PNG_U32(101,  88,  73, 102) /* registered July 2017 */
@@ -903,6 +900,10 @@ png_zfree (voidpf png_ptr, voidpf ptr);
 void PNGCBAPI
 png_default_read_data (png_struct* png_ptr, png_bytep data, size_t length);
 
+void PNGCBAPI
+png_default_write_data (png_struct* png_ptr, png_const_bytep data,
+  size_t length);
+
 void PNGCBAPI
 png_default_flush (png_struct* png_ptr);
 
@@ -1285,7 +1286,8 @@ typedef struct png_control
 {
    png_struct* png_ptr;
    png_infop   info_ptr;
-   png_voidp   error_buf;           /* Always a jmp_buf at present. */
+   png_voidp   error_buf;           /* A jmp_buf; only a marker with
+                                     * PNG_EXCEPTIONS_SUPPORTED */
 
    png_const_bytep memory;          /* Memory buffer. */
    size_t          size;            /* Size of the memory buffer. */
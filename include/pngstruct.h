@@ -28,6 +28,13 @@
 #  define ZLIB_CONST
 #endif
 #include <zlib/zlib.h>
+#include <fdeflate.h>
+#include <trial.h>
+#include <adam7.h>
+#include <gcache.h>
+#include <zcache.h>
+#include <pngmem.h>
+#include <work.h>
 #ifdef const
    /* zlib.h sometimes #defines const to nothing, undo this. */
 #  undef const
@@ -66,6 +73,40 @@ typedef struct png_compression_buffer
 #define PNG_COMPRESSION_BUFFER_SIZE(pp)\
    (offsetof(png_compression_buffer, output) + (pp)->zbuffer_size)
 
+/* The compressed IDAT data of one band of rows, used for incremental encoding
+ * (see png_create_encode_cache.)
+ */
+typedef struct png_encode_band
+{
+   size_t      start;   /* offset of the band in the IDAT data */
+   size_t      size;    /* compressed size of the band */
+   size_t      length;  /* size of the filtered rows */
+   png_uint_32 adler;   /* Adler-32 of the filtered rows */
+} png_encode_band;
+
+struct png_encode_cache_def
+{
+   png_uint_32      band_rows;
+   png_uint_32      num_bands;   /* zero until an image has been written */
+   png_encode_band *bands;
+   png_bytep        data;        /* the IDAT data of the last image */
+   size_t           data_size;
+
+   /* How the last image was written; the bands are reused only if these
+    * match.
+    */
+   png_uint_32      width;
+   png_uint_32      height;
+   png_uint_32      transformations;
+   int              level;
+   int              strategy;
+   int              mem_level;
+   int              window_bits;
+   png_byte         bit_depth;
+   png_byte         color_type;
+   png_byte         do_filter;
+};
+
 /* Colorspace support; structures used in png_struct, png_info and in internal
  * functions to hold and communicate information about the color space.
  *
@@ -229,6 +270,7 @@ struct png_struct_def
                               /* pixel depth used for the row buffers */
    png_byte transformed_pixel_depth;
                               /* pixel depth after read/write transforms */
+   png_byte row_buf_packed;   /* row_buf holds a pass row not yet expanded */
 #if ZLIB_VERNUM >= 0x1240
    png_byte zstream_start;    /* at start of an input zlib stream */
 #endif /* Zlib >= 1.2.4 */
@@ -252,6 +294,8 @@ struct png_struct_def
    png_bytep gamma_to_1;      /* converts from file to 1.0 */
    png_uint_16pp gamma_16_from_1; /* converts from 1.0 to screen */
    png_uint_16pp gamma_16_to_1; /* converts from file to 1.0 */
+   png_gamma_cachep gamma_cache; /* tables shared with other structs */
+   png_byte gamma_cached;     /* the tables above that belong to the cache */
 
    png_color_8 sig_bit;       /* significant bits in each available channel */
    png_color_8 shift;         /* shift for significant bit transformation */
@@ -318,16 +362,16 @@ struct png_struct_def
    png_voidp mem_ptr;             /* user supplied struct for mem functions */
    png_malloc_ptr malloc_fn;      /* function for allocating memory */
    png_free_ptr free_fn;          /* function for freeing memory */
+   png_mem_accountp mem_account;  /* from png_set_mem_budget */
 
 /* New member added in libpng-1.0.13 and 1.2.0 */
    png_bytep big_row_buf;         /* buffer to save current (unfiltered) row */
 
-/* The following three members were added at version 1.0.14 and 1.2.4 */
-   png_bytep quantize_sort;          /* working sort array */
-   png_bytep index_to_palette;       /* where the original index currently is
-                                        in the palette */
-   png_bytep palette_to_index;       /* which original index points to this
-                                         palette color */
+/* Quantizing to a palette (png_set_quantize) */
+   struct png_quant_tree_def *quantize_tree; /* nearest palette color search */
+   png_int_32 *quantize_error;       /* dithering error, two rows */
+   png_uint_32 quantize_error_row;   /* the row quantize_error applies to */
+   int quantize_dither;              /* error diffusion requested */
 
 /* New members added in libpng-1.0.16 and 1.2.6 */
    png_byte compression_type;
@@ -357,6 +401,8 @@ struct png_struct_def
 /* New member added in libpng-1.2.30 */
   png_bytep        read_buffer;      /* buffer for reading chunk data */
   size_t read_buffer_size; /* current size of the buffer */
+  png_bytep        iccp_data;        /* compressed iCCP data, for the ICC cache */
+  size_t iccp_data_size;
   uInt             IDAT_read_size;   /* limit on read buffer size for IDAT */
 
 /* New member added in libpng-1.4.0 */
@@ -370,5 +416,42 @@ struct png_struct_def
       png_bytep row, png_const_bytep prev_row);
 
    png_colorspace   colorspace;
+
+/* Seekable input and the chunk index built by png_read_metadata */
+   png_seek_ptr seek_fn;          /* optional input repositioning function */
+   png_off_t io_offset;           /* bytes consumed since the signature start */
+   png_chunk_locationp chunk_locations; /* chunks found by png_read_metadata */
+   png_uint_32 num_chunk_locations;
+   png_uint_32 max_chunk_locations;
+
+/* Row index under construction (see png_read_build_index) */
+   png_bytep row_index;
+   size_t row_index_size;
+   size_t row_index_max;
+
+/* Incremental encoding with an encode cache */
+   png_encode_cachep encode_cache;
+   png_uint_32 encode_dirty_first; /* rows [first, end) have changed */
+   png_uint_32 encode_dirty_end;
+   png_encode_band *encode_bands;  /* the bands of the image being written */
+   png_bytep encode_data;          /* IDAT data written so far */
+   size_t encode_data_size;
+   size_t encode_data_max;
+
+/* Speed tier from png_set_encode_speed, 0 if not set */
+   int encode_speed;
+   png_fast_deflatep fast_deflate; /* IDAT encoder of the realtime tier */
+   png_trialp trial;               /* rows kept by the smallest tier */
+   png_adam7p adam7;               /* bands of a parallel interlaced write */
+
+/* Compressed iCCP, zTXt and iTXt data waiting to be written */
+   png_zchunkp zchunks;
+   png_compress_cachep compress_cache;
+
+/* Per-stage counters from png_set_stats, NULL when they are off */
+   png_stage_stats *stats;
+
+/* Work limits from png_set_work_limits, NULL when there are none */
+   png_workp work;
 };
 #endif /* PNGSTRUCT_H */
@@ -0,0 +1,48 @@
+#pragma once
+#ifndef PNG_THREAD_H
+#define PNG_THREAD_H
+
+#include <png/png.h>
+
+/* Worker threads for internal jobs that split an image into independent row
+ * bands.  PNG_THREADS_MAX limits the number of threads used; defining it as 1
+ * runs everything on the calling thread.
+ */
+#ifndef PNG_THREADS_MAX
+#  define PNG_THREADS_MAX 16
+#endif
+
+typedef void (*png_thread_job)(png_voidp arg, png_uint_32 index);
+
+/* The number of threads png_parallel_for will use, at least 1. */
+unsigned int
+png_thread_count (void);
+
+/* Make png_thread_count return 'count' (still at most PNG_THREADS_MAX)
+ * whatever the hardware, or 0 to go back to the hardware count, and return
+ * the previous setting.  This lets the tests run the parallel paths on any
+ * machine.
+ */
+unsigned int
+png_thread_set_count (unsigned int count);
+
+/* Call job(arg, i) for every i in [0, count), spreading the calls over up to
+ * png_thread_count() threads, and return when all the calls have returned.
+ * The job must not call png_error or png_warning (they are not thread safe and
+ * png_error does not return); allocate everything it needs beforehand.
+ */
+void
+png_parallel_for (png_uint_32 count, png_thread_job job, png_voidp arg);
+
+/* As png_parallel_for, but the job is also told which thread runs it, a
+ * number less than png_thread_count() that no other call running at the same
+ * time has, so it can keep per-thread state in an array.
+ */
+typedef void (*png_thread_worker_job)(png_voidp arg, unsigned int worker,
+  png_uint_32 index);
+
+void
+png_parallel_for_worker (png_uint_32 count, png_thread_worker_job job,
+  png_voidp arg);
+
+#endif /* PNG_THREAD_H */
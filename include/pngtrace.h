@@ -0,0 +1,39 @@
+#pragma once
+#ifndef PNG_TRACE_H
+#define PNG_TRACE_H
+
+#include <png/png.h>
+
+/* Static tracepoints (USDT) for perf, bpftrace and SystemTap, compiled in when
+ * PNG_TRACE_SUPPORTED is defined (the PNG_TRACE CMake option).  An unattached
+ * probe is a single nop; its arguments are only values already in registers.
+ * The provider is "libpng" and every probe passes the png_struct first:
+ *
+ *    chunk__start  png_ptr, chunk name, length    a chunk header was read
+ *    chunk__end    png_ptr, chunk name, crc error  the chunk CRC was checked
+ *    inflate       png_ptr, chunk name, bytes in, bytes out, zlib result
+ *    read__row     png_ptr, row number, pass       a row has been read
+ *    write__row    png_ptr, row number, pass       a row is being written
+ *    error         png_ptr, message                 png_error
+ *    warning       png_ptr, message                 png_warning
+ *
+ * For example: bpftrace -e 'usdt:/usr/lib/libpng.so:libpng:chunk__start
+ *    { printf("%x %u\n", arg1, arg2); }'
+ */
+#ifdef PNG_TRACE_SUPPORTED
+#  include <sys/sdt.h>
+#  define png_trace2(name, a1, a2) DTRACE_PROBE2(libpng, name, a1, a2)
+#  define png_trace3(name, a1, a2, a3) DTRACE_PROBE3(libpng, name, a1, a2, a3)
+#  define png_trace5(name, a1, a2, a3, a4, a5) \
+      DTRACE_PROBE5(libpng, name, a1, a2, a3, a4, a5)
+#else
+   /* The arguments are still used, so a variable kept only for a probe is
+    * not reported as unused.
+    */
+#  define png_trace2(name, a1, a2) ((void)(a1), (void)(a2))
+#  define png_trace3(name, a1, a2, a3) ((void)(a1), (void)(a2), (void)(a3))
+#  define png_trace5(name, a1, a2, a3, a4, a5) \
+      ((void)(a1), (void)(a2), (void)(a3), (void)(a4), (void)(a5))
+#endif
+
+#endif /* PNG_TRACE_H */
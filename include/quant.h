@@ -0,0 +1,102 @@
+#pragma once
+#ifndef PNG_QUANT_H
+#define PNG_QUANT_H
+
+#include <png/png.h>
+
+/* Color quantization, used by png_set_quantize and by the simplified write API
+ * to produce palette images.
+ */
+
+/* A color to be represented in a palette, components 0..255, and how much it
+ * matters (typically a pixel count).
+ */
+typedef struct
+{
+   double r, g, b;
+   double weight;
+} png_quant_color;
+
+/* A k-d tree over the palette for nearest color (Euclidean RGB) searches. */
+typedef struct
+{
+   png_byte rgb[3];
+   png_byte index;   /* the palette index of this color */
+   png_byte axis;    /* the component the node splits on */
+} png_quant_node;
+
+typedef struct png_quant_tree_def
+{
+   int count;
+   png_quant_node node[PNG_MAX_PALETTE_LENGTH];
+   png_color palette[PNG_MAX_PALETTE_LENGTH];
+} png_quant_tree;
+typedef png_quant_tree * png_quant_treep;
+typedef const png_quant_tree * png_const_quant_treep;
+
+/* Recently found colors; mapping photographic images finds the same colors
+ * over and over.
+ */
+#define PNG_QUANT_CACHE_SIZE 4096
+
+typedef struct
+{
+   png_uint_32 key[PNG_QUANT_CACHE_SIZE]; /* 0x1rrggbb, 0 if empty */
+   png_byte index[PNG_QUANT_CACHE_SIZE];
+} png_quant_cache;
+
+/* A histogram of 8-bit RGB with PNG_QUANT_HIST_BITS per component. */
+#define PNG_QUANT_HIST_BITS 5
+#define PNG_QUANT_HIST_SIZE (1U << (3*PNG_QUANT_HIST_BITS))
+
+typedef struct
+{
+   png_uint_32 count;
+   png_uint_32 low[3]; /* sums of the component bits below the cell */
+} png_quant_cell;
+
+void
+png_quant_tree_init (png_quant_treep tree, png_const_colorp palette,
+  int num_palette);
+
+int
+png_quant_nearest (png_const_quant_treep tree, int red, int green, int blue);
+
+/* Choose at most maximum_colors colors to represent 'colors' by a weighted
+ * median cut refined with a few k-means passes.  The colors array is
+ * reordered.  Returns the number of palette entries.
+ */
+int
+png_quant_palette (png_structrp png_ptr, png_quant_color *colors,
+  png_uint_32 num_colors, png_colorp palette, int maximum_colors);
+
+/* Add a row of RGB (or BGR) pixels to a PNG_QUANT_HIST_SIZE histogram; the
+ * row must have fewer than 2^29 pixels.
+ */
+void
+png_quant_histogram_row (png_quant_cell *histogram, png_const_bytep row,
+  png_uint_32 width, int bgr);
+
+/* Convert the occupied cells of the sum of 'num_histograms' consecutive
+ * histograms to colors, which must have room for PNG_QUANT_HIST_SIZE entries.
+ * The sum may be over any number of pixels.  Returns the number of colors.
+ */
+png_uint_32
+png_quant_histogram_colors (const png_quant_cell *histograms,
+  png_uint_32 num_histograms, png_quant_color *colors);
+
+void
+png_quant_cache_init (png_quant_cache *cache);
+
+/* Map a row of 'channels' byte pixels, the first three of which are RGB (BGR
+ * if bgr is set), to palette indices.  Any other channel is ignored.  If error
+ * is not NULL the row is Floyd-Steinberg dithered; error must then hold
+ * 6*(width+2) values, zero before the first row of a run of rows.  cache may be
+ * NULL.  in and out may be the same.
+ */
+void
+png_quant_map_row (png_const_quant_treep tree, png_quant_cache *cache,
+  png_const_bytep in, png_bytep out, png_uint_32 width, unsigned int channels,
+  int bgr, png_int_32 *error);
+
+#endif /* PNG_QUANT_H */
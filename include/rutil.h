@@ -39,10 +39,21 @@ png_check_chunk_name (png_const_structrp png_ptr, png_uint_32 chunk_name);
 void
 png_combine_row (png_const_structrp png_ptr, png_bytep row, int display);
 
+/* The 'row' (display 0) case of png_combine_row for pixels of 8 bits or more
+ * when png_do_read_interlace has *not* been called: the pass pixels are
+ * scattered straight from the packed row in the row buffer.
+ */
+void
+png_combine_row_packed (png_const_structrp png_ptr, png_bytep row);
+
 /* Read "skip" bytes, read the file crc, and (optionally) verify png_ptr->crc */
 int 
 png_crc_finish (png_structrp png_ptr, png_uint_32 skip);
 
+/* As png_crc_finish with no skip; the four CRC bytes are stored in crc_bytes */
+int 
+png_crc_finish_copy (png_structrp png_ptr, png_bytep crc_bytes);
+
 /* Read bytes into buf, and update png_ptr->crc */
 void 
 png_crc_read (png_structrp png_ptr, png_bytep buf, png_uint_32 length);
@@ -159,6 +170,17 @@ png_read_finish_row (png_structrp png_ptr);
 void
 png_read_IDAT_data (png_structrp png_ptr, png_bytep output, size_t avail_out);
 
+/* Return png_ptr->read_buffer, reallocated if it is smaller than 'new_size'.
+ * On failure 'warn' selects an error (0), a warning (1) or silence (2); the
+ * last two return NULL.
+ */
+png_bytep
+png_read_buffer (png_structrp png_ptr, size_t new_size, int warn);
+
+/* Skip 'length' bytes of input without checking them, seeking if possible */
+void
+png_skip_data (png_structrp png_ptr, png_uint_32 length);
+
 /* Read and check the PNG file signature */
 void
 png_read_sig (png_structrp png_ptr, png_inforp info_ptr);
@@ -167,6 +189,12 @@ png_read_sig (png_structrp png_ptr, png_inforp info_ptr);
 void
 png_read_start_row (png_structrp png_ptr);
 
+/* Claim the zstream for decompression on behalf of 'owner' (a chunk name).
+ * Returns Z_OK on success, else a zlib error code.
+ */
+int
+png_inflate_claim (png_structrp png_ptr, png_uint_32 owner);
+
 int
 png_zlib_inflate (png_structrp png_ptr, int flush);
 #define PNG_INFLATE(pp, flush) png_zlib_inflate (pp, flush)
@@ -0,0 +1,28 @@
+#pragma once
+#ifndef PNG_STATS_H
+#define PNG_STATS_H
+
+#include <png/png.h>
+
+/* Per-stage counters turned on by png_set_stats.  png_ptr->stats is NULL while
+ * they are off, so an instrumented stage costs one test of that pointer; the
+ * clock is only read when the counters are on.
+ */
+
+/* A monotonic time in nanoseconds. */
+png_off_t
+png_stats_clock (void);
+
+void
+png_stats_add (png_const_structrp png_ptr, int stage, png_off_t start,
+  png_off_t bytes);
+
+/* The start time of a stage, or 0 if the counters are off. */
+#define png_stats_begin(pp) ((pp)->stats != NULL ? png_stats_clock () : 0)
+
+/* Count one call of 'stage' that began at 'start' and handled 'bytes'. */
+#define png_stats_end(pp, stage, start, bytes) \
+   do { if ((pp)->stats != NULL) \
+      png_stats_add (pp, stage, start, (png_off_t)(bytes)); } while (0)
+
+#endif /* PNG_STATS_H */
@@ -0,0 +1,46 @@
+#pragma once
+#ifndef PNG_TRIAL_H
+#define PNG_TRIAL_H
+
+#include <png/png.h>
+
+/* Trial compression for the PNG_ENCODE_SPEED_ARCHIVE and SMALLEST tiers.  The
+ * unfiltered rows are kept until the end of the image, then compressed with
+ * each combination of a filter strategy and a set of zlib parameters on worker
+ * threads, and the smallest result is written as the IDAT stream.  The archive
+ * tier tries fewer filter strategies.
+ */
+
+typedef struct png_trial_def png_trial, *png_trialp;
+
+png_trialp
+png_trial_create (png_structrp png_ptr);
+
+void
+png_trial_destroy (png_structrp png_ptr, png_trialp trial);
+
+/* Keep one row of the current pass; 'row' starts with the filter byte, which
+ * is ignored.
+ */
+void
+png_trial_row (png_structrp png_ptr, png_trialp trial, png_const_bytep row,
+  size_t len);
+
+/* Run the trials and write the smallest zlib stream with
+ * png_write_IDAT_bytes.
+ */
+void
+png_trial_finish (png_structrp png_ptr, png_trialp trial);
+
+/* Filter 'row' of 'len' bytes into 'out', which gets the filter byte first.
+ * 'prev' is NULL for the first row of a pass, which has only zeros above it.
+ */
+void
+png_trial_filter (png_bytep out, png_const_bytep row, png_const_bytep prev,
+  size_t len, unsigned int bpp, int filter);
+
+/* The sum of the bytes as signed values, as png_write_find_filter uses. */
+size_t
+png_trial_sum (png_const_bytep p, size_t len);
+
+#endif /* PNG_TRIAL_H */
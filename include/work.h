@@ -0,0 +1,25 @@
+#pragma once
+#ifndef PNG_WORK_H
+#define PNG_WORK_H
+
+#include <png/png.h>
+
+/* The work budget of png_set_work_limits.  png_ptr->work is NULL when no
+ * limit is set, so the decoder only tests that pointer where work is charged.
+ */
+typedef struct png_work_def png_work, *png_workp;
+
+#define PNG_WORK_INFLATE 0 /* bytes produced by inflate */
+#define PNG_WORK_CHUNK   1 /* one chunk header read; checks the deadline */
+#define PNG_WORK_PIXELS  2 /* pixels through the read transformations */
+#define PNG_WORK_ROW     3 /* one row read; only checks the deadline */
+
+/* Add 'amount' of 'kind' and png_error if a limit has been exceeded. */
+void
+png_work_check (png_const_structrp png_ptr, int kind, png_off_t amount);
+
+#define png_work_charge(pp, kind, amount) \
+   do { if ((pp)->work != NULL) \
+      png_work_check (pp, kind, (png_off_t)(amount)); } while (0)
+
+#endif /* PNG_WORK_H */
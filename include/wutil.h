@@ -9,6 +9,67 @@ void
 png_compress_IDAT (png_structrp png_ptr, png_const_bytep row_data, 
   size_t row_data_length, int flush);
 
+/* Append already deflated data to the IDAT stream */
+void
+png_write_IDAT_bytes (png_structrp png_ptr, png_const_bytep data, size_t len);
+
+/* Write an IDAT stream deflated elsewhere as raw deflate data: the first
+ * claims the output and writes the zlib header for the IDAT parameters, the
+ * data goes through png_write_IDAT_bytes and the second writes 'adler', the
+ * Adler-32 of the uncompressed data, and ends the stream.
+ */
+void
+png_start_IDAT_stream (png_structrp png_ptr);
+
+void
+png_end_IDAT_stream (png_structrp png_ptr, png_uint_32 adler);
+
+/* Vector row conversion for the simplified write API.  PNG_IMAGE_SIMD is 1 for
+ * AVX2 (used if the CPU has it) and 2 for NEON on AArch64.  The NEON code has
+ * not yet been built and tested on AArch64, so it is never chosen here; the
+ * PNG_IMAGE_NEON CMake option builds it and sets PNG_IMAGE_SIMD to 2.
+ */
+#ifndef PNG_IMAGE_SIMD
+#  if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#     define PNG_IMAGE_SIMD 1
+#  else
+#     define PNG_IMAGE_SIMD 0
+#  endif
+#endif
+
+/* Convert 'count' pixels of 16-bit linear components from 'in' (a row start)
+ * to 'out', exactly as png_write_image_8bit and png_write_image_16bit do.
+ * 'channels' counts the alpha channel, if any; 'afirst' says it comes first.
+ * The 8-bit function handles 1 to 4 channels (premultiplied if there is
+ * alpha), the 16-bit one only 2 or 4.  They return the number of pixels
+ * converted, which may be fewer than 'count', leaving the rest to the caller.
+ */
+typedef png_uint_32 (*png_image_row_8bit_ptr)(png_const_uint_16p in,
+  png_bytep out, png_uint_32 count, unsigned int channels, int afirst);
+typedef png_uint_32 (*png_image_row_16bit_ptr)(png_const_uint_16p in,
+  png_uint_16p out, png_uint_32 count, unsigned int channels, int afirst);
+
+#if PNG_IMAGE_SIMD == 1
+int
+png_image_have_avx2 (void);
+
+png_uint_32
+png_image_row_8bit_avx2 (png_const_uint_16p in, png_bytep out,
+  png_uint_32 count, unsigned int channels, int afirst);
+
+png_uint_32
+png_image_row_16bit_avx2 (png_const_uint_16p in, png_uint_16p out,
+  png_uint_32 count, unsigned int channels, int afirst);
+#elif PNG_IMAGE_SIMD == 2
+png_uint_32
+png_image_row_8bit_neon (png_const_uint_16p in, png_bytep out,
+  png_uint_32 count, unsigned int channels, int afirst);
+
+png_uint_32
+png_image_row_16bit_neon (png_const_uint_16p in, png_uint_16p out,
+  png_uint_32 count, unsigned int channels, int afirst);
+#endif
+
 /* Grab pixels out of a row for an interlaced pass */
 void
 png_do_write_interlace (png_row_infop row_info, png_bytep row, int pass);
@@ -114,4 +175,38 @@ png_write_finish_row (png_structrp png_ptr);
 void
 png_write_start_row (png_structrp png_ptr);
 
+/* Write a row taken from another PNG datastream of the same format, starting
+ * with its filter byte; with 'refilter' the row must be unfiltered (filter
+ * byte 0) and a filter is chosen for it as for png_write_row.
+ */
+void
+png_write_encoded_row (png_structrp png_ptr, png_bytep row, size_t row_bytes,
+  int refilter);
+
+/* Reduce the window size in the header of a zlib stream of 'data_size'
+ * uncompressed bytes to the smallest that covers the data.
+ */
+void
+optimize_cmf (png_bytep data, size_t data_size);
+
+/* Memory for a deflate stream run on a worker thread.  The accounting of
+ * png_set_mem_budget is not thread safe, so the memory is allocated through
+ * the png_struct beforehand and the stream's allocations are carved from it;
+ * a stream that needs more than png_zarena_size fails to initialize.
+ */
+typedef struct
+{
+   png_bytep base;
+   size_t size;
+   size_t used;
+} png_zarena;
+
+/* An upper bound on what deflateInit2 allocates with these parameters. */
+size_t
+png_zarena_size (int window_bits, int mem_level);
+
+/* Make 'z' allocate from 'arena', which is emptied first. */
+void
+png_zarena_use (z_stream *z, png_zarena *arena);
+
 #endif
@@ -0,0 +1,35 @@
+#pragma once
+#ifndef PNG_ZCACHE_H
+#define PNG_ZCACHE_H
+
+#include <png/png.h>
+
+/* Compressed data of the iCCP, zTXt and compressed iTXt chunks.
+ * png_zchunk_prepare compresses the data of every such chunk png_write_info or
+ * png_write_end is about to write, each on a worker thread with its own
+ * z_stream, so a large profile does not wait for a large XMP packet.  The
+ * chunk writers then take the results in file order with png_zchunk_get.  A
+ * png_compress_cache keeps results for the images written after this one.
+ */
+
+typedef struct png_zchunk_def png_zchunk, *png_zchunkp;
+
+/* Compress the data of the chunks that will be written next: the iCCP chunk
+ * if png_write_info_before_PLTE has not written it and the compressed text
+ * chunks not yet written.
+ */
+void
+png_zchunk_prepare (png_structrp png_ptr, png_const_inforp info_ptr);
+
+/* The compressed form of 'input', from png_zchunk_prepare or compressed now.
+ * Returns Z_STREAM_END with the data in *output, which stays valid until
+ * png_zchunk_free, or a zlib error code.
+ */
+int
+png_zchunk_get (png_structrp png_ptr, png_const_bytep input, size_t input_len,
+  png_const_bytep *output, size_t *output_len);
+
+void
+png_zchunk_free (png_structrp png_ptr);
+
+#endif /* PNG_ZCACHE_H */
@@ -0,0 +1,167 @@
+/* image_neon.cpp - NEON row conversion for the simplified write API
+ *
+ * This code is released under the libpng license.
+ * For conditions of distribution and use, see the disclaimer
+ * and license in png.h
+ *
+ * The AArch64 counterpart of intel/image_avx2.cpp: four components are
+ * widened to 32 bits and converted at once, with the alpha reciprocal divided
+ * out in double precision.  NEON has no gather, so the final sRGB table look
+ * up is done a lane at a time.
+ *
+ * This has not been built or run on AArch64 yet, so it is only compiled with
+ * the PNG_IMAGE_NEON CMake option.
+ */
+
+#include <wutil.h>
+
+#include "pngpriv.h"
+
+#if PNG_IMAGE_SIMD == 2
+#include <arm_neon.h>
+
+/* Copy the alpha of each pixel to all of its components. */
+static uint32x4_t
+png_alpha_neon(uint32x4_t c, unsigned int channels, int afirst)
+{
+   if (channels == 4)
+      return afirst ? vdupq_laneq_u32(c, 0) : vdupq_laneq_u32(c, 3);
+
+   return afirst ? vtrn1q_u32(c, c) : vtrn2q_u32(c, c);
+}
+
+/* The lanes holding alpha components. */
+static uint32x4_t
+png_alpha_mask_neon(unsigned int channels, int afirst)
+{
+   png_uint_32 m[4];
+   int i;
+
+   for (i = 0; i < 4; ++i)
+   {
+      int pixel = i & ~(int)(channels - 1);
+
+      m[i] = (afirst ? pixel : pixel + (int)channels - 1) == i ?
+          0xffffffffU : 0;
+   }
+
+   return vld1q_u32(m);
+}
+
+static uint32x4_t
+png_divide_neon(uint32x4_t numerator, uint32x4_t denominator)
+{
+   float64x2_t q0 = vdivq_f64(
+       vcvtq_f64_u64(vmovl_u32(vget_low_u32(numerator))),
+       vcvtq_f64_u64(vmovl_u32(vget_low_u32(denominator))));
+   float64x2_t q1 = vdivq_f64(
+       vcvtq_f64_u64(vmovl_high_u32(numerator)),
+       vcvtq_f64_u64(vmovl_high_u32(denominator)));
+
+   return vcombine_u32(vmovn_u64(vcvtq_u64_f64(q0)),
+       vmovn_u64(vcvtq_u64_f64(q1)));
+}
+
+static void
+png_sRGB_store_neon(png_bytep out, uint32x4_t linear)
+{
+   png_uint_32 v[4];
+   int i;
+
+   vst1q_u32(v, vminq_u32(linear, vdupq_n_u32(255*65535)));
+
+   for (i = 0; i < 4; ++i)
+      out[i] = PNG_sRGB_FROM_LINEAR(v[i]);
+}
+
+png_uint_32 /* PRIVATE */
+png_image_row_8bit_neon(png_const_uint_16p in, png_bytep out,
+    png_uint_32 count, unsigned int channels, int afirst)
+{
+   size_t n = (size_t)count * channels;
+   size_t i = 0;
+
+   if (channels == 2 || channels == 4)
+   {
+      uint32x4_t mask = png_alpha_mask_neon(channels, afirst);
+
+      for (; n - i >= 4; i += 4)
+      {
+         uint32x4_t c = vmovl_u16(vld1_u16(in + i));
+         uint32x4_t a = png_alpha_neon(c, channels, afirst);
+         /* Zero for an alpha of 128, which PNG_DIV257 rounds to 0 */
+         uint32x4_t reciprocal = vandq_u32(vcgtq_u32(a, vdupq_n_u32(128)),
+             png_divide_neon(vaddq_u32(vdupq_n_u32((0xffff*0xff)<<7),
+             vshrq_n_u32(a, 1)), vmaxq_u32(a, vdupq_n_u32(1))));
+         uint32x4_t linear = vbslq_u32(vcgtq_u32(a, vdupq_n_u32(65406)),
+             vmulq_n_u32(c, 255),
+             vshrq_n_u32(vmlaq_u32(vdupq_n_u32(64), c, reciprocal), 7));
+         uint32x4_t full = vorrq_u32(vcgeq_u32(c, a),
+             vcltq_u32(a, vdupq_n_u32(128)));
+         uint32x4_t zero = vceqq_u32(c, vdupq_n_u32(0));
+         png_byte v[4];
+         int j;
+
+         png_sRGB_store_neon(v, linear);
+
+         {
+            png_uint_32 f[4], z[4], m[4], al[4];
+
+            vst1q_u32(f, full);
+            vst1q_u32(z, zero);
+            vst1q_u32(m, mask);
+            vst1q_u32(al, a);
+
+            for (j = 0; j < 4; ++j)
+               out[i+j] = m[j] != 0 ? (png_byte)PNG_DIV257(al[j]) :
+                   f[j] != 0 ? 255 : z[j] != 0 ? 0 : v[j];
+         }
+      }
+   }
+
+   else
+   {
+      for (; n - i >= 4; i += 4)
+         png_sRGB_store_neon(out + i,
+             vmulq_n_u32(vmovl_u16(vld1_u16(in + i)), 255));
+   }
+
+   return (png_uint_32)(i / channels);
+}
+
+png_uint_32 /* PRIVATE */
+png_image_row_16bit_neon(png_const_uint_16p in, png_uint_16p out,
+    png_uint_32 count, unsigned int channels, int afirst)
+{
+   size_t n = (size_t)count * channels;
+   size_t i = 0;
+   uint32x4_t mask;
+
+   if (channels != 2 && channels != 4)
+      return 0;
+
+   mask = png_alpha_mask_neon(channels, afirst);
+
+   for (; n - i >= 4; i += 4)
+   {
+      uint32x4_t c = vmovl_u16(vld1_u16(in + i));
+      uint32x4_t a = png_alpha_neon(c, channels, afirst);
+      uint32x4_t reciprocal = png_divide_neon(
+          vaddq_u32(vdupq_n_u32(0xffffU<<15), vshrq_n_u32(a, 1)),
+          vmaxq_u32(a, vdupq_n_u32(1)));
+      uint32x4_t scaled = vshrq_n_u32(
+          vmlaq_u32(vdupq_n_u32(16384), c, reciprocal), 15);
+      uint32x4_t below = vcltq_u32(c, a);
+      uint32x4_t use = vandq_u32(below, vandq_u32(
+          vmvnq_u32(vceqq_u32(c, vdupq_n_u32(0))),
+          vcltq_u32(a, vdupq_n_u32(65535))));
+      uint32x4_t v = vbslq_u32(use, scaled, c);
+
+      v = vbslq_u32(below, v, vdupq_n_u32(65535));
+      v = vbslq_u32(mask, a, v);
+      vst1_u16(out + i, vmovn_u32(v));
+   }
+
+   return (png_uint_32)(i / channels);
+}
+#endif /* PNG_IMAGE_SIMD == 2 */
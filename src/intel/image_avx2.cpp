@@ -0,0 +1,236 @@
+/* image_avx2.cpp - AVX2 row conversion for the simplified write API
+ *
+ * This code is released under the libpng license.
+ * For conditions of distribution and use, see the disclaimer
+ * and license in png.h
+ *
+ * These functions reproduce the scalar code in png_write_image_8bit and
+ * png_write_image_16bit (pngwrite.cpp) exactly.  Each 16-bit component is
+ * widened to 32 bits and eight are handled at once.  The reciprocal of alpha
+ * used to undo premultiplication needs an integer division; this is done in
+ * double precision, which is exact for these operands (below 2^31), and
+ * truncated.  The linear to sRGB conversion gathers from a table combining
+ * png_sRGB_base and png_sRGB_delta.  The code is compiled for AVX2 with a
+ * function attribute and is only called if the CPU supports AVX2.
+ */
+
+#include <wutil.h>
+
+#include "pngpriv.h"
+
+#if PNG_IMAGE_SIMD == 1
+#include <immintrin.h>
+
+#define PNG_AVX2 __attribute__((target("avx2")))
+
+/* png_sRGB_base[i] | png_sRGB_delta[i] << 16 */
+static png_uint_32 png_sRGB_avx2_table[512];
+
+static int
+png_sRGB_table_init(void)
+{
+   int i;
+
+   for (i = 0; i < 512; ++i)
+      png_sRGB_avx2_table[i] = png_sRGB_base[i] |
+          ((png_uint_32)png_sRGB_delta[i] << 16);
+
+   return 1;
+}
+
+static const int png_sRGB_table_ready = png_sRGB_table_init();
+
+int /* PRIVATE */
+png_image_have_avx2(void)
+{
+   static const int have = __builtin_cpu_supports("avx2") ? 1 : 0;
+
+   return have && png_sRGB_table_ready;
+}
+
+/* PNG_sRGB_FROM_LINEAR for eight values; out of range values are clamped to
+ * the table so that the gather is always safe.
+ */
+static PNG_AVX2 __m256i
+png_sRGB_from_linear_avx2(__m256i linear)
+{
+   __m256i index = _mm256_min_epu32(_mm256_srli_epi32(linear, 15),
+       _mm256_set1_epi32(511));
+   __m256i entry = _mm256_i32gather_epi32((const int*)png_sRGB_avx2_table, index,
+       4);
+   __m256i delta = _mm256_mullo_epi32(_mm256_and_si256(linear,
+       _mm256_set1_epi32(0x7fff)), _mm256_srli_epi32(entry, 16));
+   __m256i value = _mm256_add_epi32(_mm256_and_si256(entry,
+       _mm256_set1_epi32(0xffff)), _mm256_srli_epi32(delta, 12));
+
+   return _mm256_and_si256(_mm256_srli_epi32(value, 8),
+       _mm256_set1_epi32(0xff));
+}
+
+/* (numerator / denominator) for eight positive int32 values. */
+static PNG_AVX2 __m256i
+png_divide_avx2(__m256i numerator, __m256i denominator)
+{
+   __m256d n0 = _mm256_cvtepi32_pd(_mm256_castsi256_si128(numerator));
+   __m256d n1 = _mm256_cvtepi32_pd(_mm256_extracti128_si256(numerator, 1));
+   __m256d d0 = _mm256_cvtepi32_pd(_mm256_castsi256_si128(denominator));
+   __m256d d1 = _mm256_cvtepi32_pd(_mm256_extracti128_si256(denominator, 1));
+   __m128i q0 = _mm256_cvttpd_epi32(_mm256_div_pd(n0, d0));
+   __m128i q1 = _mm256_cvttpd_epi32(_mm256_div_pd(n1, d1));
+
+   return _mm256_inserti128_si256(_mm256_castsi128_si256(q0), q1, 1);
+}
+
+/* Byte shuffle that copies the alpha of each pixel to all of its components
+ * and a mask of the alpha components, for 2 or 4 channels.
+ */
+static PNG_AVX2 void
+png_alpha_layout_avx2(unsigned int channels, int afirst, __m256i *shuffle,
+    __m256i *mask)
+{
+   png_byte s[32];
+   png_uint_32 m[8];
+   int i;
+
+   for (i = 0; i < 8; ++i)
+   {
+      int pixel = i & ~(int)(channels - 1);
+      int alpha = afirst ? pixel : pixel + (int)channels - 1;
+      int lane = alpha & 3; /* the shuffle works within 128-bit lanes */
+      int b;
+
+      for (b = 0; b < 4; ++b)
+         s[4*i + b] = (png_byte)(4*lane + b);
+
+      m[i] = alpha == i ? 0xffffffffU : 0;
+   }
+
+   *shuffle = _mm256_loadu_si256((const __m256i*)s);
+   *mask = _mm256_loadu_si256((const __m256i*)m);
+}
+
+static PNG_AVX2 void
+png_store_8x8(png_bytep out, __m256i v)
+{
+   __m256i p = _mm256_packus_epi16(_mm256_packus_epi32(v, v),
+       _mm256_setzero_si256());
+   int lo = _mm_cvtsi128_si32(_mm256_castsi256_si128(p));
+   int hi = _mm_cvtsi128_si32(_mm256_extracti128_si256(p, 1));
+
+   memcpy(out, &lo, 4);
+   memcpy(out + 4, &hi, 4);
+}
+
+png_uint_32 PNG_AVX2 /* PRIVATE */
+png_image_row_8bit_avx2(png_const_uint_16p in, png_bytep out,
+    png_uint_32 count, unsigned int channels, int afirst)
+{
+   size_t n = (size_t)count * channels;
+   size_t i = 0;
+
+   if (channels == 2 || channels == 4)
+   {
+      __m256i shuffle, mask;
+
+      png_alpha_layout_avx2(channels, afirst, &shuffle, &mask);
+
+      for (; n - i >= 8; i += 8)
+      {
+         __m256i c = _mm256_cvtepu16_epi32(
+             _mm_loadu_si128((const __m128i*)(in + i)));
+         __m256i a = _mm256_shuffle_epi8(c, shuffle);
+         __m256i alphabyte = _mm256_srli_epi32(_mm256_add_epi32(
+             _mm256_mullo_epi32(a, _mm256_set1_epi32(255)),
+             _mm256_set1_epi32(32895)), 16);
+         /* As in the scalar code the reciprocal is 0 unless alphabyte is
+          * strictly between 0 and 255; an alpha of 128 rounds to 0.
+          */
+         __m256i reciprocal = _mm256_andnot_si256(
+             _mm256_cmpeq_epi32(alphabyte, _mm256_setzero_si256()),
+             png_divide_avx2(_mm256_add_epi32(
+             _mm256_set1_epi32((0xffff*0xff)<<7), _mm256_srli_epi32(a, 1)),
+             _mm256_max_epi32(a, _mm256_set1_epi32(1))));
+         __m256i scaled = _mm256_srli_epi32(_mm256_add_epi32(
+             _mm256_mullo_epi32(c, reciprocal), _mm256_set1_epi32(64)), 7);
+         __m256i opaque = _mm256_cmpgt_epi32(a, _mm256_set1_epi32(65406));
+         __m256i linear = _mm256_blendv_epi8(scaled,
+             _mm256_mullo_epi32(c, _mm256_set1_epi32(255)), opaque);
+         __m256i v = png_sRGB_from_linear_avx2(linear);
+
+         /* component == 0 gives 0, component >= alpha or alpha < 128 gives
+          * 255 (in that order of precedence) and alpha gives alphabyte.
+          */
+         __m256i full = _mm256_or_si256(
+             _mm256_xor_si256(_mm256_cmpgt_epi32(a, c),
+             _mm256_set1_epi32(-1)),
+             _mm256_cmpgt_epi32(_mm256_set1_epi32(128), a));
+
+         v = _mm256_andnot_si256(_mm256_cmpeq_epi32(c, _mm256_setzero_si256()),
+             v);
+         v = _mm256_blendv_epi8(v, _mm256_set1_epi32(255), full);
+         v = _mm256_blendv_epi8(v, alphabyte, mask);
+
+         png_store_8x8(out + i, v);
+      }
+   }
+
+   else
+   {
+      for (; n - i >= 8; i += 8)
+      {
+         __m256i c = _mm256_cvtepu16_epi32(
+             _mm_loadu_si128((const __m128i*)(in + i)));
+
+         png_store_8x8(out + i, png_sRGB_from_linear_avx2(
+             _mm256_mullo_epi32(c, _mm256_set1_epi32(255))));
+      }
+   }
+
+   return (png_uint_32)(i / channels);
+}
+
+png_uint_32 PNG_AVX2 /* PRIVATE */
+png_image_row_16bit_avx2(png_const_uint_16p in, png_uint_16p out,
+    png_uint_32 count, unsigned int channels, int afirst)
+{
+   size_t n = (size_t)count * channels;
+   size_t i = 0;
+   __m256i shuffle, mask;
+
+   if (channels != 2 && channels != 4)
+      return 0;
+
+   png_alpha_layout_avx2(channels, afirst, &shuffle, &mask);
+
+   for (; n - i >= 8; i += 8)
+   {
+      __m256i c = _mm256_cvtepu16_epi32(
+          _mm_loadu_si128((const __m128i*)(in + i)));
+      __m256i a = _mm256_shuffle_epi8(c, shuffle);
+      __m256i reciprocal = png_divide_avx2(_mm256_add_epi32(
+          _mm256_set1_epi32(0xffff<<15), _mm256_srli_epi32(a, 1)),
+          _mm256_max_epi32(a, _mm256_set1_epi32(1)));
+      __m256i scaled = _mm256_srli_epi32(_mm256_add_epi32(
+          _mm256_mullo_epi32(c, reciprocal), _mm256_set1_epi32(16384)), 15);
+
+      /* Scale if 0 < component < alpha < 65535, 65535 if component >= alpha,
+       * otherwise leave the component alone.
+       */
+      __m256i below = _mm256_cmpgt_epi32(a, c);
+      __m256i use = _mm256_and_si256(below, _mm256_andnot_si256(
+          _mm256_cmpeq_epi32(c, _mm256_setzero_si256()),
+          _mm256_cmpgt_epi32(_mm256_set1_epi32(65535), a)));
+      __m256i v = _mm256_blendv_epi8(c, scaled, use);
+
+      v = _mm256_blendv_epi8(_mm256_set1_epi32(65535), v, below);
+      v = _mm256_blendv_epi8(v, a, mask);
+
+      v = _mm256_packus_epi32(v, v);
+      _mm_storel_epi64((__m128i*)(out + i), _mm256_castsi256_si128(v));
+      _mm_storel_epi64((__m128i*)(out + i + 4),
+          _mm256_extracti128_si256(v, 1));
+   }
+
+   return (png_uint_32)(i / channels);
+}
+#endif /* PNG_IMAGE_SIMD == 1 */
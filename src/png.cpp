@@ -14,6 +14,8 @@
 #include <pngmem.h>
 #include <pngerror.h>
 #include <pngdebug.h>
+#include <stats.h>
+#include <gcache.h>
 
 #include "pngpriv.h"
 
@@ -162,6 +164,8 @@ png_calculate_crc(png_structrp png_ptr, png_const_bytep ptr, size_t length)
    if (need_crc != 0 && length > 0)
    {
       uLong crc = png_ptr->crc; /* Should never issue a warning */
+      png_off_t stat_start = png_stats_begin(png_ptr);
+      size_t stat_bytes = length;
 
       do
       {
@@ -184,6 +188,7 @@ png_calculate_crc(png_structrp png_ptr, png_const_bytep ptr, size_t length)
 
       /* And the following is always safe because the crc is only 32 bits. */
       png_ptr->crc = (png_uint_32)crc;
+      png_stats_end(png_ptr, PNG_STAT_CRC, stat_start, stat_bytes);
    }
 }
 
@@ -2427,8 +2432,18 @@ png_gt(size_t a, size_t b)
 #   define png_gt(a,b) ((a) > (b))
 #endif
 
-void /* PRIVATE */
-png_check_IHDR(png_const_structrp png_ptr,
+/* The IHDR checks are shared with png_probe_header, which has no png_struct;
+ * in that case the messages are dropped and the default user limits apply.
+ */
+static void
+png_IHDR_warning(png_const_structrp png_ptr, png_const_charp message)
+{
+   if (png_ptr != NULL)
+      png_warning(png_ptr, message);
+}
+
+static int
+png_IHDR_errors(png_const_structrp png_ptr,
     png_uint_32 width, png_uint_32 height, int bit_depth,
     int color_type, int interlace_type, int compression_type,
     int filter_type)
@@ -2438,13 +2453,13 @@ png_check_IHDR(png_const_structrp png_ptr,
    /* Check for width and height valid values */
    if (width == 0)
    {
-      png_warning(png_ptr, "Image width is zero in IHDR");
+      png_IHDR_warning(png_ptr, "Image width is zero in IHDR");
       error = 1;
    }
 
    if (width > PNG_UINT_31_MAX)
    {
-      png_warning(png_ptr, "Invalid image width in IHDR");
+      png_IHDR_warning(png_ptr, "Invalid image width in IHDR");
       error = 1;
    }
 
@@ -2466,31 +2481,33 @@ png_check_IHDR(png_const_structrp png_ptr,
        * extensive, therefore much more dangerous and much more difficult to
        * write in a way that avoids compiler warnings.
        */
-      png_warning(png_ptr, "Image width is too large for this architecture");
+      png_IHDR_warning(png_ptr, "Image width is too large for this architecture");
       error = 1;
    }
 
-   if (width > png_ptr->user_width_max)
+   if (width > (png_ptr != NULL ? png_ptr->user_width_max :
+       PNG_USER_WIDTH_MAX))
    {
-      png_warning(png_ptr, "Image width exceeds user limit in IHDR");
+      png_IHDR_warning(png_ptr, "Image width exceeds user limit in IHDR");
       error = 1;
    }
 
    if (height == 0)
    {
-      png_warning(png_ptr, "Image height is zero in IHDR");
+      png_IHDR_warning(png_ptr, "Image height is zero in IHDR");
       error = 1;
    }
 
    if (height > PNG_UINT_31_MAX)
    {
-      png_warning(png_ptr, "Invalid image height in IHDR");
+      png_IHDR_warning(png_ptr, "Invalid image height in IHDR");
       error = 1;
    }
 
-   if (height > png_ptr->user_height_max)
+   if (height > (png_ptr != NULL ? png_ptr->user_height_max :
+       PNG_USER_HEIGHT_MAX))
    {
-      png_warning(png_ptr, "Image height exceeds user limit in IHDR");
+      png_IHDR_warning(png_ptr, "Image height exceeds user limit in IHDR");
       error = 1;
    }
 
@@ -2498,14 +2515,14 @@ png_check_IHDR(png_const_structrp png_ptr,
    if (bit_depth != 1 && bit_depth != 2 && bit_depth != 4 &&
        bit_depth != 8 && bit_depth != 16)
    {
-      png_warning(png_ptr, "Invalid bit depth in IHDR");
+      png_IHDR_warning(png_ptr, "Invalid bit depth in IHDR");
       error = 1;
    }
 
    if (color_type < 0 || color_type == 1 ||
        color_type == 5 || color_type > 6)
    {
-      png_warning(png_ptr, "Invalid color type in IHDR");
+      png_IHDR_warning(png_ptr, "Invalid color type in IHDR");
       error = 1;
    }
 
@@ -2514,32 +2531,130 @@ png_check_IHDR(png_const_structrp png_ptr,
          color_type == PNG_COLOR_TYPE_GRAY_ALPHA ||
          color_type == PNG_COLOR_TYPE_RGB_ALPHA) && bit_depth < 8))
    {
-      png_warning(png_ptr, "Invalid color type/bit depth combination in IHDR");
+      png_IHDR_warning(png_ptr, "Invalid color type/bit depth combination in IHDR");
       error = 1;
    }
 
    if (interlace_type >= PNG_INTERLACE_LAST)
    {
-      png_warning(png_ptr, "Unknown interlace method in IHDR");
+      png_IHDR_warning(png_ptr, "Unknown interlace method in IHDR");
       error = 1;
    }
 
    if (compression_type != PNG_COMPRESSION_TYPE_BASE)
    {
-      png_warning(png_ptr, "Unknown compression method in IHDR");
+      png_IHDR_warning(png_ptr, "Unknown compression method in IHDR");
       error = 1;
    }
 
    if (filter_type != PNG_FILTER_TYPE_BASE)
    {
-      png_warning(png_ptr, "Unknown filter method in IHDR");
+      png_IHDR_warning(png_ptr, "Unknown filter method in IHDR");
       error = 1;
    }
 
-   if (error == 1)
+   return error;
+}
+
+void /* PRIVATE */
+png_check_IHDR(png_const_structrp png_ptr,
+    png_uint_32 width, png_uint_32 height, int bit_depth,
+    int color_type, int interlace_type, int compression_type,
+    int filter_type)
+{
+   if (png_IHDR_errors(png_ptr, width, height, bit_depth, color_type,
+       interlace_type, compression_type, filter_type) != 0)
       png_error(png_ptr, "Invalid IHDR data");
 }
 
+/* Stateless header probe: everything here works directly on the caller's
+ * buffer.  Only the IHDR CRC is checked; the later chunks are merely located.
+ */
+int PNGAPI
+png_probe_header(png_const_voidp data, size_t size,
+    png_header_summary *summary)
+{
+   png_const_bytep buf = (png_const_bytep)data;
+   png_uint_32 width, height;
+   size_t offset;
+   int bit_depth, color_type, interlace_type;
+   png_byte flags = 0;
+
+   if (buf == NULL || summary == NULL)
+      return PNG_PROBE_NOT_PNG;
+
+   memset(summary, 0, sizeof *summary);
+
+   if (png_sig_cmp(buf, 0, size < 8 ? size : 8) != 0)
+      return PNG_PROBE_NOT_PNG;
+
+   /* Signature, IHDR length and type, 13 bytes of data and the CRC. */
+   if (size < 33)
+      return PNG_PROBE_TRUNCATED;
+
+   if (png_get_uint_32(buf + 8) != 13 ||
+       PNG_CHUNK_FROM_STRING(buf + 12) != png_IHDR ||
+       crc32(0, buf + 12, 17) != png_get_uint_32(buf + 29))
+      return PNG_PROBE_INVALID;
+
+   width = png_get_uint_32(buf + 16);
+   height = png_get_uint_32(buf + 20);
+   bit_depth = buf[24];
+   color_type = buf[25];
+   interlace_type = buf[28];
+
+   if (png_IHDR_errors(NULL, width, height, bit_depth, color_type,
+       interlace_type, buf[26], buf[27]) != 0)
+      return PNG_PROBE_INVALID;
+
+   if ((color_type & PNG_COLOR_MASK_ALPHA) != 0)
+      flags |= PNG_HEADER_HAVE_ALPHA;
+
+   /* Walk the chunk headers up to the first IDAT; PLTE, tRNS and the APNG
+    * acTL chunk must all precede it.
+    */
+   for (offset = 33; size - offset >= 8;)
+   {
+      png_uint_32 length = png_get_uint_32(buf + offset);
+      png_uint_32 chunk_name = PNG_CHUNK_FROM_STRING(buf + offset + 4);
+
+      if (length > PNG_UINT_31_MAX)
+         break;
+
+      if (chunk_name == png_IDAT)
+      {
+         flags |= PNG_HEADER_COMPLETE;
+         break;
+      }
+
+      else if (chunk_name == png_IEND)
+         break;
+
+      else if (chunk_name == png_PLTE)
+         flags |= PNG_HEADER_HAVE_PLTE;
+
+      else if (chunk_name == png_tRNS)
+         flags |= PNG_HEADER_HAVE_tRNS | PNG_HEADER_HAVE_ALPHA;
+
+      else if (chunk_name == png_acTL)
+         flags |= PNG_HEADER_HAVE_acTL;
+
+      if (size - offset - 8 < (size_t)length + 4)
+         break;
+
+      offset += (size_t)length + 12;
+   }
+
+   summary->width = width;
+   summary->height = height;
+   summary->bit_depth = (png_byte)bit_depth;
+   summary->color_type = (png_byte)color_type;
+   summary->interlace_type = (png_byte)interlace_type;
+   summary->flags = flags;
+
+   return PNG_PROBE_OK;
+}
+
 /* ASCII to fp functions */
 /* Check an ASCII formatted floating point value, see the more detailed
  * comments in pngpriv.h
@@ -3936,54 +4051,121 @@ png_build_8bit_table(png_structrp png_ptr, png_bytepp ptable,
          table[i] = (png_byte)(i & 0xff);
 }
 
-/* Used from png_read_destroy and below to release the memory used by the gamma
- * tables.
+/* The png_ptr->gamma_cached bits of the tables that belong to the gamma cache
+ * and so must not be freed.
  */
-void /* PRIVATE */
-png_destroy_gamma_table(png_structrp png_ptr)
+#define PNG_GAMMA_CACHED_TABLE      0x01
+#define PNG_GAMMA_CACHED_TO_1       0x02
+#define PNG_GAMMA_CACHED_FROM_1     0x04
+#define PNG_GAMMA_CACHED_16_TABLE   0x08
+#define PNG_GAMMA_CACHED_16_TO_1    0x10
+#define PNG_GAMMA_CACHED_16_FROM_1  0x20
+
+/* Free a 16-bit table unless it belongs to the cache. */
+static void
+png_destroy_16bit_table(png_structrp png_ptr, png_uint_16pp *ptable,
+    unsigned int bit)
 {
-   png_free(png_ptr, png_ptr->gamma_table);
-   png_ptr->gamma_table = NULL;
-
-   if (png_ptr->gamma_16_table != NULL)
+   if (*ptable != NULL && (png_ptr->gamma_cached & bit) == 0)
    {
       int i;
       int istop = (1 << (8 - png_ptr->gamma_shift));
       for (i = 0; i < istop; i++)
       {
-         png_free(png_ptr, png_ptr->gamma_16_table[i]);
+         png_free(png_ptr, (*ptable)[i]);
       }
-   png_free(png_ptr, png_ptr->gamma_16_table);
-   png_ptr->gamma_16_table = NULL;
+      png_free(png_ptr, *ptable);
    }
 
-   png_free(png_ptr, png_ptr->gamma_from_1);
+   *ptable = NULL;
+}
+
+/* Used from png_read_destroy and below to release the memory used by the gamma
+ * tables.
+ */
+void /* PRIVATE */
+png_destroy_gamma_table(png_structrp png_ptr)
+{
+   if ((png_ptr->gamma_cached & PNG_GAMMA_CACHED_TABLE) == 0)
+      png_free(png_ptr, png_ptr->gamma_table);
+   png_ptr->gamma_table = NULL;
+
+   png_destroy_16bit_table(png_ptr, &png_ptr->gamma_16_table,
+       PNG_GAMMA_CACHED_16_TABLE);
+
+   if ((png_ptr->gamma_cached & PNG_GAMMA_CACHED_FROM_1) == 0)
+      png_free(png_ptr, png_ptr->gamma_from_1);
    png_ptr->gamma_from_1 = NULL;
-   png_free(png_ptr, png_ptr->gamma_to_1);
+   if ((png_ptr->gamma_cached & PNG_GAMMA_CACHED_TO_1) == 0)
+      png_free(png_ptr, png_ptr->gamma_to_1);
    png_ptr->gamma_to_1 = NULL;
 
-   if (png_ptr->gamma_16_from_1 != NULL)
+   png_destroy_16bit_table(png_ptr, &png_ptr->gamma_16_from_1,
+       PNG_GAMMA_CACHED_16_FROM_1);
+   png_destroy_16bit_table(png_ptr, &png_ptr->gamma_16_to_1,
+       PNG_GAMMA_CACHED_16_TO_1);
+
+   png_ptr->gamma_cached = 0;
+}
+
+/* Build an 8-bit table or take it from png_ptr->gamma_cache.  'bit' is set in
+ * png_ptr->gamma_cached if the table belongs to the cache.
+ */
+static void
+png_gamma_8bit_table(png_structrp png_ptr, png_bytepp ptable,
+    png_fixed_point gamma_val, unsigned int bit)
+{
+   png_gamma_cachep cache = png_ptr->gamma_cache;
+
+   if (cache != NULL)
    {
-      int i;
-      int istop = (1 << (8 - png_ptr->gamma_shift));
-      for (i = 0; i < istop; i++)
+      *ptable = (png_bytep)png_gamma_cache_find(cache, PNG_GAMMA_TABLE_8, 0,
+          gamma_val);
+
+      if (*ptable != NULL)
       {
-         png_free(png_ptr, png_ptr->gamma_16_from_1[i]);
+         png_ptr->gamma_cached |= bit;
+         return;
       }
-   png_free(png_ptr, png_ptr->gamma_16_from_1);
-   png_ptr->gamma_16_from_1 = NULL;
    }
-   if (png_ptr->gamma_16_to_1 != NULL)
+
+   png_build_8bit_table(png_ptr, ptable, gamma_val);
+
+   if (cache != NULL && png_gamma_cache_add(cache, PNG_GAMMA_TABLE_8, 0,
+       gamma_val, *ptable) != 0)
+      png_ptr->gamma_cached |= bit;
+}
+
+/* The same for the 16-bit tables; 'kind' is PNG_GAMMA_TABLE_16 or
+ * PNG_GAMMA_TABLE_16TO8.
+ */
+static void
+png_gamma_16bit_table(png_structrp png_ptr, png_uint_16pp *ptable, int kind,
+    unsigned int shift, png_fixed_point gamma_val, unsigned int bit)
+{
+   png_gamma_cachep cache = png_ptr->gamma_cache;
+
+   if (cache != NULL)
    {
-      int i;
-      int istop = (1 << (8 - png_ptr->gamma_shift));
-      for (i = 0; i < istop; i++)
+      *ptable = (png_uint_16pp)png_gamma_cache_find(cache, kind, shift,
+          gamma_val);
+
+      if (*ptable != NULL)
       {
-         png_free(png_ptr, png_ptr->gamma_16_to_1[i]);
+         png_ptr->gamma_cached |= bit;
+         return;
       }
-   png_free(png_ptr, png_ptr->gamma_16_to_1);
-   png_ptr->gamma_16_to_1 = NULL;
    }
+
+   if (kind == PNG_GAMMA_TABLE_16TO8)
+      png_build_16to8_table(png_ptr, ptable, shift, gamma_val);
+
+   else
+      png_build_16bit_table(png_ptr, ptable, shift, gamma_val);
+
+   if (cache != NULL &&
+       png_gamma_cache_add(cache, kind, shift, gamma_val, *ptable) != 0)
+      png_ptr->gamma_cached |= bit;
 }
 
 /* We build the 8- or 16-bit gamma tables here.  Note that for 16-bit
@@ -4010,20 +4192,21 @@ png_build_gamma_table(png_structrp png_ptr, int bit_depth)
 
    if (bit_depth <= 8)
    {
-      png_build_8bit_table(png_ptr, &png_ptr->gamma_table,
+      png_gamma_8bit_table(png_ptr, &png_ptr->gamma_table,
           png_ptr->screen_gamma > 0 ?
           png_reciprocal2(png_ptr->colorspace.gamma,
-          png_ptr->screen_gamma) : PNG_FP_1);
+          png_ptr->screen_gamma) : PNG_FP_1, PNG_GAMMA_CACHED_TABLE);
 
       if ((png_ptr->transformations & (PNG_COMPOSE | PNG_RGB_TO_GRAY)) != 0)
       {
-         png_build_8bit_table(png_ptr, &png_ptr->gamma_to_1,
-             png_reciprocal(png_ptr->colorspace.gamma));
+         png_gamma_8bit_table(png_ptr, &png_ptr->gamma_to_1,
+             png_reciprocal(png_ptr->colorspace.gamma), PNG_GAMMA_CACHED_TO_1);
 
-         png_build_8bit_table(png_ptr, &png_ptr->gamma_from_1,
+         png_gamma_8bit_table(png_ptr, &png_ptr->gamma_from_1,
              png_ptr->screen_gamma > 0 ?
              png_reciprocal(png_ptr->screen_gamma) :
-             png_ptr->colorspace.gamma/* Probably doing rgb_to_gray */);
+             png_ptr->colorspace.gamma/* Probably doing rgb_to_gray */,
+             PNG_GAMMA_CACHED_FROM_1);
       }
    }
    else
@@ -4089,27 +4272,33 @@ png_build_gamma_table(png_structrp png_ptr, int bit_depth)
        * reduced to 8 bits.
        */
       if ((png_ptr->transformations & (PNG_16_TO_8 | PNG_SCALE_16_TO_8)) != 0)
-          png_build_16to8_table(png_ptr, &png_ptr->gamma_16_table, shift,
+          png_gamma_16bit_table(png_ptr, &png_ptr->gamma_16_table,
+          PNG_GAMMA_TABLE_16TO8, shift,
           png_ptr->screen_gamma > 0 ? png_product2(png_ptr->colorspace.gamma,
-          png_ptr->screen_gamma) : PNG_FP_1);
+          png_ptr->screen_gamma) : PNG_FP_1, PNG_GAMMA_CACHED_16_TABLE);
 
       else
-          png_build_16bit_table(png_ptr, &png_ptr->gamma_16_table, shift,
+          png_gamma_16bit_table(png_ptr, &png_ptr->gamma_16_table,
+          PNG_GAMMA_TABLE_16, shift,
           png_ptr->screen_gamma > 0 ? png_reciprocal2(png_ptr->colorspace.gamma,
-          png_ptr->screen_gamma) : PNG_FP_1);
+          png_ptr->screen_gamma) : PNG_FP_1, PNG_GAMMA_CACHED_16_TABLE);
 
       if ((png_ptr->transformations & (PNG_COMPOSE | PNG_RGB_TO_GRAY)) != 0)
       {
-         png_build_16bit_table(png_ptr, &png_ptr->gamma_16_to_1, shift,
-             png_reciprocal(png_ptr->colorspace.gamma));
+         png_gamma_16bit_table(png_ptr, &png_ptr->gamma_16_to_1,
+             PNG_GAMMA_TABLE_16, shift,
+             png_reciprocal(png_ptr->colorspace.gamma),
+             PNG_GAMMA_CACHED_16_TO_1);
 
          /* Notice that the '16 from 1' table should be full precision, however
           * the lookup on this table still uses gamma_shift, so it can't be.
           * TODO: fix this.
           */
-         png_build_16bit_table(png_ptr, &png_ptr->gamma_16_from_1, shift,
+         png_gamma_16bit_table(png_ptr, &png_ptr->gamma_16_from_1,
+             PNG_GAMMA_TABLE_16, shift,
              png_ptr->screen_gamma > 0 ? png_reciprocal(png_ptr->screen_gamma) :
-             png_ptr->colorspace.gamma/* Probably doing rgb_to_gray */);
+             png_ptr->colorspace.gamma/* Probably doing rgb_to_gray */,
+             PNG_GAMMA_CACHED_16_FROM_1);
       }
    }
 }
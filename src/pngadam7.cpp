@@ -0,0 +1,566 @@
+/* pngadam7.cpp - parallel encoding of interlaced images
+ *
+ * This code is released under the libpng license.
+ * For conditions of distribution and use, see the disclaimer
+ * and license in png.h
+ *
+ * png_write_row gets an interlaced image one pass row at a time, so each row
+ * must be extracted, filtered and deflated before the next.  png_write_image
+ * has the whole image and so every pass row at once.  The rows of the seven
+ * passes, in file order, are divided into bands of about PNG_ADAM7_BAND bytes
+ * of filtered data.  First each band is extracted from the image and filtered
+ * on a worker thread into a buffer holding the filtered data of the whole
+ * image; the filters are chosen by the heuristic of png_write_find_filter.
+ * Then each band is deflated on a worker thread as a raw deflate segment,
+ * with the 32K of filtered data before it as the dictionary, and all but the
+ * last end with a sync flush.  This leaves every segment at a byte boundary,
+ * so the segments are simply concatenated between a zlib header and the
+ * Adler-32 combined from those of the bands.  The filtered data is the same
+ * as png_write_row produces and, because each segment can refer back into
+ * the one before, the compressed size stays within about half a percent of
+ * that of a single deflate stream.
+ *
+ * The workers cannot allocate through the png_struct, since the accounting of
+ * png_set_mem_budget is not thread safe, so everything they use, down to the
+ * memory of their deflate streams, is allocated beforehand with
+ * png_malloc_warn.  If any of it cannot be had png_write_row does the work.
+ */
+
+#include <pngmem.h>
+#include <pngerror.h>
+#include <pngdebug.h>
+#include <trans.h>
+#include <wutil.h>
+#include <pngthread.h>
+#include <stats.h>
+#include <adam7.h>
+
+#include "pngpriv.h"
+
+#define PNG_ADAM7_BAND     262144  /* bytes of filtered data per band */
+#define PNG_ADAM7_MIN_BANDS 4      /* smaller images are written serially */
+#define PNG_ADAM7_ROW_MAX  (1U << 24) /* longest image row, in bytes */
+
+typedef struct
+{
+   int pass;
+   png_uint_32 first;      /* the first row of the pass in the band */
+   png_uint_32 rows;
+   size_t offset;          /* of the filtered data of the band */
+   size_t len;
+   png_bytep out;          /* the deflated band, in png_adam7::out */
+   size_t out_max;
+   size_t out_len;
+   png_uint_32 adler;      /* of the filtered data */
+   int failed;
+} png_adam7_band;
+
+struct png_adam7_def
+{
+   png_bytepp image;
+   png_bytep filtered;     /* all the filtered rows, in file order */
+   png_adam7_band *bands;
+   png_uint_32 num_bands;
+   png_bytep scratch;      /* three rows for each worker */
+   png_bytep out;          /* the deflated bands */
+   png_zarena *arenas;     /* a deflate stream's memory for each worker */
+   png_bytep arena_mem;
+   png_uint_32 width;
+   size_t rowbytes;        /* of an image row */
+   png_byte color_type;
+   png_byte bit_depth;
+   png_byte channels;
+   png_byte pixel_depth;
+   unsigned int bpp;       /* bytes per pixel, at least 1 */
+   unsigned int filters;   /* PNG_FILTER_ flags */
+   int level;
+   int window_bits;
+   int mem_level;
+   int strategy;
+};
+
+void /* PRIVATE */
+png_adam7_destroy(png_structrp png_ptr, png_adam7p adam7)
+{
+   if (adam7 == NULL)
+      return;
+
+   png_free(png_ptr, adam7->arena_mem);
+   png_free(png_ptr, adam7->arenas);
+   png_free(png_ptr, adam7->out);
+   png_free(png_ptr, adam7->scratch);
+   png_free(png_ptr, adam7->bands);
+   png_free(png_ptr, adam7->filtered);
+   png_free(png_ptr, adam7);
+}
+
+/* The filter flags png_write_start_row will use. */
+static unsigned int
+png_adam7_filters(png_const_structrp png_ptr)
+{
+   unsigned int filters = png_ptr->do_filter;
+
+   if (png_ptr->height == 1)
+      filters &= 0xff & ~(PNG_FILTER_UP|PNG_FILTER_AVG|PNG_FILTER_PAETH);
+
+   if (png_ptr->width == 1)
+      filters &= 0xff & ~(PNG_FILTER_SUB|PNG_FILTER_AVG|PNG_FILTER_PAETH);
+
+   if (filters == 0)
+      filters = PNG_FILTER_NONE;
+
+   return filters;
+}
+
+/* Divide the passes into bands.  Returns 0 if the image is too small to be
+ * worth it or too large to be held in memory.
+ */
+static int
+png_adam7_bands(png_const_structrp png_ptr, png_adam7p adam7)
+{
+   png_uint_32 count = 0;
+   size_t total = 0;
+   int fill, pass;
+
+   for (fill = 0; fill < 2; ++fill)
+   {
+      for (pass = 0; pass < 7; ++pass)
+      {
+         png_uint_32 width = PNG_PASS_COLS(png_ptr->width, pass);
+         png_uint_32 rows = PNG_PASS_ROWS(png_ptr->height, pass);
+         size_t len = PNG_ROWBYTES(adam7->pixel_depth, width) + 1;
+         png_uint_32 step, first;
+
+         if (width == 0 || rows == 0)
+            continue;
+
+         step = len < PNG_ADAM7_BAND ? (png_uint_32)(PNG_ADAM7_BAND / len) : 1;
+
+         for (first = 0; first < rows; first += step)
+         {
+            png_uint_32 n = rows - first < step ? rows - first : step;
+
+            if (fill != 0)
+            {
+               png_adam7_band *band = adam7->bands + count;
+
+               band->pass = pass;
+               band->first = first;
+               band->rows = n;
+               band->offset = total;
+               band->len = n * len;
+            }
+
+            else if (count == 0xffffffffU || n > (PNG_SIZE_MAX - total) / len)
+               return 0;
+
+            ++count;
+            total += n * len;
+         }
+      }
+
+      if (fill == 0)
+      {
+         if (total < PNG_ADAM7_MIN_BANDS * (size_t)PNG_ADAM7_BAND ||
+             count > PNG_SIZE_MAX / (sizeof *adam7->bands))
+            return 0;
+
+         adam7->bands = (png_adam7_band*)png_malloc_warn(png_ptr,
+             count * (sizeof *adam7->bands));
+         adam7->filtered = (png_bytep)png_malloc_warn(png_ptr, total);
+
+         if (adam7->bands == NULL || adam7->filtered == NULL)
+            return 0;
+
+         memset(adam7->bands, 0, count * (sizeof *adam7->bands));
+
+         adam7->num_bands = count;
+         count = 0;
+         total = 0;
+      }
+   }
+
+   return 1;
+}
+
+/* Copy the pixels of 'pass' in its row 'y' to 'row'. */
+static void
+png_adam7_extract(png_const_adam7p adam7, png_bytep row, int pass,
+    png_uint_32 y)
+{
+   memcpy(row, adam7->image[PNG_ROW_FROM_PASS_ROW(y, pass)], adam7->rowbytes);
+
+   if (pass < 6)
+   {
+      png_row_info row_info;
+
+      row_info.width = adam7->width;
+      row_info.rowbytes = adam7->rowbytes;
+      row_info.color_type = adam7->color_type;
+      row_info.bit_depth = adam7->bit_depth;
+      row_info.channels = adam7->channels;
+      row_info.pixel_depth = adam7->pixel_depth;
+      png_do_write_interlace(&row_info, row, pass);
+   }
+}
+
+/* Filter one row into 'out' as png_write_find_filter does: the first filter,
+ * in the order of the filter values, with the lowest sum.  'test' has room
+ * for a filtered row.
+ */
+static void
+png_adam7_filter_row(png_const_adam7p adam7, png_bytep out, png_bytep test,
+    png_const_bytep row, png_const_bytep prev, size_t len)
+{
+   unsigned int filters = adam7->filters;
+   size_t best = 0;
+   int filter, first = 1;
+
+   if (PNG_SIZE_MAX/128 <= len)
+      filters &= 0U-filters;
+
+   for (filter = PNG_FILTER_VALUE_NONE; filter < PNG_FILTER_VALUE_LAST;
+        ++filter)
+   {
+      size_t sum;
+
+      if ((filters & (PNG_FILTER_NONE << filter)) == 0)
+         continue;
+
+      if (first != 0)
+      {
+         png_trial_filter(out, row, prev, len, adam7->bpp, filter);
+
+         if ((filters & ~(PNG_FILTER_NONE << filter)) == 0)
+            return;
+
+         best = png_trial_sum(out + 1, len);
+         first = 0;
+         continue;
+      }
+
+      png_trial_filter(test, row, prev, len, adam7->bpp, filter);
+      sum = png_trial_sum(test + 1, len);
+
+      if (sum < best)
+      {
+         memcpy(out, test, len + 1);
+         best = sum;
+      }
+   }
+}
+
+/* Extract and filter the rows of one band. */
+static void
+png_adam7_filter(png_voidp arg, unsigned int worker, png_uint_32 index)
+{
+   png_const_adam7p adam7 = (png_const_adam7p)arg;
+   png_adam7_band *band = adam7->bands + index;
+   int pass = band->pass;
+   size_t len = PNG_ROWBYTES(adam7->pixel_depth,
+       PNG_PASS_COLS(adam7->width, pass));
+   png_bytep buf = adam7->scratch + worker * (3 * adam7->rowbytes + 1);
+   png_bytep out = adam7->filtered + band->offset;
+   png_bytep row = buf, prev = NULL;
+   png_uint_32 i;
+
+   if (band->first > 0)
+   {
+      prev = buf + adam7->rowbytes;
+      png_adam7_extract(adam7, prev, pass, band->first - 1);
+   }
+
+   for (i = 0; i < band->rows; ++i, out += len + 1)
+   {
+      png_adam7_extract(adam7, row, pass, band->first + i);
+      png_adam7_filter_row(adam7, out, buf + 2 * adam7->rowbytes, row, prev,
+          len);
+
+      prev = row;
+      row = row == buf ? buf + adam7->rowbytes : buf;
+   }
+}
+
+/* Deflate one band.  The output is at most deflateBound plus the few bytes of
+ * the sync flush, so one call does it.
+ */
+static void
+png_adam7_deflate(png_voidp arg, unsigned int worker, png_uint_32 index)
+{
+   png_const_adam7p adam7 = (png_const_adam7p)arg;
+   png_adam7_band *band = adam7->bands + index;
+   png_const_bytep in = adam7->filtered + band->offset;
+   size_t window = (size_t)1 << adam7->window_bits;
+   size_t dict = band->offset < window ? band->offset : window;
+   int last = index + 1 == adam7->num_bands;
+   z_stream z;
+   int ret;
+
+   band->failed = 1;
+   band->adler = (png_uint_32)adler32(adler32(0, NULL, 0), in,
+       (uInt)band->len);
+
+   memset(&z, 0, sizeof z);
+   png_zarena_use(&z, adam7->arenas + worker);
+
+   if (deflateInit2(&z, adam7->level, Z_DEFLATED, -adam7->window_bits,
+       adam7->mem_level, adam7->strategy) != Z_OK)
+      return;
+
+   if (dict == 0 || deflateSetDictionary(&z, in - dict, (uInt)dict) == Z_OK)
+   {
+      z.next_in = PNGZ_INPUT_CAST(in);
+      z.avail_in = (uInt)band->len;
+      z.next_out = band->out;
+      z.avail_out = (uInt)band->out_max;
+
+      ret = deflate(&z, last ? Z_FINISH : Z_SYNC_FLUSH);
+
+      if (z.avail_in == 0 && z.avail_out > 0 &&
+          ret == (last ? Z_STREAM_END : Z_OK))
+      {
+         band->out_len = band->out_max - z.avail_out;
+         band->failed = 0;
+      }
+   }
+
+   deflateEnd(&z);
+}
+
+/* Allocate the memory of the workers: their rows, their deflate streams and
+ * the output of every band, sized with deflateBound from a stream with the
+ * same parameters.  Returns 0 if any of it cannot be had.
+ */
+static int
+png_adam7_alloc(png_const_structrp png_ptr, png_adam7p adam7)
+{
+   unsigned int workers = png_thread_count();
+   size_t arena_size = png_zarena_size(adam7->window_bits, adam7->mem_level);
+   size_t total = 0;
+   png_uint_32 i;
+   z_stream z;
+
+   if (workers > adam7->num_bands)
+      workers = adam7->num_bands;
+
+   adam7->scratch = (png_bytep)png_malloc_warn(png_ptr,
+       workers * (3 * adam7->rowbytes + 1));
+   adam7->arenas = (png_zarena*)png_malloc_warn(png_ptr,
+       workers * (sizeof *adam7->arenas));
+   adam7->arena_mem = (png_bytep)png_malloc_warn(png_ptr,
+       workers * arena_size);
+
+   if (adam7->scratch == NULL || adam7->arenas == NULL ||
+       adam7->arena_mem == NULL)
+      return 0;
+
+   for (i = 0; i < workers; ++i)
+   {
+      adam7->arenas[i].base = adam7->arena_mem + i * arena_size;
+      adam7->arenas[i].size = arena_size;
+      adam7->arenas[i].used = 0;
+   }
+
+   memset(&z, 0, sizeof z);
+   png_zarena_use(&z, adam7->arenas);
+
+   if (deflateInit2(&z, adam7->level, Z_DEFLATED, -adam7->window_bits,
+       adam7->mem_level, adam7->strategy) != Z_OK)
+      return 0;
+
+   for (i = 0; i < adam7->num_bands; ++i)
+   {
+      png_adam7_band *band = adam7->bands + i;
+
+      band->out_max = deflateBound(&z, (uLong)band->len) + 16;
+
+      if (band->out_max > PNG_SIZE_MAX - total)
+         break;
+
+      total += band->out_max;
+   }
+
+   deflateEnd(&z);
+
+   if (i < adam7->num_bands)
+      return 0;
+
+   adam7->out = (png_bytep)png_malloc_warn(png_ptr, total);
+
+   if (adam7->out == NULL)
+      return 0;
+
+   for (i = 0, total = 0; i < adam7->num_bands; ++i)
+   {
+      adam7->bands[i].out = adam7->out + total;
+      total += adam7->bands[i].out_max;
+   }
+
+   return 1;
+}
+
+/* The arguments png_write_row gives write_row_fn after row 'y' of 'pass'. */
+static void
+png_adam7_row_written(png_structrp png_ptr, int pass, png_uint_32 y)
+{
+   y = PNG_ROW_FROM_PASS_ROW(y, pass) + 1;
+
+   if (y < png_ptr->height)
+   {
+      png_ptr->row_number = y;
+      png_ptr->pass = (png_byte)pass;
+   }
+
+   else
+   {
+      png_ptr->row_number = 0;
+      png_ptr->pass = (png_byte)(pass + 1);
+   }
+
+   if (png_ptr->write_row_fn != NULL)
+      (*(png_ptr->write_row_fn))(png_ptr, png_ptr->row_number, png_ptr->pass);
+}
+
+int /* PRIVATE */
+png_adam7_write_image(png_structrp png_ptr, png_bytepp image)
+{
+   png_adam7p adam7;
+   png_uint_32 adler, i, y;
+   png_off_t stat_start;
+   int failed;
+
+   if (png_ptr->interlaced == 0 ||
+       png_ptr->transformations != PNG_INTERLACE ||
+       png_ptr->row_number != 0 || png_ptr->pass != 0 ||
+       (png_ptr->mode & PNG_WROTE_INFO_BEFORE_PLTE) == 0 ||
+       (png_ptr->mode & PNG_HAVE_IDAT) != 0 || png_ptr->zowner != 0 ||
+       png_ptr->encode_cache != NULL ||
+       png_ptr->encode_speed == PNG_ENCODE_SPEED_REALTIME ||
+       png_ptr->encode_speed == PNG_ENCODE_SPEED_ARCHIVE ||
+       png_ptr->encode_speed == PNG_ENCODE_SPEED_SMALLEST ||
+       png_ptr->flush_dist != 0 || png_ptr->zlib_window_bits < 9 ||
+       png_thread_count() < 2)
+      return 0;
+
+   if (PNG_ROWBYTES(png_ptr->pixel_depth, png_ptr->width) >= PNG_ADAM7_ROW_MAX)
+      return 0;
+
+   png_debug(1, "in png_adam7_write_image");
+
+   adam7 = (png_adam7p)png_malloc_warn(png_ptr, sizeof *adam7);
+
+   if (adam7 == NULL)
+      return 0;
+
+   memset(adam7, 0, sizeof *adam7);
+   png_ptr->adam7 = adam7;
+
+   adam7->image = image;
+   adam7->width = png_ptr->width;
+   adam7->rowbytes = PNG_ROWBYTES(png_ptr->pixel_depth, png_ptr->width);
+   adam7->color_type = png_ptr->color_type;
+   adam7->bit_depth = png_ptr->bit_depth;
+   adam7->channels = png_ptr->channels;
+   adam7->pixel_depth = png_ptr->pixel_depth;
+   adam7->bpp = (png_ptr->pixel_depth + 7) >> 3;
+   adam7->filters = png_adam7_filters(png_ptr);
+   adam7->level = png_ptr->zlib_level;
+   adam7->window_bits = png_ptr->zlib_window_bits;
+   adam7->mem_level = png_ptr->zlib_mem_level;
+
+   /* As png_deflate_claim chooses it. */
+   if ((png_ptr->flags & PNG_FLAG_ZLIB_CUSTOM_STRATEGY) != 0)
+      adam7->strategy = png_ptr->zlib_strategy;
+
+   else if (adam7->filters != PNG_FILTER_NONE)
+      adam7->strategy = PNG_Z_DEFAULT_STRATEGY;
+
+   else
+      adam7->strategy = PNG_Z_DEFAULT_NOFILTER_STRATEGY;
+
+   if (png_adam7_bands(png_ptr, adam7) == 0 ||
+       png_adam7_alloc(png_ptr, adam7) == 0)
+   {
+      png_ptr->adam7 = NULL;
+      png_adam7_destroy(png_ptr, adam7);
+      return 0;
+   }
+
+   stat_start = png_stats_begin(png_ptr);
+   png_parallel_for_worker(adam7->num_bands, png_adam7_filter, adam7);
+   png_stats_end(png_ptr, PNG_STAT_FILTER, stat_start,
+       adam7->bands[adam7->num_bands-1].offset +
+       adam7->bands[adam7->num_bands-1].len);
+
+   for (i = 0, failed = 0; i < adam7->num_bands; ++i)
+      failed |= adam7->bands[i].failed;
+
+   if (failed == 0)
+   {
+      stat_start = png_stats_begin(png_ptr);
+      png_parallel_for_worker(adam7->num_bands, png_adam7_deflate, adam7);
+      png_stats_end(png_ptr, PNG_STAT_DEFLATE, stat_start,
+          adam7->bands[adam7->num_bands-1].offset +
+          adam7->bands[adam7->num_bands-1].len);
+
+      for (i = 0; i < adam7->num_bands; ++i)
+         failed |= adam7->bands[i].failed;
+   }
+
+   /* Nothing has been written yet, so png_write_row can still do it all. */
+   if (failed != 0)
+   {
+      png_ptr->adam7 = NULL;
+      png_adam7_destroy(png_ptr, adam7);
+      return 0;
+   }
+
+   png_write_start_row(png_ptr);
+
+   /* The palette index check looks at png_ptr->row_buf; every pixel is in
+    * one pass, so checking the image rows finds the same maximum.
+    */
+   if (png_ptr->color_type == PNG_COLOR_TYPE_PALETTE &&
+       png_ptr->num_palette_max >= 0)
+   {
+      for (y = 0; y < png_ptr->height; ++y)
+      {
+         png_row_info row_info;
+
+         row_info.width = png_ptr->width;
+         row_info.rowbytes = adam7->rowbytes;
+         row_info.color_type = png_ptr->color_type;
+         row_info.bit_depth = png_ptr->bit_depth;
+         row_info.channels = png_ptr->channels;
+         row_info.pixel_depth = png_ptr->pixel_depth;
+
+         memcpy(png_ptr->row_buf + 1, image[y], adam7->rowbytes);
+         png_do_check_palette_indexes(png_ptr, &row_info);
+      }
+   }
+
+   png_start_IDAT_stream(png_ptr);
+   adler = (png_uint_32)adler32(0, NULL, 0);
+
+   for (i = 0; i < adam7->num_bands; ++i)
+   {
+      const png_adam7_band *band = adam7->bands + i;
+
+      png_write_IDAT_bytes(png_ptr, band->out, band->out_len);
+      adler = (png_uint_32)adler32_combine(adler, band->adler,
+          (z_off_t)band->len);
+
+      for (y = 0; y < band->rows; ++y)
+         png_adam7_row_written(png_ptr, band->pass, band->first + y);
+   }
+
+   /* The rows after the last one of pass 6, if any, were skipped. */
+   png_ptr->row_number = 0;
+   png_ptr->pass = 7;
+
+   png_ptr->adam7 = NULL;
+   png_adam7_destroy(png_ptr, adam7);
+   png_end_IDAT_stream(png_ptr, adler);
+
+   return 1;
+}
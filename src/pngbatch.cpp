@@ -0,0 +1,131 @@
+/* pngbatch.cpp - decoding many images at once on worker threads
+ *
+ * This code is released under the libpng license.
+ * For conditions of distribution and use, see the disclaimer
+ * and license in png.h
+ *
+ * A server decoding a set of small images from a pool of its own threads,
+ * one image per thread, waits at the end for whichever thread drew the large
+ * image.  Here the jobs are taken one at a time from a shared counter, in
+ * order of decreasing file size, so the large images start first and the
+ * small ones fill in around them.  The simplified API catches its own errors,
+ * so a job never unwinds through the thread code.
+ *
+ * Setting up a png_struct costs well under a microsecond, so there is nothing
+ * to gain by reusing one, but building the gamma tables for a 16-bit image can
+ * cost more than decoding it; each thread keeps those in a png_gamma_cache.
+ * The pool threads of pngthread.cpp run every batch, so the caches are kept
+ * from one batch to the next and freed when their thread exits.  The caches
+ * and the job order belong to no png_struct, so they come from malloc and no
+ * png_set_mem_budget counts them.
+ */
+
+#include <pngmem.h>
+#include <pngdebug.h>
+#include <pngthread.h>
+#include <gcache.h>
+
+#include "pngpriv.h"
+
+#include <algorithm>
+
+typedef struct
+{
+   png_image_batch_job *jobs;
+   size_t *order;                /* the jobs by decreasing size, or NULL */
+} png_batch;
+
+/* The gamma tables of this thread. */
+struct png_batch_cache
+{
+   png_gamma_cachep cache;
+
+   ~png_batch_cache() { png_gamma_cache_destroy(cache); }
+};
+
+static thread_local png_batch_cache png_batch_gamma = { NULL };
+
+static int
+png_batch_job(png_image_batch_job *job, png_gamma_cachep cache)
+{
+   png_imagep image = &job->image;
+   png_uint_32 format = image->format;
+   png_uint_32 component, stride;
+
+   if (png_image_begin_read_from_memory(image, job->memory, job->memory_size)
+       == 0)
+      return 0;
+
+   image->format = format;
+   component = PNG_IMAGE_PIXEL_COMPONENT_SIZE(format);
+
+   if (job->row_stride == 0)
+      stride = PNG_IMAGE_ROW_STRIDE(*image);
+
+   else if (job->row_stride < 0)
+      stride = (png_uint_32)-job->row_stride;
+
+   else
+      stride = (png_uint_32)job->row_stride;
+
+   /* png_image_finish_read checks the stride itself. */
+   if (job->buffer == NULL || (stride > 0 && image->height >
+       job->buffer_size / component / stride))
+      return png_image_error(image, "png_image_batch_read: buffer too small");
+
+   image->opaque->png_ptr->gamma_cache = cache;
+
+   return png_image_finish_read(image, job->background, job->buffer,
+       job->row_stride, job->colormap);
+}
+
+static void
+png_batch_run(png_voidp arg, png_uint_32 index)
+{
+   png_batch *batch = (png_batch*)arg;
+   png_image_batch_job *job = batch->jobs +
+       (batch->order != NULL ? batch->order[index] : index);
+
+   /* Without memory for it the job builds its own tables. */
+   if (png_batch_gamma.cache == NULL)
+      png_batch_gamma.cache = png_gamma_cache_create();
+
+   job->status = png_batch_job(job, png_batch_gamma.cache);
+}
+
+int PNGAPI
+png_image_batch_read(png_image_batch_job *jobs, size_t count)
+{
+   png_batch batch;
+   size_t j;
+   int done = 0;
+
+   if (jobs == NULL || count == 0)
+      return 0;
+
+   /* The thread job index is 32 bits and the result an int. */
+   if (count > PNG_UINT_31_MAX)
+      count = PNG_UINT_31_MAX;
+
+   /* Without memory for this the jobs simply run in order. */
+   batch.jobs = jobs;
+   batch.order = (size_t*)malloc(count * (sizeof (size_t)));
+
+   if (batch.order != NULL)
+   {
+      for (j = 0; j < count; ++j)
+         batch.order[j] = j;
+
+      std::stable_sort(batch.order, batch.order + count,
+          [jobs](size_t a, size_t b)
+          { return jobs[a].memory_size > jobs[b].memory_size; });
+   }
+
+   png_parallel_for((png_uint_32)count, png_batch_run, &batch);
+   free(batch.order);
+
+   for (j = 0; j < count; ++j)
+      done += jobs[j].status != 0;
+
+   return done;
+}
@@ -0,0 +1,363 @@
+/* pngcxx.cpp - C++ interface to libpng
+ *
+ * This code is released under the libpng license.
+ * For conditions of distribution and use, see the disclaimer
+ * and license in png.h
+ *
+ * The callbacks get their state through the io_ptr and mem_ptr, so the
+ * per-object state lives in one heap block that does not move when the
+ * reader or writer is moved.
+ */
+
+#include <new>
+#include <utility>
+
+#include <png/pngcxx.h>
+
+#include "pngpriv.h"
+
+struct png::reader::state
+{
+   png_const_bytep memory;       /* memory input, or NULL */
+   size_t size;
+   size_t pos;
+   source *in;                   /* source input, or NULL */
+   int passes;                   /* 0 until the transforms are fixed */
+};
+
+struct png::writer::state
+{
+   sink *out;
+   int passes;                   /* 0 until write_info */
+};
+
+static void PNGCBAPI
+png_cxx_error(png_struct *png_ptr, png_const_charp error_message)
+{
+   PNG_UNUSED(png_ptr)
+   throw png::error(error_message);
+}
+
+static png_voidp PNGCBAPI
+png_cxx_malloc(const png_struct *png_ptr, size_t size)
+{
+   png::allocator *alloc =
+      static_cast<png::allocator*>(png_get_mem_ptr(png_ptr));
+
+   try
+   {
+      return alloc->allocate(size);
+   }
+
+   catch (const std::bad_alloc &)
+   {
+      return NULL;
+   }
+}
+
+static void PNGCBAPI
+png_cxx_free(const png_struct *png_ptr, png_voidp ptr)
+{
+   static_cast<png::allocator*>(png_get_mem_ptr(png_ptr))->deallocate(ptr);
+}
+
+static void PNGCBAPI
+png_cxx_read_memory(png_struct *png_ptr, png_bytep data, size_t length)
+{
+   png::reader::state *s =
+      static_cast<png::reader::state*>(png_get_io_ptr(png_ptr));
+
+   if (length > s->size - s->pos)
+      png_error(png_ptr, "read beyond end of data");
+
+   memcpy(data, s->memory + s->pos, length);
+   s->pos += length;
+}
+
+static void PNGCBAPI
+png_cxx_read_source(png_struct *png_ptr, png_bytep data, size_t length)
+{
+   static_cast<png::reader::state*>(png_get_io_ptr(png_ptr))->in->read(data,
+       length);
+}
+
+static void PNGCBAPI
+png_cxx_write_sink(png_struct *png_ptr, png_const_bytep data, size_t length)
+{
+   static_cast<png::writer::state*>(png_get_io_ptr(png_ptr))->out->write(data,
+       length);
+}
+
+static void PNGCBAPI
+png_cxx_flush_sink(png_struct *png_ptr)
+{
+   static_cast<png::writer::state*>(png_get_io_ptr(png_ptr))->out->flush();
+}
+
+/* The image checks shared by reader and writer.  Returns the stride. */
+static size_t
+png_cxx_check_image(png_const_structrp png_ptr, size_t rowbytes,
+    png_uint_32 height, size_t size, size_t stride)
+{
+   if (stride == 0)
+      stride = rowbytes;
+
+   if (stride < rowbytes)
+      png_error(png_ptr, "image stride is less than the row size");
+
+   if (height > 0 &&
+       (height - 1 > (PNG_SIZE_MAX - rowbytes) / stride ||
+        size < stride * (height - 1) + rowbytes))
+      png_error(png_ptr, "image buffer is too small");
+
+   return stride;
+}
+
+/* reader */
+png::reader::reader(FILE *fp, allocator *alloc)
+   : png_ptr_(NULL), info_ptr_(NULL), state_(NULL)
+{
+   png_ptr_ = alloc != NULL ?
+      png_create_read_struct_2(PNG_LIBPNG_VER_STRING, NULL, png_cxx_error,
+          NULL, alloc, png_cxx_malloc, png_cxx_free) :
+      png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, png_cxx_error, NULL);
+
+   if (png_ptr_ == NULL)
+      throw error("png_create_read_struct failed");
+
+   info_ptr_ = png_create_info_struct(png_ptr_);
+   state_ = new (std::nothrow) state();
+
+   if (info_ptr_ == NULL || state_ == NULL)
+   {
+      png_destroy_read_struct(&png_ptr_, &info_ptr_, NULL);
+      delete state_;
+      throw std::bad_alloc();
+   }
+
+   if (fp != NULL)
+      png_init_io(png_ptr_, fp);
+}
+
+png::reader::reader(const void *data, size_t size, allocator *alloc)
+   : reader((FILE*)NULL, alloc)
+{
+   state_->memory = static_cast<png_const_bytep>(data);
+   state_->size = size;
+   png_set_read_fn(png_ptr_, state_, png_cxx_read_memory);
+}
+
+png::reader::reader(source &in, allocator *alloc)
+   : reader((FILE*)NULL, alloc)
+{
+   state_->in = &in;
+   png_set_read_fn(png_ptr_, state_, png_cxx_read_source);
+}
+
+png::reader::reader(reader &&other) noexcept
+   : png_ptr_(other.png_ptr_), info_ptr_(other.info_ptr_),
+     state_(other.state_)
+{
+   other.png_ptr_ = NULL;
+   other.info_ptr_ = NULL;
+   other.state_ = NULL;
+}
+
+png::reader &
+png::reader::operator=(reader &&other) noexcept
+{
+   std::swap(png_ptr_, other.png_ptr_);
+   std::swap(info_ptr_, other.info_ptr_);
+   std::swap(state_, other.state_);
+   return *this;
+}
+
+png::reader::~reader()
+{
+   png_destroy_read_struct(&png_ptr_, &info_ptr_, NULL);
+   delete state_;
+   state_ = NULL;
+}
+
+void
+png::reader::read_info()
+{
+   png_read_info(png_ptr_, info_ptr_);
+}
+
+void
+png::reader::start()
+{
+   if (state_->passes == 0)
+   {
+      state_->passes = png_set_interlace_handling(png_ptr_);
+      png_read_update_info(png_ptr_, info_ptr_);
+   }
+}
+
+size_t
+png::reader::rowbytes()
+{
+   start();
+   return png_get_rowbytes(png_ptr_, info_ptr_);
+}
+
+int
+png::reader::passes()
+{
+   start();
+   return state_->passes;
+}
+
+void
+png::reader::read_row(png_bytep row, size_t size)
+{
+   if (size < rowbytes())
+      png_error(png_ptr_, "row buffer is too small");
+
+   png_read_row(png_ptr_, row, NULL);
+}
+
+void
+png::reader::read_image(png_bytep image, size_t size, size_t stride)
+{
+   png_uint_32 h = height();
+   int pass;
+
+   stride = png_cxx_check_image(png_ptr_, rowbytes(), h, size, stride);
+
+   /* Each pass of an interlaced image goes over every row; libpng only
+    * touches the pixels of that pass.
+    */
+   for (pass = 0; pass < state_->passes; ++pass)
+   {
+      png_bytep row = image;
+      png_uint_32 y;
+
+      for (y = 0; y < h; ++y, row += stride)
+         png_read_row(png_ptr_, row, NULL);
+   }
+}
+
+void
+png::reader::read_end()
+{
+   png_read_end(png_ptr_, info_ptr_);
+}
+
+/* writer */
+png::writer::writer(FILE *fp, allocator *alloc)
+   : png_ptr_(NULL), info_ptr_(NULL), state_(NULL)
+{
+   png_ptr_ = alloc != NULL ?
+      png_create_write_struct_2(PNG_LIBPNG_VER_STRING, NULL, png_cxx_error,
+          NULL, alloc, png_cxx_malloc, png_cxx_free) :
+      png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, png_cxx_error,
+          NULL);
+
+   if (png_ptr_ == NULL)
+      throw error("png_create_write_struct failed");
+
+   info_ptr_ = png_create_info_struct(png_ptr_);
+   state_ = new (std::nothrow) state();
+
+   if (info_ptr_ == NULL || state_ == NULL)
+   {
+      png_destroy_write_struct(&png_ptr_, &info_ptr_);
+      delete state_;
+      throw std::bad_alloc();
+   }
+
+   if (fp != NULL)
+      png_init_io(png_ptr_, fp);
+}
+
+png::writer::writer(sink &out, allocator *alloc)
+   : writer((FILE*)NULL, alloc)
+{
+   state_->out = &out;
+   png_set_write_fn(png_ptr_, state_, png_cxx_write_sink, png_cxx_flush_sink);
+}
+
+png::writer::writer(writer &&other) noexcept
+   : png_ptr_(other.png_ptr_), info_ptr_(other.info_ptr_),
+     state_(other.state_)
+{
+   other.png_ptr_ = NULL;
+   other.info_ptr_ = NULL;
+   other.state_ = NULL;
+}
+
+png::writer &
+png::writer::operator=(writer &&other) noexcept
+{
+   std::swap(png_ptr_, other.png_ptr_);
+   std::swap(info_ptr_, other.info_ptr_);
+   std::swap(state_, other.state_);
+   return *this;
+}
+
+png::writer::~writer()
+{
+   png_destroy_write_struct(&png_ptr_, &info_ptr_);
+   delete state_;
+   state_ = NULL;
+}
+
+void
+png::writer::write_info()
+{
+   if (state_->passes == 0)
+   {
+      png_write_info(png_ptr_, info_ptr_);
+      state_->passes = png_set_interlace_handling(png_ptr_);
+   }
+}
+
+int
+png::writer::passes()
+{
+   write_info();
+   return state_->passes;
+}
+
+void
+png::writer::write_row(png_const_bytep row, size_t size)
+{
+   write_info();
+
+   /* The file row size; a transform such as png_set_filler only makes the
+    * application's rows larger.
+    */
+   if (size < png_get_rowbytes(png_ptr_, info_ptr_))
+      png_error(png_ptr_, "row buffer is too small");
+
+   png_write_row(png_ptr_, row);
+}
+
+void
+png::writer::write_image(png_const_bytep image, size_t size, size_t stride)
+{
+   png_uint_32 h = png_get_image_height(png_ptr_, info_ptr_);
+   int pass;
+
+   write_info();
+   stride = png_cxx_check_image(png_ptr_, png_get_rowbytes(png_ptr_,
+       info_ptr_), h, size, stride);
+
+   for (pass = 0; pass < state_->passes; ++pass)
+   {
+      png_const_bytep row = image;
+      png_uint_32 y;
+
+      for (y = 0; y < h; ++y, row += stride)
+         png_write_row(png_ptr_, row);
+   }
+}
+
+void
+png::writer::finish()
+{
+   write_info();
+   png_write_end(png_ptr_, info_ptr_);
+}
@@ -18,6 +18,7 @@
 
 #include <pngerror.h>
 #include <pngdebug.h>
+#include <pngtrace.h>
 
 #include "pngpriv.h"
 
@@ -76,6 +77,8 @@ png_error (png_const_structrp png_ptr, png_const_charp error_message)
       }
    }
 #endif
+   png_trace2(error, png_ptr, error_message);
+
    if (png_ptr != NULL && png_ptr->error_fn != NULL)
       (*(png_ptr->error_fn))(const_cast<png_struct*>(png_ptr),
           error_message);
@@ -208,6 +211,8 @@ png_warning(png_const_structrp png_ptr, png_const_charp warning_message)
          }
       }
    }
+   png_trace2(warning, png_ptr, warning_message + offset);
+
    if (png_ptr != NULL && png_ptr->warning_fn != NULL)
       (*(png_ptr->warning_fn))(const_cast<png_struct*>(png_ptr),
           warning_message + offset);
@@ -634,6 +639,15 @@ png_free_jmpbuf(png_structrp png_ptr)
 static void
 png_default_error (png_const_structrp png_ptr, png_const_charp error_message)
 {
+#ifdef PNG_EXCEPTIONS_SUPPORTED
+   /* An application that asked for a jmp_buf (png_jmpbuf) still gets the
+    * longjmp; so does libpng itself while it is creating the png_struct.
+    * Everyone else gets the message as a png::error.
+    */
+   if (png_ptr == NULL || png_ptr->jmp_buf_ptr == NULL)
+      throw png::error(error_message != NULL ? error_message : "undefined");
+#endif
+
 #ifdef PNG_ERROR_NUMBERS_SUPPORTED
    /* Check on NULL only added in 1.5.4 */
    if (error_message != NULL && *error_message == PNG_LITERAL_SHARP)
@@ -801,12 +815,20 @@ png_safe_error (png_struct* png_nonconst_ptr, png_const_charp error_message)
       png_safecat(image->message, (sizeof image->message), 0, error_message);
       image->warning_or_error |= PNG_IMAGE_ERROR;
 
+#ifdef PNG_EXCEPTIONS_SUPPORTED
+      /* png_safe_execute catches this; error_buf only marks that it is
+       * active.
+       */
+      if (image->opaque != NULL && image->opaque->error_buf != NULL)
+         throw png::error(error_message);
+#else
       /* Retrieve the jmp_buf from within the png_control, making this work for
        * C++ compilation too is pretty tricky: C++ wants a pointer to the first
        * element of a jmp_buf, but C doesn't tell us the type of that.
        */
       if (image->opaque != NULL && image->opaque->error_buf != NULL)
          longjmp(png_control_jmp_buf(image->opaque), 1);
+#endif
 
       /* Missing longjmp buffer, the following is to help debugging: */
       {
@@ -835,6 +857,36 @@ png_safe_warning(png_struct* png_nonconst_ptr, png_const_charp warning_message)
    }
 }
 
+#ifdef PNG_EXCEPTIONS_SUPPORTED
+int /* PRIVATE */
+png_safe_execute(png_imagep image, int (*function)(png_voidp), png_voidp arg)
+{
+   png_voidp saved_error_buf = image->opaque->error_buf;
+   int result;
+
+   /* No jmp_buf is needed; a non-NULL error_buf tells png_safe_error to throw
+    * and png_image_free to leave the cleanup to this function.
+    */
+   image->opaque->error_buf = &result;
+
+   try
+   {
+      result = function(arg);
+   }
+
+   catch (const png::error &)
+   {
+      result = 0;
+   }
+
+   image->opaque->error_buf = saved_error_buf;
+
+   if (result == 0)
+      png_image_free(image);
+
+   return result;
+}
+#else
 int /* PRIVATE */
 png_safe_execute(png_imagep image_in, int (*function)(png_voidp), png_voidp arg)
 {
@@ -862,3 +914,4 @@ png_safe_execute(png_imagep image_in, int (*function)(png_voidp), png_voidp arg)
 
    return result;
 }
+#endif
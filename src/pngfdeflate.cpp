@@ -0,0 +1,519 @@
+/* pngfdeflate.cpp - fast IDAT compression for the realtime encode tier
+ *
+ * This code is released under the libpng license.
+ * For conditions of distribution and use, see the disclaimer
+ * and license in png.h
+ *
+ * This is a greedy LZ77 matcher with a single hash probe per position and no
+ * lazy evaluation.  Matches are written with the fixed Huffman codes and runs
+ * of unmatched bytes as stored blocks; the positions inside a match are not
+ * added to the hash table.  Filtered screen content is mostly long runs and
+ * repeats of the row above, which this finds; photographic data is mostly
+ * stored, at about the speed of a copy.  The output is an ordinary zlib
+ * stream: a header, the deflate data and the Adler-32 of the filtered rows.
+ */
+
+#include <pngmem.h>
+#include <pngerror.h>
+#include <pngdebug.h>
+#include <wutil.h>
+#include <fdeflate.h>
+
+#include "pngpriv.h"
+
+#define PNG_FD_WINDOW    32768 /* the deflate window */
+#define PNG_FD_MAX_MATCH 258
+#define PNG_FD_HASH_BITS 15
+#define PNG_FD_OUT_SIZE  65536
+#define PNG_FD_STORED_MIN 64  /* shorter literal runs use Huffman codes */
+
+struct png_fast_deflate_def
+{
+   png_byte window[2*PNG_FD_WINDOW];
+   png_uint_32 head[1 << PNG_FD_HASH_BITS]; /* stream offsets, see below */
+   png_uint_32 base;                /* stream offset of window[0], modulo 2^32 */
+   size_t pos;                      /* next byte to compress */
+   size_t end;                      /* end of the data in 'window' */
+   png_uint_32 adler;
+   unsigned long long bits;         /* pending output bits, LSB first */
+   unsigned int nbits;
+   size_t out_size;
+   png_byte out[PNG_FD_OUT_SIZE + 16];
+};
+
+/* The fixed Huffman codes, bit reversed so they can be written LSB first.
+ * The length codes include their extra bits.
+ */
+static png_uint_32 png_fd_lit_code[256];
+static png_byte png_fd_lit_bits[256];
+static png_uint_32 png_fd_len_code[PNG_FD_MAX_MATCH+1];
+static png_byte png_fd_len_bits[PNG_FD_MAX_MATCH+1];
+static png_byte png_fd_dist_sym[512]; /* as zlib's _dist_code */
+static png_byte png_fd_dist_code[30];
+
+static const png_uint_16 png_fd_len_base[29] =
+{
+   3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59,
+   67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+static const png_byte png_fd_len_extra[29] =
+{
+   0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5,
+   5, 5, 5, 0
+};
+
+static const png_uint_16 png_fd_dist_base[30] =
+{
+   1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513,
+   769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+
+static const png_byte png_fd_dist_extra[30] =
+{
+   0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10,
+   11, 11, 12, 12, 13, 13
+};
+
+static png_uint_32
+png_fd_reverse(png_uint_32 code, int bits)
+{
+   png_uint_32 result = 0;
+
+   while (bits-- > 0)
+   {
+      result = (result << 1) | (code & 1);
+      code >>= 1;
+   }
+
+   return result;
+}
+
+/* The fixed code of a literal/length symbol; returns the length. */
+static int
+png_fd_fixed_code(int symbol, png_uint_32 *code)
+{
+   if (symbol < 144)
+   {
+      *code = png_fd_reverse(0x30 + symbol, 8);
+      return 8;
+   }
+
+   if (symbol < 256)
+   {
+      *code = png_fd_reverse(0x190 + symbol - 144, 9);
+      return 9;
+   }
+
+   if (symbol < 280)
+   {
+      *code = png_fd_reverse(symbol - 256, 7);
+      return 7;
+   }
+
+   *code = png_fd_reverse(0xc0 + symbol - 280, 8);
+   return 8;
+}
+
+static int
+png_fd_tables_init(void)
+{
+   int i, sym;
+
+   for (i = 0; i < 256; ++i)
+      png_fd_lit_bits[i] = (png_byte)png_fd_fixed_code(i, png_fd_lit_code + i);
+
+   for (sym = 0; sym < 29; ++sym)
+   {
+      int last = sym < 28 ? png_fd_len_base[sym+1] - 1 : PNG_FD_MAX_MATCH;
+
+      for (i = png_fd_len_base[sym]; i <= last; ++i)
+      {
+         png_uint_32 code;
+         int bits = png_fd_fixed_code(257 + sym, &code);
+
+         png_fd_len_code[i] = code |
+             ((png_uint_32)(i - png_fd_len_base[sym]) << bits);
+         png_fd_len_bits[i] = (png_byte)(bits + png_fd_len_extra[sym]);
+      }
+   }
+
+   for (sym = 0; sym < 30; ++sym)
+   {
+      int last = sym < 29 ? png_fd_dist_base[sym+1] - 1 : PNG_FD_WINDOW;
+
+      for (i = png_fd_dist_base[sym]; i <= last; ++i)
+      {
+         if (i <= 256)
+            png_fd_dist_sym[i-1] = (png_byte)sym;
+
+         else
+            png_fd_dist_sym[256 + ((i-1) >> 7)] = (png_byte)sym;
+      }
+
+      png_fd_dist_code[sym] = (png_byte)png_fd_reverse(sym, 5);
+   }
+
+   return 1;
+}
+
+static const int png_fd_tables_ready = png_fd_tables_init();
+
+static png_uint_32
+png_fd_load32(png_const_bytep p)
+{
+   png_uint_32 v;
+
+   memcpy(&v, p, 4);
+   return v;
+}
+
+static unsigned long long
+png_fd_load64(png_const_bytep p)
+{
+   unsigned long long v;
+
+   memcpy(&v, p, 8);
+   return v;
+}
+
+static void
+png_fd_write_out(png_structrp png_ptr, png_fast_deflatep fd)
+{
+   png_write_IDAT_bytes(png_ptr, fd->out, fd->out_size);
+   fd->out_size = 0;
+}
+
+/* Move whole bytes from the bit buffer to the output. */
+static void
+png_fd_flush_bits(png_fast_deflatep fd)
+{
+   while (fd->nbits >= 8)
+   {
+      fd->out[fd->out_size++] = (png_byte)fd->bits;
+      fd->bits >>= 8;
+      fd->nbits -= 8;
+   }
+}
+
+/* Number of equal bytes at 'a' and 'b', which differ within 8 bytes. */
+static size_t
+png_fd_mismatch(png_const_bytep a, png_const_bytep b)
+{
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && \
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+   return (size_t)__builtin_ctzll(png_fd_load64(a) ^ png_fd_load64(b)) >> 3;
+#else
+   size_t n = 0;
+
+   while (a[n] == b[n])
+      ++n;
+
+   return n;
+#endif
+}
+
+/* Write 32 bits of the bit buffer if they are complete. */
+static void
+png_fd_put(png_structrp png_ptr, png_fast_deflatep fd)
+{
+   if (fd->nbits >= 32)
+   {
+      png_bytep out = fd->out + fd->out_size;
+
+      out[0] = (png_byte)fd->bits;
+      out[1] = (png_byte)(fd->bits >> 8);
+      out[2] = (png_byte)(fd->bits >> 16);
+      out[3] = (png_byte)(fd->bits >> 24);
+      fd->bits >>= 32;
+      fd->nbits -= 32;
+      fd->out_size += 4;
+
+      if (fd->out_size >= PNG_FD_OUT_SIZE)
+         png_fd_write_out(png_ptr, fd);
+   }
+}
+
+/* Write 'n' bytes that have no match.  Fixed Huffman codes take 8 or 9 bits
+ * for a literal, so a long run is written as stored blocks, which is no
+ * larger and much faster.  These end the current fixed Huffman block and a
+ * new one is started after them.
+ */
+static void
+png_fd_literals(png_structrp png_ptr, png_fast_deflatep fd, png_const_bytep p,
+    size_t n)
+{
+   if (n >= PNG_FD_STORED_MIN)
+   {
+      fd->nbits += 7; /* end of block */
+
+      do
+      {
+         size_t len = n > 65535 ? 65535 : n;
+         png_bytep out;
+
+         /* A stored block header, not the last, and padding to a byte. */
+         fd->nbits = (fd->nbits + 3 + 7) & ~7U;
+         png_fd_flush_bits(fd);
+
+         out = fd->out + fd->out_size;
+         out[0] = (png_byte)len;
+         out[1] = (png_byte)(len >> 8);
+         out[2] = (png_byte)~len;
+         out[3] = (png_byte)(~len >> 8);
+         fd->out_size += 4;
+
+         if (fd->out_size + len > PNG_FD_OUT_SIZE)
+         {
+            png_fd_write_out(png_ptr, fd);
+            png_write_IDAT_bytes(png_ptr, p, len);
+         }
+
+         else
+         {
+            memcpy(fd->out + fd->out_size, p, len);
+            fd->out_size += len;
+         }
+
+         p += len;
+         n -= len;
+      }
+      while (n > 0);
+
+      fd->bits = 2; /* a fixed Huffman block, not the last */
+      fd->nbits = 3;
+   }
+
+   else
+   {
+      unsigned long long bits = fd->bits;
+      unsigned int nbits = fd->nbits;
+
+      while (n > 0)
+      {
+         /* Up to three literals (27 bits) between writes */
+         size_t count = n > 3 ? 3 : n;
+
+         n -= count;
+
+         do
+         {
+            bits |= (unsigned long long)png_fd_lit_code[*p] << nbits;
+            nbits += png_fd_lit_bits[*p++];
+         }
+         while (--count > 0);
+
+         fd->bits = bits;
+         fd->nbits = nbits;
+         png_fd_put(png_ptr, fd);
+         bits = fd->bits;
+         nbits = fd->nbits;
+      }
+   }
+}
+
+static void
+png_fd_match(png_structrp png_ptr, png_fast_deflatep fd, size_t len,
+    png_uint_32 dist)
+{
+   unsigned long long bits = fd->bits;
+   unsigned int nbits = fd->nbits;
+   unsigned int sym = dist <= 256 ? png_fd_dist_sym[dist-1] :
+       png_fd_dist_sym[256 + ((dist-1) >> 7)];
+
+   bits |= (unsigned long long)png_fd_len_code[len] << nbits;
+   nbits += png_fd_len_bits[len];
+   bits |= (unsigned long long)(png_fd_dist_code[sym] |
+       ((dist - png_fd_dist_base[sym]) << 5)) << nbits;
+   nbits += 5 + png_fd_dist_extra[sym];
+
+   fd->bits = bits;
+   fd->nbits = nbits;
+   png_fd_put(png_ptr, fd);
+}
+
+/* Compress from fd->pos until at least 'limit'.  A match may extend past
+ * 'limit', but not past fd->end.  Each call writes all its literals, so
+ * nothing before fd->pos is needed except as match history.
+ *
+ * The hash table holds the stream offset (modulo 2^32) of the last position
+ * with each hash, so it does not need to change when the window slides.  An
+ * entry is only used if it is within the deflate window and in the buffer,
+ * and the bytes are compared, so stale or initial entries are harmless.
+ * After repeated misses positions are skipped, as in LZ4; the skipped bytes
+ * are still written as literals.
+ */
+static void
+png_fd_compress(png_structrp png_ptr, png_fast_deflatep fd, size_t limit)
+{
+   png_const_bytep win = fd->window;
+   png_uint_32 *head = fd->head;
+   png_uint_32 base = fd->base;
+   size_t pos = fd->pos;
+   size_t end = fd->end;
+   size_t literal = pos; /* start of the bytes not yet written */
+   unsigned int misses = 0;
+
+   while (pos < limit)
+   {
+      if (end - pos >= 4)
+      {
+         png_uint_32 v = png_fd_load32(win + pos);
+         png_uint_32 h = (v * 2654435761U) >> (32 - PNG_FD_HASH_BITS);
+         png_uint_32 dist = base + (png_uint_32)pos - head[h];
+
+         head[h] = base + (png_uint_32)pos;
+
+         if (dist - 1 < PNG_FD_WINDOW && dist <= pos &&
+             png_fd_load32(win + pos - dist) == v)
+         {
+            png_const_bytep match = win + pos - dist;
+            size_t max = end - pos;
+            size_t len = 4;
+
+            if (max > PNG_FD_MAX_MATCH)
+               max = PNG_FD_MAX_MATCH;
+
+            while (len + 8 <= max)
+            {
+               if (png_fd_load64(match + len) != png_fd_load64(win + pos + len))
+               {
+                  len += png_fd_mismatch(match + len, win + pos + len);
+                  break;
+               }
+
+               len += 8;
+            }
+
+            /* Stops at once after a mismatch above. */
+            while (len < max && match[len] == win[pos + len])
+               ++len;
+
+            if (literal < pos)
+               png_fd_literals(png_ptr, fd, win + literal, pos - literal);
+
+            png_fd_match(png_ptr, fd, len, dist);
+            pos += len;
+            literal = pos;
+            misses = 0;
+            continue;
+         }
+      }
+
+      pos += 1 + (++misses >> 5);
+
+      if (pos > end)
+         pos = end;
+   }
+
+   if (literal < pos)
+      png_fd_literals(png_ptr, fd, win + literal, pos - literal);
+
+   fd->pos = pos;
+}
+
+/* Discard the older half of the window. */
+static void
+png_fd_slide(png_fast_deflatep fd)
+{
+   memmove(fd->window, fd->window + PNG_FD_WINDOW, PNG_FD_WINDOW);
+   fd->base += PNG_FD_WINDOW;
+   fd->pos -= PNG_FD_WINDOW;
+   fd->end -= PNG_FD_WINDOW;
+}
+
+png_fast_deflatep /* PRIVATE */
+png_fast_deflate_create(png_structrp png_ptr)
+{
+   png_fast_deflatep fd = (png_fast_deflatep)png_malloc(png_ptr, sizeof *fd);
+   static const png_byte header[2] = { 0x78, 0x01 }; /* 32K window, fastest */
+
+   PNG_UNUSED(png_fd_tables_ready)
+
+   memset(fd->head, 0, sizeof fd->head);
+   fd->base = 0;
+   fd->pos = fd->end = 0;
+   fd->adler = adler32(0, NULL, 0);
+   fd->bits = 2; /* a fixed Huffman block, not the last */
+   fd->nbits = 3;
+   fd->out_size = 0;
+
+   png_write_IDAT_bytes(png_ptr, header, 2);
+
+   return fd;
+}
+
+void /* PRIVATE */
+png_fast_deflate_destroy(png_structrp png_ptr, png_fast_deflatep fd)
+{
+   png_free(png_ptr, fd);
+}
+
+void /* PRIVATE */
+png_fast_deflate_data(png_structrp png_ptr, png_fast_deflatep fd,
+    png_const_bytep data, size_t len, int flush)
+{
+   while (len > 0)
+   {
+      size_t avail;
+
+      if (fd->end == 2*PNG_FD_WINDOW)
+         png_fd_slide(fd);
+
+      avail = 2*PNG_FD_WINDOW - fd->end;
+
+      if (avail > len)
+         avail = len;
+
+      memcpy(fd->window + fd->end, data, avail);
+      fd->adler = adler32(fd->adler, data, (uInt)avail);
+      fd->end += avail;
+      data += avail;
+      len -= avail;
+
+      /* Keep enough data after the last position for a maximal match. */
+      if (fd->end > PNG_FD_MAX_MATCH)
+         png_fd_compress(png_ptr, fd, fd->end - PNG_FD_MAX_MATCH);
+   }
+
+   if (flush == Z_NO_FLUSH)
+      return;
+
+   png_fd_compress(png_ptr, fd, fd->end);
+
+   /* End of block code (seven zero bits), then for a flush an empty stored
+    * block as zlib writes for Z_SYNC_FLUSH and a new fixed block.  At the end
+    * the final block is an empty fixed block.
+    */
+   fd->nbits += 7;
+
+   if (flush == Z_FINISH)
+   {
+      fd->bits |= 3ULL << fd->nbits;
+      fd->nbits += 3 + 7;
+   }
+
+   else
+      fd->nbits += 3;
+
+   fd->nbits = (fd->nbits + 7) & ~7U;
+   png_fd_flush_bits(fd);
+
+   if (flush == Z_FINISH)
+   {
+      png_save_uint_32(fd->out + fd->out_size, fd->adler);
+      fd->out_size += 4;
+   }
+
+   else
+   {
+      static const png_byte stored[4] = { 0, 0, 0xff, 0xff };
+
+      memcpy(fd->out + fd->out_size, stored, 4);
+      fd->out_size += 4;
+      fd->bits = 2;
+      fd->nbits = 3;
+   }
+
+   png_fd_write_out(png_ptr, fd);
+}
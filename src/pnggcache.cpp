@@ -0,0 +1,105 @@
+/* pnggcache.cpp - gamma tables kept from one png_struct to the next
+ *
+ * This code is released under the libpng license.
+ * For conditions of distribution and use, see the disclaimer
+ * and license in png.h
+ *
+ * Building a 16-bit gamma table takes up to 65536 calls of pow, which is more
+ * than the rest of the work of decoding a small 16-bit image.  The tables
+ * depend only on the kind, the shift and the gamma value, and a run of images
+ * from one source tends to need the same few, so a batch worker keeps them.
+ */
+
+#include <pngmem.h>
+#include <pngdebug.h>
+#include <gcache.h>
+
+#include "pngpriv.h"
+
+#define PNG_GAMMA_CACHE_SIZE 16 /* tables kept */
+
+typedef struct
+{
+   int kind;
+   unsigned int shift;
+   png_fixed_point gamma_val;
+   png_voidp table;
+} png_gamma_entry;
+
+struct png_gamma_cache_def
+{
+   unsigned int count;
+   png_gamma_entry entries[PNG_GAMMA_CACHE_SIZE];
+};
+
+png_gamma_cachep /* PRIVATE */
+png_gamma_cache_create(void)
+{
+   return (png_gamma_cachep)calloc(1, sizeof (png_gamma_cache));
+}
+
+void /* PRIVATE */
+png_gamma_cache_destroy(png_gamma_cachep cache)
+{
+   unsigned int i;
+
+   if (cache == NULL)
+      return;
+
+   for (i = 0; i < cache->count; ++i)
+   {
+      png_gamma_entry *entry = cache->entries + i;
+
+      if (entry->kind != PNG_GAMMA_TABLE_8)
+      {
+         png_uint_16pp table = (png_uint_16pp)entry->table;
+         unsigned int j, num = 1U << (8U - entry->shift);
+
+         for (j = 0; j < num; ++j)
+            free(table[j]);
+      }
+
+      free(entry->table);
+   }
+
+   free(cache);
+}
+
+png_voidp /* PRIVATE */
+png_gamma_cache_find(png_gamma_cachep cache, int kind, unsigned int shift,
+    png_fixed_point gamma_val)
+{
+   unsigned int i;
+
+   for (i = 0; i < cache->count; ++i)
+   {
+      const png_gamma_entry *entry = cache->entries + i;
+
+      if (entry->kind == kind && entry->shift == shift &&
+          entry->gamma_val == gamma_val)
+         return entry->table;
+   }
+
+   return NULL;
+}
+
+int /* PRIVATE */
+png_gamma_cache_add(png_gamma_cachep cache, int kind, unsigned int shift,
+    png_fixed_point gamma_val, png_voidp table)
+{
+   png_gamma_entry *entry;
+
+   /* Entries are never replaced, since the png_struct that is building its
+    * tables may be using any of them.
+    */
+   if (cache->count == PNG_GAMMA_CACHE_SIZE)
+      return 0;
+
+   entry = cache->entries + cache->count++;
+   entry->kind = kind;
+   entry->shift = shift;
+   entry->gamma_val = gamma_val;
+   entry->table = table;
+
+   return 1;
+}
@@ -1123,3 +1123,16 @@ png_get_palette_max(const png_struct* png_ptr, png_const_infop info_ptr)
 
    return (-1);
 }
+
+png_uint_32 PNGAPI
+png_get_chunk_locations(png_const_structrp png_ptr,
+    png_const_chunk_locationp *locations)
+{
+   if (png_ptr == NULL)
+      return 0;
+
+   if (locations != NULL)
+      *locations = png_ptr->chunk_locations;
+
+   return png_ptr->num_chunk_locations;
+}
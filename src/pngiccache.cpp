@@ -0,0 +1,228 @@
+/* pngiccache.cpp - process-wide cache of ICC profiles read from iCCP chunks
+ *
+ * This code is released under the libpng license.
+ * For conditions of distribution and use, see the disclaimer
+ * and license in png.h
+ *
+ * Images from one source tend to carry the same few profiles.  Decompressing
+ * and checksumming a 60KB profile costs far more than hashing its compressed
+ * form, so png_handle_iCCP reads the whole chunk, looks it up here and only
+ * inflates it on a miss.  The cheap structural checks (header and tag table)
+ * are still made on every read, since they depend on the image color type and
+ * the application limits and may produce warnings.
+ *
+ * The lock is only held to search and change the list.  A hit takes a
+ * reference to the entry, so the profile can be copied out, into a buffer
+ * from the application's allocator, after the lock has been released; an
+ * entry dropped from the list meanwhile is freed by the last reference.
+ */
+
+#include <pngmem.h>
+#include <pngerror.h>
+#include <pngdebug.h>
+#include <rutil.h>
+#include <iccache.h>
+
+#include "pngpriv.h"
+
+#include <mutex>
+
+typedef struct png_icc_entry_def png_icc_entry;
+
+/* The compressed data, then the profile, follow the entry. */
+struct png_icc_entry_def
+{
+   png_icc_entry *next;
+   png_uint_32 hash;             /* CRC-32 of the compressed data */
+   size_t size;                  /* of the compressed data */
+   png_uint_32 profile_length;
+   png_uint_32 adler;            /* of the profile */
+   unsigned int refs;            /* readers copying the profile out */
+   int dropped;                  /* no longer in the list */
+};
+
+#define png_icc_entry_data(e) ((png_bytep)((e) + 1))
+#define png_icc_entry_profile(e) (png_icc_entry_data(e) + (e)->size)
+#define png_icc_entry_bytes(e) (sizeof (png_icc_entry) + (e)->size + \
+   (e)->profile_length)
+
+static std::mutex png_icc_lock;
+static png_icc_entry *png_icc_first;  /* the most recently used first */
+static size_t png_icc_bytes;
+static size_t png_icc_max = PNG_ICC_CACHE_SIZE;
+
+/* Drop least recently used entries until at most 'max' bytes are kept; the
+ * lock must be held.  An entry still being copied is left to its readers.
+ */
+static void
+png_icc_trim(size_t max)
+{
+   while (png_icc_bytes > max)
+   {
+      png_icc_entry **link = &png_icc_first;
+      png_icc_entry *entry;
+
+      while ((*link)->next != NULL)
+         link = &(*link)->next;
+
+      entry = *link;
+      *link = NULL;
+      png_icc_bytes -= png_icc_entry_bytes(entry);
+
+      if (entry->refs == 0)
+         free(entry);
+
+      else
+         entry->dropped = 1;
+   }
+}
+
+/* Release a reference taken by png_icc_cache_find, also when png_error leaves
+ * it with an exception.
+ */
+struct png_icc_ref
+{
+   png_icc_entry *entry;
+
+   ~png_icc_ref()
+   {
+      int dropped;
+
+      if (entry == NULL)
+         return;
+
+      {
+         std::lock_guard<std::mutex> lock(png_icc_lock);
+
+         dropped = --entry->refs == 0 && entry->dropped;
+      }
+
+      if (dropped)
+         free(entry);
+   }
+};
+
+static png_uint_32
+png_icc_hash(png_const_bytep data, size_t size)
+{
+   /* Chunk data is less than 2^31 bytes, but the cache only takes data that
+    * fits in its limit anyway.
+    */
+   return (png_uint_32)crc32(crc32(0, Z_NULL, 0), data, (uInt)size);
+}
+
+size_t PNGAPI
+png_set_icc_cache_size(size_t max_bytes)
+{
+   std::lock_guard<std::mutex> lock(png_icc_lock);
+   size_t old = png_icc_max;
+
+   if (max_bytes > ZLIB_IO_MAX)
+      max_bytes = ZLIB_IO_MAX;
+
+   png_icc_max = max_bytes;
+   png_icc_trim(max_bytes);
+   return old;
+}
+
+size_t /* PRIVATE */
+png_icc_cache_limit(void)
+{
+   std::lock_guard<std::mutex> lock(png_icc_lock);
+
+   return png_icc_max;
+}
+
+png_bytep /* PRIVATE */
+png_icc_cache_find(png_structrp png_ptr, png_const_bytep data, size_t size,
+    png_uint_32 *profile_length, png_uint_32 *adler)
+{
+   png_uint_32 hash = png_icc_hash(data, size);
+   png_icc_ref ref = { NULL };
+   png_bytep profile;
+
+   {
+      std::lock_guard<std::mutex> lock(png_icc_lock);
+      png_icc_entry **link = &png_icc_first;
+
+      while ((ref.entry = *link) != NULL)
+      {
+         if (ref.entry->hash == hash && ref.entry->size == size &&
+             memcmp(png_icc_entry_data(ref.entry), data, size) == 0)
+         {
+            *link = ref.entry->next;
+            ref.entry->next = png_icc_first;
+            png_icc_first = ref.entry;
+            ++ref.entry->refs;
+            break;
+         }
+
+         link = &ref.entry->next;
+      }
+
+      if (ref.entry == NULL)
+         return NULL;
+   }
+
+   /* The entry's data does not change, so it is copied without the lock. */
+   profile = png_read_buffer(png_ptr, ref.entry->profile_length, 2/*silent*/);
+
+   if (profile != NULL)
+   {
+      memcpy(profile, png_icc_entry_profile(ref.entry),
+          ref.entry->profile_length);
+      *profile_length = ref.entry->profile_length;
+      *adler = ref.entry->adler;
+   }
+
+   return profile;
+}
+
+void /* PRIVATE */
+png_icc_cache_add(png_const_bytep data, size_t size, png_const_bytep profile,
+    png_uint_32 profile_length, png_uint_32 adler)
+{
+   png_icc_entry *entry, *e;
+   size_t max = png_icc_cache_limit();
+
+   if (size > max || profile_length > max - size ||
+       sizeof *entry > max - size - profile_length)
+      return; /* too big to keep */
+
+   /* Made outside the lock; the limit is checked again under it. */
+   entry = (png_icc_entry*)malloc(sizeof *entry + size + profile_length);
+
+   if (entry == NULL)
+      return;
+
+   entry->next = NULL;
+   entry->hash = png_icc_hash(data, size);
+   entry->size = size;
+   entry->profile_length = profile_length;
+   entry->adler = adler;
+   entry->refs = 0;
+   entry->dropped = 0;
+   memcpy(png_icc_entry_data(entry), data, size);
+   memcpy(png_icc_entry_profile(entry), profile, profile_length);
+
+   {
+      std::lock_guard<std::mutex> lock(png_icc_lock);
+
+      /* Another thread may have added the same profile meanwhile. */
+      for (e = png_icc_first; e != NULL; e = e->next)
+         if (e->hash == entry->hash && e->size == size &&
+             memcmp(png_icc_entry_data(e), data, size) == 0)
+            break;
+
+      if (e == NULL && png_icc_entry_bytes(entry) <= png_icc_max)
+      {
+         png_icc_trim(png_icc_max - png_icc_entry_bytes(entry));
+         entry->next = png_icc_first;
+         png_icc_first = entry;
+         png_icc_bytes += png_icc_entry_bytes(entry);
+         entry = NULL;
+      }
+   }
+
+   free(entry);
+}
@@ -19,6 +19,140 @@
 
 #include "pngpriv.h"
 #include <pngmem.h>
+#include <pngdebug.h>
+
+#include <stdint.h>
+
+/* The accounting behind png_set_mem_budget.  The size of every block
+ * allocated while it is on is kept in an open-addressed table keyed on the
+ * block address, so application allocators need not leave room for a header
+ * and blocks allocated before it was turned on are just not counted when they
+ * are freed.  libpng has few live blocks at a time, so the table stays small.
+ */
+typedef struct
+{
+   png_voidp ptr;
+   size_t size;
+} png_mem_block;
+
+struct png_mem_account_def
+{
+   size_t budget;                /* PNG_SIZE_MAX for no limit */
+   size_t current;
+   size_t peak;
+   png_off_t allocs;
+   size_t used;                  /* blocks in the table */
+   size_t slots;                 /* a power of 2 */
+   png_mem_block *table;
+};
+
+static size_t
+png_mem_slot(const png_mem_account *account, png_const_voidp ptr)
+{
+   uintptr_t h = (uintptr_t)ptr >> 4;
+
+   return (size_t)(h * 2654435761U) & (account->slots - 1);
+}
+
+/* Returns 0 if the table could not be grown, in which case the block cannot
+ * be counted.
+ */
+static int
+png_mem_insert(png_mem_account *account, png_voidp ptr, size_t size)
+{
+   size_t i;
+
+   if (2 * (account->used + 1) > account->slots)
+   {
+      size_t slots = account->slots > 0 ? 2 * account->slots : 64;
+      png_mem_block *old = account->table;
+      size_t old_slots = account->slots;
+      png_mem_block *table =
+         (png_mem_block*)calloc(slots, sizeof (png_mem_block));
+
+      if (table == NULL)
+         return 0;
+
+      account->table = table;
+      account->slots = slots;
+
+      for (i = 0; i < old_slots; ++i)
+      {
+         if (old[i].ptr != NULL)
+         {
+            size_t j = png_mem_slot(account, old[i].ptr);
+
+            while (table[j].ptr != NULL)
+               j = (j + 1) & (slots - 1);
+
+            table[j] = old[i];
+         }
+      }
+
+      free(old);
+   }
+
+   i = png_mem_slot(account, ptr);
+
+   while (account->table[i].ptr != NULL)
+      i = (i + 1) & (account->slots - 1);
+
+   account->table[i].ptr = ptr;
+   account->table[i].size = size;
+   account->used += 1;
+   account->current += size;
+   account->allocs += 1;
+
+   if (account->current > account->peak)
+      account->peak = account->current;
+
+   return 1;
+}
+
+static void
+png_mem_remove(png_mem_account *account, png_voidp ptr)
+{
+   size_t mask = account->slots - 1;
+   size_t i, j;
+
+   if (account->used == 0)
+      return;
+
+   for (i = png_mem_slot(account, ptr); account->table[i].ptr != ptr;
+       i = (i + 1) & mask)
+   {
+      if (account->table[i].ptr == NULL)
+         return; /* allocated before the accounting started */
+   }
+
+   account->current -= account->table[i].size;
+   account->used -= 1;
+
+   /* Move later entries of the run back into the hole so that lookups never
+    * stop early.
+    */
+   for (j = (i + 1) & mask; account->table[j].ptr != NULL; j = (j + 1) & mask)
+   {
+      size_t home = png_mem_slot(account, account->table[j].ptr);
+
+      if (((j - home) & mask) >= ((j - i) & mask))
+      {
+         account->table[i] = account->table[j];
+         i = j;
+      }
+   }
+
+   account->table[i].ptr = NULL;
+}
+
+static int
+png_mem_over_budget(png_const_structrp png_ptr, size_t size)
+{
+   png_mem_account *account = png_ptr->mem_account;
+
+   return account != NULL && (account->current > account->budget ||
+       size > account->budget - account->current);
+}
 
 /* Free a png_struct */
 void
@@ -37,6 +171,12 @@ png_destroy_png_struct (png_structrp png_ptr)
          /* We may have a jmp_buf left to deallocate. */
          png_free_jmpbuf(&dummy_struct);
 #     endif
+
+      if (dummy_struct.mem_account != NULL)
+      {
+         free(dummy_struct.mem_account->table);
+         free(dummy_struct.mem_account);
+      }
    }
 }
 
@@ -82,11 +222,28 @@ png_malloc_base (png_const_structrp png_ptr, size_t size)
 #     endif
       )
    {
-      if (png_ptr != NULL && png_ptr->malloc_fn != NULL)
-         return png_ptr->malloc_fn (png_ptr, size);
+      png_voidp ret;
 
-      else
+      if (png_ptr == NULL)
          return malloc((size_t)size); /* checked for truncation above */
+
+      if (png_mem_over_budget(png_ptr, size) != 0)
+         return NULL;
+
+      if (png_ptr->malloc_fn != NULL)
+         ret = png_ptr->malloc_fn (png_ptr, size);
+
+      else
+         ret = malloc((size_t)size);
+
+      if (ret != NULL && png_ptr->mem_account != NULL &&
+          png_mem_insert(png_ptr->mem_account, ret, size) == 0)
+      {
+         png_free(png_ptr, ret);
+         ret = NULL;
+      }
+
+      return ret;
    }
 
    else
@@ -168,7 +325,12 @@ png_malloc (png_const_structrp png_ptr, size_t size)
    ret = png_malloc_base(png_ptr, size);
 
    if (ret == NULL)
-       png_error(png_ptr, "Out of memory"); /* 'm' means png_malloc */
+   {
+      if (png_mem_over_budget(png_ptr, size) != 0)
+         png_error(png_ptr, "Memory budget exceeded");
+
+      png_error(png_ptr, "Out of memory"); /* 'm' means png_malloc */
+   }
 
    return ret;
 }
@@ -204,7 +366,11 @@ png_malloc_warn (png_const_structrp png_ptr, size_t size)
       if (ret != NULL)
          return ret;
 
-      png_warning(png_ptr, "Out of memory");
+      if (png_mem_over_budget(png_ptr, size) != 0)
+         png_warning(png_ptr, "Memory budget exceeded");
+
+      else
+         png_warning(png_ptr, "Out of memory");
    }
 
    return NULL;
@@ -219,6 +385,9 @@ png_free(png_const_structrp png_ptr, png_voidp ptr)
    if (png_ptr == NULL || ptr == NULL)
       return;
 
+   if (png_ptr->mem_account != NULL)
+      png_mem_remove(png_ptr->mem_account, ptr);
+
    if (png_ptr->free_fn != NULL)
       png_ptr->free_fn(png_ptr, ptr);
 
@@ -262,3 +431,42 @@ png_get_mem_ptr(png_const_structrp png_ptr)
 
    return png_ptr->mem_ptr;
 }
+
+void PNGAPI
+png_set_mem_budget(png_structrp png_ptr, size_t max_bytes)
+{
+   png_debug(1, "in png_set_mem_budget");
+
+   if (png_ptr == NULL)
+      return;
+
+   if (png_ptr->mem_account == NULL)
+   {
+      png_ptr->mem_account = (png_mem_accountp)calloc(1,
+          sizeof (png_mem_account));
+
+      if (png_ptr->mem_account == NULL)
+      {
+         png_warning(png_ptr, "Insufficient memory for memory accounting");
+         return;
+      }
+   }
+
+   png_ptr->mem_account->budget = max_bytes > 0 ? max_bytes : PNG_SIZE_MAX;
+}
+
+int PNGAPI
+png_get_mem_stats(png_const_structrp png_ptr, png_mem_stats *stats)
+{
+   const png_mem_account *account;
+
+   if (png_ptr == NULL || png_ptr->mem_account == NULL || stats == NULL)
+      return 0;
+
+   account = png_ptr->mem_account;
+   stats->current = account->current;
+   stats->peak = account->peak;
+   stats->allocs = account->allocs;
+   stats->budget = account->budget < PNG_SIZE_MAX ? account->budget : 0;
+   return 1;
+}
@@ -13,6 +13,8 @@
 
 #include <rutil.h>
 #include <trans.h>
+#include <pngtrace.h>
+#include <work.h>
 #include "pngpriv.h"
 
 static void
@@ -205,6 +207,9 @@ png_push_read_chunk(png_structrp png_ptr, png_inforp info_ptr)
       png_check_chunk_name(png_ptr, png_ptr->chunk_name);
       png_check_chunk_length(png_ptr, png_ptr->push_length);
       png_ptr->mode |= PNG_HAVE_CHUNK_HEADER;
+      png_trace3(chunk__start, png_ptr, png_ptr->chunk_name,
+          png_ptr->push_length);
+      png_work_charge(png_ptr, PNG_WORK_CHUNK, 1);
    }
 
    chunk_name = png_ptr->chunk_name;
@@ -524,6 +529,9 @@ png_push_read_IDAT(png_structrp png_ptr)
       png_crc_read(png_ptr, chunk_tag, 4);
       png_ptr->chunk_name = PNG_CHUNK_FROM_STRING(chunk_tag);
       png_ptr->mode |= PNG_HAVE_CHUNK_HEADER;
+      png_trace3(chunk__start, png_ptr, png_ptr->chunk_name,
+          png_ptr->push_length);
+      png_work_charge(png_ptr, PNG_WORK_CHUNK, 1);
 
       if (png_ptr->chunk_name != png_IDAT)
       {
@@ -719,6 +727,8 @@ png_push_process_row(png_structrp png_ptr)
    /* 1.5.6: row_info moved out of png_struct to a local here. */
    png_row_info row_info;
 
+   png_work_charge(png_ptr, PNG_WORK_ROW, 0);
+
    row_info.width = png_ptr->iwidth; /* NOTE: width of current interlaced row */
    row_info.color_type = png_ptr->color_type;
    row_info.bit_depth = png_ptr->bit_depth;
@@ -1018,6 +1028,8 @@ png_push_have_end(png_structrp png_ptr, png_inforp info_ptr)
 static void
 png_push_have_row(png_structrp png_ptr, png_bytep row)
 {
+   png_trace3(read__row, png_ptr, png_ptr->row_number, png_ptr->pass);
+
    if (png_ptr->row_fn != NULL)
       (*(png_ptr->row_fn))(png_ptr, row, png_ptr->row_number,
           (int)png_ptr->pass);
@@ -0,0 +1,524 @@
+/* pngquant.cpp - palette selection and color mapping
+ *
+ * This code is released under the libpng license.
+ * For conditions of distribution and use, see the disclaimer
+ * and license in png.h
+ *
+ * The palette is chosen by median cut: the box of colors with the largest
+ * weighted squared error is split across its widest component at the point
+ * that minimizes the error of the two halves, until there are enough boxes.
+ * The box means are then improved by a few k-means passes.  Nearest colors
+ * are found with a k-d tree over the palette, so mapping costs about log2 of
+ * the palette size comparisons per pixel rather than one per palette entry.
+ */
+
+#include <pngmem.h>
+#include <pngerror.h>
+#include <pngdebug.h>
+#include <quant.h>
+
+#include "pngpriv.h"
+
+#define PNG_QUANT_PASSES 3 /* k-means refinement passes */
+
+/* Sorting on one component at a time */
+#define PNG_QUANT_COMPARE(name, type, member)\
+static int name(const void *a, const void *b)\
+{\
+   double d = (double)((const type*)a)->member - \
+       (double)((const type*)b)->member;\
+   return d < 0 ? -1 : d > 0;\
+}
+
+PNG_QUANT_COMPARE(png_quant_compare_r, png_quant_color, r)
+PNG_QUANT_COMPARE(png_quant_compare_g, png_quant_color, g)
+PNG_QUANT_COMPARE(png_quant_compare_b, png_quant_color, b)
+PNG_QUANT_COMPARE(png_quant_compare_node0, png_quant_node, rgb[0])
+PNG_QUANT_COMPARE(png_quant_compare_node1, png_quant_node, rgb[1])
+PNG_QUANT_COMPARE(png_quant_compare_node2, png_quant_node, rgb[2])
+
+static double
+png_quant_component(const png_quant_color *color, int axis)
+{
+   return axis == 0 ? color->r : (axis == 1 ? color->g : color->b);
+}
+
+/* k-d tree */
+
+static void
+png_quant_tree_build(png_quant_node *node, int count)
+{
+   static int (*const compare[3])(const void*, const void*) =
+   {
+      png_quant_compare_node0, png_quant_compare_node1, png_quant_compare_node2
+   };
+
+   while (count > 1)
+   {
+      int lo[3] = { 255, 255, 255 }, hi[3] = { 0, 0, 0 };
+      int axis = 0, mid = count/2, i, c;
+
+      for (i = 0; i < count; ++i) for (c = 0; c < 3; ++c)
+      {
+         if (node[i].rgb[c] < lo[c]) lo[c] = node[i].rgb[c];
+         if (node[i].rgb[c] > hi[c]) hi[c] = node[i].rgb[c];
+      }
+
+      for (c = 1; c < 3; ++c)
+         if (hi[c] - lo[c] > hi[axis] - lo[axis])
+            axis = c;
+
+      qsort(node, (size_t)count, sizeof *node, compare[axis]);
+      node[mid].axis = (png_byte)axis;
+
+      png_quant_tree_build(node, mid);
+      node += mid+1;
+      count -= mid+1;
+   }
+
+   if (count == 1)
+      node->axis = 0;
+}
+
+void /* PRIVATE */
+png_quant_tree_init(png_quant_treep tree, png_const_colorp palette,
+    int num_palette)
+{
+   int i;
+
+   if (num_palette > PNG_MAX_PALETTE_LENGTH)
+      num_palette = PNG_MAX_PALETTE_LENGTH;
+
+   tree->count = num_palette;
+
+   for (i = 0; i < num_palette; ++i)
+   {
+      tree->palette[i] = palette[i];
+      tree->node[i].rgb[0] = palette[i].red;
+      tree->node[i].rgb[1] = palette[i].green;
+      tree->node[i].rgb[2] = palette[i].blue;
+      tree->node[i].index = (png_byte)i;
+   }
+
+   png_quant_tree_build(tree->node, num_palette);
+}
+
+static void
+png_quant_search(const png_quant_node *node, int count, const int *rgb,
+    int *best, int *best_index)
+{
+   while (count > 0)
+   {
+      int mid = count/2;
+      const png_quant_node *n = node + mid;
+      int dr = rgb[0] - n->rgb[0], dg = rgb[1] - n->rgb[1];
+      int db = rgb[2] - n->rgb[2];
+      int d = dr*dr + dg*dg + db*db;
+      int split = rgb[n->axis] - n->rgb[n->axis];
+
+      if (d < *best || (d == *best && n->index < *best_index))
+      {
+         *best = d;
+         *best_index = n->index;
+      }
+
+      /* Search the side containing the color first; the other side can only
+       * help if the splitting plane is closer than the best so far.
+       */
+      if (split < 0)
+      {
+         png_quant_search(node, mid, rgb, best, best_index);
+
+         if (split*split > *best)
+            return;
+
+         node += mid+1;
+         count -= mid+1;
+      }
+
+      else
+      {
+         png_quant_search(node + mid+1, count - (mid+1), rgb, best,
+             best_index);
+
+         if (split*split > *best)
+            return;
+
+         count = mid;
+      }
+   }
+}
+
+int /* PRIVATE */
+png_quant_nearest(png_const_quant_treep tree, int red, int green, int blue)
+{
+   int rgb[3];
+   int best = 0x7fffffff, best_index = 0;
+
+   rgb[0] = red;
+   rgb[1] = green;
+   rgb[2] = blue;
+   png_quant_search(tree->node, tree->count, rgb, &best, &best_index);
+
+   return best_index;
+}
+
+/* Median cut */
+
+typedef struct
+{
+   png_uint_32 first, count;
+   double error;    /* weighted squared error about the mean */
+   int axis;        /* the component with the largest error */
+} png_quant_box;
+
+static void
+png_quant_box_measure(png_quant_box *box, const png_quant_color *colors)
+{
+   double w = 0, s[3] = { 0, 0, 0 }, s2[3] = { 0, 0, 0 }, largest = -1;
+   png_uint_32 i;
+   int c;
+
+   for (i = box->first; i < box->first + box->count; ++i)
+      for (w += colors[i].weight, c = 0; c < 3; ++c)
+      {
+         double x = png_quant_component(colors+i, c);
+
+         s[c] += colors[i].weight * x;
+         s2[c] += colors[i].weight * x * x;
+      }
+
+   box->error = 0;
+   box->axis = 0;
+
+   for (c = 0; c < 3; ++c)
+   {
+      double e = w > 0 ? s2[c] - s[c]*s[c]/w : 0;
+
+      if (e > largest)
+      {
+         box->axis = c;
+         largest = e;
+      }
+
+      box->error += e;
+   }
+}
+
+/* Split a box along its axis where the sum of the errors of the two parts on
+ * that axis is least.  Returns the number of colors in the first part.
+ */
+static png_uint_32
+png_quant_box_split(const png_quant_box *box, png_quant_color *colors)
+{
+   static int (*const compare[3])(const void*, const void*) =
+   {
+      png_quant_compare_r, png_quant_compare_g, png_quant_compare_b
+   };
+
+   png_quant_color *c = colors + box->first;
+   double w = 0, s = 0, s2 = 0, lw = 0, ls = 0, ls2 = 0, best = -1;
+   png_uint_32 i, split = 1;
+
+   qsort(c, box->count, sizeof *c, compare[box->axis]);
+
+   for (i = 0; i < box->count; ++i)
+   {
+      double x = png_quant_component(c+i, box->axis);
+
+      w += c[i].weight;
+      s += c[i].weight * x;
+      s2 += c[i].weight * x * x;
+   }
+
+   for (i = 1; i < box->count; ++i)
+   {
+      double x = png_quant_component(c+i-1, box->axis);
+      double e, rw;
+
+      lw += c[i-1].weight;
+      ls += c[i-1].weight * x;
+      ls2 += c[i-1].weight * x * x;
+      rw = w - lw;
+
+      e = (lw > 0 ? ls2 - ls*ls/lw : 0) + (rw > 0 ?
+          (s2 - ls2) - (s - ls)*(s - ls)/rw : 0);
+
+      if (best < 0 || e < best)
+      {
+         best = e;
+         split = i;
+      }
+   }
+
+   return split;
+}
+
+static png_byte
+png_quant_round(double v)
+{
+   return (png_byte)(v <= 0 ? 0 : (v >= 255 ? 255 : (int)(v + .5)));
+}
+
+int /* PRIVATE */
+png_quant_palette(png_structrp png_ptr, png_quant_color *colors,
+    png_uint_32 num_colors, png_colorp palette, int maximum_colors)
+{
+   png_quant_box box[PNG_MAX_PALETTE_LENGTH];
+   png_quant_treep tree;
+   png_uint_32 i;
+   int n, pass;
+
+   png_debug(1, "in png_quant_palette");
+
+   if (num_colors == 0 || maximum_colors < 1)
+      return 0;
+
+   if (maximum_colors > PNG_MAX_PALETTE_LENGTH)
+      maximum_colors = PNG_MAX_PALETTE_LENGTH;
+
+   box[0].first = 0;
+   box[0].count = num_colors;
+   png_quant_box_measure(box, colors);
+   n = 1;
+
+   while (n < maximum_colors)
+   {
+      int b = -1, j;
+      png_uint_32 split;
+
+      for (j = 0; j < n; ++j)
+         if (box[j].count > 1 && box[j].error > 0 &&
+             (b < 0 || box[j].error > box[b].error))
+            b = j;
+
+      if (b < 0)
+         break;
+
+      split = png_quant_box_split(box+b, colors);
+      box[n].first = box[b].first + split;
+      box[n].count = box[b].count - split;
+      box[b].count = split;
+      png_quant_box_measure(box+b, colors);
+      png_quant_box_measure(box+n, colors);
+      ++n;
+   }
+
+   /* The palette starts with the box means, then each color moves to its
+    * nearest entry and the entries move to the mean of their colors.
+    */
+   tree = (png_quant_treep)png_malloc(png_ptr, sizeof *tree);
+
+   for (pass = 0; pass <= PNG_QUANT_PASSES; ++pass)
+   {
+      double sum[PNG_MAX_PALETTE_LENGTH][4];
+      int j;
+
+      memset(sum, 0, sizeof sum);
+
+      if (pass == 0) for (j = 0; j < n; ++j)
+      {
+         for (i = box[j].first; i < box[j].first + box[j].count; ++i)
+         {
+            /* Zero weights would leave the mean undefined */
+            double w = colors[i].weight > 0 ? colors[i].weight : 1E-6;
+
+            sum[j][0] += w * colors[i].r;
+            sum[j][1] += w * colors[i].g;
+            sum[j][2] += w * colors[i].b;
+            sum[j][3] += w;
+         }
+      }
+
+      else
+      {
+         png_quant_tree_init(tree, palette, n);
+
+         for (i = 0; i < num_colors; ++i)
+         {
+            double w = colors[i].weight > 0 ? colors[i].weight : 1E-6;
+
+            j = png_quant_nearest(tree, png_quant_round(colors[i].r),
+                png_quant_round(colors[i].g), png_quant_round(colors[i].b));
+            sum[j][0] += w * colors[i].r;
+            sum[j][1] += w * colors[i].g;
+            sum[j][2] += w * colors[i].b;
+            sum[j][3] += w;
+         }
+      }
+
+      for (j = 0; j < n; ++j) if (sum[j][3] > 0)
+      {
+         palette[j].red = png_quant_round(sum[j][0] / sum[j][3]);
+         palette[j].green = png_quant_round(sum[j][1] / sum[j][3]);
+         palette[j].blue = png_quant_round(sum[j][2] / sum[j][3]);
+      }
+   }
+
+   png_free(png_ptr, tree);
+
+   return n;
+}
+
+/* Histograms */
+
+void /* PRIVATE */
+png_quant_histogram_row(png_quant_cell *histogram, png_const_bytep row,
+    png_uint_32 width, int bgr)
+{
+   const unsigned int shift = 8 - PNG_QUANT_HIST_BITS;
+   const unsigned int mask = (1U << shift) - 1;
+   png_uint_32 x;
+
+   for (x = 0; x < width; ++x, row += 3)
+   {
+      unsigned int r = row[bgr ? 2 : 0], g = row[1], b = row[bgr ? 0 : 2];
+      png_quant_cell *cell = histogram + ((((r >> shift) <<
+          PNG_QUANT_HIST_BITS) + (g >> shift)) << PNG_QUANT_HIST_BITS) +
+          (b >> shift);
+
+      ++cell->count;
+      cell->low[0] += r & mask;
+      cell->low[1] += g & mask;
+      cell->low[2] += b & mask;
+   }
+}
+
+png_uint_32 /* PRIVATE */
+png_quant_histogram_colors(const png_quant_cell *histograms,
+    png_uint_32 num_histograms, png_quant_color *colors)
+{
+   const unsigned int shift = 8 - PNG_QUANT_HIST_BITS;
+   const unsigned int size = 1U << PNG_QUANT_HIST_BITS;
+   png_uint_32 i, n = 0;
+
+   for (i = 0; i < PNG_QUANT_HIST_SIZE; ++i)
+   {
+      /* The sums for the whole image may not fit in 32 bits; a double holds
+       * them exactly (they are below 2^53).
+       */
+      double count = 0, low[3] = { 0, 0, 0 };
+      png_uint_32 h;
+
+      for (h = 0; h < num_histograms; ++h)
+      {
+         const png_quant_cell *cell = histograms +
+             (size_t)h * PNG_QUANT_HIST_SIZE + i;
+
+         count += cell->count;
+         low[0] += cell->low[0];
+         low[1] += cell->low[1];
+         low[2] += cell->low[2];
+      }
+
+      if (count > 0)
+      {
+         colors[n].r = ((i / (size*size)) << shift) + low[0] / count;
+         colors[n].g = (((i / size) % size) << shift) + low[1] / count;
+         colors[n].b = ((i % size) << shift) + low[2] / count;
+         colors[n].weight = count;
+         ++n;
+      }
+   }
+
+   return n;
+}
+
+/* Mapping */
+
+void /* PRIVATE */
+png_quant_cache_init(png_quant_cache *cache)
+{
+   memset(cache->key, 0, sizeof cache->key);
+}
+
+static int
+png_quant_lookup(png_const_quant_treep tree, png_quant_cache *cache, int r,
+    int g, int b)
+{
+   png_uint_32 key = 0x1000000U | ((png_uint_32)r << 16) |
+       ((png_uint_32)g << 8) | (png_uint_32)b;
+   png_uint_32 slot;
+   int index;
+
+   if (cache == NULL)
+      return png_quant_nearest(tree, r, g, b);
+
+   slot = (key * 2654435761U) >> (32 - 12);
+
+   if (cache->key[slot] == key)
+      return cache->index[slot];
+
+   index = png_quant_nearest(tree, r, g, b);
+   cache->key[slot] = key;
+   cache->index[slot] = (png_byte)index;
+
+   return index;
+}
+
+void /* PRIVATE */
+png_quant_map_row(png_const_quant_treep tree, png_quant_cache *cache,
+    png_const_bytep in, png_bytep out, png_uint_32 width,
+    unsigned int channels, int bgr, png_int_32 *error)
+{
+   const int ri = bgr ? 2 : 0, bi = bgr ? 0 : 2;
+   png_uint_32 x;
+
+   if (error == NULL)
+   {
+      for (x = 0; x < width; ++x, in += channels)
+         out[x] = (png_byte)png_quant_lookup(tree, cache, in[ri], in[1],
+             in[bi]);
+   }
+
+   else
+   {
+      /* Errors are held in 1/16ths, with a spare pixel at each end of each
+       * row; 'next' collects the error passed down to the following row.
+       */
+      png_int_32 *cur = error + 3;
+      png_int_32 *next = error + 3*((size_t)width+2) + 3;
+
+      for (x = 0; x < width; ++x, in += channels)
+      {
+         int v[3], c, index;
+         png_const_colorp p;
+
+         v[0] = in[ri];
+         v[1] = in[1];
+         v[2] = in[bi];
+
+         for (c = 0; c < 3; ++c)
+         {
+            png_int_32 e = cur[3*x+c];
+
+            v[c] += (e + (e < 0 ? -8 : 8)) / 16;
+            v[c] = v[c] < 0 ? 0 : (v[c] > 255 ? 255 : v[c]);
+         }
+
+         index = png_quant_lookup(tree, cache, v[0], v[1], v[2]);
+         p = tree->palette + index;
+         out[x] = (png_byte)index;
+
+         v[0] -= p->red;
+         v[1] -= p->green;
+         v[2] -= p->blue;
+
+         for (c = 0; c < 3; ++c)
+         {
+            png_int_32 *below = next + 3*(size_t)x + c;
+
+            cur[3*(size_t)x+3+c] += 7*v[c];
+            below[-3] += 3*v[c];
+            below[0] += 5*v[c];
+            below[3] += v[c];
+         }
+      }
+
+      /* The next row's error becomes the current error. */
+      memcpy(error, error + 3*((size_t)width+2),
+          3*((size_t)width+2) * sizeof *error);
+      memset(error + 3*((size_t)width+2), 0,
+          3*((size_t)width+2) * sizeof *error);
+   }
+}
@@ -25,6 +25,8 @@
 #include <pngdebug.h>
 #include <rutil.h>
 #include <trans.h>
+#include <pngtrace.h>
+#include <work.h>
 
 #include "pngpriv.h"
 
@@ -77,6 +79,82 @@ png_create_read_struct_2 (png_const_charp user_png_ver, png_voidp error_ptr, png
 }
 
 
+/* Handle PLTE and the ancillary chunks; this is the part of the chunk dispatch
+ * shared by png_read_info, png_read_end and png_read_metadata.  The callers
+ * deal with IHDR, IDAT, IEND and chunks the application wants handled as
+ * unknown.
+ */
+static void
+png_read_dispatch_chunk(png_structrp png_ptr, png_inforp info_ptr,
+    png_uint_32 length)
+{
+   png_uint_32 chunk_name = png_ptr->chunk_name;
+
+   /* This should be a binary subdivision search or a hash for
+    * matching the chunk name rather than a linear search.
+    */
+   if (chunk_name == png_PLTE)
+      png_handle_PLTE(png_ptr, info_ptr, length);
+
+   else if (chunk_name == png_bKGD)
+      png_handle_bKGD(png_ptr, info_ptr, length);
+
+   else if (chunk_name == png_cHRM)
+      png_handle_cHRM(png_ptr, info_ptr, length);
+
+   else if (chunk_name == png_eXIf)
+      png_handle_eXIf(png_ptr, info_ptr, length);
+
+   else if (chunk_name == png_gAMA)
+      png_handle_gAMA(png_ptr, info_ptr, length);
+
+   else if (chunk_name == png_hIST)
+      png_handle_hIST(png_ptr, info_ptr, length);
+
+   else if (chunk_name == png_oFFs)
+      png_handle_oFFs(png_ptr, info_ptr, length);
+
+   else if (chunk_name == png_pCAL)
+      png_handle_pCAL(png_ptr, info_ptr, length);
+
+   else if (chunk_name == png_sCAL)
+      png_handle_sCAL(png_ptr, info_ptr, length);
+
+   else if (chunk_name == png_pHYs)
+      png_handle_pHYs(png_ptr, info_ptr, length);
+
+   else if (chunk_name == png_sBIT)
+      png_handle_sBIT(png_ptr, info_ptr, length);
+
+   else if (chunk_name == png_sRGB)
+      png_handle_sRGB(png_ptr, info_ptr, length);
+
+   else if (chunk_name == png_iCCP)
+      png_handle_iCCP(png_ptr, info_ptr, length);
+
+   else if (chunk_name == png_sPLT)
+      png_handle_sPLT(png_ptr, info_ptr, length);
+
+   else if (chunk_name == png_tEXt)
+      png_handle_tEXt(png_ptr, info_ptr, length);
+
+   else if (chunk_name == png_tIME)
+      png_handle_tIME(png_ptr, info_ptr, length);
+
+   else if (chunk_name == png_tRNS)
+      png_handle_tRNS(png_ptr, info_ptr, length);
+
+   else if (chunk_name == png_zTXt)
+      png_handle_zTXt(png_ptr, info_ptr, length);
+
+   else if (chunk_name == png_iTXt)
+      png_handle_iTXt(png_ptr, info_ptr, length);
+
+   else
+      png_handle_unknown(png_ptr, info_ptr, length,
+          PNG_HANDLE_CHUNK_AS_DEFAULT);
+}
+
 /* Read the information before the actual image data.  This has been
  * changed in v0.90 to allow reading a file that already has the magic
  * bytes read from the stream.  You can tell libpng how many bytes have
@@ -149,72 +227,14 @@ png_read_info(png_structrp png_ptr, png_inforp info_ptr)
             break;
          }
       }
-      else if (chunk_name == png_PLTE)
-         png_handle_PLTE(png_ptr, info_ptr, length);
-
       else if (chunk_name == png_IDAT)
       {
          png_ptr->idat_size = length;
          break;
       }
 
-      else if (chunk_name == png_bKGD)
-         png_handle_bKGD(png_ptr, info_ptr, length);
-
-      else if (chunk_name == png_cHRM)
-         png_handle_cHRM(png_ptr, info_ptr, length);
-
-      else if (chunk_name == png_eXIf)
-         png_handle_eXIf(png_ptr, info_ptr, length);
-
-      else if (chunk_name == png_gAMA)
-         png_handle_gAMA(png_ptr, info_ptr, length);
-
-      else if (chunk_name == png_hIST)
-         png_handle_hIST(png_ptr, info_ptr, length);
-
-      else if (chunk_name == png_oFFs)
-         png_handle_oFFs(png_ptr, info_ptr, length);
-
-      else if (chunk_name == png_pCAL)
-         png_handle_pCAL(png_ptr, info_ptr, length);
-
-      else if (chunk_name == png_sCAL)
-         png_handle_sCAL(png_ptr, info_ptr, length);
-
-      else if (chunk_name == png_pHYs)
-         png_handle_pHYs(png_ptr, info_ptr, length);
-
-      else if (chunk_name == png_sBIT)
-         png_handle_sBIT(png_ptr, info_ptr, length);
-
-      else if (chunk_name == png_sRGB)
-         png_handle_sRGB(png_ptr, info_ptr, length);
-
-      else if (chunk_name == png_iCCP)
-         png_handle_iCCP(png_ptr, info_ptr, length);
-
-      else if (chunk_name == png_sPLT)
-         png_handle_sPLT(png_ptr, info_ptr, length);
-
-      else if (chunk_name == png_tEXt)
-         png_handle_tEXt(png_ptr, info_ptr, length);
-
-      else if (chunk_name == png_tIME)
-         png_handle_tIME(png_ptr, info_ptr, length);
-
-      else if (chunk_name == png_tRNS)
-         png_handle_tRNS(png_ptr, info_ptr, length);
-
-      else if (chunk_name == png_zTXt)
-         png_handle_zTXt(png_ptr, info_ptr, length);
-
-      else if (chunk_name == png_iTXt)
-         png_handle_iTXt(png_ptr, info_ptr, length);
-
       else
-         png_handle_unknown(png_ptr, info_ptr, length,
-             PNG_HANDLE_CHUNK_AS_DEFAULT);
+         png_read_dispatch_chunk(png_ptr, info_ptr, length);
    }
 }
 
@@ -261,6 +281,27 @@ png_start_read_image(png_structrp png_ptr)
    }
 }
 
+/* The 'blocky' display of a row that is not in the current pass replicates
+ * the last row read, which png_read_row leaves packed when that row had no
+ * display row.
+ */
+static void
+png_read_display_row(png_structrp png_ptr, png_bytep dsp_row)
+{
+   if (png_ptr->row_buf_packed != 0)
+   {
+      png_row_info row_info;
+
+      row_info.width = png_ptr->iwidth;
+      row_info.pixel_depth = png_ptr->transformed_pixel_depth;
+      png_do_read_interlace(&row_info, png_ptr->row_buf + 1, png_ptr->pass,
+          png_ptr->transformations);
+      png_ptr->row_buf_packed = 0;
+   }
+
+   png_combine_row(png_ptr, dsp_row, 1/*display*/);
+}
+
 void PNGAPI
 png_read_row(png_structrp png_ptr, png_bytep row, png_bytep dsp_row)
 {
@@ -272,6 +313,8 @@ png_read_row(png_structrp png_ptr, png_bytep row, png_bytep dsp_row)
    png_debug2(1, "in png_read_row (row %lu, pass %d)",
        (unsigned long)png_ptr->row_number, png_ptr->pass);
 
+   png_work_charge(png_ptr, PNG_WORK_ROW, 0);
+
    /* png_read_start_row sets the information (in particular iwidth) for this
     * interlace pass.
     */
@@ -301,7 +344,7 @@ png_read_row(png_structrp png_ptr, png_bytep row, png_bytep dsp_row)
             if (png_ptr->row_number & 0x07)
             {
                if (dsp_row != NULL)
-                  png_combine_row(png_ptr, dsp_row, 1/*display*/);
+                  png_read_display_row(png_ptr, dsp_row);
                png_read_finish_row(png_ptr);
                return;
             }
@@ -311,7 +354,7 @@ png_read_row(png_structrp png_ptr, png_bytep row, png_bytep dsp_row)
             if ((png_ptr->row_number & 0x07) || png_ptr->width < 5)
             {
                if (dsp_row != NULL)
-                  png_combine_row(png_ptr, dsp_row, 1/*display*/);
+                  png_read_display_row(png_ptr, dsp_row);
 
                png_read_finish_row(png_ptr);
                return;
@@ -322,7 +365,7 @@ png_read_row(png_structrp png_ptr, png_bytep row, png_bytep dsp_row)
             if ((png_ptr->row_number & 0x07) != 4)
             {
                if (dsp_row != NULL && (png_ptr->row_number & 4))
-                  png_combine_row(png_ptr, dsp_row, 1/*display*/);
+                  png_read_display_row(png_ptr, dsp_row);
 
                png_read_finish_row(png_ptr);
                return;
@@ -333,7 +376,7 @@ png_read_row(png_structrp png_ptr, png_bytep row, png_bytep dsp_row)
             if ((png_ptr->row_number & 3) || png_ptr->width < 3)
             {
                if (dsp_row != NULL)
-                  png_combine_row(png_ptr, dsp_row, 1/*display*/);
+                  png_read_display_row(png_ptr, dsp_row);
 
                png_read_finish_row(png_ptr);
                return;
@@ -344,7 +387,7 @@ png_read_row(png_structrp png_ptr, png_bytep row, png_bytep dsp_row)
             if ((png_ptr->row_number & 3) != 2)
             {
                if (dsp_row != NULL && (png_ptr->row_number & 2))
-                  png_combine_row(png_ptr, dsp_row, 1/*display*/);
+                  png_read_display_row(png_ptr, dsp_row);
 
                png_read_finish_row(png_ptr);
                return;
@@ -355,7 +398,7 @@ png_read_row(png_structrp png_ptr, png_bytep row, png_bytep dsp_row)
             if ((png_ptr->row_number & 1) || png_ptr->width < 2)
             {
                if (dsp_row != NULL)
-                  png_combine_row(png_ptr, dsp_row, 1/*display*/);
+                  png_read_display_row(png_ptr, dsp_row);
 
                png_read_finish_row(png_ptr);
                return;
@@ -410,19 +453,35 @@ png_read_row(png_structrp png_ptr, png_bytep row, png_bytep dsp_row)
    else if (png_ptr->transformed_pixel_depth != row_info.pixel_depth)
       png_error(png_ptr, "internal sequential row size calculation error");
 
-   /* Expand interlaced rows to full size */
+   /* Expand interlaced rows to full size.  Without a display row the pass
+    * pixels are scattered straight into 'row'; replicating them first would
+    * only be undone by png_combine_row.
+    */
+   png_ptr->row_buf_packed = 0;
+
    if (png_ptr->interlaced != 0 &&
       (png_ptr->transformations & PNG_INTERLACE) != 0)
    {
-      if (png_ptr->pass < 6)
-         png_do_read_interlace(&row_info, png_ptr->row_buf + 1, png_ptr->pass,
-             png_ptr->transformations);
+      if (dsp_row == NULL && png_ptr->pass < 6 && row_info.pixel_depth >= 8)
+      {
+         png_ptr->row_buf_packed = 1;
 
-      if (dsp_row != NULL)
-         png_combine_row(png_ptr, dsp_row, 1/*display*/);
+         if (row != NULL)
+            png_combine_row_packed(png_ptr, row);
+      }
 
-      if (row != NULL)
-         png_combine_row(png_ptr, row, 0/*row*/);
+      else
+      {
+         if (png_ptr->pass < 6)
+            png_do_read_interlace(&row_info, png_ptr->row_buf + 1,
+                png_ptr->pass, png_ptr->transformations);
+
+         if (dsp_row != NULL)
+            png_combine_row(png_ptr, dsp_row, 1/*display*/);
+
+         if (row != NULL)
+            png_combine_row(png_ptr, row, 0/*row*/);
+      }
    }
 
    else
@@ -433,6 +492,7 @@ png_read_row(png_structrp png_ptr, png_bytep row, png_bytep dsp_row)
       if (dsp_row != NULL)
          png_combine_row(png_ptr, dsp_row, -1/*ignored*/);
    }
+   png_trace3(read__row, png_ptr, png_ptr->row_number, png_ptr->pass);
    png_read_finish_row(png_ptr);
 
    if (png_ptr->read_row_fn != NULL)
@@ -638,69 +698,297 @@ png_read_end(png_structrp png_ptr, png_inforp info_ptr)
 
          png_crc_finish(png_ptr, length);
       }
-      else if (chunk_name == png_PLTE)
-         png_handle_PLTE(png_ptr, info_ptr, length);
+      else
+         png_read_dispatch_chunk(png_ptr, info_ptr, length);
+   } while ((png_ptr->mode & PNG_HAVE_IEND) == 0);
+}
 
-      else if (chunk_name == png_bKGD)
-         png_handle_bKGD(png_ptr, info_ptr, length);
+/* Record the location of the chunk whose header has just been read. */
+static void
+png_record_chunk_location(png_structrp png_ptr, png_off_t offset,
+    png_uint_32 length)
+{
+   png_chunk_locationp location;
 
-      else if (chunk_name == png_cHRM)
-         png_handle_cHRM(png_ptr, info_ptr, length);
+   if (png_ptr->num_chunk_locations >= png_ptr->max_chunk_locations)
+   {
+      int add = png_ptr->max_chunk_locations < 16 ? 16 :
+          (int)png_ptr->max_chunk_locations;
+      png_chunk_locationp new_locations;
 
-      else if (chunk_name == png_eXIf)
-         png_handle_eXIf(png_ptr, info_ptr, length);
+      if (png_ptr->max_chunk_locations > PNG_UINT_31_MAX/2 - 16)
+         png_error(png_ptr, "too many chunks");
 
-      else if (chunk_name == png_gAMA)
-         png_handle_gAMA(png_ptr, info_ptr, length);
+      new_locations = (png_chunk_locationp)png_realloc_array(png_ptr,
+          png_ptr->chunk_locations, (int)png_ptr->num_chunk_locations, add,
+          sizeof *png_ptr->chunk_locations);
 
-      else if (chunk_name == png_hIST)
-         png_handle_hIST(png_ptr, info_ptr, length);
+      if (new_locations == NULL)
+         png_error(png_ptr, "too many chunks");
 
-      else if (chunk_name == png_oFFs)
-         png_handle_oFFs(png_ptr, info_ptr, length);
+      png_free(png_ptr, png_ptr->chunk_locations);
+      png_ptr->chunk_locations = new_locations;
+      png_ptr->max_chunk_locations += (png_uint_32)add;
+   }
 
-      else if (chunk_name == png_pCAL)
-         png_handle_pCAL(png_ptr, info_ptr, length);
+   location = png_ptr->chunk_locations + png_ptr->num_chunk_locations++;
+   PNG_CSTRING_FROM_CHUNK(location->name, png_ptr->chunk_name);
+   location->length = length;
+   location->offset = offset;
+}
 
-      else if (chunk_name == png_sCAL)
-         png_handle_sCAL(png_ptr, info_ptr, length);
+void PNGAPI
+png_read_metadata(png_structrp png_ptr, png_inforp info_ptr)
+{
+   png_debug(1, "in png_read_metadata");
+
+   if (png_ptr == NULL || info_ptr == NULL)
+      return;
+
+   png_ptr->num_chunk_locations = 0;
 
-      else if (chunk_name == png_pHYs)
-         png_handle_pHYs(png_ptr, info_ptr, length);
+   png_read_sig(png_ptr, info_ptr);
 
-      else if (chunk_name == png_sBIT)
-         png_handle_sBIT(png_ptr, info_ptr, length);
+   do
+   {
+      png_off_t offset = png_ptr->io_offset;
+      png_uint_32 length = png_read_chunk_header(png_ptr);
+      png_uint_32 chunk_name = png_ptr->chunk_name;
+      int keep;
 
-      else if (chunk_name == png_sRGB)
-         png_handle_sRGB(png_ptr, info_ptr, length);
+      png_record_chunk_location(png_ptr, offset, length);
 
-      else if (chunk_name == png_iCCP)
-         png_handle_iCCP(png_ptr, info_ptr, length);
+      if (chunk_name == png_IDAT)
+      {
+         if ((png_ptr->mode & PNG_HAVE_IHDR) == 0)
+            png_chunk_error(png_ptr, "Missing IHDR before IDAT");
 
-      else if (chunk_name == png_sPLT)
-         png_handle_sPLT(png_ptr, info_ptr, length);
+         else if (png_ptr->color_type == PNG_COLOR_TYPE_PALETTE &&
+             (png_ptr->mode & PNG_HAVE_PLTE) == 0)
+            png_chunk_error(png_ptr, "Missing PLTE before IDAT");
 
-      else if (chunk_name == png_tEXt)
-         png_handle_tEXt(png_ptr, info_ptr, length);
+         else if ((png_ptr->mode & PNG_AFTER_IDAT) != 0)
+            png_chunk_benign_error(png_ptr, "Too many IDATs found");
 
-      else if (chunk_name == png_tIME)
-         png_handle_tIME(png_ptr, info_ptr, length);
+         png_ptr->mode |= PNG_HAVE_IDAT;
 
-      else if (chunk_name == png_tRNS)
-         png_handle_tRNS(png_ptr, info_ptr, length);
+         /* The image data and its CRC are not needed. */
+         png_skip_data(png_ptr, length + 4);
+         continue;
+      }
 
-      else if (chunk_name == png_zTXt)
-         png_handle_zTXt(png_ptr, info_ptr, length);
+      if ((png_ptr->mode & PNG_HAVE_IDAT) != 0)
+         png_ptr->mode |= PNG_HAVE_CHUNK_AFTER_IDAT | PNG_AFTER_IDAT;
 
-      else if (chunk_name == png_iTXt)
-         png_handle_iTXt(png_ptr, info_ptr, length);
+      if (chunk_name == png_IHDR)
+         png_handle_IHDR(png_ptr, info_ptr, length);
+
+      else if (chunk_name == png_IEND)
+         png_handle_IEND(png_ptr, info_ptr, length);
+
+      else if ((keep = png_chunk_unknown_handling(png_ptr, chunk_name)) != 0)
+      {
+         /* Ancillary chunks the application has said it does not want are
+          * never looked at, so there is no need to read them either.
+          */
+         if (keep == PNG_HANDLE_CHUNK_NEVER &&
+             PNG_CHUNK_ANCILLARY(chunk_name) != 0)
+            png_skip_data(png_ptr, length + 4);
+
+         else
+         {
+            png_handle_unknown(png_ptr, info_ptr, length, keep);
+
+            if (chunk_name == png_PLTE)
+               png_ptr->mode |= PNG_HAVE_PLTE;
+         }
+      }
 
       else
-         png_handle_unknown(png_ptr, info_ptr, length,
-             PNG_HANDLE_CHUNK_AS_DEFAULT);
+         png_read_dispatch_chunk(png_ptr, info_ptr, length);
    } while ((png_ptr->mode & PNG_HAVE_IEND) == 0);
 }
 
+/* The work of png_read_verify, which puts back the settings changed here. */
+static void
+png_read_verify_rows(png_structrp png_ptr, png_inforp info_ptr,
+    png_verify_result *result, int flags, png_uint_32 benign)
+{
+   png_row_info row_info;
+
+   /* Every CRC is checked and a mismatch is an error, as is any error in the
+    * deflate stream including a bad Adler-32.
+    */
+   png_ptr->flags &= ~PNG_FLAG_CRC_MASK;
+   png_ptr->flags |= PNG_FLAG_CRC_ANCILLARY_NOWARN;
+   png_ptr->options &= ~(3U << PNG_IGNORE_ADLER32);
+
+   if ((png_ptr->mode & PNG_HAVE_IDAT) == 0)
+      png_read_info(png_ptr, info_ptr);
+
+   /* Only the raw rows are looked at, so the transformations are dropped;
+    * png_read_start_row then allocates just the two row buffers.
+    */
+   png_ptr->transformations = 0;
+   png_read_start_row(png_ptr);
+
+   /* An index can only be out of range if the palette is short. */
+   if (png_ptr->color_type != PNG_COLOR_TYPE_PALETTE ||
+       png_ptr->num_palette >= (1 << png_ptr->bit_depth))
+      flags &= ~PNG_VERIFY_PALETTE_INDEX;
+
+   /* Inconsistencies in the image data, such as trailing compressed data,
+    * are normally benign; here they are fatal.
+    */
+   png_ptr->flags &= ~PNG_FLAG_BENIGN_ERRORS_WARN;
+
+   row_info.color_type = png_ptr->color_type;
+   row_info.bit_depth = png_ptr->bit_depth;
+   row_info.channels = png_ptr->channels;
+   row_info.pixel_depth = png_ptr->pixel_depth;
+
+   while (png_ptr->interlaced != 0 ? png_ptr->pass < 7 :
+       png_ptr->row_number < png_ptr->num_rows)
+   {
+      png_byte filter;
+
+      row_info.width = png_ptr->iwidth;
+      row_info.rowbytes = PNG_ROWBYTES(row_info.pixel_depth, row_info.width);
+
+      png_ptr->row_buf[0] = 255;
+      png_read_IDAT_data(png_ptr, png_ptr->row_buf, row_info.rowbytes + 1);
+
+      filter = png_ptr->row_buf[0];
+      if (filter >= PNG_FILTER_VALUE_LAST)
+         png_error(png_ptr, "bad adaptive filter value");
+
+      result->filter_count[filter]++;
+
+      /* Index checks need the real pixel values, so only then is the row
+       * unfiltered (in the library's own row buffer.)
+       */
+      if ((flags & PNG_VERIFY_PALETTE_INDEX) != 0)
+      {
+         if (filter > PNG_FILTER_VALUE_NONE)
+            png_read_filter_row(png_ptr, &row_info, png_ptr->row_buf + 1,
+                png_ptr->prev_row + 1, filter);
+
+         memcpy(png_ptr->prev_row, png_ptr->row_buf, row_info.rowbytes + 1);
+         png_do_check_palette_indexes(png_ptr, &row_info);
+      }
+
+      result->rows++;
+      result->image_bytes += row_info.rowbytes + 1;
+
+      png_read_finish_row(png_ptr);
+   }
+
+   /* png_read_finish_row has consumed the rest of the deflate stream (checking
+    * the Adler-32) by now; the remaining chunks are handled with the
+    * application's setting.
+    */
+   png_ptr->flags |= benign;
+
+   if ((flags & PNG_VERIFY_PALETTE_INDEX) != 0)
+   {
+      result->palette_max = png_ptr->num_palette_max;
+
+      if (png_ptr->num_palette_max >= png_ptr->num_palette)
+         result->flags |= PNG_VERIFY_PALETTE_INDEX;
+
+      /* Reported in the result rather than by png_read_end */
+      png_ptr->num_palette_max = 0;
+   }
+
+   png_read_end(png_ptr, info_ptr);
+
+   result->file_bytes = png_ptr->io_offset;
+   result->flags |= PNG_VERIFY_COMPLETE;
+}
+
+/* The CRC, Adler-32 and benign error settings that png_read_verify_rows
+ * overrides.
+ */
+#define PNG_VERIFY_FLAGS (PNG_FLAG_CRC_MASK | PNG_FLAG_BENIGN_ERRORS_WARN)
+#define PNG_VERIFY_OPTIONS (3U << PNG_IGNORE_ADLER32)
+
+static void
+png_read_verify_restore(png_structrp png_ptr, png_uint_32 flags,
+    png_uint_32 options)
+{
+   png_ptr->flags = (png_ptr->flags & ~PNG_VERIFY_FLAGS) | flags;
+   png_ptr->options = (png_ptr->options & ~PNG_VERIFY_OPTIONS) | options;
+}
+
+void PNGAPI
+png_read_verify(png_structrp png_ptr, png_inforp info_ptr,
+    png_verify_result *result, int flags)
+{
+   png_uint_32 saved_flags, saved_options;
+
+   png_debug(1, "in png_read_verify");
+
+   if (png_ptr == NULL || info_ptr == NULL || result == NULL)
+      return;
+
+   memset(result, 0, sizeof *result);
+   result->palette_max = -1;
+
+   if ((png_ptr->flags & PNG_FLAG_ROW_INIT) != 0)
+   {
+      png_app_error(png_ptr, "png_read_verify: image reading already started");
+      return;
+   }
+
+   saved_flags = png_ptr->flags & PNG_VERIFY_FLAGS;
+   saved_options = png_ptr->options & PNG_VERIFY_OPTIONS;
+
+#ifdef PNG_SETJMP_SUPPORTED
+   /* If the application has a jmp_buf a png_error comes back here first, so
+    * that the settings are put back before the application sees the error.
+    */
+   if (png_ptr->jmp_buf_ptr != NULL)
+   {
+      jmp_buf *saved_jmp_buf = png_ptr->jmp_buf_ptr;
+      jmp_buf verify_jmp_buf;
+
+      png_ptr->jmp_buf_ptr = &verify_jmp_buf;
+
+      if (setjmp(verify_jmp_buf) != 0)
+      {
+         png_ptr->jmp_buf_ptr = saved_jmp_buf;
+         png_read_verify_restore(png_ptr, saved_flags, saved_options);
+         png_longjmp(png_ptr, 1);
+      }
+
+      png_read_verify_rows(png_ptr, info_ptr, result, flags,
+          saved_flags & PNG_FLAG_BENIGN_ERRORS_WARN);
+      png_ptr->jmp_buf_ptr = saved_jmp_buf;
+   }
+
+   else
+#endif
+   {
+      /* Otherwise the error is thrown (PNG_EXCEPTIONS, or an error_fn that
+       * throws) or the error_fn does not return to libpng at all, in which
+       * case nothing can be done.
+       */
+      try
+      {
+         png_read_verify_rows(png_ptr, info_ptr, result, flags,
+             saved_flags & PNG_FLAG_BENIGN_ERRORS_WARN);
+      }
+
+      catch (...)
+      {
+         png_read_verify_restore(png_ptr, saved_flags, saved_options);
+         throw;
+      }
+   }
+
+   png_read_verify_restore(png_ptr, saved_flags, saved_options);
+}
+
 /* Free all memory used in the read struct */
 static void
 png_read_destroy(png_structrp png_ptr)
@@ -715,11 +1003,21 @@ png_read_destroy(png_structrp png_ptr)
    png_ptr->big_prev_row = NULL;
    png_free(png_ptr, png_ptr->read_buffer);
    png_ptr->read_buffer = NULL;
+   png_free(png_ptr, png_ptr->iccp_data);
+   png_ptr->iccp_data = NULL;
+   png_free(png_ptr, png_ptr->stats);
+   png_ptr->stats = NULL;
+   png_free(png_ptr, png_ptr->work);
+   png_ptr->work = NULL;
 
    png_free(png_ptr, png_ptr->palette_lookup);
    png_ptr->palette_lookup = NULL;
    png_free(png_ptr, png_ptr->quantize_index);
    png_ptr->quantize_index = NULL;
+   png_free(png_ptr, png_ptr->quantize_tree);
+   png_ptr->quantize_tree = NULL;
+   png_free(png_ptr, png_ptr->quantize_error);
+   png_ptr->quantize_error = NULL;
 
    if ((png_ptr->free_me & PNG_FREE_PLTE) != 0)
    {
@@ -749,6 +1047,11 @@ png_read_destroy(png_structrp png_ptr)
    png_free(png_ptr, png_ptr->riffled_palette);
    png_ptr->riffled_palette = NULL;
 
+   png_free(png_ptr, png_ptr->chunk_locations);
+   png_ptr->chunk_locations = NULL;
+   png_free(png_ptr, png_ptr->row_index);
+   png_ptr->row_index = NULL;
+
    /* NOTE: the 'setjmp' buffer may still be allocated and the memory and error
     * callbacks are still set at this point.  They are required to complete the
     * destruction of the png_struct itself.
@@ -0,0 +1,437 @@
+/* pngrewrite.cpp - copy a PNG chunk by chunk without recompression
+ *
+ * This code is released under the libpng license.
+ * For conditions of distribution and use, see the disclaimer
+ * and license in png.h
+ *
+ * Stripping or adding metadata does not need the image decoded.  The chunks
+ * are read with the usual chunk header and CRC code and written again, and
+ * the IDAT chunks, nearly all of the file, are either copied unchanged or
+ * only re-framed into chunks of a different size.
+ *
+ * To recompress the image the IDAT stream is inflated and the rows, still
+ * filtered, are deflated again by the write code; unfiltering and filtering
+ * again is optional.
+ */
+
+#include <pngmem.h>
+#include <pngerror.h>
+#include <pngdebug.h>
+#include <rutil.h>
+#include <wutil.h>
+#include <stats.h>
+
+#include "pngpriv.h"
+
+#ifdef __linux__
+#  include <sys/types.h>
+#  include <sys/sendfile.h>
+#  include <unistd.h>
+#endif
+
+#ifdef __linux__
+/* Copy 'length' bytes from offset 'start' of 'in' to the end of 'out' in the
+ * kernel, and return the number copied.  This may be less than 'length', or
+ * zero, if the files do not support it; the caller copies the rest.  The
+ * position of 'in' is not changed.
+ */
+static png_off_t
+png_rewrite_copy_kernel(FILE *in, FILE *out, off_t start, png_off_t length)
+{
+   int fd_in = fileno(in), fd_out = fileno(out);
+   png_off_t done = 0;
+
+   if (fd_in < 0 || fd_out < 0 || fflush(out) != 0)
+      return 0;
+
+   /* copy_file_range needs two regular files (on one file system before
+    * Linux 5.3); sendfile only needs an input that can be mapped.
+    */
+   while (done < length)
+   {
+      ssize_t n = copy_file_range(fd_in, &start, fd_out, NULL,
+          (size_t)(length - done), 0);
+
+      if (n <= 0)
+         break;
+
+      done += (png_off_t)n;
+   }
+
+   while (done < length)
+   {
+      ssize_t n = sendfile(fd_out, fd_in, &start, (size_t)(length - done));
+
+      if (n <= 0)
+         break;
+
+      done += (png_off_t)n;
+   }
+
+   return done;
+}
+
+/* Copy the run of IDAT chunks starting with the one whose header has just
+ * been read, when both structs use the default stdio functions and the CRCs
+ * are not checked.  The chunk headers are read to find
+ * the end of the run, but the data is skipped and the whole run is copied at
+ * once.  Returns the length of the chunk after the run.
+ */
+static png_uint_32
+png_rewrite_IDAT_files(png_structrp read_ptr, png_structrp write_ptr,
+    png_uint_32 length)
+{
+   FILE *in = (FILE*)read_ptr->io_ptr;
+   FILE *out = (FILE*)write_ptr->io_ptr;
+   off_t start = ftello(in) - 8;
+   off_t end;
+   png_off_t done;
+
+   do
+   {
+      png_off_t stat_start = png_stats_begin(read_ptr);
+
+      if (fseeko(in, (off_t)length + 4, SEEK_CUR) != 0)
+         png_error(read_ptr, "Read Error");
+
+      /* Counted as read, as the copy below reads it. */
+      read_ptr->io_offset += (png_off_t)length + 4;
+      png_stats_end(read_ptr, PNG_STAT_READ_DATA, stat_start,
+          (png_off_t)length + 4);
+      length = png_read_chunk_header(read_ptr);
+   }
+   while (read_ptr->chunk_name == png_IDAT);
+
+   end = ftello(in) - 8;
+   done = png_rewrite_copy_kernel(in, out, start, (png_off_t)(end - start));
+
+   /* Anything the kernel did not copy goes through the write function. */
+   if (done < (png_off_t)(end - start))
+   {
+      png_byte buf[PNG_INFLATE_BUF_SIZE];
+
+      if (fseeko(in, start + (off_t)done, SEEK_SET) != 0)
+         png_error(read_ptr, "Read Error");
+
+      while (done < (png_off_t)(end - start))
+      {
+         size_t n = sizeof buf;
+
+         if (n > (png_off_t)(end - start) - done)
+            n = (size_t)((png_off_t)(end - start) - done);
+
+         if (fread(buf, 1, n, in) != n)
+            png_error(read_ptr, "Read Error");
+
+         png_write_data(write_ptr, buf, n);
+         done += n;
+      }
+
+      if (fseeko(in, end + 8, SEEK_SET) != 0)
+         png_error(read_ptr, "Read Error");
+   }
+
+   return length;
+}
+#endif /* __linux__ */
+
+/* Copy a run of IDAT chunks; the header of the first has been read.  Returns
+ * the length of the chunk after the run, whose header has been read.
+ */
+static png_uint_32
+png_rewrite_IDAT(png_structrp read_ptr, png_structrp write_ptr,
+    png_uint_32 length, png_uint_32 idat_size)
+{
+   png_byte idat[5];
+
+   PNG_CSTRING_FROM_CHUNK(idat, png_IDAT);
+   read_ptr->mode |= PNG_HAVE_IDAT;
+
+   if (idat_size > 0)
+   {
+      /* The CRC is recomputed, so the old one is checked first. */
+      png_bytep buf = png_read_buffer(read_ptr, idat_size, 0/*error*/);
+      png_uint_32 used = 0;
+
+      do
+      {
+         while (length > 0)
+         {
+            png_uint_32 n = idat_size - used;
+
+            if (n > length)
+               n = length;
+
+            png_crc_read(read_ptr, buf + used, n);
+            used += n;
+            length -= n;
+
+            if (used == idat_size)
+            {
+               png_write_chunk(write_ptr, idat, buf, used);
+               used = 0;
+            }
+         }
+
+         png_crc_finish(read_ptr, 0);
+         length = png_read_chunk_header(read_ptr);
+      }
+      while (read_ptr->chunk_name == png_IDAT);
+
+      if (used > 0)
+         png_write_chunk(write_ptr, idat, buf, used);
+
+      return length;
+   }
+
+#ifdef __linux__
+   /* Copying in the kernel cannot check the CRCs, so it is only used when the
+    * application has said to ignore them.  Both ends must be the default
+    * stdio functions, since the files are used directly.
+    */
+   if ((read_ptr->flags & PNG_FLAG_CRC_CRITICAL_IGNORE) != 0 &&
+       read_ptr->read_data_fn == png_default_read_data &&
+       write_ptr->write_data_fn == png_default_write_data &&
+       ftello((FILE*)read_ptr->io_ptr) >= 8)
+      return png_rewrite_IDAT_files(read_ptr, write_ptr, length);
+#endif
+
+   /* Each chunk is copied as it stands, CRC included, once the CRC has been
+    * checked.
+    */
+   do
+   {
+      png_byte buf[PNG_INFLATE_BUF_SIZE];
+
+      png_save_uint_32(buf, length);
+      memcpy(buf + 4, idat, 4);
+      png_write_data(write_ptr, buf, 8);
+
+      while (length > 0)
+      {
+         png_uint_32 n = sizeof buf;
+
+         if (n > length)
+            n = length;
+
+         png_crc_read(read_ptr, buf, n);
+         png_write_data(write_ptr, buf, n);
+         length -= n;
+      }
+
+      png_crc_finish_copy(read_ptr, buf);
+      png_write_data(write_ptr, buf, 4);
+      length = png_read_chunk_header(read_ptr);
+   }
+   while (read_ptr->chunk_name == png_IDAT);
+
+   return length;
+}
+
+/* Decompress the image data, the header of whose first IDAT chunk has been
+ * read, and compress it again through write_ptr's row code.  Returns the
+ * length of the chunk after the image data, whose header has been read.
+ */
+static png_uint_32
+png_rewrite_recompress_IDAT(png_structrp read_ptr, png_structrp write_ptr,
+    png_uint_32 length, int refilter)
+{
+   png_row_info row_info;
+
+   read_ptr->mode |= PNG_HAVE_IDAT;
+   read_ptr->idat_size = length;
+
+   /* Only the raw rows are wanted on either side. */
+   read_ptr->transformations = 0;
+   write_ptr->transformations = 0;
+   png_read_start_row(read_ptr);
+   png_write_start_row(write_ptr);
+
+   /* The trial compression of the archive and smallest tiers filters
+    * unfiltered rows.
+    */
+   if (write_ptr->trial != NULL)
+      refilter = 1;
+
+   row_info.color_type = read_ptr->color_type;
+   row_info.bit_depth = read_ptr->bit_depth;
+   row_info.channels = read_ptr->channels;
+   row_info.pixel_depth = read_ptr->pixel_depth;
+
+   while (read_ptr->interlaced != 0 ? read_ptr->pass < 7 :
+       read_ptr->row_number < read_ptr->num_rows)
+   {
+      png_bytep row = read_ptr->row_buf;
+      png_byte filter;
+
+      row_info.width = read_ptr->iwidth;
+      row_info.rowbytes = PNG_ROWBYTES(row_info.pixel_depth, row_info.width);
+
+      row[0] = 255;
+      png_read_IDAT_data(read_ptr, row, row_info.rowbytes + 1);
+
+      filter = row[0];
+      if (filter >= PNG_FILTER_VALUE_LAST)
+         png_error(read_ptr, "bad adaptive filter value");
+
+      if (refilter != 0)
+      {
+         if (filter > PNG_FILTER_VALUE_NONE)
+            png_read_filter_row(read_ptr, &row_info, row + 1,
+                read_ptr->prev_row + 1, filter);
+
+         row[0] = PNG_FILTER_VALUE_NONE;
+         memcpy(read_ptr->prev_row, row, row_info.rowbytes + 1);
+      }
+
+      png_write_encoded_row(write_ptr, row, row_info.rowbytes + 1, refilter);
+      png_read_finish_row(read_ptr);
+   }
+
+   /* The last row finished the deflate stream and the IDAT chunk it ended in;
+    * any more IDAT chunks should be empty.
+    */
+   for (;;)
+   {
+      length = png_read_chunk_header(read_ptr);
+
+      if (read_ptr->chunk_name != png_IDAT)
+         return length;
+
+      if (length > 0)
+         png_chunk_benign_error(read_ptr, "Too many IDATs found");
+
+      (void)png_crc_finish(read_ptr, length);
+   }
+}
+
+/* The chunk loop shared by png_rewrite_chunks and png_rewrite_recompress;
+ * 'recompress' is negative to copy the IDAT chunks, else the refilter flag.
+ */
+static void
+png_rewrite(png_structrp read_ptr, png_inforp info_ptr,
+    png_structrp write_ptr, png_rewrite_ptr rewrite_fn, png_voidp rewrite_arg,
+    png_uint_32 idat_size, int recompress)
+{
+   png_uint_32 length;
+
+   png_read_sig(read_ptr, info_ptr);
+   png_write_sig(write_ptr);
+   length = png_read_chunk_header(read_ptr);
+
+   for (;;)
+   {
+      png_uint_32 chunk_name = read_ptr->chunk_name;
+      png_byte name[5];
+
+      PNG_CSTRING_FROM_CHUNK(name, chunk_name);
+
+      if (chunk_name == png_IHDR)
+      {
+         /* Written from info_ptr; this also validates it. */
+         png_handle_IHDR(read_ptr, info_ptr, length);
+         png_write_IHDR(write_ptr, info_ptr->width, info_ptr->height,
+             info_ptr->bit_depth, info_ptr->color_type,
+             info_ptr->compression_type, info_ptr->filter_type,
+             info_ptr->interlace_type);
+      }
+
+      else if ((read_ptr->mode & PNG_HAVE_IHDR) == 0)
+         png_chunk_error(read_ptr, "missing IHDR");
+
+      else if (chunk_name == png_IDAT && recompress >= 0 &&
+          (read_ptr->mode & PNG_HAVE_IDAT) != 0)
+      {
+         /* The image has been written already */
+         png_chunk_benign_error(read_ptr, "Too many IDATs found");
+         (void)png_crc_finish(read_ptr, length);
+      }
+
+      else if (chunk_name == png_IDAT)
+      {
+         if (rewrite_fn != NULL)
+            (void)(*rewrite_fn)(write_ptr, rewrite_arg, name, NULL, 0);
+
+         /* These read the header of the next chunk. */
+         if (recompress < 0)
+            length = png_rewrite_IDAT(read_ptr, write_ptr, length, idat_size);
+
+         else
+            length = png_rewrite_recompress_IDAT(read_ptr, write_ptr, length,
+                recompress);
+
+         continue;
+      }
+
+      else if (chunk_name == png_IEND)
+      {
+         if (rewrite_fn != NULL)
+            (void)(*rewrite_fn)(write_ptr, rewrite_arg, name, NULL, 0);
+
+         png_handle_IEND(read_ptr, info_ptr, length);
+         png_write_IEND(write_ptr);
+         return;
+      }
+
+      else if (PNG_CHUNK_ANCILLARY(chunk_name) != 0 &&
+          png_chunk_unknown_handling(read_ptr, chunk_name) ==
+          PNG_HANDLE_CHUNK_NEVER)
+         png_skip_data(read_ptr, length + 4);
+
+      else
+      {
+         /* At least one byte so that an empty chunk has a buffer. */
+         png_bytep data = png_read_buffer(read_ptr, length + 1, 0/*error*/);
+
+         png_crc_read(read_ptr, data, length);
+
+         /* An ancillary chunk with a bad CRC may be discarded. */
+         if (png_crc_finish(read_ptr, 0) == 0)
+         {
+            int keep = PNG_REWRITE_KEEP;
+
+            if (rewrite_fn != NULL)
+               keep = (*rewrite_fn)(write_ptr, rewrite_arg, name, data, length);
+
+            if (keep != PNG_REWRITE_DROP || PNG_CHUNK_CRITICAL(chunk_name))
+               png_write_chunk(write_ptr, name, data, length);
+         }
+      }
+
+      length = png_read_chunk_header(read_ptr);
+   }
+}
+
+void PNGAPI
+png_rewrite_chunks(png_structrp read_ptr, png_inforp info_ptr,
+    png_structrp write_ptr, png_rewrite_ptr rewrite_fn, png_voidp rewrite_arg,
+    png_uint_32 idat_size)
+{
+   png_debug(1, "in png_rewrite_chunks");
+
+   if (read_ptr == NULL || info_ptr == NULL || write_ptr == NULL)
+      return;
+
+   if (idat_size > PNG_UINT_31_MAX)
+   {
+      png_app_error(write_ptr, "png_rewrite_chunks: IDAT size too large");
+      idat_size = 0;
+   }
+
+   png_rewrite(read_ptr, info_ptr, write_ptr, rewrite_fn, rewrite_arg,
+       idat_size, -1/*copy*/);
+}
+
+void PNGAPI
+png_rewrite_recompress(png_structrp read_ptr, png_inforp info_ptr,
+    png_structrp write_ptr, png_rewrite_ptr rewrite_fn, png_voidp rewrite_arg,
+    int flags)
+{
+   png_debug(1, "in png_rewrite_recompress");
+
+   if (read_ptr == NULL || info_ptr == NULL || write_ptr == NULL)
+      return;
+
+   png_rewrite(read_ptr, info_ptr, write_ptr, rewrite_fn, rewrite_arg, 0,
+       (flags & PNG_RECOMPRESS_REFILTER) != 0);
+}
@@ -0,0 +1,609 @@
+/* pngrindex.c - random access to the rows of a non-interlaced PNG
+ *
+ * This code is released under the libpng license.
+ * For conditions of distribution and use, see the disclaimer
+ * and license in png.h
+ *
+ * An index of inflate checkpoints is built in a single pass over the IDAT
+ * stream, in the manner of zlib's examples/zran.c.  A checkpoint is taken at
+ * the start of a deflate block and records the position of that block in the
+ * compressed stream and in the inflated (still filtered) image data, the 32K
+ * window that precedes it and the unfiltered row before the first row that
+ * starts after it.  That is everything needed to resume inflating at the
+ * checkpoint and to unfilter the following rows, so a range of rows can be
+ * decoded from the nearest preceding checkpoint rather than from the start of
+ * the image.
+ */
+
+#include <pngmem.h>
+#include <pngerror.h>
+#include <pngdebug.h>
+#include <rutil.h>
+
+#include "pngpriv.h"
+
+#define PNG_INDEX_VERSION 1
+#define PNG_INDEX_WINDOW  32768   /* largest deflate window */
+#define PNG_INDEX_SPAN    1048576 /* default inflated bytes between points */
+#define PNG_INDEX_HEADER  28
+
+/* The index is a header followed by a sequence of records, in stream order.
+ * All numbers are big-endian:
+ *
+ *    header: "PNGx" version(4) width(4) height(4) rowbytes(8) span(4)
+ *    'D' record, one for each IDAT chunk:
+ *       data_offset(8) length(4)
+ *    'C' record, one for each checkpoint:
+ *       in(8) out(8) row(4) bits(1) byte(1) window_size(2)
+ *       window[window_size] prev_row[rowbytes]
+ *
+ * 'in' is the offset of the next compressed byte within the concatenated IDAT
+ * data; when 'bits' is non-zero the top 'bits' bits of 'byte' (the preceding
+ * compressed byte) have not yet been used.  'out' is the offset of the block in
+ * the inflated data and 'row' the first row that starts at or after it.  The
+ * 'in' offset of a checkpoint always lies within (or at the end of) the IDAT
+ * chunk described by the most recent 'D' record.
+ */
+#define PNG_INDEX_DATA_RECORD  13
+#define PNG_INDEX_POINT_RECORD 25
+
+static void
+png_index_save_64(png_bytep buf, png_off_t value)
+{
+   png_save_uint_32(buf, (png_uint_32)(value >> 32));
+   png_save_uint_32(buf + 4, (png_uint_32)value);
+}
+
+static png_off_t
+png_index_get_64(png_const_bytep buf)
+{
+   return ((png_off_t)png_get_uint_32(buf) << 32) + png_get_uint_32(buf + 4);
+}
+
+/* Append 'add' bytes to the index being built, returning a pointer to them.
+ * The buffer belongs to png_ptr until it is handed to the application so that
+ * it is released if a png_error occurs.
+ */
+static png_bytep
+png_index_extend(png_structrp png_ptr, size_t add)
+{
+   size_t size = png_ptr->row_index_size;
+
+   if (add > PNG_SIZE_MAX - size)
+      png_error(png_ptr, "row index too large");
+
+   if (size + add > png_ptr->row_index_max)
+   {
+      size_t max = png_ptr->row_index_max < 65536 ? 65536 :
+          png_ptr->row_index_max;
+      png_bytep data;
+
+      while (max < size + add)
+      {
+         if (max > PNG_SIZE_MAX / 2)
+            max = size + add;
+
+         else
+            max *= 2;
+      }
+
+      data = (png_bytep)png_malloc(png_ptr, max);
+
+      if (size > 0)
+         memcpy(data, png_ptr->row_index, size);
+
+      png_free(png_ptr, png_ptr->row_index);
+      png_ptr->row_index = data;
+      png_ptr->row_index_max = max;
+   }
+
+   png_ptr->row_index_size = size + add;
+   return png_ptr->row_index + size;
+}
+
+static void
+png_index_add_data(png_structrp png_ptr)
+{
+   png_bytep rec = png_index_extend(png_ptr, PNG_INDEX_DATA_RECORD);
+
+   rec[0] = 'D';
+   png_index_save_64(rec + 1, png_ptr->io_offset);
+   png_save_uint_32(rec + 9, png_ptr->idat_size);
+}
+
+void PNGAPI
+png_read_build_index(png_structrp png_ptr, size_t span, png_bytepp index,
+    size_t *index_size)
+{
+#if ZLIB_VERNUM >= 0x1280
+   png_byte inbuf[PNG_INFLATE_BUF_SIZE];
+   png_byte last_byte = 0;     /* final byte of the previous input buffer */
+   png_off_t total_in = 0;     /* compressed bytes given to zlib */
+   png_off_t total_out = 0;    /* inflated bytes */
+   png_off_t last_point = 0;   /* total_out at the last checkpoint */
+   size_t pending = 0;         /* prev_row offset of an incomplete checkpoint */
+   png_uint_32 pending_row = 0;
+   png_uint_32 row = 0;        /* number of complete rows */
+   size_t row_len, fill = 0;
+   int extra = 0;
+   png_row_info row_info;
+   png_bytep header;
+
+   png_debug(1, "in png_read_build_index");
+
+   if (png_ptr == NULL)
+      return;
+
+   if (index == NULL || index_size == NULL ||
+       (png_ptr->mode & PNG_HAVE_IDAT) == 0 ||
+       (png_ptr->flags & PNG_FLAG_ROW_INIT) != 0)
+   {
+      png_app_error(png_ptr,
+          "png_read_build_index: call after png_read_info only");
+      return;
+   }
+
+   if (png_ptr->interlaced != 0)
+      png_error(png_ptr, "cannot index an interlaced image");
+
+   if (span == 0)
+      span = PNG_INDEX_SPAN;
+
+   /* The raw rows are unfiltered to obtain the previous row for each
+    * checkpoint but are not transformed.
+    */
+   png_ptr->transformations = 0;
+   png_read_start_row(png_ptr);
+
+   row_info.width = png_ptr->width;
+   row_info.color_type = png_ptr->color_type;
+   row_info.bit_depth = png_ptr->bit_depth;
+   row_info.channels = png_ptr->channels;
+   row_info.pixel_depth = png_ptr->pixel_depth;
+   row_info.rowbytes = PNG_ROWBYTES(row_info.pixel_depth, row_info.width);
+   row_len = row_info.rowbytes + 1;
+
+   png_ptr->row_index_size = 0;
+   header = png_index_extend(png_ptr, PNG_INDEX_HEADER);
+   memcpy(header, "PNGx", 4);
+   png_save_uint_32(header + 4, PNG_INDEX_VERSION);
+   png_save_uint_32(header + 8, png_ptr->width);
+   png_save_uint_32(header + 12, png_ptr->height);
+   png_index_save_64(header + 16, row_info.rowbytes);
+   png_save_uint_32(header + 24, (png_uint_32)(span > PNG_UINT_31_MAX ?
+       PNG_UINT_31_MAX : span));
+
+   /* png_read_info stopped just after the first IDAT chunk header. */
+   png_index_add_data(png_ptr);
+
+   for (;;)
+   {
+      size_t avail_out;
+      int ret;
+
+      if (png_ptr->zstream.avail_in == 0)
+      {
+         uInt avail;
+
+         while (png_ptr->idat_size == 0)
+         {
+            png_crc_finish(png_ptr, 0);
+
+            png_ptr->idat_size = png_read_chunk_header(png_ptr);
+            if (png_ptr->chunk_name != png_IDAT)
+               png_error(png_ptr, "Not enough image data");
+
+            png_index_add_data(png_ptr);
+         }
+
+         if (total_in > 0)
+            last_byte = png_ptr->zstream.next_in[-1];
+
+         avail = (sizeof inbuf);
+         if (avail > png_ptr->idat_size)
+            avail = (uInt)png_ptr->idat_size;
+
+         png_crc_read(png_ptr, inbuf, avail);
+         png_ptr->idat_size -= avail;
+         total_in += avail;
+
+         png_ptr->zstream.next_in = inbuf;
+         png_ptr->zstream.avail_in = avail;
+      }
+
+      /* Once all the rows are complete any more data is an error; the row
+       * buffer is used to swallow it.
+       */
+      if (row < png_ptr->height)
+         avail_out = row_len - fill;
+
+      else
+      {
+         fill = 0;
+         avail_out = row_len;
+      }
+
+      png_ptr->zstream.next_out = png_ptr->row_buf + fill;
+      png_ptr->zstream.avail_out = (uInt)avail_out;
+
+      ret = PNG_INFLATE(png_ptr, Z_BLOCK);
+
+      avail_out -= png_ptr->zstream.avail_out;
+      total_out += avail_out;
+
+      if (row >= png_ptr->height)
+      {
+         if (avail_out > 0)
+            extra = 1;
+      }
+
+      else if ((fill += avail_out) == row_len)
+      {
+         png_byte filter = png_ptr->row_buf[0];
+
+         if (filter > PNG_FILTER_VALUE_NONE)
+         {
+            if (filter >= PNG_FILTER_VALUE_LAST)
+               png_error(png_ptr, "bad adaptive filter value");
+
+            png_read_filter_row(png_ptr, &row_info, png_ptr->row_buf + 1,
+                png_ptr->prev_row + 1, filter);
+         }
+
+         memcpy(png_ptr->prev_row, png_ptr->row_buf, row_len);
+         fill = 0;
+
+         if (++row == pending_row && pending != 0)
+         {
+            memcpy(png_ptr->row_index + pending, png_ptr->prev_row + 1,
+                row_info.rowbytes);
+            pending = 0;
+         }
+      }
+
+      if (ret == Z_STREAM_END)
+         break;
+
+      if (ret != Z_OK)
+      {
+         png_zstream_error(png_ptr, ret);
+         png_chunk_error(png_ptr, png_ptr->zstream.msg);
+      }
+
+      /* At the start of a block (and not after the last one) consider adding
+       * a checkpoint.  Only one checkpoint at a time can be waiting for its
+       * previous row.
+       */
+      if ((png_ptr->zstream.data_type & 128) != 0 &&
+          (png_ptr->zstream.data_type & 64) == 0 &&
+          total_out - last_point >= span && pending == 0)
+      {
+         png_uint_32 next_row = (png_uint_32)((total_out + row_len - 1) /
+             row_len);
+
+         if (next_row < png_ptr->height)
+         {
+            int bits = png_ptr->zstream.data_type & 7;
+            png_bytep rec = png_index_extend(png_ptr, PNG_INDEX_POINT_RECORD +
+                PNG_INDEX_WINDOW);
+            size_t rec_offset = (size_t)(rec - png_ptr->row_index);
+            uInt window_size = PNG_INDEX_WINDOW;
+
+            rec[0] = 'C';
+            png_index_save_64(rec + 1, total_in - png_ptr->zstream.avail_in);
+            png_index_save_64(rec + 9, total_out);
+            png_save_uint_32(rec + 17, next_row);
+            rec[21] = (png_byte)bits;
+            rec[22] = (png_byte)(bits == 0 ? 0 :
+                png_ptr->zstream.next_in > inbuf ?
+                png_ptr->zstream.next_in[-1] : last_byte);
+
+            if (inflateGetDictionary(&png_ptr->zstream,
+                rec + PNG_INDEX_POINT_RECORD, &window_size) != Z_OK)
+               png_error(png_ptr, "row index: cannot save the window");
+
+            rec[23] = (png_byte)(window_size >> 8);
+            rec[24] = (png_byte)window_size;
+
+            /* Trim the unused window space then add the previous row. */
+            png_ptr->row_index_size = rec_offset + PNG_INDEX_POINT_RECORD +
+                window_size;
+            rec = png_index_extend(png_ptr, row_info.rowbytes);
+
+            if (fill == 0) /* the previous row is complete */
+               memcpy(rec, png_ptr->prev_row + 1, row_info.rowbytes);
+
+            else
+            {
+               pending = (size_t)(rec - png_ptr->row_index);
+               pending_row = next_row;
+            }
+
+            last_point = total_out;
+         }
+      }
+   }
+
+   if (row < png_ptr->height)
+      png_error(png_ptr, "Not enough image data");
+
+   png_ptr->zowner = 0;
+   png_ptr->mode |= PNG_AFTER_IDAT;
+   png_ptr->flags |= PNG_FLAG_ZSTREAM_ENDED;
+
+   if (extra != 0)
+      png_chunk_benign_error(png_ptr, "Too much image data");
+
+   else if (png_ptr->zstream.avail_in > 0 || png_ptr->idat_size > 0)
+      png_chunk_benign_error(png_ptr, "Extra compressed data");
+
+   png_ptr->zstream.next_in = NULL;
+   png_ptr->zstream.avail_in = 0;
+   png_ptr->zstream.next_out = NULL;
+   png_crc_finish(png_ptr, png_ptr->idat_size);
+   png_ptr->idat_size = 0;
+
+   *index = png_ptr->row_index;
+   *index_size = png_ptr->row_index_size;
+   png_ptr->row_index = NULL;
+   png_ptr->row_index_size = png_ptr->row_index_max = 0;
+#else
+   PNG_UNUSED(span)
+   PNG_UNUSED(index)
+   PNG_UNUSED(index_size)
+   png_error(png_ptr, "row index requires zlib 1.2.8 or later");
+#endif
+}
+
+void PNGAPI
+png_read_indexed_rows(png_structrp png_ptr, png_const_bytep index,
+    size_t index_size, png_uint_32 y0, png_uint_32 y1, png_bytepp rows)
+{
+   png_const_bytep p, end;
+   png_const_bytep data = NULL;  /* 'D' record of the chosen checkpoint */
+   png_const_bytep point = NULL; /* the checkpoint, NULL for the start */
+   png_off_t data_start = 0, stream_pos = 0, in = 0, out = 0, position;
+   png_uint_32 row = 0, num_rows, crc_flags;
+   size_t rowbytes, row_len, skip;
+   int ret;
+
+   png_debug(1, "in png_read_indexed_rows");
+
+   if (png_ptr == NULL)
+      return;
+
+   if (index == NULL || rows == NULL || y0 >= y1 || y1 > png_ptr->height ||
+       (png_ptr->mode & PNG_HAVE_IDAT) == 0)
+   {
+      png_app_error(png_ptr, "png_read_indexed_rows: invalid arguments");
+      return;
+   }
+
+   if (png_ptr->seek_fn == NULL)
+   {
+      png_app_error(png_ptr, "png_read_indexed_rows: no seek function");
+      return;
+   }
+
+   if (png_ptr->interlaced != 0)
+      png_error(png_ptr, "cannot index an interlaced image");
+
+   if ((png_ptr->flags & PNG_FLAG_ROW_INIT) == 0)
+      png_read_start_row(png_ptr);
+
+   rowbytes = PNG_ROWBYTES(png_ptr->pixel_depth, png_ptr->width);
+   row_len = rowbytes + 1;
+
+   if (index_size < PNG_INDEX_HEADER + PNG_INDEX_DATA_RECORD ||
+       memcmp(index, "PNGx", 4) != 0 ||
+       png_get_uint_32(index + 4) != PNG_INDEX_VERSION ||
+       png_get_uint_32(index + 8) != png_ptr->width ||
+       png_get_uint_32(index + 12) != png_ptr->height ||
+       png_index_get_64(index + 16) != rowbytes)
+      png_error(png_ptr, "row index does not match the image");
+
+   /* Find the last checkpoint at or before row y0, tracking the 'D' record in
+    * effect and its position in the stream as the records are scanned.
+    */
+   p = index + PNG_INDEX_HEADER;
+   end = index + index_size;
+
+   {
+      png_const_bytep cur_data = NULL;
+      png_off_t cur_start = 0;
+
+      while (p < end)
+      {
+         if (*p == 'D')
+         {
+            if ((size_t)(end - p) < PNG_INDEX_DATA_RECORD)
+               break;
+
+            if (cur_data != NULL)
+               stream_pos += png_get_uint_32(cur_data + 9);
+
+            cur_data = p;
+            cur_start = stream_pos;
+
+            if (data == NULL) /* the start of the stream */
+            {
+               data = p;
+               data_start = 0;
+            }
+
+            p += PNG_INDEX_DATA_RECORD;
+         }
+
+         else if (*p == 'C')
+         {
+            size_t window_size;
+
+            if ((size_t)(end - p) < PNG_INDEX_POINT_RECORD || cur_data == NULL)
+               break;
+
+            window_size = ((size_t)p[23] << 8) + p[24];
+
+            if ((size_t)(end - p) - PNG_INDEX_POINT_RECORD <
+                window_size + rowbytes)
+               break;
+
+            if (png_get_uint_32(p + 17) > y0)
+               break;
+
+            point = p;
+            data = cur_data;
+            data_start = cur_start;
+            p += PNG_INDEX_POINT_RECORD + window_size + rowbytes;
+         }
+
+         else
+            break;
+      }
+   }
+
+   if (data == NULL)
+      png_error(png_ptr, "row index is damaged");
+
+   if (point != NULL)
+   {
+      in = png_index_get_64(point + 1);
+      out = png_index_get_64(point + 9);
+      row = png_get_uint_32(point + 17);
+
+      if (in < data_start || in - data_start > png_get_uint_32(data + 9) ||
+          out > (png_off_t)row * row_len)
+         png_error(png_ptr, "row index is damaged");
+   }
+
+   /* Reset the inflate stream, either to the zlib header or to a raw deflate
+    * stream positioned at the checkpoint.
+    */
+   if (png_ptr->zowner != png_IDAT &&
+       png_inflate_claim(png_ptr, png_IDAT) != Z_OK)
+      png_error(png_ptr, png_ptr->zstream.msg);
+
+   if (point == NULL)
+   {
+      ret = inflateReset2(&png_ptr->zstream, 0);
+      png_ptr->zstream_start = 1;
+      png_ptr->flags &= ~PNG_FLAG_ZSTREAM_RAW;
+   }
+
+   else
+   {
+      int bits = point[21];
+
+      ret = inflateReset2(&png_ptr->zstream, -15);
+      png_ptr->zstream_start = 0;
+      png_ptr->flags |= PNG_FLAG_ZSTREAM_RAW;
+
+      if (ret == Z_OK && bits != 0)
+         ret = inflatePrime(&png_ptr->zstream, bits, point[22] >> (8 - bits));
+
+      if (ret == Z_OK)
+         ret = inflateSetDictionary(&png_ptr->zstream,
+             point + PNG_INDEX_POINT_RECORD,
+             ((uInt)point[23] << 8) + point[24]);
+   }
+
+   if (ret != Z_OK)
+   {
+      png_zstream_error(png_ptr, ret);
+      png_error(png_ptr, png_ptr->zstream.msg);
+   }
+
+   position = png_index_get_64(data + 1) + (in - data_start);
+
+   if ((*(png_ptr->seek_fn))(png_ptr, position) == 0)
+      png_error(png_ptr, "png_read_indexed_rows: seek failed");
+
+   png_ptr->io_offset = position;
+   png_ptr->idat_size = png_get_uint_32(data + 9) - (png_uint_32)(in -
+       data_start);
+   png_ptr->chunk_name = png_IDAT;
+   png_ptr->zstream.next_in = NULL;
+   png_ptr->zstream.avail_in = 0;
+   png_ptr->flags &= ~PNG_FLAG_ZSTREAM_ENDED;
+
+   /* Reading starts in the middle of a chunk so its CRC cannot be checked. */
+   crc_flags = png_ptr->flags & PNG_FLAG_CRC_CRITICAL_MASK;
+   png_ptr->flags |= PNG_FLAG_CRC_CRITICAL_IGNORE;
+
+   /* Discard the data between the checkpoint and the start of its row. */
+   skip = (size_t)((png_off_t)row * row_len - out);
+
+   while (skip > 0)
+   {
+      size_t len = skip < row_len ? skip : row_len;
+
+      png_read_IDAT_data(png_ptr, png_ptr->row_buf, len);
+      skip -= len;
+   }
+
+   if (point == NULL)
+      memset(png_ptr->prev_row, 0, row_len);
+
+   else
+      memcpy(png_ptr->prev_row + 1, point + PNG_INDEX_POINT_RECORD +
+          ((size_t)point[23] << 8) + point[24], rowbytes);
+
+   /* Rows before y0 are only unfiltered. */
+   if (row < y0)
+   {
+      png_row_info row_info;
+
+      row_info.width = png_ptr->width;
+      row_info.color_type = png_ptr->color_type;
+      row_info.bit_depth = png_ptr->bit_depth;
+      row_info.channels = png_ptr->channels;
+      row_info.pixel_depth = png_ptr->pixel_depth;
+      row_info.rowbytes = rowbytes;
+
+      do
+      {
+         png_byte filter;
+
+         png_read_IDAT_data(png_ptr, png_ptr->row_buf, row_len);
+         filter = png_ptr->row_buf[0];
+
+         if (filter > PNG_FILTER_VALUE_NONE)
+         {
+            if (filter >= PNG_FILTER_VALUE_LAST)
+               png_error(png_ptr, "bad adaptive filter value");
+
+            png_read_filter_row(png_ptr, &row_info, png_ptr->row_buf + 1,
+                png_ptr->prev_row + 1, filter);
+         }
+
+         memcpy(png_ptr->prev_row, png_ptr->row_buf, row_len);
+      }
+      while (++row < y0);
+   }
+
+   /* The requested rows go through the normal row reader, so the
+    * application's transformations are applied.  num_rows is raised to stop
+    * png_read_finish_row reading on to the end of the stream after the last
+    * row; a raw deflate stream has no Adler-32 to check there.
+    */
+   num_rows = png_ptr->num_rows;
+   png_ptr->num_rows = PNG_UINT_32_MAX;
+   png_ptr->row_number = y0;
+
+   for (row = y0; row < y1; ++row)
+      png_read_row(png_ptr, rows[row - y0], NULL);
+
+   /* The input is left part way through the image data, so release the
+    * zstream and treat the image data as finished.
+    */
+   png_ptr->num_rows = num_rows;
+   png_ptr->row_number = 0;
+   png_ptr->zowner = 0;
+   png_ptr->zstream.next_in = NULL;
+   png_ptr->zstream.avail_in = 0;
+   png_ptr->zstream.next_out = NULL;
+   png_ptr->idat_size = 0;
+   png_ptr->mode |= PNG_AFTER_IDAT;
+   png_ptr->flags |= PNG_FLAG_ZSTREAM_ENDED;
+   png_ptr->flags &= ~PNG_FLAG_ZSTREAM_RAW;
+   png_ptr->flags = (png_ptr->flags & ~PNG_FLAG_CRC_CRITICAL_MASK) | crc_flags;
+}
@@ -19,6 +19,8 @@
  */
 
 #include <pngdebug.h>
+#include <rutil.h>
+#include <stats.h>
 
 #include "pngpriv.h"
 
@@ -31,6 +33,8 @@
 void /* PRIVATE */
 png_read_data(png_structrp png_ptr, png_bytep data, size_t length)
 {
+   png_off_t stat_start = png_stats_begin(png_ptr);
+
    png_debug1(4, "reading %d bytes", (int)length);
 
    if (png_ptr->read_data_fn != NULL)
@@ -38,6 +42,42 @@ png_read_data(png_structrp png_ptr, png_bytep data, size_t length)
 
    else
       png_error(png_ptr, "Call to NULL read function");
+
+   png_ptr->io_offset += length;
+   png_stats_end(png_ptr, PNG_STAT_READ_DATA, stat_start, length);
+}
+
+/* Skip over input that will not be used.  If the application has supplied a
+ * seek function it is tried first, otherwise (or if it fails) the data is read
+ * and thrown away.  The CRC is not updated.
+ */
+void /* PRIVATE */
+png_skip_data(png_structrp png_ptr, png_uint_32 length)
+{
+   png_debug1(4, "skipping %lu bytes", (unsigned long)length);
+
+   if (length == 0)
+      return;
+
+   if (png_ptr->seek_fn != NULL &&
+       (*(png_ptr->seek_fn))(png_ptr, png_ptr->io_offset + length) != 0)
+   {
+      png_ptr->io_offset += length;
+      return;
+   }
+
+   while (length > 0)
+   {
+      png_uint_32 len;
+      png_byte tmpbuf[PNG_INFLATE_BUF_SIZE];
+
+      len = (sizeof tmpbuf);
+      if (len > length)
+         len = length;
+      length -= len;
+
+      png_read_data(png_ptr, tmpbuf, len);
+   }
 }
 
 /* This is the function that does the actual reading of data.  If you are
@@ -106,3 +146,16 @@ png_set_read_fn(png_structrp png_ptr, png_voidp io_ptr,
 
    png_ptr->output_flush_fn = NULL;
 }
+
+/* This function allows the application to supply a function that repositions
+ * the input.  It is only used to skip data libpng has been told it does not
+ * need; a NULL seek_fn restores the default of reading and discarding.
+ */
+void PNGAPI
+png_set_seek_fn(png_structrp png_ptr, png_seek_ptr seek_fn)
+{
+   if (png_ptr == NULL)
+      return;
+
+   png_ptr->seek_fn = seek_fn;
+}
@@ -19,6 +19,9 @@
 #include <pngerror.h>
 #include <pngdebug.h>
 #include <trans.h>
+#include <quant.h>
+#include <stats.h>
+#include <work.h>
 
 #include "pngpriv.h"
 
@@ -394,32 +397,36 @@ png_set_alpha_mode(png_structrp png_ptr, int mode, double output_gamma)
  * whether we need a quantizing cube set up for RGB images, or if we
  * simply are reducing the number of colors in a paletted image.
  */
-
-typedef struct png_dsort_struct
-{
-   struct png_dsort_struct * next;
-   png_byte left;
-   png_byte right;
-} png_dsort;
-typedef png_dsort *   png_dsortp;
-typedef png_dsort * * png_dsortpp;
-
 void PNGAPI
 png_set_quantize(png_structrp png_ptr, png_colorp palette,
     int num_palette, int maximum_colors, png_const_uint_16p histogram,
     int full_quantize)
 {
+   png_quant_treep tree;
+
    png_debug(1, "in png_set_quantize");
 
    if (png_rtran_ok(png_ptr, 0) == 0)
       return;
 
+   if (num_palette < 1 || num_palette > PNG_MAX_PALETTE_LENGTH ||
+       maximum_colors < 1)
+   {
+      png_app_error(png_ptr, "png_set_quantize: invalid palette size");
+      return;
+   }
+
    png_ptr->transformations |= PNG_QUANTIZE;
 
+   png_free(png_ptr, png_ptr->quantize_tree);
+   png_ptr->quantize_tree = tree = (png_quant_treep)png_malloc(png_ptr,
+       sizeof *tree);
+
    if (full_quantize == 0)
    {
       int i;
 
+      png_free(png_ptr, png_ptr->quantize_index);
       png_ptr->quantize_index = (png_bytep)png_malloc(png_ptr,
           (size_t)((png_uint_32)num_palette * (sizeof (png_byte))));
       for (i = 0; i < num_palette; i++)
@@ -428,301 +435,39 @@ png_set_quantize(png_structrp png_ptr, png_colorp palette,
 
    if (num_palette > maximum_colors)
    {
-      if (histogram != NULL)
-      {
-         /* This is easy enough, just throw out the least used colors.
-          * Perhaps not the best solution, but good enough.
-          */
-
-         int i;
-
-         /* Initialize an array to sort colors */
-         png_ptr->quantize_sort = (png_bytep)png_malloc(png_ptr,
-             (size_t)((png_uint_32)num_palette * (sizeof (png_byte))));
-
-         /* Initialize the quantize_sort array */
-         for (i = 0; i < num_palette; i++)
-            png_ptr->quantize_sort[i] = (png_byte)i;
-
-         /* Find the least used palette entries by starting a
-          * bubble sort, and running it until we have sorted
-          * out enough colors.  Note that we don't care about
-          * sorting all the colors, just finding which are
-          * least used.
-          */
-
-         for (i = num_palette - 1; i >= maximum_colors; i--)
-         {
-            int done; /* To stop early if the list is pre-sorted */
-            int j;
-
-            done = 1;
-            for (j = 0; j < i; j++)
-            {
-               if (histogram[png_ptr->quantize_sort[j]]
-                   < histogram[png_ptr->quantize_sort[j + 1]])
-               {
-                  png_byte t;
-
-                  t = png_ptr->quantize_sort[j];
-                  png_ptr->quantize_sort[j] = png_ptr->quantize_sort[j + 1];
-                  png_ptr->quantize_sort[j + 1] = t;
-                  done = 0;
-               }
-            }
-
-            if (done != 0)
-               break;
-         }
-
-         /* Swap the palette around, and set up a table, if necessary */
-         if (full_quantize != 0)
-         {
-            int j = num_palette;
-
-            /* Put all the useful colors within the max, but don't
-             * move the others.
-             */
-            for (i = 0; i < maximum_colors; i++)
-            {
-               if ((int)png_ptr->quantize_sort[i] >= maximum_colors)
-               {
-                  do
-                     j--;
-                  while ((int)png_ptr->quantize_sort[j] >= maximum_colors);
-
-                  palette[i] = palette[j];
-               }
-            }
-         }
-         else
-         {
-            int j = num_palette;
-
-            /* Move all the used colors inside the max limit, and
-             * develop a translation table.
-             */
-            for (i = 0; i < maximum_colors; i++)
-            {
-               /* Only move the colors we need to */
-               if ((int)png_ptr->quantize_sort[i] >= maximum_colors)
-               {
-                  png_color tmp_color;
-
-                  do
-                     j--;
-                  while ((int)png_ptr->quantize_sort[j] >= maximum_colors);
-
-                  tmp_color = palette[j];
-                  palette[j] = palette[i];
-                  palette[i] = tmp_color;
-                  /* Indicate where the color went */
-                  png_ptr->quantize_index[j] = (png_byte)i;
-                  png_ptr->quantize_index[i] = (png_byte)j;
-               }
-            }
-
-            /* Find closest color for those colors we are not using */
-            for (i = 0; i < num_palette; i++)
-            {
-               if ((int)png_ptr->quantize_index[i] >= maximum_colors)
-               {
-                  int min_d, k, min_k, d_index;
-
-                  /* Find the closest color to one we threw out */
-                  d_index = png_ptr->quantize_index[i];
-                  min_d = PNG_COLOR_DIST(palette[d_index], palette[0]);
-                  for (k = 1, min_k = 0; k < maximum_colors; k++)
-                  {
-                     int d;
-
-                     d = PNG_COLOR_DIST(palette[d_index], palette[k]);
+      /* Replace the palette with a median cut of its colors, weighted by the
+       * histogram if there is one, then point each of the original colors at
+       * the nearest new one.
+       */
+      png_quant_color colors[PNG_MAX_PALETTE_LENGTH];
+      png_color original[PNG_MAX_PALETTE_LENGTH];
+      int num_original = num_palette;
+      int i;
 
-                     if (d < min_d)
-                     {
-                        min_d = d;
-                        min_k = k;
-                     }
-                  }
-                  /* Point to closest color */
-                  png_ptr->quantize_index[i] = (png_byte)min_k;
-               }
-            }
-         }
-         png_free(png_ptr, png_ptr->quantize_sort);
-         png_ptr->quantize_sort = NULL;
-      }
-      else
+      for (i = 0; i < num_palette; i++)
       {
-         /* This is much harder to do simply (and quickly).  Perhaps
-          * we need to go through a median cut routine, but those
-          * don't always behave themselves with only a few colors
-          * as input.  So we will just find the closest two colors,
-          * and throw out one of them (chosen somewhat randomly).
-          * [We don't understand this at all, so if someone wants to
-          *  work on improving it, be our guest - AED, GRP]
-          */
-         int i;
-         int max_d;
-         int num_new_palette;
-         png_dsortp t;
-         png_dsortpp hash;
-
-         t = NULL;
-
-         /* Initialize palette index arrays */
-         png_ptr->index_to_palette = (png_bytep)png_malloc(png_ptr,
-             (size_t)((png_uint_32)num_palette *
-             (sizeof (png_byte))));
-         png_ptr->palette_to_index = (png_bytep)png_malloc(png_ptr,
-             (size_t)((png_uint_32)num_palette *
-             (sizeof (png_byte))));
-
-         /* Initialize the sort array */
-         for (i = 0; i < num_palette; i++)
-         {
-            png_ptr->index_to_palette[i] = (png_byte)i;
-            png_ptr->palette_to_index[i] = (png_byte)i;
-         }
-
-         hash = (png_dsortpp)png_calloc(png_ptr, (size_t)(769 *
-             (sizeof (png_dsortp))));
-
-         num_new_palette = num_palette;
-
-         /* Initial wild guess at how far apart the farthest pixel
-          * pair we will be eliminating will be.  Larger
-          * numbers mean more areas will be allocated, Smaller
-          * numbers run the risk of not saving enough data, and
-          * having to do this all over again.
-          *
-          * I have not done extensive checking on this number.
-          */
-         max_d = 96;
-
-         while (num_new_palette > maximum_colors)
-         {
-            for (i = 0; i < num_new_palette - 1; i++)
-            {
-               int j;
-
-               for (j = i + 1; j < num_new_palette; j++)
-               {
-                  int d;
-
-                  d = PNG_COLOR_DIST(palette[i], palette[j]);
-
-                  if (d <= max_d)
-                  {
-
-                     t = (png_dsortp)png_malloc_warn(png_ptr,
-                         (size_t)(sizeof (png_dsort)));
-
-                     if (t == NULL)
-                         break;
-
-                     t->next = hash[d];
-                     t->left = (png_byte)i;
-                     t->right = (png_byte)j;
-                     hash[d] = t;
-                  }
-               }
-               if (t == NULL)
-                  break;
-            }
+         original[i] = palette[i];
+         colors[i].r = palette[i].red;
+         colors[i].g = palette[i].green;
+         colors[i].b = palette[i].blue;
+         colors[i].weight = histogram != NULL ? histogram[i] : 1;
+      }
 
-            if (t != NULL)
-            for (i = 0; i <= max_d; i++)
-            {
-               if (hash[i] != NULL)
-               {
-                  png_dsortp p;
+      num_palette = png_quant_palette(png_ptr, colors,
+          (png_uint_32)num_palette, palette, maximum_colors);
 
-                  for (p = hash[i]; p; p = p->next)
-                  {
-                     if ((int)png_ptr->index_to_palette[p->left]
-                         < num_new_palette &&
-                         (int)png_ptr->index_to_palette[p->right]
-                         < num_new_palette)
-                     {
-                        int j, next_j;
-
-                        if (num_new_palette & 0x01)
-                        {
-                           j = p->left;
-                           next_j = p->right;
-                        }
-                        else
-                        {
-                           j = p->right;
-                           next_j = p->left;
-                        }
-
-                        num_new_palette--;
-                        palette[png_ptr->index_to_palette[j]]
-                            = palette[num_new_palette];
-                        if (full_quantize == 0)
-                        {
-                           int k;
-
-                           for (k = 0; k < num_palette; k++)
-                           {
-                              if (png_ptr->quantize_index[k] ==
-                                  png_ptr->index_to_palette[j])
-                                 png_ptr->quantize_index[k] =
-                                     png_ptr->index_to_palette[next_j];
-
-                              if ((int)png_ptr->quantize_index[k] ==
-                                  num_new_palette)
-                                 png_ptr->quantize_index[k] =
-                                     png_ptr->index_to_palette[j];
-                           }
-                        }
-
-                        png_ptr->index_to_palette[png_ptr->palette_to_index
-                            [num_new_palette]] = png_ptr->index_to_palette[j];
-
-                        png_ptr->palette_to_index[png_ptr->index_to_palette[j]]
-                            = png_ptr->palette_to_index[num_new_palette];
-
-                        png_ptr->index_to_palette[j] =
-                            (png_byte)num_new_palette;
-
-                        png_ptr->palette_to_index[num_new_palette] =
-                            (png_byte)j;
-                     }
-                     if (num_new_palette <= maximum_colors)
-                        break;
-                  }
-                  if (num_new_palette <= maximum_colors)
-                     break;
-               }
-            }
+      if (full_quantize == 0)
+      {
+         png_quant_tree_init(tree, palette, num_palette);
 
-            for (i = 0; i < 769; i++)
-            {
-               if (hash[i] != NULL)
-               {
-                  png_dsortp p = hash[i];
-                  while (p)
-                  {
-                     t = p->next;
-                     png_free(png_ptr, p);
-                     p = t;
-                  }
-               }
-               hash[i] = 0;
-            }
-            max_d += 96;
-         }
-         png_free(png_ptr, hash);
-         png_free(png_ptr, png_ptr->palette_to_index);
-         png_free(png_ptr, png_ptr->index_to_palette);
-         png_ptr->palette_to_index = NULL;
-         png_ptr->index_to_palette = NULL;
+         for (i = 0; i < num_original; i++)
+            png_ptr->quantize_index[i] = (png_byte)png_quant_nearest(tree,
+                original[i].red, original[i].green, original[i].blue);
       }
-      num_palette = maximum_colors;
    }
+
+   png_quant_tree_init(tree, palette, num_palette);
+
    if (png_ptr->palette == NULL)
    {
       png_ptr->palette = palette;
@@ -731,67 +476,49 @@ png_set_quantize(png_structrp png_ptr, png_colorp palette,
 
    if (full_quantize != 0)
    {
-      int i;
-      png_bytep distance;
-      int total_bits = PNG_QUANTIZE_RED_BITS + PNG_QUANTIZE_GREEN_BITS +
-          PNG_QUANTIZE_BLUE_BITS;
-      int num_red = (1 << PNG_QUANTIZE_RED_BITS);
-      int num_green = (1 << PNG_QUANTIZE_GREEN_BITS);
-      int num_blue = (1 << PNG_QUANTIZE_BLUE_BITS);
-      size_t num_entries = ((size_t)1 << total_bits);
-
-      png_ptr->palette_lookup = (png_bytep)png_calloc(png_ptr,
+      /* The lookup gives the palette entry nearest the center of each cell. */
+      int ir, ig, ib;
+      size_t num_entries = (size_t)1 << (PNG_QUANTIZE_RED_BITS +
+          PNG_QUANTIZE_GREEN_BITS + PNG_QUANTIZE_BLUE_BITS);
+      png_bytep lookup;
+
+      png_free(png_ptr, png_ptr->palette_lookup);
+      png_ptr->palette_lookup = lookup = (png_bytep)png_malloc(png_ptr,
           (size_t)(num_entries * (sizeof (png_byte))));
 
-      distance = (png_bytep)png_malloc(png_ptr, (size_t)(num_entries *
-          (sizeof (png_byte))));
-
-      memset(distance, 0xff, num_entries * (sizeof (png_byte)));
-
-      for (i = 0; i < num_palette; i++)
+      for (ir = 0; ir < (1 << PNG_QUANTIZE_RED_BITS); ir++)
       {
-         int ir, ig, ib;
-         int r = (palette[i].red >> (8 - PNG_QUANTIZE_RED_BITS));
-         int g = (palette[i].green >> (8 - PNG_QUANTIZE_GREEN_BITS));
-         int b = (palette[i].blue >> (8 - PNG_QUANTIZE_BLUE_BITS));
+         int r = (ir << (8 - PNG_QUANTIZE_RED_BITS)) +
+             ((1 << (8 - PNG_QUANTIZE_RED_BITS)) >> 1);
 
-         for (ir = 0; ir < num_red; ir++)
+         for (ig = 0; ig < (1 << PNG_QUANTIZE_GREEN_BITS); ig++)
          {
-            /* int dr = abs(ir - r); */
-            int dr = ((ir > r) ? ir - r : r - ir);
-            int index_r = (ir << (PNG_QUANTIZE_BLUE_BITS +
-                PNG_QUANTIZE_GREEN_BITS));
+            int g = (ig << (8 - PNG_QUANTIZE_GREEN_BITS)) +
+                ((1 << (8 - PNG_QUANTIZE_GREEN_BITS)) >> 1);
 
-            for (ig = 0; ig < num_green; ig++)
+            for (ib = 0; ib < (1 << PNG_QUANTIZE_BLUE_BITS); ib++)
             {
-               /* int dg = abs(ig - g); */
-               int dg = ((ig > g) ? ig - g : g - ig);
-               int dt = dr + dg;
-               int dm = ((dr > dg) ? dr : dg);
-               int index_g = index_r | (ig << PNG_QUANTIZE_BLUE_BITS);
-
-               for (ib = 0; ib < num_blue; ib++)
-               {
-                  int d_index = index_g | ib;
-                  /* int db = abs(ib - b); */
-                  int db = ((ib > b) ? ib - b : b - ib);
-                  int dmax = ((dm > db) ? dm : db);
-                  int d = dmax + dt + db;
+               int b = (ib << (8 - PNG_QUANTIZE_BLUE_BITS)) +
+                   ((1 << (8 - PNG_QUANTIZE_BLUE_BITS)) >> 1);
 
-                  if (d < (int)distance[d_index])
-                  {
-                     distance[d_index] = (png_byte)d;
-                     png_ptr->palette_lookup[d_index] = (png_byte)i;
-                  }
-               }
+               *lookup++ = (png_byte)png_quant_nearest(tree, r, g, b);
             }
          }
       }
-
-      png_free(png_ptr, distance);
    }
 }
 
+void PNGAPI
+png_set_quantize_dither(png_structrp png_ptr, int dither)
+{
+   png_debug(1, "in png_set_quantize_dither");
+
+   if (png_rtran_ok(png_ptr, 0) == 0)
+      return;
+
+   png_ptr->quantize_dither = dither != 0;
+}
+
 void PNGAPI
 png_set_gamma_fixed(png_structrp png_ptr, png_fixed_point scrn_gamma,
     png_fixed_point file_gamma)
@@ -4497,6 +4224,34 @@ png_do_quantize(png_row_infop row_info, png_bytep row,
    }
 }
 
+/* As png_do_quantize for RGB rows, but Floyd-Steinberg dithered and mapped to
+ * the exact nearest palette color.  The error carries over from one row to the
+ * next only if the rows are consecutive.
+ */
+static void
+png_do_quantize_dither(png_structrp png_ptr, png_row_infop row_info,
+    png_bytep row)
+{
+   size_t size = 6 * ((size_t)png_ptr->width + 2) * (sizeof (png_int_32));
+
+   png_debug(1, "in png_do_quantize_dither");
+
+   if (png_ptr->quantize_error == NULL)
+      png_ptr->quantize_error = (png_int_32*)png_calloc(png_ptr, size);
+
+   else if (png_ptr->row_number != png_ptr->quantize_error_row)
+      memset(png_ptr->quantize_error, 0, size);
+
+   png_quant_map_row(png_ptr->quantize_tree, NULL, row, row, row_info->width,
+       row_info->channels, 0/*rgb*/, png_ptr->quantize_error);
+   png_ptr->quantize_error_row = png_ptr->row_number + 1;
+
+   row_info->color_type = PNG_COLOR_TYPE_PALETTE;
+   row_info->channels = 1;
+   row_info->pixel_depth = row_info->bit_depth;
+   row_info->rowbytes = PNG_ROWBYTES(row_info->pixel_depth, row_info->width);
+}
+
 /* Transform the row.  The order of transformations is significant,
  * and is very touchy.  If you add a transformation, take care to
  * decide how it fits in with the other transformations here.
@@ -4504,6 +4259,8 @@ png_do_quantize(png_row_infop row_info, png_bytep row,
 void /* PRIVATE */
 png_do_read_transformations(png_structrp png_ptr, png_row_infop row_info)
 {
+   png_off_t stat_start = png_stats_begin(png_ptr);
+
    png_debug(1, "in png_do_read_transformations");
 
    if (png_ptr->row_buf == NULL)
@@ -4668,8 +4425,15 @@ png_do_read_transformations(png_structrp png_ptr, png_row_infop row_info)
 
    if ((png_ptr->transformations & PNG_QUANTIZE) != 0)
    {
-      png_do_quantize(row_info, png_ptr->row_buf + 1,
-          png_ptr->palette_lookup, png_ptr->quantize_index);
+      if (png_ptr->quantize_dither != 0 && png_ptr->palette_lookup != NULL &&
+          row_info->bit_depth == 8 &&
+          (row_info->color_type == PNG_COLOR_TYPE_RGB ||
+          row_info->color_type == PNG_COLOR_TYPE_RGB_ALPHA))
+         png_do_quantize_dither(png_ptr, row_info, png_ptr->row_buf + 1);
+
+      else
+         png_do_quantize(row_info, png_ptr->row_buf + 1,
+             png_ptr->palette_lookup, png_ptr->quantize_index);
 
       if (row_info->rowbytes == 0)
          png_error(png_ptr, "png_do_quantize returned rowbytes=0");
@@ -4745,4 +4509,8 @@ png_do_read_transformations(png_structrp png_ptr, png_row_infop row_info)
 
       row_info->rowbytes = PNG_ROWBYTES(row_info->pixel_depth, row_info->width);
    }
+
+   png_stats_end(png_ptr, PNG_STAT_READ_TRANSFORM, stat_start,
+       row_info->rowbytes);
+   png_work_charge(png_ptr, PNG_WORK_PIXELS, row_info->width);
 }
@@ -20,11 +20,15 @@
 #include <pngdebug.h>
 #include <trans.h>
 #include <wutil.h>
+#include <iccache.h>
+#include <stats.h>
+#include <pngtrace.h>
+#include <work.h>
 
 #include "pngpriv.h"
 
 static int
-png_crc_error (png_structrp png_ptr);
+png_crc_error (png_structrp png_ptr, png_bytep crc_bytes);
 
  png_uint_32 PNGAPI
 png_get_uint_31(png_const_structrp png_ptr, png_const_bytep buf)
@@ -126,6 +130,11 @@ png_read_sig(png_structrp png_ptr, png_inforp info_ptr)
 {
    size_t num_checked, num_to_check;
 
+   /* Offsets in the datastream are measured from the start of the signature,
+    * including any bytes the application has already read.
+    */
+   png_ptr->io_offset = png_ptr->sig_bytes;
+
    /* Exit if the user application does not expect a signature. */
    if (png_ptr->sig_bytes >= 8)
       return;
@@ -185,6 +194,8 @@ png_read_chunk_header(png_structrp png_ptr)
    png_check_chunk_length(png_ptr, length);
 
    png_ptr->io_state = PNG_IO_READING | PNG_IO_CHUNK_DATA;
+   png_trace3(chunk__start, png_ptr, png_ptr->chunk_name, length);
+   png_work_charge(png_ptr, PNG_WORK_CHUNK, 1);
 
    return length;
 }
@@ -205,8 +216,8 @@ png_crc_read(png_structrp png_ptr, png_bytep buf, png_uint_32 length)
  * things up, we may calculate the CRC on the data and print a message.
  * Returns '1' if there was a CRC error, '0' otherwise.
  */
-int /* PRIVATE */
-png_crc_finish(png_structrp png_ptr, png_uint_32 skip)
+static int
+png_crc_check(png_structrp png_ptr, png_uint_32 skip, png_bytep crc_bytes)
 {
    /* The size of the local buffer for inflate is a good guess as to a
     * reasonable size to use for buffering reads from the application.
@@ -224,7 +235,7 @@ png_crc_finish(png_structrp png_ptr, png_uint_32 skip)
       png_crc_read(png_ptr, tmpbuf, len);
    }
 
-   if (png_crc_error(png_ptr) != 0)
+   if (png_crc_error(png_ptr, crc_bytes) != 0)
    {
       if (PNG_CHUNK_ANCILLARY(png_ptr->chunk_name) != 0 ?
           (png_ptr->flags & PNG_FLAG_CRC_ANCILLARY_NOWARN) == 0 :
@@ -236,19 +247,37 @@ png_crc_finish(png_structrp png_ptr, png_uint_32 skip)
       else
          png_chunk_error(png_ptr, "CRC error");
 
+      png_trace3(chunk__end, png_ptr, png_ptr->chunk_name, 1);
       return (1);
    }
 
+   png_trace3(chunk__end, png_ptr, png_ptr->chunk_name, 0);
    return (0);
 }
 
+int /* PRIVATE */
+png_crc_finish(png_structrp png_ptr, png_uint_32 skip)
+{
+   png_byte crc_bytes[4];
+
+   return png_crc_check(png_ptr, skip, crc_bytes);
+}
+
+/* As png_crc_finish(png_ptr, 0), but the four CRC bytes read from the file are
+ * also returned, for code that copies the chunk as it is.
+ */
+int /* PRIVATE */
+png_crc_finish_copy(png_structrp png_ptr, png_bytep crc_bytes)
+{
+   return png_crc_check(png_ptr, 0, crc_bytes);
+}
+
 /* Compare the CRC stored in the PNG file with that calculated by libpng from
  * the data it has read thus far.
  */
 static int
-png_crc_error(png_structrp png_ptr)
+png_crc_error(png_structrp png_ptr, png_bytep crc_bytes)
 {
-   png_byte crc_bytes[4];
    png_uint_32 crc;
    int need_crc = 1;
 
@@ -286,7 +315,7 @@ png_crc_error(png_structrp png_ptr)
  * it will call png_error (via png_malloc) on failure.  (warn == 2 means
  * 'silent').
  */
-static png_bytep
+png_bytep /* PRIVATE */
 png_read_buffer(png_structrp png_ptr, size_t new_size, int warn)
 {
    png_bytep buffer = png_ptr->read_buffer;
@@ -328,7 +357,7 @@ png_read_buffer(png_structrp png_ptr, size_t new_size, int warn)
  * the owner but, in final release builds, just issues a warning if some other
  * chunk apparently owns the stream.  Prior to release it does a png_error.
  */
-static int
+int /* PRIVATE */
 png_inflate_claim(png_structrp png_ptr, png_uint_32 owner)
 {
    if (png_ptr->zowner != 0)
@@ -442,6 +471,10 @@ png_inflate_claim(png_structrp png_ptr, png_uint_32 owner)
 int /* PRIVATE */
 png_zlib_inflate(png_structrp png_ptr, int flush)
 {
+   png_off_t stat_start;
+   uInt avail_in, avail_out;
+   int ret;
+
    if (png_ptr->zstream_start && png_ptr->zstream.avail_in > 0)
    {
       if ((*png_ptr->zstream.next_in >> 4) > 7)
@@ -453,7 +486,19 @@ png_zlib_inflate(png_structrp png_ptr, int flush)
       png_ptr->zstream_start = 0;
    }
 
-   return inflate(&png_ptr->zstream, flush);
+   stat_start = png_stats_begin(png_ptr);
+   avail_in = png_ptr->zstream.avail_in;
+   avail_out = png_ptr->zstream.avail_out;
+   ret = inflate(&png_ptr->zstream, flush);
+   png_stats_end(png_ptr, PNG_STAT_INFLATE, stat_start,
+       avail_out - png_ptr->zstream.avail_out);
+   png_trace5(inflate, png_ptr, png_ptr->zowner,
+       avail_in - png_ptr->zstream.avail_in,
+       avail_out - png_ptr->zstream.avail_out, ret);
+   png_work_charge(png_ptr, PNG_WORK_INFLATE,
+       avail_out - png_ptr->zstream.avail_out);
+
+   return ret;
 }
 #endif /* Zlib >= 1.2.4 */
 
@@ -1262,6 +1307,86 @@ png_handle_sRGB(png_structrp png_ptr, png_inforp info_ptr, png_uint_32 length)
    png_colorspace_sync(png_ptr, info_ptr);
 }
 
+/* The last step of reading a valid iCCP chunk, whether the profile was
+ * decompressed or came from the ICC cache: check it against the known sRGB
+ * profiles and give it to info_ptr.  Returns NULL or an error message.
+ */
+static png_const_charp
+png_iCCP_set(png_structrp png_ptr, png_inforp info_ptr, png_const_charp keyword,
+    uInt keyword_length, png_bytep profile, png_uint_32 profile_length,
+    png_uint_32 adler)
+{
+   png_const_charp errmsg = NULL;
+
+# if  PNG_sRGB_PROFILE_CHECKS >= 0
+   /* Check for a match against sRGB */
+   png_icc_set_sRGB(png_ptr, &png_ptr->colorspace, profile, adler);
+# else
+   PNG_UNUSED(adler)
+# endif
+
+   /* Steal the profile for info_ptr. */
+   if (info_ptr != NULL)
+   {
+      png_free_data(png_ptr, info_ptr, PNG_FREE_ICCP, 0);
+
+      info_ptr->iccp_name = (char*)png_malloc_base(png_ptr, keyword_length+1);
+      if (info_ptr->iccp_name != NULL)
+      {
+         memcpy(info_ptr->iccp_name, keyword, keyword_length+1);
+         info_ptr->iccp_proflen = profile_length;
+         info_ptr->iccp_profile = profile;
+         png_ptr->read_buffer = NULL; /*steal*/
+         info_ptr->free_me |= PNG_FREE_ICCP;
+         info_ptr->valid |= PNG_INFO_iCCP;
+      }
+
+      else
+      {
+         png_ptr->colorspace.flags |= PNG_COLORSPACE_INVALID;
+         errmsg = "out of memory";
+      }
+   }
+
+   /* else the profile remains in the read buffer which gets reused for
+    * subsequent chunks.
+    */
+
+   if (info_ptr != NULL)
+      png_colorspace_sync(png_ptr, info_ptr);
+
+   return errmsg;
+}
+
+/* With the ICC cache enabled the whole compressed profile is read into
+ * png_ptr->iccp_data, so that it can be looked up, and the caller inflates it
+ * from there on a miss.  Returns 0 if the chunk is left in the stream.
+ */
+static int
+png_iCCP_read_data(png_structrp png_ptr, png_const_bytep data,
+    uInt data_length, png_uint_32 length)
+{
+   size_t limit = png_icc_cache_limit();
+   png_bytep buffer;
+
+   png_free(png_ptr, png_ptr->iccp_data);
+   png_ptr->iccp_data = NULL;
+
+   if (limit == 0 || length > limit || data_length > limit - length)
+      return 0;
+
+   buffer = (png_bytep)png_malloc_base(png_ptr, data_length + length);
+
+   if (buffer == NULL)
+      return 0;
+
+   png_ptr->iccp_data = buffer;
+   png_ptr->iccp_data_size = data_length + length;
+   memcpy(buffer, data, data_length);
+   png_crc_read(png_ptr, buffer + data_length, length);
+   return 1;
+}
+
 void /* PRIVATE */
 png_handle_iCCP(png_structrp png_ptr, png_inforp info_ptr, png_uint_32 length)
 /* Note: this does not properly handle profiles that are > 64K under DOS */
@@ -1347,15 +1472,60 @@ png_handle_iCCP(png_structrp png_ptr, png_inforp info_ptr, png_uint_32 length)
          if (keyword_length+1 < read_length &&
             keyword[keyword_length+1] == PNG_COMPRESSION_TYPE_BASE)
          {
+            png_const_bytep data = (png_const_bytep)keyword +
+               (keyword_length+2);
+            png_bytep profile;
+            png_uint_32 profile_length, adler;
+
             read_length -= keyword_length+2;
 
-            if (png_inflate_claim(png_ptr, png_iCCP) == Z_OK)
+            if (png_iCCP_read_data(png_ptr, data, read_length, length) != 0)
+            {
+               data = png_ptr->iccp_data;
+               read_length = (uInt)png_ptr->iccp_data_size;
+               length = 0;
+            }
+
+            /* A profile from the ICC cache has been through all of these
+             * checks before, but they depend on the color type and the
+             * application limits, so make the cheap ones again.
+             */
+            if (png_ptr->iccp_data != NULL &&
+                (profile = png_icc_cache_find(png_ptr, data, read_length,
+                &profile_length, &adler)) != NULL)
+            {
+               png_crc_finish(png_ptr, 0);
+               finished = 1;
+
+               if (png_icc_check_length(png_ptr, &png_ptr->colorspace,
+                   keyword, profile_length) != 0 &&
+                   png_icc_check_header(png_ptr, &png_ptr->colorspace,
+                   keyword, profile_length, profile,
+                   png_ptr->color_type) != 0 &&
+                   png_icc_check_tag_table(png_ptr, &png_ptr->colorspace,
+                   keyword, profile_length, profile) != 0)
+               {
+                  errmsg = png_iCCP_set(png_ptr, info_ptr, keyword,
+                      keyword_length, profile, profile_length, adler);
+
+                  if (errmsg == NULL)
+                  {
+                     png_free(png_ptr, png_ptr->iccp_data);
+                     png_ptr->iccp_data = NULL;
+                     return;
+                  }
+               }
+
+               /* else a check output an error */
+            }
+
+            else if (png_inflate_claim(png_ptr, png_iCCP) == Z_OK)
             {
                Byte profile_header[132]={0};
                Byte local_buffer[PNG_INFLATE_BUF_SIZE];
                size_t size = (sizeof profile_header);
 
-               png_ptr->zstream.next_in = (Bytef*)keyword + (keyword_length+2);
+               png_ptr->zstream.next_in = data;
                png_ptr->zstream.avail_in = read_length;
                (void)png_inflate_read(png_ptr, local_buffer,
                    (sizeof local_buffer), &length, profile_header, &size,
@@ -1365,7 +1535,7 @@ png_handle_iCCP(png_structrp png_ptr, png_inforp info_ptr, png_uint_32 length)
                {
                   /* We have the ICC profile header; do the basic header checks.
                    */
-                  png_uint_32 profile_length = png_get_uint_32(profile_header);
+                  profile_length = png_get_uint_32(profile_header);
 
                   if (png_icc_check_length(png_ptr, &png_ptr->colorspace,
                       keyword, profile_length) != 0)
@@ -1384,8 +1554,8 @@ png_handle_iCCP(png_structrp png_ptr, png_inforp info_ptr, png_uint_32 length)
                          */
                         png_uint_32 tag_count =
                            png_get_uint_32(profile_header + 128);
-                        png_bytep profile = png_read_buffer(png_ptr,
-                            profile_length, 2/*silent*/);
+                        profile = png_read_buffer(png_ptr, profile_length,
+                            2/*silent*/);
 
                         if (profile != NULL)
                         {
@@ -1437,53 +1607,25 @@ png_handle_iCCP(png_structrp png_ptr, png_inforp info_ptr, png_uint_32 length)
                                     png_crc_finish(png_ptr, length);
                                     finished = 1;
 
-# if  PNG_sRGB_PROFILE_CHECKS >= 0
-                                    /* Check for a match against sRGB */
-                                    png_icc_set_sRGB(png_ptr,
-                                        &png_ptr->colorspace, profile,
+                                    /* Keep it unless there was extra data */
+                                    if (png_ptr->iccp_data != NULL &&
+                                        png_ptr->zstream.avail_in == 0)
+                                       png_icc_cache_add(
+                                           png_ptr->iccp_data,
+                                           png_ptr->iccp_data_size, profile,
+                                           profile_length,
+                                           png_ptr->zstream.adler);
+
+                                    errmsg = png_iCCP_set(png_ptr, info_ptr,
+                                        keyword, keyword_length, profile,
+                                        profile_length,
                                         png_ptr->zstream.adler);
-# endif
-
-                                    /* Steal the profile for info_ptr. */
-                                    if (info_ptr != NULL)
-                                    {
-                                       png_free_data(png_ptr, info_ptr,
-                                           PNG_FREE_ICCP, 0);
-
-                                       info_ptr->iccp_name = (char*)
-                                           png_malloc_base(png_ptr,
-                                           keyword_length+1);
-                                       if (info_ptr->iccp_name != NULL)
-                                       {
-                                          memcpy(info_ptr->iccp_name, keyword,
-                                              keyword_length+1);
-                                          info_ptr->iccp_proflen =
-                                              profile_length;
-                                          info_ptr->iccp_profile = profile;
-                                          png_ptr->read_buffer = NULL; /*steal*/
-                                          info_ptr->free_me |= PNG_FREE_ICCP;
-                                          info_ptr->valid |= PNG_INFO_iCCP;
-                                       }
-
-                                       else
-                                       {
-                                          png_ptr->colorspace.flags |=
-                                             PNG_COLORSPACE_INVALID;
-                                          errmsg = "out of memory";
-                                       }
-                                    }
-
-                                    /* else the profile remains in the read
-                                     * buffer which gets reused for subsequent
-                                     * chunks.
-                                     */
-
-                                    if (info_ptr != NULL)
-                                       png_colorspace_sync(png_ptr, info_ptr);
 
                                     if (errmsg == NULL)
                                     {
                                        png_ptr->zowner = 0;
+                                       png_free(png_ptr, png_ptr->iccp_data);
+                                       png_ptr->iccp_data = NULL;
                                        return;
                                     }
                                  }
@@ -1532,6 +1674,9 @@ png_handle_iCCP(png_structrp png_ptr, png_inforp info_ptr, png_uint_32 length)
    if (finished == 0)
       png_crc_finish(png_ptr, length);
 
+   png_free(png_ptr, png_ptr->iccp_data);
+   png_ptr->iccp_data = NULL;
+
    png_ptr->colorspace.flags |= PNG_COLORSPACE_INVALID;
    png_colorspace_sync(png_ptr, info_ptr);
    if (errmsg != NULL) /* else already output */
@@ -2982,8 +3127,8 @@ png_check_chunk_length(png_const_structrp png_ptr, png_uint_32 length)
  * (dp) is filled from the start by replicating the available pixels.  If
  * 'display' is false only those pixels present in the pass are filled in.
  */
-void /* PRIVATE */
-png_combine_row(png_const_structrp png_ptr, png_bytep dp, int display)
+static void
+png_combine_row_data(png_const_structrp png_ptr, png_bytep dp, int display)
 {
    unsigned int pixel_depth = png_ptr->transformed_pixel_depth;
    png_const_bytep sp = png_ptr->row_buf + 1;
@@ -3458,6 +3603,110 @@ png_combine_row(png_const_structrp png_ptr, png_bytep dp, int display)
       *end_ptr = (png_byte)((end_byte & end_mask) | (*end_ptr & ~end_mask));
 }
 
+void /* PRIVATE */
+png_combine_row(png_const_structrp png_ptr, png_bytep dp, int display)
+{
+   png_off_t stat_start = png_stats_begin(png_ptr);
+
+   png_combine_row_data(png_ptr, dp, display);
+   png_stats_end(png_ptr, PNG_STAT_COMBINE_ROW, stat_start,
+       PNG_ROWBYTES(png_ptr->transformed_pixel_depth, png_ptr->width));
+}
+
+/* Adam7 kernels for whole-byte pixels.  With the pixel size (and for the
+ * replication the pass increment) known at compile time each pixel is a
+ * single load and store, and the replication of small pixels becomes one wide
+ * store; the generic loops above call memcpy per pixel.
+ *
+ * There are no SSE2 or NEON versions.  Only the stride 2 scatter of 8-bit
+ * gray (pass 5) gains much from one, about 4x on the kernel, but for a
+ * 2000x2000 gray image the scatters of all the passes take about 1.2ms of a
+ * 27ms decode and that case would save 0.4ms; wider pixels are already one
+ * store each.
+ */
+template <size_t N>
+static void
+png_adam7_scatter(png_bytep dp, png_const_bytep sp, png_uint_32 count,
+    size_t jump)
+{
+   for (; count > 0; --count, sp += N, dp += jump)
+      memcpy(dp, sp, N);
+}
+
+template <size_t N, unsigned int INC>
+static void
+png_adam7_replicate(png_bytep row, png_uint_32 width)
+{
+   png_const_bytep sp = row + (size_t)width * N;
+   png_bytep dp = row + (size_t)width * INC * N;
+
+   /* Backwards, because the expanded row overwrites the packed one; pixel 0
+    * is read before it is overwritten.
+    */
+   while (sp > row)
+   {
+      png_byte v[N];
+      unsigned int j;
+
+      sp -= N;
+      memcpy(v, sp, N);
+
+      for (j = 0; j < INC; ++j)
+         memcpy(dp - (j + 1) * N, v, N);
+
+      dp -= INC * N;
+   }
+}
+
+template <size_t N>
+static void
+png_adam7_replicate_pass(png_bytep row, png_uint_32 width, int pass)
+{
+   switch (PNG_PASS_COL_OFFSET(pass))
+   {
+      case 8: png_adam7_replicate<N, 8>(row, width); break;
+      case 4: png_adam7_replicate<N, 4>(row, width); break;
+      case 2: png_adam7_replicate<N, 2>(row, width); break;
+      default: break; /* pass 6 is never expanded */
+   }
+}
+
+void /* PRIVATE */
+png_combine_row_packed(png_const_structrp png_ptr, png_bytep dp)
+{
+   png_off_t stat_start = png_stats_begin(png_ptr);
+   unsigned int pixel_bytes = png_ptr->transformed_pixel_depth >> 3;
+   unsigned int pass = png_ptr->pass;
+   png_uint_32 count = PNG_PASS_COLS(png_ptr->width, pass);
+   png_const_bytep sp = png_ptr->row_buf + 1;
+   size_t jump = (size_t)PNG_PASS_COL_OFFSET(pass) * pixel_bytes;
+
+   png_debug(1, "in png_combine_row_packed");
+
+   if ((png_ptr->transformed_pixel_depth & 7) != 0 || pass >= 6)
+      png_error(png_ptr, "internal row logic error");
+
+   dp += PNG_PASS_START_COL(pass) * pixel_bytes;
+
+   switch (pixel_bytes)
+   {
+      case 1: png_adam7_scatter<1>(dp, sp, count, jump); break;
+      case 2: png_adam7_scatter<2>(dp, sp, count, jump); break;
+      case 3: png_adam7_scatter<3>(dp, sp, count, jump); break;
+      case 4: png_adam7_scatter<4>(dp, sp, count, jump); break;
+      case 6: png_adam7_scatter<6>(dp, sp, count, jump); break;
+      case 8: png_adam7_scatter<8>(dp, sp, count, jump); break;
+
+      default:
+         for (; count > 0; --count, sp += pixel_bytes, dp += jump)
+            memcpy(dp, sp, pixel_bytes);
+         break;
+   }
+
+   png_stats_end(png_ptr, PNG_STAT_COMBINE_ROW, stat_start,
+       (png_off_t)PNG_PASS_COLS(png_ptr->width, pass) * pixel_bytes);
+}
+
 void /* PRIVATE */
 png_do_read_interlace(png_row_infop row_info, png_bytep row, int pass,
     png_uint_32 transformations /* Because these may affect the byte layout */)
@@ -3658,6 +3907,30 @@ png_do_read_interlace(png_row_infop row_info, png_bytep row, int pass,
             break;
          }
 
+         case 8:
+            png_adam7_replicate_pass<1>(row, row_info->width, pass);
+            break;
+
+         case 16:
+            png_adam7_replicate_pass<2>(row, row_info->width, pass);
+            break;
+
+         case 24:
+            png_adam7_replicate_pass<3>(row, row_info->width, pass);
+            break;
+
+         case 32:
+            png_adam7_replicate_pass<4>(row, row_info->width, pass);
+            break;
+
+         case 48:
+            png_adam7_replicate_pass<6>(row, row_info->width, pass);
+            break;
+
+         case 64:
+            png_adam7_replicate_pass<8>(row, row_info->width, pass);
+            break;
+
          default:
          {
             size_t pixel_bytes = (row_info->pixel_depth >> 3);
@@ -3904,10 +4177,13 @@ png_read_filter_row(png_structrp pp, png_row_infop row_info, png_bytep row,
     */
    if (filter > PNG_FILTER_VALUE_NONE && filter < PNG_FILTER_VALUE_LAST)
    {
+      png_off_t stat_start = png_stats_begin(pp);
+
       if (pp->read_filter[0] == NULL)
          png_init_filter_functions(pp);
 
       pp->read_filter[filter-1](row_info, row, prev_row);
+      png_stats_end(pp, PNG_STAT_UNFILTER, stat_start, row_info->rowbytes);
    }
 }
 
@@ -4007,7 +4283,12 @@ png_read_IDAT_data(png_structrp png_ptr, png_bytep output,
          png_ptr->mode |= PNG_AFTER_IDAT;
          png_ptr->flags |= PNG_FLAG_ZSTREAM_ENDED;
 
-         if (png_ptr->zstream.avail_in > 0 || png_ptr->idat_size > 0)
+         /* A raw deflate stream (png_read_indexed_rows) is followed by the
+          * unread Adler-32.
+          */
+         if ((png_ptr->zstream.avail_in > 0 || png_ptr->idat_size > 0) &&
+             ((png_ptr->flags & PNG_FLAG_ZSTREAM_RAW) == 0 ||
+             png_ptr->zstream.avail_in + png_ptr->idat_size > 4))
             png_chunk_benign_error(png_ptr, "Extra compressed data");
          break;
       }
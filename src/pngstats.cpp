@@ -0,0 +1,82 @@
+/* pngstats.cpp - per-stage timing and byte counters
+ *
+ * This code is released under the libpng license.
+ * For conditions of distribution and use, see the disclaimer
+ * and license in png.h
+ *
+ * The counters live in an array allocated by png_set_stats, one entry for each
+ * PNG_STAT_ stage.  The stages themselves call png_stats_begin and
+ * png_stats_end (stats.h) around the work they measure; the stages never nest,
+ * so each nanosecond is counted once.
+ */
+
+#include <pngmem.h>
+#include <pngerror.h>
+#include <pngdebug.h>
+#include <stats.h>
+
+#include "pngpriv.h"
+
+#include <chrono>
+
+png_off_t /* PRIVATE */
+png_stats_clock(void)
+{
+   return (png_off_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+       std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void /* PRIVATE */
+png_stats_add(png_const_structrp png_ptr, int stage, png_off_t start,
+    png_off_t bytes)
+{
+   png_stage_stats *s = png_ptr->stats + stage;
+
+   s->calls += 1;
+   s->bytes += bytes;
+   s->nanoseconds += png_stats_clock() - start;
+}
+
+void PNGAPI
+png_set_stats(png_structrp png_ptr, int enable)
+{
+   png_debug(1, "in png_set_stats");
+
+   if (png_ptr == NULL)
+      return;
+
+   if (enable == 0)
+   {
+      png_free(png_ptr, png_ptr->stats);
+      png_ptr->stats = NULL;
+      return;
+   }
+
+   if (png_ptr->stats == NULL)
+   {
+      png_ptr->stats = (png_stage_stats*)png_malloc_warn(png_ptr,
+          PNG_STAT_COUNT * (sizeof *png_ptr->stats));
+
+      if (png_ptr->stats == NULL)
+      {
+         png_warning(png_ptr, "Insufficient memory for stats");
+         return;
+      }
+   }
+
+   memset(png_ptr->stats, 0, PNG_STAT_COUNT * (sizeof *png_ptr->stats));
+}
+
+int PNGAPI
+png_get_stats(png_const_structrp png_ptr, png_stage_stats *stats, int count)
+{
+   if (png_ptr == NULL || png_ptr->stats == NULL || stats == NULL ||
+       count <= 0)
+      return 0;
+
+   if (count > PNG_STAT_COUNT)
+      count = PNG_STAT_COUNT;
+
+   memcpy(stats, png_ptr->stats, count * (sizeof *stats));
+   return count;
+}
@@ -0,0 +1,257 @@
+/* pngthread.cpp - worker threads for banded image jobs
+ *
+ * This code is released under the libpng license.
+ * For conditions of distribution and use, see the disclaimer
+ * and license in png.h
+ *
+ * Jobs are handed out one index at a time from a shared counter, so threads
+ * that get cheap bands go on to take more of them.  If a thread cannot be
+ * started the calling thread simply does more of the work itself.
+ *
+ * Starting and joining a thread costs tens of microseconds, as much as
+ * decoding a small image, so the threads are kept in a pool: started when
+ * first needed, they wait on a condition variable between calls and live
+ * until the process exits.  The pool runs one call at a time; a call made
+ * while it is busy, from another application thread or from inside a job,
+ * starts threads of its own for the duration of the call.
+ *
+ * A child created with fork() has only the thread that called fork(), and
+ * the pool's mutex may have been held by one of the others at the time, so
+ * the pool records the process that made it and a child makes a new one.  The
+ * old pool is abandoned, not freed: its lock cannot be trusted.
+ */
+
+#include <pngthread.h>
+
+#include "pngpriv.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#  include <unistd.h>
+#  define png_thread_pid() ((long)getpid())
+#else
+#  define png_thread_pid() 0L /* no fork() */
+#endif
+
+static std::atomic<unsigned int> png_thread_forced(0);
+
+unsigned int /* PRIVATE */
+png_thread_set_count(unsigned int count)
+{
+   return png_thread_forced.exchange(count);
+}
+
+unsigned int /* PRIVATE */
+png_thread_count(void)
+{
+   unsigned int n = png_thread_forced;
+
+   if (n == 0)
+      n = std::thread::hardware_concurrency();
+
+   if (n == 0)
+      n = 1;
+
+   return n < PNG_THREADS_MAX ? n : PNG_THREADS_MAX;
+}
+
+static void
+png_thread_worker(std::atomic<png_uint_32> *next, png_uint_32 count,
+    png_thread_worker_job job, png_voidp arg, unsigned int worker)
+{
+   for (;;)
+   {
+      png_uint_32 i = next->fetch_add(1);
+
+      if (i >= count)
+         break;
+
+      job(arg, worker, i);
+   }
+}
+
+struct png_thread_pool
+{
+   std::mutex lock;
+   std::condition_variable wake;   /* the threads wait for a new round */
+   std::condition_variable done;   /* the caller waits for the round to end */
+   std::atomic<bool> busy;         /* a call is using the pool */
+   unsigned int threads;           /* started, as workers 1 to 'threads' */
+   unsigned long round;            /* incremented for each call */
+   unsigned int workers;           /* of this round, the caller included */
+   unsigned int running;           /* threads still working on this round */
+   std::atomic<png_uint_32> next;
+   png_uint_32 count;
+   png_thread_worker_job job;
+   png_voidp arg;
+   long owner;                     /* the process the threads belong to */
+};
+
+static void
+png_thread_pool_main(png_thread_pool *pool, unsigned int worker,
+    unsigned long seen)
+{
+   std::unique_lock<std::mutex> hold(pool->lock);
+
+   for (;;)
+   {
+      pool->wake.wait(hold, [pool, seen] { return pool->round != seen; });
+      seen = pool->round;
+
+      if (worker >= pool->workers)
+         continue;
+
+      hold.unlock();
+      png_thread_worker(&pool->next, pool->count, pool->job, pool->arg,
+          worker);
+      hold.lock();
+
+      if (--pool->running == 0)
+         pool->done.notify_one();
+   }
+}
+
+static std::atomic<png_thread_pool*> png_thread_pool_current(NULL);
+
+/* The pool of this process, made on first use.  A pool is never freed: its
+ * threads wait on it until the process exits.
+ */
+static png_thread_pool *
+png_thread_pool_get(void)
+{
+   png_thread_pool *pool = png_thread_pool_current;
+   png_thread_pool *made;
+
+   if (pool != NULL && pool->owner == png_thread_pid())
+      return pool;
+
+   made = new (std::nothrow) png_thread_pool();
+
+   if (made == NULL)
+      return NULL;
+
+   made->owner = png_thread_pid();
+
+   /* Another thread may have made one first; then use that. */
+   if (png_thread_pool_current.compare_exchange_strong(pool, made))
+      return made;
+
+   delete made;
+   return pool;
+}
+
+/* Run the call on 'n' threads of the pool, the calling thread included. */
+static void
+png_thread_pool_run(png_thread_pool *pool, unsigned int n, png_uint_32 count,
+    png_thread_worker_job job, png_voidp arg)
+{
+   std::unique_lock<std::mutex> hold(pool->lock);
+
+   try
+   {
+      while (pool->threads < n-1)
+      {
+         std::thread(png_thread_pool_main, pool, pool->threads + 1,
+             pool->round).detach();
+         ++pool->threads;
+      }
+   }
+
+   catch (...)
+   {
+      /* Out of memory or threads; carry on with what was started. */
+   }
+
+   if (n > pool->threads + 1)
+      n = pool->threads + 1;
+
+   pool->next = 0;
+   pool->count = count;
+   pool->job = job;
+   pool->arg = arg;
+   pool->workers = n;
+   pool->running = n-1;
+   ++pool->round;
+   hold.unlock();
+   pool->wake.notify_all();
+
+   png_thread_worker(&pool->next, count, job, arg, 0);
+
+   hold.lock();
+   pool->done.wait(hold, [pool] { return pool->running == 0; });
+}
+
+void /* PRIVATE */
+png_parallel_for_worker(png_uint_32 count, png_thread_worker_job job,
+    png_voidp arg)
+{
+   std::atomic<png_uint_32> next(0);
+   std::vector<std::thread> threads;
+   unsigned int n = png_thread_count();
+
+   if (n > count)
+      n = count;
+
+   if (n > 1)
+   {
+      png_thread_pool *pool = png_thread_pool_get();
+      bool idle = false;
+
+      if (pool != NULL && pool->busy.compare_exchange_strong(idle, true))
+      {
+         png_thread_pool_run(pool, n, count, job, arg);
+         pool->busy = false;
+         return;
+      }
+
+      try
+      {
+         threads.reserve(n-1);
+
+         while (threads.size() < n-1)
+            threads.emplace_back(png_thread_worker, &next, count, job, arg,
+                (unsigned int)threads.size() + 1);
+      }
+
+      catch (...)
+      {
+         /* Out of memory or threads; carry on with what was started. */
+      }
+   }
+
+   png_thread_worker(&next, count, job, arg, 0);
+
+   for (size_t i = 0; i < threads.size(); ++i)
+      threads[i].join();
+}
+
+typedef struct
+{
+   png_thread_job job;
+   png_voidp arg;
+} png_thread_call;
+
+static void
+png_thread_call_job(png_voidp arg, unsigned int worker, png_uint_32 index)
+{
+   png_thread_call *call = (png_thread_call*)arg;
+
+   PNG_UNUSED(worker)
+   call->job(call->arg, index);
+}
+
+void /* PRIVATE */
+png_parallel_for(png_uint_32 count, png_thread_job job, png_voidp arg)
+{
+   png_thread_call call;
+
+   call.job = job;
+   call.arg = arg;
+   png_parallel_for_worker(count, png_thread_call_job, &call);
+}
@@ -0,0 +1,135 @@
+/* pngtranscode.cpp - decode and encode a PNG one row at a time
+ *
+ * This code is released under the libpng license.
+ * For conditions of distribution and use, see the disclaimer
+ * and license in png.h
+ *
+ * png_read_png followed by png_write_png holds the whole decoded image.  When
+ * the interlacing does not change the rows can instead go from the reader to
+ * the writer as they are decoded: each transformed row is left in the read
+ * struct's row buffer (png_read_row is given no destination) and
+ * png_write_row copies it from there into its own.
+ */
+
+#include <pngmem.h>
+#include <pngerror.h>
+#include <pngdebug.h>
+
+#include "pngpriv.h"
+
+/* Change the interlacing: the image is read into info_ptr's rows as by
+ * png_read_png, then written from them.  The rows are allocated through
+ * read_ptr, so they count against its png_set_mem_budget limit; that is
+ * checked for the whole image before any row is allocated.
+ */
+static void
+png_transcode_buffered(png_structrp read_ptr, png_inforp info_ptr,
+    png_structrp write_ptr)
+{
+   png_mem_stats stats;
+   png_uint_32 y;
+   size_t rowbytes = info_ptr->rowbytes;
+
+   if (rowbytes > 0 && info_ptr->height > PNG_SIZE_MAX / rowbytes /
+       (sizeof (png_bytep)))
+      png_error(read_ptr, "png_transcode: image too large to buffer");
+
+   if (png_get_mem_stats(read_ptr, &stats) != 0 && stats.budget > 0 &&
+       (stats.current > stats.budget || info_ptr->height *
+       (rowbytes + (sizeof (png_bytep))) > stats.budget - stats.current))
+      png_error(read_ptr, "png_transcode: image exceeds the memory budget");
+
+   png_free_data(read_ptr, info_ptr, PNG_FREE_ROWS, 0);
+
+   info_ptr->row_pointers = (png_bytepp)png_calloc(read_ptr,
+       info_ptr->height * (sizeof (png_bytep)));
+   info_ptr->free_me |= PNG_FREE_ROWS;
+
+   for (y = 0; y < info_ptr->height; ++y)
+      info_ptr->row_pointers[y] = (png_bytep)png_malloc(read_ptr, rowbytes);
+
+   png_read_image(read_ptr, info_ptr->row_pointers);
+
+   (void)png_set_interlace_handling(write_ptr);
+   png_write_image(write_ptr, info_ptr->row_pointers);
+
+   png_free_data(read_ptr, info_ptr, PNG_FREE_ROWS, 0);
+}
+
+void PNGAPI
+png_transcode(png_structrp read_ptr, png_inforp info_ptr,
+    png_structrp write_ptr, int interlace_type)
+{
+   png_byte bit_depth;
+
+   png_debug(1, "in png_transcode");
+
+   if (read_ptr == NULL || info_ptr == NULL || write_ptr == NULL)
+      return;
+
+   if ((read_ptr->flags & PNG_FLAG_ROW_INIT) != 0)
+   {
+      png_app_error(read_ptr, "png_transcode: image reading already started");
+      return;
+   }
+
+   if ((read_ptr->mode & PNG_HAVE_IDAT) == 0)
+      png_read_info(read_ptr, info_ptr);
+
+   if (interlace_type >= PNG_INTERLACE_LAST)
+   {
+      png_app_error(write_ptr, "png_transcode: invalid interlace type");
+      interlace_type = -1;
+   }
+
+   if (interlace_type < 0)
+      interlace_type = info_ptr->interlace_type;
+
+   /* Without interlace handling the passes of an interlaced image are read
+    * and written as they are stored, row by row.
+    */
+   if (interlace_type != info_ptr->interlace_type)
+      (void)png_set_interlace_handling(read_ptr);
+
+   else
+      read_ptr->transformations &= ~PNG_INTERLACE;
+
+   bit_depth = info_ptr->bit_depth;
+   png_read_update_info(read_ptr, info_ptr);
+
+   /* Expanding to an alpha channel, or stripping it, leaves info_ptr's tRNS
+    * values behind; they no longer apply.  Nor does a gray or RGB key color
+    * once the bit depth changes; png_set_tRNS_to_alpha keeps the
+    * transparency.
+    */
+   if ((info_ptr->valid & PNG_INFO_tRNS) != 0 && (info_ptr->num_trans == 0 ||
+       (info_ptr->color_type != PNG_COLOR_TYPE_PALETTE &&
+       info_ptr->bit_depth != bit_depth)))
+   {
+      if (info_ptr->num_trans != 0)
+         png_warning(read_ptr, "png_transcode: tRNS dropped");
+
+      info_ptr->valid &= ~PNG_INFO_tRNS;
+   }
+
+   info_ptr->interlace_type = (png_byte)interlace_type;
+   png_write_info(write_ptr, info_ptr);
+
+   if (interlace_type != read_ptr->interlaced)
+      png_transcode_buffered(read_ptr, info_ptr, write_ptr);
+
+   else
+   {
+      while (read_ptr->interlaced != 0 ? read_ptr->pass < 7 :
+          read_ptr->row_number < read_ptr->num_rows)
+      {
+         png_read_row(read_ptr, NULL, NULL);
+         png_write_row(write_ptr, read_ptr->row_buf + 1);
+      }
+   }
+
+   info_ptr->valid |= PNG_INFO_IDAT;
+
+   png_read_end(read_ptr, info_ptr);
+   png_write_end(write_ptr, info_ptr);
+}
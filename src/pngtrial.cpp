@@ -0,0 +1,580 @@
+/* pngtrial.cpp - trial compression for the archive and smallest encode tiers
+ *
+ * This code is released under the libpng license.
+ * For conditions of distribution and use, see the disclaimer
+ * and license in png.h
+ *
+ * A filter strategy gives the filter for every row.  There are eight: each of
+ * the five filters on all rows, the minimum sum of absolute differences
+ * heuristic of png_write_find_filter, the filter giving the lowest byte
+ * entropy per row, and a brute force choice that compresses every row with
+ * each filter, continuing from the stream so far, and keeps the shortest.
+ * The last is the "zlib predictive" method mentioned in pngwutil.cpp.  Each
+ * strategy is then compressed with each of the zlib parameter sets below,
+ * all on worker threads, and the smallest stream wins.  Ties go to the first
+ * in the order above, so the output does not depend on the threads.
+ *
+ * The archive tier only tries no filtering, the heuristic and the entropy
+ * choice: nine compressions instead of twenty-four, and none of the row by row
+ * brute force, which is most of the time the smallest tier takes.
+ *
+ * The workers only measure the streams.  Their rows and deflate streams are
+ * allocated through the png_struct beforehand, so png_set_mem_budget sees
+ * them, and the winner is compressed again on the calling thread straight
+ * into the IDAT chunks rather than each job keeping its whole output.
+ */
+
+#include <pngmem.h>
+#include <pngerror.h>
+#include <pngdebug.h>
+#include <wutil.h>
+#include <pngthread.h>
+#include <trial.h>
+
+#include "pngpriv.h"
+
+#include <math.h>
+
+#define PNG_TRIAL_FIXED    5 /* strategies that use one filter for all rows */
+#define PNG_TRIAL_SUM      5
+#define PNG_TRIAL_ENTROPY  6
+#define PNG_TRIAL_BRUTE    7
+#define PNG_TRIAL_FILTERS  8
+#define PNG_TRIAL_ZLIB     3
+#define PNG_TRIAL_JOBS     (PNG_TRIAL_FILTERS * PNG_TRIAL_ZLIB)
+
+/* The filter strategies tried by each tier, one bit per strategy. */
+#define PNG_TRIAL_ALL      ((1U << PNG_TRIAL_FILTERS) - 1)
+#define PNG_TRIAL_ARCHIVE  ((1U << PNG_FILTER_VALUE_NONE) | \
+                            (1U << PNG_TRIAL_SUM) | (1U << PNG_TRIAL_ENTROPY))
+
+/* All at level 9 with the largest window and memory level. */
+static const int png_trial_strategy[PNG_TRIAL_ZLIB] =
+{
+   Z_DEFAULT_STRATEGY, Z_FILTERED, Z_RLE
+};
+
+typedef struct
+{
+   size_t offset;   /* of the row in 'data' */
+   size_t len;      /* without a filter byte */
+   int first;       /* no previous row: the first of a pass */
+} png_trial_line;
+
+struct png_trial_def
+{
+   png_bytep data;              /* the unfiltered rows */
+   size_t data_size;
+   size_t data_max;
+   png_trial_line *rows;
+   png_uint_32 num_rows;
+   png_uint_32 max_rows;
+   size_t max_len;              /* the longest row */
+   unsigned int bpp;            /* bytes per pixel, at least 1 */
+   int pass;                    /* of the last row */
+   unsigned int strategies;     /* PNG_TRIAL_ALL or PNG_TRIAL_ARCHIVE */
+   png_bytep filters[PNG_TRIAL_FILTERS]; /* a filter for each row */
+   size_t size[PNG_TRIAL_JOBS]; /* of the compressed stream */
+   int failed[PNG_TRIAL_JOBS];
+   png_bytep scratch;           /* five filtered rows for each worker */
+   png_zarena *arenas;          /* two deflate streams for each worker */
+   png_bytep arena_mem;
+};
+
+/* Grow 'p', an array of 'max' elements of 'size' bytes, to hold 'need'. */
+static png_voidp
+png_trial_grow(png_structrp png_ptr, png_voidp p, size_t *max, size_t need,
+    size_t size)
+{
+   size_t n = *max;
+
+   if (need <= n)
+      return p;
+
+   do
+      n = n < 1024 ? 1024 : n > PNG_SIZE_MAX/2 ? PNG_SIZE_MAX : 2*n;
+   while (need > n);
+
+   if (n > PNG_SIZE_MAX/size)
+      png_error(png_ptr, "Insufficient memory for trial compression");
+
+   {
+      png_voidp q = png_malloc(png_ptr, n * size);
+
+      if (p != NULL)
+         memcpy(q, p, *max * size);
+
+      png_free(png_ptr, p);
+      *max = n;
+      return q;
+   }
+}
+
+png_trialp /* PRIVATE */
+png_trial_create(png_structrp png_ptr)
+{
+   png_trialp trial = (png_trialp)png_calloc(png_ptr, sizeof *trial);
+
+   trial->bpp = (png_ptr->pixel_depth + 7) >> 3;
+   trial->pass = -1;
+   trial->strategies = png_ptr->encode_speed == PNG_ENCODE_SPEED_ARCHIVE ?
+       PNG_TRIAL_ARCHIVE : PNG_TRIAL_ALL;
+
+   return trial;
+}
+
+void /* PRIVATE */
+png_trial_destroy(png_structrp png_ptr, png_trialp trial)
+{
+   int i;
+
+   if (trial == NULL)
+      return;
+
+   for (i = 0; i < PNG_TRIAL_FILTERS; ++i)
+      png_free(png_ptr, trial->filters[i]);
+
+   png_free(png_ptr, trial->arena_mem);
+   png_free(png_ptr, trial->arenas);
+   png_free(png_ptr, trial->scratch);
+   png_free(png_ptr, trial->rows);
+   png_free(png_ptr, trial->data);
+   png_free(png_ptr, trial);
+}
+
+void /* PRIVATE */
+png_trial_row(png_structrp png_ptr, png_trialp trial, png_const_bytep row,
+    size_t len)
+{
+   png_trial_line *line;
+
+   --len; /* the filter byte */
+
+   if (trial->num_rows == 0xffffffffU)
+      png_error(png_ptr, "Too many rows for trial compression");
+
+   if (trial->num_rows == trial->max_rows)
+   {
+      size_t max = trial->max_rows;
+
+      trial->rows = (png_trial_line*)png_trial_grow(png_ptr, trial->rows, &max,
+          max + 1, sizeof (png_trial_line));
+      trial->max_rows = max > 0xffffffffU ? 0xffffffffU : (png_uint_32)max;
+   }
+
+   if (len > PNG_SIZE_MAX - trial->data_size)
+      png_error(png_ptr, "Image too large for trial compression");
+
+   trial->data = (png_bytep)png_trial_grow(png_ptr, trial->data,
+       &trial->data_max, trial->data_size + len, 1);
+
+   line = trial->rows + trial->num_rows++;
+   line->offset = trial->data_size;
+   line->len = len;
+   line->first = png_ptr->pass != trial->pass;
+
+   memcpy(trial->data + trial->data_size, row + 1, len);
+   trial->data_size += len;
+   trial->pass = png_ptr->pass;
+
+   if (len > trial->max_len)
+      trial->max_len = len;
+}
+
+void /* PRIVATE */
+png_trial_filter(png_bytep out, png_const_bytep row, png_const_bytep prev,
+    size_t len, unsigned int bpp, int filter)
+{
+   size_t i;
+
+   *out++ = (png_byte)filter;
+
+   if (bpp > len)
+      bpp = (unsigned int)len;
+
+   switch (filter)
+   {
+      case PNG_FILTER_VALUE_SUB:
+         memcpy(out, row, bpp);
+         for (i = bpp; i < len; ++i)
+            out[i] = (png_byte)(row[i] - row[i-bpp]);
+         break;
+
+      case PNG_FILTER_VALUE_UP:
+         if (prev == NULL)
+            memcpy(out, row, len);
+
+         else for (i = 0; i < len; ++i)
+            out[i] = (png_byte)(row[i] - prev[i]);
+         break;
+
+      case PNG_FILTER_VALUE_AVG:
+         if (prev == NULL)
+         {
+            memcpy(out, row, bpp);
+            for (i = bpp; i < len; ++i)
+               out[i] = (png_byte)(row[i] - (row[i-bpp] >> 1));
+         }
+
+         else
+         {
+            for (i = 0; i < bpp; ++i)
+               out[i] = (png_byte)(row[i] - (prev[i] >> 1));
+            for (i = bpp; i < len; ++i)
+               out[i] = (png_byte)(row[i] - ((row[i-bpp] + prev[i]) >> 1));
+         }
+         break;
+
+      case PNG_FILTER_VALUE_PAETH:
+         /* With no row above the predictor is always the byte to the left. */
+         if (prev == NULL)
+         {
+            memcpy(out, row, bpp);
+            for (i = bpp; i < len; ++i)
+               out[i] = (png_byte)(row[i] - row[i-bpp]);
+         }
+
+         else
+         {
+            for (i = 0; i < bpp; ++i)
+               out[i] = (png_byte)(row[i] - prev[i]);
+
+            for (i = bpp; i < len; ++i)
+            {
+               int a = row[i-bpp], b = prev[i], c = prev[i-bpp];
+               int pa = abs(b - c), pb = abs(a - c), pc = abs(a + b - 2*c);
+
+               if (pb < pa)
+                  a = b, pa = pb;
+
+               if (pc < pa)
+                  a = c;
+
+               out[i] = (png_byte)(row[i] - a);
+            }
+         }
+         break;
+
+      default:
+         memcpy(out, row, len);
+         break;
+   }
+}
+
+/* Deflate 'len' bytes then, when they are consumed, do 'flush'.  The length
+ * of the output is added to '*total' and the output itself is written with
+ * png_write_IDAT_bytes if 'png_ptr' is not NULL, otherwise discarded.  Returns
+ * 0 on an error; on a worker 'png_ptr' is NULL, so this cannot png_error.
+ */
+static int
+png_trial_deflate(z_streamp z, png_const_bytep in, size_t len, int flush,
+    size_t *total, png_structrp png_ptr)
+{
+   png_byte scratch[4096];
+
+   for (;;)
+   {
+      uInt avail = len > ZLIB_IO_MAX ? ZLIB_IO_MAX : (uInt)len;
+      int ret;
+
+      z->next_in = PNGZ_INPUT_CAST(in);
+      z->avail_in = avail;
+      in += avail;
+      len -= avail;
+
+      do
+      {
+         z->next_out = scratch;
+         z->avail_out = sizeof scratch;
+
+         ret = deflate(z, len > 0 ? Z_NO_FLUSH : flush);
+
+         if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+            return 0;
+
+         *total += sizeof scratch - z->avail_out;
+
+         if (png_ptr != NULL)
+            png_write_IDAT_bytes(png_ptr, scratch,
+                sizeof scratch - z->avail_out);
+      }
+      while (z->avail_in > 0 || (z->avail_out == 0 && ret != Z_STREAM_END));
+
+      if (len == 0)
+         return 1;
+   }
+}
+
+static int
+png_trial_deflate_init(z_streamp z, int strategy, png_zarena *arena)
+{
+   memset(z, 0, sizeof *z);
+   png_zarena_use(z, arena);
+   return deflateInit2(z, 9, Z_DEFLATED, 15, 9, strategy) == Z_OK;
+}
+
+size_t /* PRIVATE */
+png_trial_sum(png_const_bytep p, size_t len)
+{
+   size_t sum = 0;
+
+   while (len-- > 0)
+   {
+      unsigned int v = *p++;
+
+      sum += v < 128 ? v : 256 - v;
+   }
+
+   return sum;
+}
+
+/* Less is better: -sum(count * log2(count)), which orders the filtered rows of
+ * one length the same way as their entropy.
+ */
+static double
+png_trial_entropy(png_const_bytep p, size_t len)
+{
+   size_t count[256];
+   double cost = 0;
+   int i;
+
+   memset(count, 0, sizeof count);
+
+   while (len-- > 0)
+      ++count[*p++];
+
+   for (i = 0; i < 256; ++i)
+      if (count[i] > 1)
+         cost -= (double)count[i] * log2((double)count[i]);
+
+   return cost;
+}
+
+/* Choose a filter for every row for one of the strategies that is not
+ * fixed.  Stage one of png_trial_finish.
+ */
+static void
+png_trial_choose(png_voidp arg, unsigned int worker, png_uint_32 index)
+{
+   png_trialp trial = (png_trialp)arg;
+   int strategy = PNG_TRIAL_FIXED + (int)index;
+   png_bytep choice = trial->filters[strategy];
+   size_t stride = trial->max_len + 1;
+   png_bytep cand = trial->scratch + worker * 5 * stride;
+   z_stream z;
+   png_uint_32 r;
+
+   if ((trial->strategies & (1U << strategy)) == 0)
+      return;
+
+   if (strategy == PNG_TRIAL_BRUTE &&
+       !png_trial_deflate_init(&z, Z_DEFAULT_STRATEGY, trial->arenas + worker))
+      goto fail;
+
+   for (r = 0; r < trial->num_rows; ++r)
+   {
+      const png_trial_line *line = trial->rows + r;
+      png_const_bytep row = trial->data + line->offset;
+      png_const_bytep prev = line->first ? NULL : row - line->len;
+      double best = 0;
+      int f, pick = 0;
+
+      for (f = 0; f < 5; ++f)
+      {
+         png_bytep out = cand + f * stride;
+         double cost;
+
+         png_trial_filter(out, row, prev, line->len, trial->bpp, f);
+
+         if (strategy == PNG_TRIAL_SUM)
+            cost = (double)png_trial_sum(out + 1, line->len);
+
+         else if (strategy == PNG_TRIAL_ENTROPY)
+            cost = png_trial_entropy(out + 1, line->len);
+
+         else
+         {
+            /* The output up to a sync flush of a copy of the stream, which
+             * allocates from the same arena and gives it back at deflateEnd.
+             */
+            z_stream t;
+            size_t size = 0;
+            int ok;
+
+            if (deflateCopy(&t, &z) != Z_OK)
+               goto fail_brute;
+
+            ok = png_trial_deflate(&t, out, line->len + 1, Z_SYNC_FLUSH, &size,
+                NULL);
+            cost = (double)size;
+            deflateEnd(&t);
+
+            if (!ok)
+               goto fail_brute;
+         }
+
+         if (f == 0 || cost < best)
+            best = cost, pick = f;
+      }
+
+      choice[r] = (png_byte)pick;
+
+      if (strategy == PNG_TRIAL_BRUTE)
+      {
+         size_t size = 0;
+
+         if (!png_trial_deflate(&z, cand + pick * stride, line->len + 1,
+             Z_NO_FLUSH, &size, NULL))
+            goto fail_brute;
+      }
+   }
+
+   if (strategy == PNG_TRIAL_BRUTE)
+      deflateEnd(&z);
+
+   return;
+
+fail_brute:
+   deflateEnd(&z);
+
+fail:
+   /* Every job compressing this strategy fails too. */
+   for (r = 0; r < PNG_TRIAL_ZLIB; ++r)
+      trial->failed[strategy * PNG_TRIAL_ZLIB + r] = 1;
+}
+
+/* Compress the rows with one filter strategy and one zlib parameter set,
+ * writing the stream if 'png_ptr' is not NULL.  Returns 0 on an error.
+ */
+static int
+png_trial_run(png_trialp trial, int index, png_bytep buf, png_zarena *arena,
+    size_t *total, png_structrp png_ptr)
+{
+   png_const_bytep choice = trial->filters[index / PNG_TRIAL_ZLIB];
+   z_stream z;
+   png_uint_32 r;
+   int ok;
+
+   ok = png_trial_deflate_init(&z, png_trial_strategy[index % PNG_TRIAL_ZLIB],
+       arena);
+
+   for (r = 0; ok && r < trial->num_rows; ++r)
+   {
+      const png_trial_line *line = trial->rows + r;
+      png_const_bytep row = trial->data + line->offset;
+
+      png_trial_filter(buf, row, line->first ? NULL : row - line->len,
+          line->len, trial->bpp, choice[r]);
+      ok = png_trial_deflate(&z, buf, line->len + 1, Z_NO_FLUSH, total,
+          png_ptr);
+   }
+
+   if (ok)
+      ok = png_trial_deflate(&z, NULL, 0, Z_FINISH, total, png_ptr);
+
+   /* If png_write_IDAT_bytes does png_error the stream is simply left in the
+    * arena.
+    */
+   if (z.state != NULL)
+      deflateEnd(&z);
+
+   return ok;
+}
+
+/* Measure one filter strategy with one zlib parameter set.  Stage two of
+ * png_trial_finish.
+ */
+static void
+png_trial_compress(png_voidp arg, unsigned int worker, png_uint_32 index)
+{
+   png_trialp trial = (png_trialp)arg;
+
+   if (trial->failed[index])
+      return;
+
+   if (!png_trial_run(trial, (int)index,
+       trial->scratch + worker * 5 * (trial->max_len + 1),
+       trial->arenas + worker, trial->size + index, NULL))
+      trial->failed[index] = 1;
+}
+
+/* Allocate the rows and deflate streams of the workers.  Brute force keeps a
+ * stream and a copy of it, hence two streams in each arena.
+ */
+static void
+png_trial_alloc(png_structrp png_ptr, png_trialp trial)
+{
+   unsigned int workers = png_thread_count();
+   size_t stride = trial->max_len + 1;
+   size_t arena_size = 2 * png_zarena_size(15, 9);
+   unsigned int i;
+
+   if (workers > PNG_TRIAL_JOBS)
+      workers = PNG_TRIAL_JOBS;
+
+   if (stride > PNG_SIZE_MAX / 5 / workers)
+      png_error(png_ptr, "Image too large for trial compression");
+
+   trial->scratch = (png_bytep)png_malloc(png_ptr, workers * 5 * stride);
+   trial->arenas = (png_zarena*)png_malloc(png_ptr,
+       workers * (sizeof *trial->arenas));
+   trial->arena_mem = (png_bytep)png_malloc(png_ptr, workers * arena_size);
+
+   for (i = 0; i < workers; ++i)
+   {
+      trial->arenas[i].base = trial->arena_mem + i * arena_size;
+      trial->arenas[i].size = arena_size;
+      trial->arenas[i].used = 0;
+   }
+}
+
+void /* PRIVATE */
+png_trial_finish(png_structrp png_ptr, png_trialp trial)
+{
+   size_t total = 0;
+   int best = -1;
+   int i;
+
+   png_debug(1, "in png_trial_finish");
+
+   for (i = 0; i < PNG_TRIAL_FILTERS; ++i)
+   {
+      int z;
+
+      if ((trial->strategies & (1U << i)) == 0)
+      {
+         for (z = 0; z < PNG_TRIAL_ZLIB; ++z)
+            trial->failed[i * PNG_TRIAL_ZLIB + z] = 1;
+
+         continue;
+      }
+
+      /* At least one byte, for an image with no rows. */
+      trial->filters[i] = (png_bytep)png_malloc(png_ptr, trial->num_rows + 1);
+
+      if (i < PNG_TRIAL_FIXED)
+         memset(trial->filters[i], i, trial->num_rows + 1);
+   }
+
+   png_trial_alloc(png_ptr, trial);
+
+   png_parallel_for_worker(PNG_TRIAL_FILTERS - PNG_TRIAL_FIXED,
+       png_trial_choose, trial);
+   png_parallel_for_worker(PNG_TRIAL_JOBS, png_trial_compress, trial);
+
+   for (i = 0; i < PNG_TRIAL_JOBS; ++i)
+      if (trial->failed[i] == 0 &&
+          (best < 0 || trial->size[i] < trial->size[best]))
+         best = i;
+
+   if (best < 0)
+      png_error(png_ptr, "Trial compression failed");
+
+   png_debug2(2, "trial %d: %lu bytes", best,
+       (unsigned long)trial->size[best]);
+
+   /* The same stream again, from the first worker's memory. */
+   if (!png_trial_run(trial, best, trial->scratch, trial->arenas, &total,
+       png_ptr) || total != trial->size[best])
+      png_error(png_ptr, "Trial compression failed");
+}
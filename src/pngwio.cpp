@@ -18,6 +18,8 @@
  * them at run time with png_set_write_fn(...).
  */
 
+#include <stats.h>
+
 #include "pngpriv.h"
 
 /* Write the data to whatever output you are using.  The default routine
@@ -30,12 +32,16 @@
 void /* PRIVATE */
 png_write_data(png_structrp png_ptr, png_const_bytep data, size_t length)
 {
+   png_off_t stat_start = png_stats_begin(png_ptr);
+
    /* NOTE: write_data_fn must not change the buffer! */
    if (png_ptr->write_data_fn != NULL )
       (*(png_ptr->write_data_fn))(png_ptr, data, length);
 
    else
       png_error(png_ptr, "Call to NULL write function");
+
+   png_stats_end(png_ptr, PNG_STAT_WRITE_DATA, stat_start, length);
 }
 
 /* This is the function that does the actual writing of data.  If you are
@@ -0,0 +1,96 @@
+/* pngwork.cpp - work limits for untrusted input
+ *
+ * This code is released under the libpng license.
+ * For conditions of distribution and use, see the disclaimer
+ * and license in png.h
+ *
+ * The size limits (png_set_user_limits, png_set_chunk_malloc_max) do not stop
+ * a small file that is merely expensive: a few KB of IDAT can inflate to a
+ * gigapixel image and a stream of tiny chunks can keep the reader busy
+ * indefinitely.  The work limits bound the total effort instead.  The reader
+ * charges work as it goes and png_work_check stops the read with png_error
+ * once a limit has been passed, so the application sees an ordinary error.
+ */
+
+#include <pngmem.h>
+#include <pngerror.h>
+#include <pngdebug.h>
+#include <stats.h>
+#include <work.h>
+
+#include "pngpriv.h"
+
+struct png_work_def
+{
+   png_off_t max[3];             /* indexed by PNG_WORK_, 0 for no limit */
+   png_off_t done[3];
+   png_off_t deadline;           /* png_stats_clock time, 0 for none */
+};
+
+void /* PRIVATE */
+png_work_check(png_const_structrp png_ptr, int kind, png_off_t amount)
+{
+   png_workp work = png_ptr->work;
+
+   if (kind < PNG_WORK_ROW)
+   {
+      work->done[kind] += amount;
+
+      if (work->max[kind] > 0 && work->done[kind] > work->max[kind])
+      {
+         switch (kind)
+         {
+            case PNG_WORK_INFLATE:
+               png_error(png_ptr, "inflated data exceeds the work limit");
+
+            case PNG_WORK_CHUNK:
+               png_error(png_ptr, "number of chunks exceeds the work limit");
+
+            default:
+               png_error(png_ptr, "transformed pixels exceed the work limit");
+         }
+      }
+   }
+
+   if (work->deadline > 0 && (kind == PNG_WORK_ROW || kind == PNG_WORK_CHUNK)
+       && png_stats_clock() > work->deadline)
+      png_error(png_ptr, "decode deadline exceeded");
+}
+
+void PNGAPI
+png_set_work_limits(png_structrp png_ptr, png_off_t max_inflated_bytes,
+    png_uint_32 max_chunks, png_off_t max_pixels, png_uint_32 max_milliseconds)
+{
+   png_debug(1, "in png_set_work_limits");
+
+   if (png_ptr == NULL)
+      return;
+
+   if (max_inflated_bytes == 0 && max_chunks == 0 && max_pixels == 0 &&
+       max_milliseconds == 0)
+   {
+      png_free(png_ptr, png_ptr->work);
+      png_ptr->work = NULL;
+      return;
+   }
+
+   if (png_ptr->work == NULL)
+   {
+      png_ptr->work = (png_workp)png_malloc_warn(png_ptr, sizeof (png_work));
+
+      if (png_ptr->work == NULL)
+      {
+         png_warning(png_ptr, "Insufficient memory for work limits");
+         return;
+      }
+   }
+
+   memset(png_ptr->work, 0, sizeof (png_work));
+   png_ptr->work->max[PNG_WORK_INFLATE] = max_inflated_bytes;
+   png_ptr->work->max[PNG_WORK_CHUNK] = max_chunks;
+   png_ptr->work->max[PNG_WORK_PIXELS] = max_pixels;
+
+   if (max_milliseconds > 0)
+      png_ptr->work->deadline = png_stats_clock() +
+         (png_off_t)max_milliseconds * 1000000;
+}
@@ -21,6 +21,9 @@
 #include <pngdebug.h>
 #include <trans.h>
 #include <wutil.h>
+#include <quant.h>
+#include <pngtrace.h>
+#include <pngthread.h>
 
 #include "pngpriv.h"
 
@@ -92,6 +95,9 @@ png_write_info_before_PLTE(png_structrp png_ptr, png_const_inforp info_ptr)
 
    if ((png_ptr->mode & PNG_WROTE_INFO_BEFORE_PLTE) == 0)
    {
+      /* Compress the profile and the text chunks first, all at once. */
+      png_zchunk_prepare(png_ptr, info_ptr);
+
       /* Write PNG signature */
       png_write_sig(png_ptr);
 
@@ -272,6 +278,7 @@ png_write_info(png_structrp png_ptr, png_const_inforp info_ptr)
    }
 
    write_unknown_chunks(png_ptr, info_ptr, PNG_HAVE_PLTE);
+   png_zchunk_free(png_ptr);
 }
 
 /* Writes the end of the PNG file.  If you don't want to write comments or
@@ -297,6 +304,9 @@ png_write_end (png_structrp png_ptr, png_inforp info_ptr)
   if (info_ptr != NULL)
   {
     int i; /* local index variable */
+
+    png_zchunk_prepare (png_ptr, info_ptr);
+
     /* Check to see if user has supplied a time chunk */
     if ((info_ptr->valid & PNG_INFO_tIME) != 0 && (png_ptr->mode & PNG_WROTE_tIME) == 0)
       png_write_tIME (png_ptr, &(info_ptr->mod_time));
@@ -340,6 +350,7 @@ png_write_end (png_structrp png_ptr, png_inforp info_ptr)
       png_write_eXIf (png_ptr, info_ptr->exif, info_ptr->num_exif);
 
     write_unknown_chunks (png_ptr, info_ptr, PNG_AFTER_IDAT);
+    png_zchunk_free (png_ptr);
   }
 
   png_ptr->mode |= PNG_AFTER_IDAT;
@@ -506,6 +517,10 @@ png_write_image(png_structrp png_ptr, png_bytepp image)
     */
    num_pass = png_set_interlace_handling(png_ptr);
 
+   /* With all the rows at hand the passes can be encoded in parallel. */
+   if (num_pass > 1 && png_adam7_write_image(png_ptr, image) != 0)
+      return;
+
    /* Loop through passes */
    for (pass = 0; pass < num_pass; pass++)
    {
@@ -657,6 +672,7 @@ png_write_row(png_structrp png_ptr, png_const_bytep row)
       png_do_check_palette_indexes(png_ptr, &row_info);
 
    /* Find a filter if necessary, filter the row and write it out. */
+   png_trace3(write__row, png_ptr, png_ptr->row_number, png_ptr->pass);
    png_write_find_filter(png_ptr, &row_info);
 
    if (png_ptr->write_row_fn != NULL)
@@ -693,6 +709,59 @@ png_write_flush(png_structrp png_ptr)
    png_flush(png_ptr);
 }
 
+png_encode_cachep PNGAPI
+png_create_encode_cache(png_uint_32 band_rows)
+{
+   png_encode_cachep cache = (png_encode_cachep)malloc(sizeof *cache);
+
+   if (cache != NULL)
+   {
+      memset(cache, 0, sizeof *cache);
+
+      if (band_rows == 0)
+         band_rows = 32;
+
+      else if (band_rows > PNG_UINT_31_MAX)
+         band_rows = PNG_UINT_31_MAX;
+
+      cache->band_rows = band_rows;
+   }
+
+   return cache;
+}
+
+void PNGAPI
+png_destroy_encode_cache(png_encode_cachep cache)
+{
+   if (cache != NULL)
+   {
+      free(cache->bands);
+      free(cache->data);
+      free(cache);
+   }
+}
+
+void PNGAPI
+png_set_encode_cache(png_structrp png_ptr, png_encode_cachep cache,
+    png_uint_32 first_row, png_uint_32 num_rows)
+{
+   png_debug(1, "in png_set_encode_cache");
+
+   if (png_ptr == NULL)
+      return;
+
+   if (png_ptr->row_buf != NULL)
+   {
+      png_app_error(png_ptr, "png_set_encode_cache: image already started");
+      return;
+   }
+
+   png_ptr->encode_cache = cache;
+   png_ptr->encode_dirty_first = first_row;
+   png_ptr->encode_dirty_end = num_rows > PNG_UINT_32_MAX - first_row ?
+       PNG_UINT_32_MAX : first_row + num_rows;
+}
+
 /* Free any memory used in png_ptr struct without freeing the struct itself. */
 static void
 png_write_destroy(png_structrp png_ptr)
@@ -717,6 +786,21 @@ png_write_destroy(png_structrp png_ptr)
    png_free(png_ptr, png_ptr->chunk_list);
    png_ptr->chunk_list = NULL;
 
+   png_free(png_ptr, png_ptr->encode_bands);
+   png_free(png_ptr, png_ptr->encode_data);
+   png_ptr->encode_bands = NULL;
+   png_ptr->encode_data = NULL;
+
+   png_fast_deflate_destroy(png_ptr, png_ptr->fast_deflate);
+   png_ptr->fast_deflate = NULL;
+   png_trial_destroy(png_ptr, png_ptr->trial);
+   png_ptr->trial = NULL;
+   png_adam7_destroy(png_ptr, png_ptr->adam7);
+   png_ptr->adam7 = NULL;
+   png_zchunk_free(png_ptr);
+   png_free(png_ptr, png_ptr->stats);
+   png_ptr->stats = NULL;
+
    /* The error handling and memory handling information is left intact at this
     * point: the jmp_buf may still have to be freed.  See png_destroy_png_struct
     * for how this happens.
@@ -943,6 +1027,65 @@ png_set_compression_method(png_structrp png_ptr, int method)
    png_ptr->zlib_method = method;
 }
 
+void PNGAPI
+png_set_encode_speed(png_structrp png_ptr, int speed)
+{
+   int filters, level, mem_level;
+
+   png_debug(1, "in png_set_encode_speed");
+
+   if (png_ptr == NULL)
+      return;
+
+   if (png_ptr->row_buf != NULL)
+   {
+      png_app_error(png_ptr, "png_set_encode_speed: image already started");
+      return;
+   }
+
+   switch (speed)
+   {
+      case PNG_ENCODE_SPEED_REALTIME:
+         /* The level is only used if an encode cache needs zlib. */
+         filters = PNG_FILTER_UP; level = 1; mem_level = 8; break;
+
+      case PNG_ENCODE_SPEED_FAST:
+         filters = PNG_FILTER_SUB; level = 1; mem_level = 8; break;
+
+      case PNG_ENCODE_SPEED_DEFAULT:
+         filters = PNG_NO_FILTERS; level = PNG_Z_DEFAULT_COMPRESSION;
+         mem_level = 8; break;
+
+      case PNG_ENCODE_SPEED_SMALL:
+         filters = PNG_NO_FILTERS; level = 9; mem_level = 9; break;
+
+      case PNG_ENCODE_SPEED_ARCHIVE:
+      case PNG_ENCODE_SPEED_SMALLEST:
+         /* Trial compression (pngtrial.cpp); the filters and level are only
+          * used with an encode cache.
+          */
+         filters = PNG_ALL_FILTERS; level = 9; mem_level = 9; break;
+
+      default:
+         png_app_error(png_ptr, "png_set_encode_speed: unknown speed");
+         return;
+   }
+
+   /* PNG_NO_FILTERS leaves the choice to png_write_start_row, which does not
+    * filter palette or low bit depth images.
+    */
+   if (filters == PNG_NO_FILTERS)
+      png_ptr->do_filter = PNG_NO_FILTERS;
+
+   else
+      png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, filters);
+
+   png_ptr->zlib_level = level;
+   png_ptr->zlib_mem_level = mem_level;
+   png_ptr->flags &= ~PNG_FLAG_ZLIB_CUSTOM_STRATEGY;
+   png_ptr->encode_speed = speed;
+}
+
 /* The following were added to libpng-1.5.4 */
 void PNGAPI
 png_set_text_compression_level(png_structrp png_ptr, int level)
@@ -1176,12 +1319,41 @@ typedef struct
    png_const_voidp first_row;
    ptrdiff_t       row_bytes;
    png_voidp       local_row;
+   /* Lossless reduction (PNG_IMAGE_FLAG_REDUCE) */
+   int             reduced;     /* the image has been analyzed */
+   int             strip_alpha; /* the alpha channel is all opaque */
+   int             bit_depth;   /* gray output depth if below 8, else 0 */
    /* Byte count for memory writing */
    png_bytep        memory;
    size_t memory_bytes; /* not used for STDIO */
    size_t output_bytes; /* running total */
 } png_image_write_control;
 
+/* The vector row converters, if any are usable on this machine. */
+static png_image_row_8bit_ptr
+png_image_row_8bit_select(void)
+{
+#if PNG_IMAGE_SIMD == 1
+   if (png_image_have_avx2() != 0)
+      return png_image_row_8bit_avx2;
+#elif PNG_IMAGE_SIMD == 2
+   return png_image_row_8bit_neon;
+#endif
+   return NULL;
+}
+
+static png_image_row_16bit_ptr
+png_image_row_16bit_select(void)
+{
+#if PNG_IMAGE_SIMD == 1
+   if (png_image_have_avx2() != 0)
+      return png_image_row_16bit_avx2;
+#elif PNG_IMAGE_SIMD == 2
+   return png_image_row_16bit_neon;
+#endif
+   return NULL;
+}
+
 /* Write png_uint_16 input to a 16-bit PNG; the png_ptr has already been set to
  * do any necessary byte swapping.  The component order is defined by the
  * png_image format value.
@@ -1199,13 +1371,16 @@ png_write_image_16bit(png_voidp argument)
    unsigned int channels = (image->format & PNG_FORMAT_FLAG_COLOR) != 0 ?
        3 : 1;
    int aindex = 0;
+   int afirst = 0;
    png_uint_32 y = image->height;
+   png_image_row_16bit_ptr convert = png_image_row_16bit_select();
 
    if ((image->format & PNG_FORMAT_FLAG_ALPHA) != 0)
    {
       if ((image->format & PNG_FORMAT_FLAG_AFIRST) != 0)
       {
          aindex = -1;
+         afirst = 1;
          ++input_row; /* To point to the first component */
          ++output_row;
       }
@@ -1227,6 +1402,18 @@ png_write_image_16bit(png_voidp argument)
       png_const_uint_16p in_ptr = input_row;
       png_uint_16p out_ptr = output_row;
 
+      /* The vector code does as many pixels as it can, the rest are done
+       * below.
+       */
+      if (convert != NULL)
+      {
+         size_t done = convert(input_row - afirst, output_row - afirst,
+             image->width, channels+1, afirst) * (size_t)(channels+1);
+
+         in_ptr += done;
+         out_ptr += done;
+      }
+
       while (out_ptr < row_end)
       {
          png_uint_16 alpha = in_ptr[aindex];
@@ -1351,15 +1538,18 @@ png_write_image_8bit(png_voidp argument)
    png_uint_32 y = image->height;
    unsigned int channels = (image->format & PNG_FORMAT_FLAG_COLOR) != 0 ?
        3 : 1;
+   png_image_row_8bit_ptr convert = png_image_row_8bit_select();
 
    if ((image->format & PNG_FORMAT_FLAG_ALPHA) != 0)
    {
       png_bytep row_end;
       int aindex;
+      int afirst = 0;
 
       if ((image->format & PNG_FORMAT_FLAG_AFIRST) != 0)
       {
          aindex = -1;
+         afirst = 1;
          ++input_row; /* To point to the first component */
          ++output_row;
       }
@@ -1375,6 +1565,15 @@ png_write_image_8bit(png_voidp argument)
          png_const_uint_16p in_ptr = input_row;
          png_bytep out_ptr = output_row;
 
+         if (convert != NULL)
+         {
+            size_t done = convert(input_row - afirst, output_row - afirst,
+                image->width, channels+1, afirst) * (size_t)(channels+1);
+
+            in_ptr += done;
+            out_ptr += done;
+         }
+
          while (out_ptr < row_end)
          {
             png_uint_16 alpha = in_ptr[aindex];
@@ -1415,6 +1614,15 @@ png_write_image_8bit(png_voidp argument)
          png_const_uint_16p in_ptr = input_row;
          png_bytep out_ptr = output_row;
 
+         if (convert != NULL)
+         {
+            size_t done = convert(input_row, output_row, image->width,
+                channels, 0) * (size_t)channels;
+
+            in_ptr += done;
+            out_ptr += done;
+         }
+
          while (out_ptr < row_end)
          {
             png_uint_32 component = *in_ptr++;
@@ -1568,6 +1776,491 @@ png_image_set_PLTE(png_image_write_control *display)
    image->colormap_entries = (png_uint_32)entries;
 }
 
+/* Writing an RGB image as a quantized palette image.  The rows are split into
+ * bands, one per thread; the bands are histogrammed in parallel, the palette is
+ * chosen from the combined histogram and then the bands are mapped to palette
+ * indices in parallel.  Dithering carries the error from each row to the next,
+ * so a dithered image is mapped in one pass down the whole image; the output
+ * never depends on the number of threads.  The result is written as a
+ * color-mapped image.
+ */
+typedef struct
+{
+   png_image_write_control *display;
+   png_const_bytep  first_row;
+   ptrdiff_t        row_bytes;
+   png_uint_32      band_rows;
+   png_uint_32      bands;
+   int              bgr;
+   png_quant_cell  *histograms;   /* one per band */
+   png_quant_color *colors;
+   png_quant_treep  tree;
+   png_int_32      *errors;       /* dithering error, or NULL */
+   png_bytep        indices;      /* the palette image */
+   png_byte         colormap[3*PNG_MAX_PALETTE_LENGTH];
+} png_image_quantize_control;
+
+static int
+png_image_write_main(png_voidp argument);
+
+static void
+png_image_quantize_histogram(png_voidp arg, png_uint_32 band)
+{
+   png_image_quantize_control *control = (png_image_quantize_control*)arg;
+   png_imagep image = control->display->image;
+   png_uint_32 y = band * control->band_rows;
+   png_uint_32 end = y + control->band_rows;
+   png_quant_cell *histogram = control->histograms +
+       (size_t)band * PNG_QUANT_HIST_SIZE;
+
+   if (end > image->height)
+      end = image->height;
+
+   for (; y < end; ++y)
+      png_quant_histogram_row(histogram, control->first_row +
+          (ptrdiff_t)y * control->row_bytes, image->width, control->bgr);
+}
+
+static void
+png_image_quantize_map_rows(png_image_quantize_control *control,
+    png_uint_32 y, png_uint_32 end)
+{
+   png_imagep image = control->display->image;
+   png_quant_cache cache;
+
+   png_quant_cache_init(&cache);
+
+   for (; y < end; ++y)
+      png_quant_map_row(control->tree, &cache, control->first_row +
+          (ptrdiff_t)y * control->row_bytes, control->indices +
+          (size_t)y * image->width, image->width, 3, control->bgr,
+          control->errors);
+}
+
+static void
+png_image_quantize_map(png_voidp arg, png_uint_32 band)
+{
+   png_image_quantize_control *control = (png_image_quantize_control*)arg;
+   png_uint_32 y = band * control->band_rows;
+   png_uint_32 end = y + control->band_rows;
+
+   if (end > control->display->image->height)
+      end = control->display->image->height;
+
+   png_image_quantize_map_rows(control, y, end);
+}
+
+static int
+png_image_write_quantize_main(png_voidp argument)
+{
+   png_image_quantize_control *control =
+       (png_image_quantize_control*)argument;
+   png_image_write_control *display = control->display;
+   png_imagep image = display->image;
+   png_structrp png_ptr = image->opaque->png_ptr;
+   png_uint_32 maximum = image->colormap_entries;
+   png_uint_32 num_colors, entries, i;
+   png_image_write_control indexed;
+
+   png_parallel_for(control->bands, png_image_quantize_histogram, control);
+
+   control->colors = (png_quant_color*)png_malloc_array(png_ptr,
+       PNG_QUANT_HIST_SIZE, sizeof *control->colors);
+
+   if (control->colors == NULL)
+      png_error(png_ptr, "quantize: out of memory");
+
+   num_colors = png_quant_histogram_colors(control->histograms, control->bands,
+       control->colors);
+
+   if (maximum == 0 || maximum > PNG_MAX_PALETTE_LENGTH)
+      maximum = PNG_MAX_PALETTE_LENGTH;
+
+   {
+      png_color palette[PNG_MAX_PALETTE_LENGTH];
+
+      entries = (png_uint_32)png_quant_palette(png_ptr, control->colors,
+          num_colors, palette, (int)maximum);
+
+      control->tree = (png_quant_treep)png_malloc(png_ptr,
+          sizeof *control->tree);
+      png_quant_tree_init(control->tree, palette, (int)entries);
+
+      for (i = 0; i < entries; ++i)
+      {
+         control->colormap[3*i+0] = palette[i].red;
+         control->colormap[3*i+1] = palette[i].green;
+         control->colormap[3*i+2] = palette[i].blue;
+      }
+   }
+
+   control->indices = (png_bytep)png_malloc(png_ptr,
+       (size_t)image->height * image->width);
+
+   if ((image->flags & PNG_IMAGE_FLAG_QUANTIZE_DITHER) != 0)
+   {
+      control->errors = (png_int_32*)png_calloc(png_ptr,
+          6 * ((size_t)image->width + 2) * (sizeof (png_int_32)));
+      png_image_quantize_map_rows(control, 0, image->height);
+   }
+
+   else
+      png_parallel_for(control->bands, png_image_quantize_map, control);
+
+   /* Write the result as a color-mapped image. */
+   indexed = *display;
+   indexed.buffer = control->indices;
+   indexed.row_stride = (png_int_32)image->width;
+   indexed.colormap = control->colormap;
+   image->format = PNG_FORMAT_RGB_COLORMAP;
+   image->colormap_entries = entries;
+
+   return png_image_write_main(&indexed);
+}
+
+static int
+png_image_write_quantized(png_image_write_control *display)
+{
+   png_imagep image = display->image;
+   png_structrp png_ptr = image->opaque->png_ptr;
+   png_uint_32 format = image->format;
+   png_uint_32 entries = image->colormap_entries;
+   png_image_quantize_control control;
+   int result;
+
+   memset(&control, 0, (sizeof control));
+   control.display = display;
+   control.bgr = (format & PNG_FORMAT_FLAG_BGR) != 0;
+   control.first_row = (png_const_bytep)display->buffer;
+   control.row_bytes = display->row_stride;
+
+   if (control.row_bytes < 0)
+      control.first_row += (image->height-1) * (-control.row_bytes);
+
+   /* One band per thread, but the 32-bit sums in a band's histogram limit it
+    * to 2^29 pixels.
+    */
+   control.bands = png_thread_count();
+   control.band_rows = (image->height + control.bands - 1) / control.bands;
+
+   if (control.band_rows > 0x1fffffffU / image->width)
+      control.band_rows = 0x1fffffffU / image->width;
+
+   control.bands = (image->height + control.band_rows - 1) / control.band_rows;
+
+   control.histograms = (png_quant_cell*)png_calloc(png_ptr,
+       (size_t)control.bands * PNG_QUANT_HIST_SIZE *
+       (sizeof (png_quant_cell)));
+
+   result = png_safe_execute(image, png_image_write_quantize_main, &control);
+
+   image->format = format;
+   image->colormap_entries = entries;
+   png_free(png_ptr, control.histograms);
+   png_free(png_ptr, control.colors);
+   png_free(png_ptr, control.tree);
+   png_free(png_ptr, control.errors);
+   png_free(png_ptr, control.indices);
+
+   return result;
+}
+
+/* Lossless reduction.  An 8-bit image is scanned for the properties that allow
+ * a smaller PNG: an alpha channel that is always 255, color components that
+ * are always equal, gray levels that fit in fewer bits and at most 256
+ * distinct pixel values.  The scan stops as soon as all of these have been
+ * ruled out.  The smallest representation is then written through the normal
+ * code: either with png_set_filler to drop the alpha channel or from a
+ * converted copy of the image, as gray or as a color-mapped image.
+ */
+#define PNG_REDUCE_HASH 1024 /* more than four times the palette size */
+
+typedef struct
+{
+   png_image_write_control *display;
+   png_const_bytep  first_row;
+   ptrdiff_t        row_bytes;
+   unsigned int     channels;
+   int              ri, gi, bi, ai;  /* component offsets, ai < 0: no alpha */
+   /* Findings */
+   int              opaque;      /* all alpha values are 255 */
+   int              gray;        /* all pixels are gray */
+   png_uint_32      num_colors;  /* distinct RGBA values, 257 means more */
+   png_uint_32      colors[PNG_MAX_PALETTE_LENGTH];   /* 0xRRGGBBAA */
+   png_uint_16      hash[PNG_REDUCE_HASH];  /* color index + 1, 0 if empty */
+   png_byte         levels[256]; /* gray levels seen */
+   /* The reduced image */
+   png_bytep        pixels;
+   png_byte         colormap[4*PNG_MAX_PALETTE_LENGTH];
+} png_image_reduce_control;
+
+static png_uint_32
+png_image_reduce_pixel(const png_image_reduce_control *control,
+    png_const_bytep p)
+{
+   return ((png_uint_32)p[control->ri] << 24) |
+       ((png_uint_32)p[control->gi] << 16) | ((png_uint_32)p[control->bi] << 8) |
+       (control->ai >= 0 ? p[control->ai] : 255U);
+}
+
+/* Returns the index of color in the table, adding it if there is room; more
+ * than 256 colors sets num_colors to 257 and returns 0.
+ */
+static png_uint_32
+png_image_reduce_color(png_image_reduce_control *control, png_uint_32 color)
+{
+   png_uint_32 slot = (color * 2654435761U) >> 22; /* PNG_REDUCE_HASH */
+
+   for (;; slot = (slot + 1) & (PNG_REDUCE_HASH-1))
+   {
+      unsigned int i = control->hash[slot];
+
+      if (i == 0)
+      {
+         if (control->num_colors >= PNG_MAX_PALETTE_LENGTH)
+         {
+            control->num_colors = PNG_MAX_PALETTE_LENGTH+1;
+            return 0;
+         }
+
+         control->colors[control->num_colors] = color;
+         control->hash[slot] = (png_uint_16)++control->num_colors;
+         return control->num_colors-1;
+      }
+
+      if (control->colors[i-1] == color)
+         return i-1;
+   }
+}
+
+static void
+png_image_reduce_scan(png_image_reduce_control *control)
+{
+   png_imagep image = control->display->image;
+   png_uint_32 y;
+
+   control->opaque = control->ai < 0 ? 0 : 1; /* only useful with alpha */
+   control->gray = 1;
+   control->num_colors = 0;
+
+   for (y = 0; y < image->height; ++y)
+   {
+      png_const_bytep p = control->first_row + (ptrdiff_t)y *
+          control->row_bytes;
+      png_const_bytep end = p + (size_t)image->width * control->channels;
+      png_uint_32 last = ~png_image_reduce_pixel(control, p); /* not seen */
+
+      for (; p < end; p += control->channels)
+      {
+         png_uint_32 color = png_image_reduce_pixel(control, p);
+
+         if (control->opaque != 0 && (color & 0xff) != 0xff)
+            control->opaque = 0;
+
+         if (control->gray != 0)
+         {
+            if ((color >> 24) != ((color >> 16) & 0xff) ||
+                (color >> 24) != ((color >> 8) & 0xff))
+               control->gray = 0;
+
+            else
+               control->levels[color >> 24] = 1;
+         }
+
+         if (control->num_colors <= PNG_MAX_PALETTE_LENGTH && color != last)
+         {
+            png_image_reduce_color(control, color);
+            last = color;
+         }
+      }
+
+      /* Nothing left to find? */
+      if (control->opaque == 0 && control->gray == 0 &&
+          control->num_colors > PNG_MAX_PALETTE_LENGTH)
+         break;
+   }
+}
+
+/* The smallest depth that holds all the gray levels exactly. */
+static int
+png_image_reduce_gray_depth(const png_image_reduce_control *control)
+{
+   int depth;
+
+   for (depth = 1; depth < 8; depth *= 2)
+   {
+      unsigned int step = 255U / ((1U << depth) - 1);
+      unsigned int v;
+
+      for (v = 0; v < 256; ++v)
+         if (control->levels[v] != 0 && v % step != 0)
+            break;
+
+      if (v == 256)
+         break;
+   }
+
+   return depth;
+}
+
+static int
+png_image_write_reduce_main(png_voidp argument)
+{
+   png_image_reduce_control *control = (png_image_reduce_control*)argument;
+   png_image_write_control *display = control->display;
+   png_imagep image = display->image;
+   png_structrp png_ptr = image->opaque->png_ptr;
+   int has_alpha = control->ai >= 0 && control->opaque == 0;
+   int color = (image->format & PNG_FORMAT_FLAG_COLOR) != 0 &&
+       control->gray == 0;
+   int gray_depth = !color && !has_alpha ?
+       png_image_reduce_gray_depth(control) : 8;
+   int plain_bits = color ? (has_alpha ? 32 : 24) :
+       (has_alpha ? 16 : gray_depth);
+   int palette_bits = 99;
+   png_image_write_control reduced;
+   png_uint_32 y;
+
+   if (control->num_colors <= PNG_MAX_PALETTE_LENGTH)
+      palette_bits = control->num_colors > 16 ? 8 :
+          (control->num_colors > 4 ? 4 : (control->num_colors > 2 ? 2 : 1));
+
+   reduced = *display;
+   reduced.reduced = 1;
+
+   if (palette_bits < plain_bits)
+   {
+      /* Transparent entries go first to keep the tRNS chunk short. */
+      png_uint_32 map[PNG_MAX_PALETTE_LENGTH];
+      png_uint_32 i, n = 0;
+      int pass;
+
+      for (pass = 0; pass < 2; ++pass)
+         for (i = 0; i < control->num_colors; ++i)
+            if (((control->colors[i] & 0xff) == 0xff) == (pass != 0))
+            {
+               png_uint_32 c = control->colors[i];
+
+               map[i] = n;
+               control->colormap[4*n+0] = (png_byte)(c >> 24);
+               control->colormap[4*n+1] = (png_byte)(c >> 16);
+               control->colormap[4*n+2] = (png_byte)(c >> 8);
+               control->colormap[4*n+3] = (png_byte)c;
+               ++n;
+            }
+
+      control->pixels = (png_bytep)png_malloc(png_ptr,
+          (size_t)image->height * image->width);
+
+      for (y = 0; y < image->height; ++y)
+      {
+         png_const_bytep p = control->first_row + (ptrdiff_t)y *
+             control->row_bytes;
+         png_bytep out = control->pixels + (size_t)y * image->width;
+         png_uint_32 x;
+
+         for (x = 0; x < image->width; ++x, p += control->channels)
+            out[x] = (png_byte)map[png_image_reduce_color(control,
+                png_image_reduce_pixel(control, p))];
+      }
+
+      image->format = PNG_FORMAT_RGBA_COLORMAP;
+      image->colormap_entries = control->num_colors;
+      reduced.colormap = control->colormap;
+      reduced.row_stride = (png_int_32)image->width;
+   }
+
+   else if (color == 0 && (gray_depth < 8 ||
+       (image->format & PNG_FORMAT_FLAG_COLOR) != 0))
+   {
+      /* Gray, possibly with alpha, from a copy of the image. */
+      unsigned int step = 255U / ((1U << gray_depth) - 1);
+      unsigned int out_channels = has_alpha ? 2 : 1;
+
+      control->pixels = (png_bytep)png_malloc(png_ptr,
+          (size_t)image->height * image->width * out_channels);
+
+      for (y = 0; y < image->height; ++y)
+      {
+         png_const_bytep p = control->first_row + (ptrdiff_t)y *
+             control->row_bytes;
+         png_bytep out = control->pixels +
+             (size_t)y * image->width * out_channels;
+         png_uint_32 x;
+
+         for (x = 0; x < image->width; ++x, p += control->channels)
+         {
+            *out++ = (png_byte)(p[control->gi] / step);
+
+            if (has_alpha)
+               *out++ = p[control->ai];
+         }
+      }
+
+      image->format = has_alpha ? PNG_FORMAT_GA : PNG_FORMAT_GRAY;
+      reduced.row_stride = (png_int_32)(image->width * out_channels);
+      reduced.bit_depth = gray_depth < 8 ? gray_depth : 0;
+   }
+
+   else
+   {
+      /* At most the alpha channel goes, which png_set_filler handles. */
+      reduced.strip_alpha = control->ai >= 0 && !has_alpha;
+      return png_image_write_main(&reduced);
+   }
+
+   reduced.buffer = control->pixels;
+   return png_image_write_main(&reduced);
+}
+
+static int
+png_image_write_reduced(png_image_write_control *display)
+{
+   png_imagep image = display->image;
+   png_structrp png_ptr = image->opaque->png_ptr;
+   png_uint_32 format = image->format;
+   png_uint_32 entries = image->colormap_entries;
+   png_image_reduce_control *control;
+   int afirst = (format & PNG_FORMAT_FLAG_AFIRST) != 0 &&
+       (format & PNG_FORMAT_FLAG_ALPHA) != 0;
+   int result;
+
+   control = (png_image_reduce_control*)png_calloc(png_ptr, sizeof *control);
+   control->display = display;
+   control->channels = PNG_IMAGE_PIXEL_CHANNELS(format);
+   control->first_row = (png_const_bytep)display->buffer;
+   control->row_bytes = display->row_stride;
+
+   if (control->row_bytes < 0)
+      control->first_row += (image->height-1) * (-control->row_bytes);
+
+   if ((format & PNG_FORMAT_FLAG_COLOR) != 0)
+   {
+      int bgr = (format & PNG_FORMAT_FLAG_BGR) != 0;
+
+      control->ri = afirst + (bgr ? 2 : 0);
+      control->gi = afirst + 1;
+      control->bi = afirst + (bgr ? 0 : 2);
+   }
+
+   else
+      control->ri = control->gi = control->bi = afirst;
+
+   control->ai = (format & PNG_FORMAT_FLAG_ALPHA) == 0 ? -1 :
+       (afirst ? 0 : (int)control->channels - 1);
+
+   png_image_reduce_scan(control);
+
+   result = png_safe_execute(image, png_image_write_reduce_main, control);
+
+   image->format = format;
+   image->colormap_entries = entries;
+   png_free(png_ptr, control->pixels);
+   png_free(png_ptr, control);
+
+   return result;
+}
+
 static int
 png_image_write_main(png_voidp argument)
 {
@@ -1624,6 +2317,15 @@ png_image_write_main(png_voidp argument)
          png_error(image->opaque->png_ptr, "image row stride too large");
    }
 
+   if ((image->flags & PNG_IMAGE_FLAG_REDUCE) != 0 && display->reduced == 0 &&
+       colormap == 0 && linear == 0 && image->width > 0 && image->height > 0)
+      return png_image_write_reduced(display);
+
+   if ((image->flags & PNG_IMAGE_FLAG_QUANTIZE) != 0 && colormap == 0 &&
+       linear == 0 && alpha == 0 && (format & PNG_FORMAT_FLAG_COLOR) != 0 &&
+       image->width > 0 && image->height > 0)
+      return png_image_write_quantized(display);
+
    /* Set the required transforms then write the rows in the correct order. */
    if ((format & PNG_FORMAT_FLAG_COLORMAP) != 0)
    {
@@ -1646,9 +2348,10 @@ png_image_write_main(png_voidp argument)
 
    else
       png_set_IHDR(png_ptr, info_ptr, image->width, image->height,
-          write_16bit ? 16 : 8,
+          write_16bit ? 16 : (display->bit_depth != 0 ? display->bit_depth : 8),
           ((format & PNG_FORMAT_FLAG_COLOR) ? PNG_COLOR_MASK_COLOR : 0) +
-          ((format & PNG_FORMAT_FLAG_ALPHA) ? PNG_COLOR_MASK_ALPHA : 0),
+          ((format & PNG_FORMAT_FLAG_ALPHA) && display->strip_alpha == 0 ?
+          PNG_COLOR_MASK_ALPHA : 0),
           PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
 
    /* Counter-intuitively the data transformations must be called *after*
@@ -1704,6 +2407,16 @@ png_image_write_main(png_voidp argument)
          format &= ~PNG_FORMAT_FLAG_BGR;
       }
 
+      /* An opaque alpha channel found by the PNG_IMAGE_FLAG_REDUCE analysis
+       * is dropped as a filler.
+       */
+      if (display->strip_alpha != 0)
+      {
+         png_set_filler(png_ptr, 0, (format & PNG_FORMAT_FLAG_AFIRST) != 0 ?
+             PNG_FILLER_BEFORE : PNG_FILLER_AFTER);
+         format &= ~PNG_FORMAT_FLAG_AFIRST;
+      }
+
       if ((format & PNG_FORMAT_FLAG_AFIRST) != 0)
       {
          if (colormap == 0 && (format & PNG_FORMAT_FLAG_ALPHA) != 0)
@@ -1712,9 +2425,11 @@ png_image_write_main(png_voidp argument)
       }
 
    /* If there are 16 or fewer color-map entries we wrote a lower bit depth
-    * above, but the application data is still byte packed.
+    * above, but the application data is still byte packed.  The same goes for
+    * reduced gray images.
     */
-   if (colormap != 0 && image->colormap_entries <= 16)
+   if ((colormap != 0 && image->colormap_entries <= 16) ||
+       display->bit_depth != 0)
       png_set_packing(png_ptr);
 
    /* That should have handled all (both) the transforms. */
@@ -13,6 +13,7 @@
 
 #include <pngdebug.h>
 #include <trans.h>
+#include <stats.h>
 #include "pngpriv.h"
 
 /* Pack pixels into bytes.  Pass the true bit depth in bit_depth.  The
@@ -483,11 +484,15 @@ png_do_write_invert_alpha(png_row_infop row_info, png_bytep row)
 void /* PRIVATE */
 png_do_write_transformations(png_structrp png_ptr, png_row_infop row_info)
 {
+   png_off_t stat_start;
+
    png_debug(1, "in png_do_write_transformations");
 
    if (png_ptr == NULL)
       return;
 
+   stat_start = png_stats_begin(png_ptr);
+
    if ((png_ptr->transformations & PNG_USER_TRANSFORM) != 0)
       if (png_ptr->write_user_transform_fn != NULL)
          (*(png_ptr->write_user_transform_fn)) /* User write transform
@@ -531,4 +536,7 @@ png_do_write_transformations(png_structrp png_ptr, png_row_infop row_info)
 
    if ((png_ptr->transformations & PNG_INVERT_MONO) != 0)
       png_do_invert(row_info, png_ptr->row_buf + 1);
+
+   png_stats_end(png_ptr, PNG_STAT_WRITE_TRANSFORM, stat_start,
+       row_info->rowbytes);
 }
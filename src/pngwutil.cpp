@@ -14,6 +14,8 @@
 #include <pngmem.h>
 #include <pngerror.h>
 #include <pngdebug.h>
+#include <wutil.h>
+#include <stats.h>
 
 #include "pngpriv.h"
 
@@ -237,7 +239,7 @@ png_image_size(png_structrp png_ptr)
     * first argument is the *compressed* data (and it must be deflate
     * compressed.)
     */
-static void
+void /* PRIVATE */
 optimize_cmf(png_bytep data, size_t data_size)
 {
    /* Optimize the CMF field in the zlib stream.  The resultant zlib stream is
@@ -277,6 +279,70 @@ optimize_cmf(png_bytep data, size_t data_size)
    }
 }
 
+size_t /* PRIVATE */
+png_zarena_size(int window_bits, int mem_level)
+{
+   if (window_bits < 0)
+      window_bits = -window_bits;
+
+   if (window_bits < 9)
+      window_bits = 9;
+
+   /* zlib.h gives (1 << (windowBits+2)) + (1 << (memLevel+9)) plus a few
+    * kilobytes; zlib 1.3.1 can keep a fifth byte per literal and zlib-ng
+    * aligns its buffers, which the rest covers.
+    */
+   return ((size_t)1 << (window_bits + 2)) + ((size_t)1 << (mem_level + 9)) +
+       ((size_t)1 << (mem_level + 7)) + 16384;
+}
+
+/* Each block is preceded by the arena's 'used' before it and its own end, so
+ * a block freed while it is the last one gives its memory back; deflateEnd
+ * frees in the reverse of the order deflateInit2 and deflateCopy allocate.
+ * Anything else is reclaimed when the arena is next used.
+ */
+#define PNG_ZARENA_HEADER 16 /* two size_t, keeping the blocks aligned */
+
+static voidpf
+png_zarena_alloc(voidpf opaque, uInt items, uInt size)
+{
+   png_zarena *arena = (png_zarena*)opaque;
+   size_t start = (arena->used + 15) & ~(size_t)15;
+   size_t header[2];
+
+   if (start > arena->size || arena->size - start < PNG_ZARENA_HEADER ||
+       (size > 0 && items > (arena->size - start - PNG_ZARENA_HEADER) / size))
+      return Z_NULL;
+
+   header[0] = arena->used;
+   header[1] = start + PNG_ZARENA_HEADER + (size_t)items * size;
+   memcpy(arena->base + start, header, sizeof header);
+   arena->used = header[1];
+
+   return arena->base + start + PNG_ZARENA_HEADER;
+}
+
+static void
+png_zarena_free(voidpf opaque, voidpf ptr)
+{
+   png_zarena *arena = (png_zarena*)opaque;
+   size_t header[2];
+
+   memcpy(header, (png_bytep)ptr - PNG_ZARENA_HEADER, sizeof header);
+
+   if (header[1] == arena->used)
+      arena->used = header[0];
+}
+
+void /* PRIVATE */
+png_zarena_use(z_stream *z, png_zarena *arena)
+{
+   arena->used = 0;
+   z->zalloc = png_zarena_alloc;
+   z->zfree = png_zarena_free;
+   z->opaque = arena;
+}
+
 /* Initialize the compressor for the appropriate type of compression. */
 static int
 png_deflate_claim(png_structrp png_ptr, png_uint_32 owner,
@@ -363,6 +429,10 @@ png_deflate_claim(png_structrp png_ptr, png_uint_32 owner,
          }
       }
 
+      /* Incremental encoding writes the zlib header and trailer itself. */
+      if (owner == png_IDAT && png_ptr->encode_cache != NULL)
+         windowBits = -windowBits;
+
       /* Check against the previous initialized values, if any. */
       if ((png_ptr->flags & PNG_FLAG_ZSTREAM_INITIALIZED) != 0 &&
          (png_ptr->zlib_set_level != level ||
@@ -439,17 +509,17 @@ png_free_buffer_list(png_structrp png_ptr, png_compression_bufferp *listp)
  * The compression_state structure is shared context for these functions
  * set up by the caller to allow access to the relevant local variables.
  *
- * compression_buffer (new in 1.6.0) is just a linked list of zbuffer_size
- * temporary buffers.  From 1.6.0 it is retained in png_struct so that it will
- * be correctly freed in the event of a write error (previous implementations
- * just leaked memory.)
+ * The compression itself is done by png_zchunk_prepare, which compresses all
+ * the chunks about to be written together on worker threads, or by
+ * png_zchunk_get for data it did not see; see pngzcache.cpp.  The output is
+ * a single buffer kept on the png_struct until the chunks are written.
  */
 typedef struct
 {
    png_const_bytep      input;        /* The uncompressed input data */
    size_t     input_len;    /* Its length */
    png_uint_32          output_len;   /* Final compressed length */
-   png_byte             output[1024]; /* First block of output */
+   png_const_bytep      output;       /* The compressed data */
 } compression_state;
 
 static void
@@ -459,6 +529,7 @@ png_text_compress_init(compression_state *comp, png_const_bytep input,
    comp->input = input;
    comp->input_len = input_len;
    comp->output_len = 0;
+   comp->output = NULL;
 }
 
 /* Compress the data in the compression state input */
@@ -466,177 +537,40 @@ static int
 png_text_compress(png_structrp png_ptr, png_uint_32 chunk_name,
     compression_state *comp, png_uint_32 prefix_len)
 {
+   size_t output_len = 0;
    int ret;
 
-   /* To find the length of the output it is necessary to first compress the
-    * input. The result is buffered rather than using the two-pass algorithm
-    * that is used on the inflate side; deflate is assumed to be slower and a
-    * PNG writer is assumed to have more memory available than a PNG reader.
-    *
-    * IMPLEMENTATION NOTE: the zlib API deflateBound() can be used to find an
-    * upper limit on the output size, but it is always bigger than the input
-    * size so it is likely to be more efficient to use this linked-list
-    * approach.
-    */
-   ret = png_deflate_claim(png_ptr, chunk_name, comp->input_len);
+   PNG_UNUSED(chunk_name)
 
-   if (ret != Z_OK)
-      return ret;
+   ret = png_zchunk_get(png_ptr, comp->input, comp->input_len, &comp->output,
+       &output_len);
 
-   /* Set up the compression buffers, we need a loop here to avoid overflowing a
-    * uInt.  Use ZLIB_IO_MAX to limit the input.  The output is always limited
-    * by the output buffer size, so there is no need to check that.  Since this
-    * is ANSI-C we know that an 'int', hence a uInt, is always at least 16 bits
-    * in size.
+   /* Chunk data is limited to 2^31 bytes in length, so the prefix length must
+    * be counted here.  Otherwise ensure the z_stream::msg pointer is set to
+    * something.
     */
+   if (ret == Z_STREAM_END && output_len >= PNG_UINT_31_MAX - prefix_len)
    {
-      png_compression_bufferp *end = &png_ptr->zbuffer_list;
-      size_t input_len = comp->input_len; /* may be zero! */
-      png_uint_32 output_len;
-
-      /* zlib updates these for us: */
-      png_ptr->zstream.next_in = PNGZ_INPUT_CAST(comp->input);
-      png_ptr->zstream.avail_in = 0; /* Set below */
-      png_ptr->zstream.next_out = comp->output;
-      png_ptr->zstream.avail_out = (sizeof comp->output);
-
-      output_len = png_ptr->zstream.avail_out;
-
-      do
-      {
-         uInt avail_in = ZLIB_IO_MAX;
-
-         if (avail_in > input_len)
-            avail_in = (uInt)input_len;
-
-         input_len -= avail_in;
-
-         png_ptr->zstream.avail_in = avail_in;
-
-         if (png_ptr->zstream.avail_out == 0)
-         {
-            png_compression_buffer *next;
-
-            /* Chunk data is limited to 2^31 bytes in length, so the prefix
-             * length must be counted here.
-             */
-            if (output_len + prefix_len > PNG_UINT_31_MAX)
-            {
-               ret = Z_MEM_ERROR;
-               break;
-            }
-
-            /* Need a new (malloc'ed) buffer, but there may be one present
-             * already.
-             */
-            next = *end;
-            if (next == NULL)
-            {
-               next = (png_compression_bufferp) png_malloc_base (png_ptr, 
-                 PNG_COMPRESSION_BUFFER_SIZE(png_ptr));
-
-               if (next == NULL)
-               {
-                  ret = Z_MEM_ERROR;
-                  break;
-               }
-
-               /* Link in this buffer (so that it will be freed later) */
-               next->next = NULL;
-               *end = next;
-            }
-
-            png_ptr->zstream.next_out = next->output;
-            png_ptr->zstream.avail_out = png_ptr->zbuffer_size;
-            output_len += png_ptr->zstream.avail_out;
-
-            /* Move 'end' to the next buffer pointer. */
-            end = &next->next;
-         }
-
-         /* Compress the data */
-         ret = deflate(&png_ptr->zstream,
-             input_len > 0 ? Z_NO_FLUSH : Z_FINISH);
-
-         /* Claw back input data that was not consumed (because avail_in is
-          * reset above every time round the loop).
-          */
-         input_len += png_ptr->zstream.avail_in;
-         png_ptr->zstream.avail_in = 0; /* safety */
-      }
-      while (ret == Z_OK);
-
-      /* There may be some space left in the last output buffer. This needs to
-       * be subtracted from output_len.
-       */
-      output_len -= png_ptr->zstream.avail_out;
-      png_ptr->zstream.avail_out = 0; /* safety */
-      comp->output_len = output_len;
-
-      /* Now double check the output length, put in a custom message if it is
-       * too long.  Otherwise ensure the z_stream::msg pointer is set to
-       * something.
-       */
-      if (output_len + prefix_len >= PNG_UINT_31_MAX)
-      {
-         png_ptr->zstream.msg = PNGZ_MSG_CAST("compressed data too long");
-         ret = Z_MEM_ERROR;
-      }
-
-      else
-         png_zstream_error(png_ptr, ret);
-
-      /* Reset zlib for another zTXt/iTXt or image data */
-      png_ptr->zowner = 0;
-
-      /* The only success case is Z_STREAM_END, input_len must be 0; if not this
-       * is an internal error.
-       */
-      if (ret == Z_STREAM_END && input_len == 0)
-      {
-         /* Fix up the deflate header, if required */
-         optimize_cmf(comp->output, comp->input_len);
-         /* But Z_OK is returned, not Z_STREAM_END; this allows the claim
-          * function above to return Z_STREAM_END on an error (though it never
-          * does in the current versions of zlib.)
-          */
-         return Z_OK;
-      }
+      png_ptr->zstream.msg = PNGZ_MSG_CAST("compressed data too long");
+      return Z_MEM_ERROR;
+   }
 
-      else
-         return ret;
+   if (ret != Z_STREAM_END)
+   {
+      png_ptr->zstream.msg = NULL;
+      png_zstream_error(png_ptr, ret);
+      return ret == Z_OK ? Z_STREAM_ERROR : ret;
    }
+
+   comp->output_len = (png_uint_32)output_len;
+   return Z_OK;
 }
 
 /* Ship the compressed text out via chunk writes */
 static void
 png_write_compressed_data_out(png_structrp png_ptr, compression_state *comp)
 {
-   png_uint_32 output_len = comp->output_len;
-   png_const_bytep output = comp->output;
-   png_uint_32 avail = (sizeof comp->output);
-   png_compression_buffer *next = png_ptr->zbuffer_list;
-
-   for (;;)
-   {
-      if (avail > output_len)
-         avail = output_len;
-
-      png_write_chunk_data(png_ptr, output, avail);
-
-      output_len -= avail;
-
-      if (output_len == 0 || next == NULL)
-         break;
-
-      avail = png_ptr->zbuffer_size;
-      output = next->output;
-      next = next->next;
-   }
-
-   /* This is an internal error; 'next' must have been NULL! */
-   if (output_len > 0)
-      png_error(png_ptr, "error writing ancillary chunked compressed data");
+   png_write_chunk_data(png_ptr, comp->output, comp->output_len);
 }
 
 /* Write the IHDR chunk, and update the png_struct with the necessary
@@ -832,6 +766,401 @@ png_write_PLTE(png_structrp png_ptr, png_const_colorp palette,
    png_ptr->mode |= PNG_HAVE_PLTE;
 }
 
+/* Write a buffer of compressed data as an IDAT chunk.  The first IDAT may need
+ * deflate header optimization.  With an encode cache the data is also kept.
+ */
+static void
+png_write_IDAT_buffer(png_structrp png_ptr, png_bytep data, uInt size)
+{
+   if ((png_ptr->mode & PNG_HAVE_IDAT) == 0 &&
+       png_ptr->compression_type == PNG_COMPRESSION_TYPE_BASE)
+      optimize_cmf(data, png_image_size(png_ptr));
+
+   if (size > 0)
+   {
+      png_write_complete_chunk(png_ptr, png_IDAT, data, size);
+
+      if (png_ptr->encode_cache != NULL)
+      {
+         if (size > png_ptr->encode_data_max - png_ptr->encode_data_size)
+         {
+            size_t max = png_ptr->encode_data_max;
+            png_bytep buf;
+
+            do
+               max = max < 65536 ? 65536 : max > PNG_SIZE_MAX/2 ?
+                   PNG_SIZE_MAX : 2*max;
+            while (size > max - png_ptr->encode_data_size);
+
+            buf = (png_bytep)png_malloc(png_ptr, max);
+
+            if (png_ptr->encode_data_size > 0)
+               memcpy(buf, png_ptr->encode_data, png_ptr->encode_data_size);
+
+            png_free(png_ptr, png_ptr->encode_data);
+            png_ptr->encode_data = buf;
+            png_ptr->encode_data_max = max;
+         }
+
+         memcpy(png_ptr->encode_data + png_ptr->encode_data_size, data, size);
+         png_ptr->encode_data_size += size;
+      }
+   }
+
+   png_ptr->mode |= PNG_HAVE_IDAT;
+}
+
+/* Append data that is already deflate encoded to the IDAT stream, which must
+ * have been claimed and must be at a byte boundary.
+ */
+void /* PRIVATE */
+png_write_IDAT_bytes(png_structrp png_ptr, png_const_bytep data, size_t len)
+{
+   while (len > 0)
+   {
+      uInt avail = png_ptr->zstream.avail_out;
+
+      if (avail > len)
+         avail = (uInt)len;
+
+      memcpy(png_ptr->zstream.next_out, data, avail);
+      png_ptr->zstream.next_out += avail;
+      png_ptr->zstream.avail_out -= avail;
+      data += avail;
+      len -= avail;
+
+      if (png_ptr->zstream.avail_out == 0)
+      {
+         png_bytep out = png_ptr->zbuffer_list->output;
+
+         png_write_IDAT_buffer(png_ptr, out, png_ptr->zbuffer_size);
+         png_ptr->zstream.next_out = out;
+         png_ptr->zstream.avail_out = png_ptr->zbuffer_size;
+      }
+   }
+}
+
+/* Incremental encoding.  With an encode cache the IDAT data is a raw deflate
+ * stream, with the zlib header and Adler-32 written separately, and each band
+ * of rows ends with a full flush.  A full flush discards the compression
+ * history and leaves the output at a byte boundary, so the compressed data of
+ * a band depends only on its filtered rows.  Those depend on the rows of the
+ * band and the row before it, so if none of these changed the band can be
+ * copied from the previous image.  The Adler-32 of the whole stream is
+ * combined from the values for the bands.
+ */
+
+/* Offset of the next byte of IDAT data. */
+static size_t
+png_encode_position(png_const_structrp png_ptr)
+{
+   return png_ptr->encode_data_size +
+       (png_ptr->zbuffer_size - png_ptr->zstream.avail_out);
+}
+
+static int
+png_encode_band_reused(png_const_structrp png_ptr, png_uint_32 band)
+{
+   png_const_encode_cachep cache = png_ptr->encode_cache;
+   png_uint_32 first = band * cache->band_rows;
+   png_uint_32 end = png_ptr->height - first > cache->band_rows ?
+       first + cache->band_rows : png_ptr->height;
+
+   if (cache->num_bands == 0)
+      return 0;
+
+   if (png_ptr->encode_dirty_first >= png_ptr->encode_dirty_end)
+      return 1;
+
+   /* The row before the band must also be unchanged. */
+   return end <= png_ptr->encode_dirty_first ||
+       first > png_ptr->encode_dirty_end;
+}
+
+static int
+png_encode_strategy(png_const_structrp png_ptr)
+{
+   if ((png_ptr->flags & PNG_FLAG_ZLIB_CUSTOM_STRATEGY) != 0)
+      return png_ptr->zlib_strategy;
+
+   return -1; /* the default, which depends on do_filter */
+}
+
+/* Called at the start of the image: check that the cached image was written
+ * the same way and allocate the new band list.
+ */
+static void
+png_encode_start(png_structrp png_ptr)
+{
+   png_encode_cachep cache = png_ptr->encode_cache;
+   png_uint_32 num_bands;
+
+   if (png_ptr->interlaced != 0)
+   {
+      png_app_warning(png_ptr, "encode cache ignored for interlaced image");
+      png_ptr->encode_cache = NULL;
+      return;
+   }
+
+   num_bands = (png_ptr->height + cache->band_rows - 1) / cache->band_rows;
+
+   if (cache->num_bands != num_bands ||
+       cache->width != png_ptr->width ||
+       cache->height != png_ptr->height ||
+       cache->transformations != png_ptr->transformations ||
+       cache->level != png_ptr->zlib_level ||
+       cache->strategy != png_encode_strategy(png_ptr) ||
+       cache->mem_level != png_ptr->zlib_mem_level ||
+       cache->window_bits != png_ptr->zlib_window_bits ||
+       cache->bit_depth != png_ptr->bit_depth ||
+       cache->color_type != png_ptr->color_type ||
+       cache->do_filter != png_ptr->do_filter)
+   {
+      /* Everything must be compressed. */
+      png_ptr->encode_dirty_first = 0;
+      png_ptr->encode_dirty_end = png_ptr->height;
+   }
+
+   /* num_bands is at most the height, which fits in an int. */
+   png_free(png_ptr, png_ptr->encode_bands);
+   png_ptr->encode_bands = (png_encode_band*)png_malloc_array(png_ptr,
+       (int)num_bands, sizeof (png_encode_band));
+
+   if (png_ptr->encode_bands == NULL)
+      png_error(png_ptr, "Insufficient memory for encode cache");
+
+   png_ptr->encode_data_size = 0;
+}
+
+/* Called when the IDAT stream is complete: replace the cached image.  The
+ * cache outlives the png_struct, so it takes a copy made with malloc rather
+ * than the png_struct's own buffers.
+ */
+static void
+png_encode_save(png_structrp png_ptr)
+{
+   png_encode_cachep cache = png_ptr->encode_cache;
+   png_uint_32 num_bands = (png_ptr->height + cache->band_rows - 1) /
+       cache->band_rows;
+   /* png_encode_start allocated the same amount. */
+   size_t bands_size = num_bands * (sizeof (png_encode_band));
+   size_t data_size = png_ptr->encode_data_size;
+
+   free(cache->bands);
+   free(cache->data);
+
+   cache->bands = (png_encode_band*)malloc(bands_size);
+   cache->data = (png_bytep)malloc(data_size > 0 ? data_size : 1);
+
+   if (cache->bands == NULL || cache->data == NULL)
+   {
+      /* The next image is compressed in full. */
+      free(cache->bands);
+      free(cache->data);
+      cache->bands = NULL;
+      cache->data = NULL;
+      cache->num_bands = 0;
+      cache->data_size = 0;
+      png_warning(png_ptr, "Insufficient memory for encode cache");
+   }
+
+   else
+   {
+      memcpy(cache->bands, png_ptr->encode_bands, bands_size);
+
+      if (data_size > 0)
+         memcpy(cache->data, png_ptr->encode_data, data_size);
+
+      cache->num_bands = num_bands;
+      cache->data_size = data_size;
+   }
+
+   cache->width = png_ptr->width;
+   cache->height = png_ptr->height;
+   cache->transformations = png_ptr->transformations;
+   cache->level = png_ptr->zlib_level;
+   cache->strategy = png_encode_strategy(png_ptr);
+   cache->mem_level = png_ptr->zlib_mem_level;
+   cache->window_bits = png_ptr->zlib_window_bits;
+   cache->bit_depth = png_ptr->bit_depth;
+   cache->color_type = png_ptr->color_type;
+   cache->do_filter = png_ptr->do_filter;
+
+   png_free(png_ptr, png_ptr->encode_bands);
+   png_free(png_ptr, png_ptr->encode_data);
+   png_ptr->encode_bands = NULL;
+   png_ptr->encode_data = NULL;
+   png_ptr->encode_data_size = png_ptr->encode_data_max = 0;
+}
+
+/* The zlib header for the IDAT parameters, for streams whose deflate data
+ * is raw.  It gives the configured window size; optimize_cmf reduces this for
+ * small images just as it does for a header from zlib.
+ */
+static void
+png_write_zlib_header(png_structrp png_ptr)
+{
+   int level = png_ptr->zlib_level;
+   int strategy = (png_ptr->flags & PNG_FLAG_ZLIB_CUSTOM_STRATEGY) != 0 ?
+       png_ptr->zlib_strategy : Z_DEFAULT_STRATEGY;
+   unsigned int header = (unsigned int)(png_ptr->zlib_window_bits - 8) <<
+       12 | 0x800;
+   png_byte buf[2];
+
+   if (level == Z_DEFAULT_COMPRESSION)
+      level = 6;
+
+   if (strategy >= Z_HUFFMAN_ONLY || level < 2)
+      header |= 0 << 6;
+
+   else if (level < 6)
+      header |= 1 << 6;
+
+   else if (level == 6)
+      header |= 2 << 6;
+
+   else
+      header |= 3 << 6;
+
+   header += 31 - (header % 31);
+   buf[0] = (png_byte)(header >> 8);
+   buf[1] = (png_byte)header;
+   png_write_IDAT_bytes(png_ptr, buf, 2);
+}
+
+/* Ensure we have a temporary buffer for compression and trim the buffer list
+ * if it has more than one entry to free memory.  If 'WRITE_COMPRESSED_TEXT' is
+ * not set the list will never have been created at this point, but the check
+ * here is quick and safe.
+ */
+static void
+png_IDAT_buffer(png_structrp png_ptr)
+{
+   if (png_ptr->zbuffer_list == NULL)
+   {
+      png_ptr->zbuffer_list = (png_compression_bufferp) png_malloc(png_ptr, 
+        PNG_COMPRESSION_BUFFER_SIZE(png_ptr));
+      png_ptr->zbuffer_list->next = NULL;
+   }
+
+   else
+      png_free_buffer_list(png_ptr, &png_ptr->zbuffer_list->next);
+}
+
+/* Claim the zstream for IDAT and set up the output buffer. */
+static void
+png_start_IDAT(png_structrp png_ptr)
+{
+   png_IDAT_buffer(png_ptr);
+
+   /* The realtime tier does not use zlib, only the zstream output fields. */
+   if (png_ptr->encode_speed == PNG_ENCODE_SPEED_REALTIME &&
+       png_ptr->encode_cache == NULL)
+   {
+      png_ptr->zowner = png_IDAT;
+      png_ptr->zstream.next_out = png_ptr->zbuffer_list->output;
+      png_ptr->zstream.avail_out = png_ptr->zbuffer_size;
+      png_ptr->fast_deflate = png_fast_deflate_create(png_ptr);
+      return;
+   }
+
+   /* Nor does the smallest tier until the image is complete. */
+   if (png_ptr->trial != NULL)
+   {
+      png_ptr->zowner = png_IDAT;
+      png_ptr->zstream.next_out = png_ptr->zbuffer_list->output;
+      png_ptr->zstream.avail_out = png_ptr->zbuffer_size;
+      return;
+   }
+
+   /* It is a terminal error if we can't claim the zstream. */
+   if (png_deflate_claim(png_ptr, png_IDAT, png_image_size(png_ptr)) != Z_OK)
+      png_error(png_ptr, png_ptr->zstream.msg);
+
+   /* The output state is maintained in png_ptr->zstream, so it must be
+    * initialized here after the claim.
+    */
+   png_ptr->zstream.next_out = png_ptr->zbuffer_list->output;
+   png_ptr->zstream.avail_out = png_ptr->zbuffer_size;
+
+   /* With an encode cache deflate produces a raw stream (see
+    * png_deflate_claim) and the zlib header is written here.
+    */
+   if (png_ptr->encode_cache != NULL)
+      png_write_zlib_header(png_ptr);
+}
+
+/* Finish the IDAT stream: write the remaining data and release the stream. */
+static void
+png_end_IDAT(png_structrp png_ptr)
+{
+   if (png_ptr->encode_cache != NULL)
+   {
+      /* Complete the final band and add the Adler-32 of the whole stream. */
+      png_encode_cachep cache = png_ptr->encode_cache;
+      png_uint_32 num_bands = (png_ptr->height + cache->band_rows - 1) /
+          cache->band_rows;
+      png_encode_band *last = png_ptr->encode_bands + num_bands - 1;
+      png_uint_32 adler = adler32(0, NULL, 0);
+      png_byte buf[4];
+      png_uint_32 i;
+
+      if (png_encode_band_reused(png_ptr, num_bands - 1) == 0)
+         last->size = png_encode_position(png_ptr) - last->start;
+
+      for (i = 0; i < num_bands; ++i)
+         adler = adler32_combine(adler, png_ptr->encode_bands[i].adler,
+             (z_off_t)png_ptr->encode_bands[i].length);
+
+      png_save_uint_32(buf, adler);
+      png_write_IDAT_bytes(png_ptr, buf, 4);
+   }
+
+   /* Any pending output must be flushed.  For small PNG files we may still be
+    * at the beginning.
+    */
+   png_write_IDAT_buffer(png_ptr, png_ptr->zbuffer_list->output,
+       png_ptr->zbuffer_size - png_ptr->zstream.avail_out);
+   png_ptr->zstream.avail_out = 0;
+   png_ptr->zstream.next_out = NULL;
+   png_ptr->mode |= PNG_HAVE_IDAT | PNG_AFTER_IDAT;
+
+   png_ptr->zowner = 0; /* Release the stream */
+
+   if (png_ptr->fast_deflate != NULL)
+   {
+      png_fast_deflate_destroy(png_ptr, png_ptr->fast_deflate);
+      png_ptr->fast_deflate = NULL;
+   }
+
+   png_trial_destroy(png_ptr, png_ptr->trial);
+   png_ptr->trial = NULL;
+
+   if (png_ptr->encode_cache != NULL)
+      png_encode_save(png_ptr);
+}
+
+void /* PRIVATE */
+png_start_IDAT_stream(png_structrp png_ptr)
+{
+   png_IDAT_buffer(png_ptr);
+
+   png_ptr->zowner = png_IDAT;
+   png_ptr->zstream.next_out = png_ptr->zbuffer_list->output;
+   png_ptr->zstream.avail_out = png_ptr->zbuffer_size;
+   png_write_zlib_header(png_ptr);
+}
+
+void /* PRIVATE */
+png_end_IDAT_stream(png_structrp png_ptr, png_uint_32 adler)
+{
+   png_byte buf[4];
+
+   png_save_uint_32(buf, adler);
+   png_write_IDAT_bytes(png_ptr, buf, 4);
+   png_end_IDAT(png_ptr);
+}
+
 /* This is similar to png_text_compress, above, except that it does not require
  * all of the data at once and, instead of buffering the compressed result,
  * writes it as IDAT chunks.  Unlike png_text_compress it *can* png_error out
@@ -843,6 +1172,7 @@ png_write_PLTE(png_structrp png_ptr, png_const_colorp palette,
  *
  * Z_NO_FLUSH: normal incremental output of compressed data
  * Z_SYNC_FLUSH: do a SYNC_FLUSH, used by png_write_flush
+ * Z_FULL_FLUSH: end a band of rows written with an encode cache
  * Z_FINISH: this is the end of the input, do a Z_FINISH and clean up
  *
  * The routine manages the acquire and release of the png_ptr->zstream by
@@ -854,31 +1184,40 @@ png_compress_IDAT(png_structrp png_ptr, png_const_bytep input,
     size_t input_len, int flush)
 {
    if (png_ptr->zowner != png_IDAT)
+      png_start_IDAT(png_ptr);
+
+   /* If the last band was copied from an encode cache the deflate stream is
+    * already complete.
+    */
+   if (flush == Z_FINISH && png_ptr->encode_cache != NULL &&
+       png_encode_band_reused(png_ptr, (png_ptr->height - 1) /
+       png_ptr->encode_cache->band_rows) != 0)
    {
-      /* First time.   Ensure we have a temporary buffer for compression and
-       * trim the buffer list if it has more than one entry to free memory.
-       * If 'WRITE_COMPRESSED_TEXT' is not set the list will never have been
-       * created at this point, but the check here is quick and safe.
-       */
-      if (png_ptr->zbuffer_list == NULL)
-      {
-         png_ptr->zbuffer_list = (png_compression_bufferp) png_malloc(png_ptr, 
-           PNG_COMPRESSION_BUFFER_SIZE(png_ptr));
-         png_ptr->zbuffer_list->next = NULL;
-      }
+      png_end_IDAT(png_ptr);
+      return;
+   }
 
-      else
-         png_free_buffer_list(png_ptr, &png_ptr->zbuffer_list->next);
+   if (png_ptr->fast_deflate != NULL)
+   {
+      png_fast_deflate_data(png_ptr, png_ptr->fast_deflate, input, input_len,
+          flush);
 
-      /* It is a terminal error if we can't claim the zstream. */
-      if (png_deflate_claim(png_ptr, png_IDAT, png_image_size(png_ptr)) != Z_OK)
-         png_error(png_ptr, png_ptr->zstream.msg);
+      if (flush == Z_FINISH)
+         png_end_IDAT(png_ptr);
 
-      /* The output state is maintained in png_ptr->zstream, so it must be
-       * initialized here after the claim.
-       */
-      png_ptr->zstream.next_out = png_ptr->zbuffer_list->output;
-      png_ptr->zstream.avail_out = png_ptr->zbuffer_size;
+      return;
+   }
+
+   /* The rows are only compressed at the end, so flushes do nothing. */
+   if (png_ptr->trial != NULL)
+   {
+      if (flush == Z_FINISH)
+      {
+         png_trial_finish(png_ptr, png_ptr->trial);
+         png_end_IDAT(png_ptr);
+      }
+
+      return;
    }
 
    /* Now loop reading and writing until all the input is consumed or an error
@@ -889,6 +1228,7 @@ png_compress_IDAT(png_structrp png_ptr, png_const_bytep input,
    png_ptr->zstream.avail_in = 0; /* set below */
    for (;;)
    {
+      png_off_t stat_start;
       int ret;
 
       /* INPUT: from the row data */
@@ -900,7 +1240,10 @@ png_compress_IDAT(png_structrp png_ptr, png_const_bytep input,
       png_ptr->zstream.avail_in = avail;
       input_len -= avail;
 
+      stat_start = png_stats_begin(png_ptr);
       ret = deflate(&png_ptr->zstream, input_len > 0 ? Z_NO_FLUSH : flush);
+      png_stats_end(png_ptr, PNG_STAT_DEFLATE, stat_start,
+          avail - png_ptr->zstream.avail_in);
 
       /* Include as-yet unconsumed input */
       input_len += png_ptr->zstream.avail_in;
@@ -915,16 +1258,8 @@ png_compress_IDAT(png_structrp png_ptr, png_const_bytep input,
          png_bytep data = png_ptr->zbuffer_list->output;
          uInt size = png_ptr->zbuffer_size;
 
-         /* Write an IDAT containing the data then reset the buffer.  The
-          * first IDAT may need deflate header optimization.
-          */
-            if ((png_ptr->mode & PNG_HAVE_IDAT) == 0 &&
-                png_ptr->compression_type == PNG_COMPRESSION_TYPE_BASE)
-               optimize_cmf(data, png_image_size(png_ptr));
-
-         if (size > 0)
-            png_write_complete_chunk(png_ptr, png_IDAT, data, size);
-         png_ptr->mode |= PNG_HAVE_IDAT;
+         /* Write an IDAT containing the data then reset the buffer. */
+         png_write_IDAT_buffer(png_ptr, data, size);
 
          png_ptr->zstream.next_out = data;
          png_ptr->zstream.avail_out = size;
@@ -957,23 +1292,8 @@ png_compress_IDAT(png_structrp png_ptr, png_const_bytep input,
 
       else if (ret == Z_STREAM_END && flush == Z_FINISH)
       {
-         /* This is the end of the IDAT data; any pending output must be
-          * flushed.  For small PNG files we may still be at the beginning.
-          */
-         png_bytep data = png_ptr->zbuffer_list->output;
-         uInt size = png_ptr->zbuffer_size - png_ptr->zstream.avail_out;
-
-         if ((png_ptr->mode & PNG_HAVE_IDAT) == 0 &&
-             png_ptr->compression_type == PNG_COMPRESSION_TYPE_BASE)
-            optimize_cmf(data, png_image_size(png_ptr));
-
-         if (size > 0)
-            png_write_complete_chunk(png_ptr, png_IDAT, data, size);
-         png_ptr->zstream.avail_out = 0;
-         png_ptr->zstream.next_out = NULL;
-         png_ptr->mode |= PNG_HAVE_IDAT | PNG_AFTER_IDAT;
-
-         png_ptr->zowner = 0; /* Release the stream */
+         /* This is the end of the IDAT data. */
+         png_end_IDAT(png_ptr);
          return;
       }
 
@@ -986,6 +1306,75 @@ png_compress_IDAT(png_structrp png_ptr, png_const_bytep input,
    }
 }
 
+/* Compress one filtered row, or at the start of a band that is unchanged copy
+ * the band from the cache.
+ */
+static void
+png_encode_row(png_structrp png_ptr, png_const_bytep row, size_t len)
+{
+   png_encode_cachep cache = png_ptr->encode_cache;
+   png_uint_32 band = png_ptr->row_number / cache->band_rows;
+   png_uint_32 first = band * cache->band_rows;
+   png_uint_32 last = png_ptr->height - first > cache->band_rows ?
+       first + cache->band_rows - 1 : png_ptr->height - 1;
+   png_encode_band *b = png_ptr->encode_bands + band;
+   int reused = png_encode_band_reused(png_ptr, band);
+
+   if (png_ptr->row_number == first)
+   {
+      if (png_ptr->zowner != png_IDAT)
+         png_start_IDAT(png_ptr);
+
+      b->start = png_encode_position(png_ptr);
+
+      if (reused != 0)
+      {
+         const png_encode_band *old = cache->bands + band;
+
+         png_write_IDAT_bytes(png_ptr, cache->data + old->start, old->size);
+         b->size = old->size;
+         b->length = old->length;
+         b->adler = old->adler;
+      }
+
+      else
+      {
+         b->length = 0;
+         b->adler = adler32(0, NULL, 0);
+      }
+   }
+
+   if (reused == 0)
+   {
+      png_const_bytep p = row;
+      size_t n = len;
+      int flush = Z_NO_FLUSH;
+
+      while (n > 0)
+      {
+         uInt avail = ZLIB_IO_MAX;
+
+         if (avail > n)
+            avail = (uInt)n;
+
+         b->adler = adler32(b->adler, p, avail);
+         p += avail;
+         n -= avail;
+      }
+
+      b->length += len;
+
+      /* The last band is ended by the Z_FINISH from png_write_finish_row. */
+      if (png_ptr->row_number == last && last + 1 < png_ptr->height)
+         flush = Z_FULL_FLUSH;
+
+      png_compress_IDAT(png_ptr, row, len, flush);
+
+      if (flush == Z_FULL_FLUSH)
+         b->size = png_encode_position(png_ptr) - b->start;
+   }
+}
+
 /* Write an IEND chunk */
 void /* PRIVATE */
 png_write_IEND(png_structrp png_ptr)
@@ -1828,6 +2217,14 @@ png_write_start_row(png_structrp png_ptr)
       png_ptr->num_rows = png_ptr->height;
       png_ptr->usr_width = png_ptr->width;
    }
+
+   if (png_ptr->encode_cache != NULL)
+      png_encode_start(png_ptr);
+
+   if (png_ptr->encode_cache == NULL &&
+       (png_ptr->encode_speed == PNG_ENCODE_SPEED_ARCHIVE ||
+       png_ptr->encode_speed == PNG_ENCODE_SPEED_SMALLEST))
+      png_ptr->trial = png_trial_create(png_ptr);
 }
 
 /* Internal use only.  Called when finished processing a row of data. */
@@ -2377,9 +2774,27 @@ png_write_find_filter(png_structrp png_ptr, png_row_infop row_info)
    png_uint_32 bpp;
    size_t mins;
    size_t row_bytes = row_info->rowbytes;
+   png_off_t stat_start;
 
    png_debug(1, "in png_write_find_filter");
 
+   /* A band copied from the encode cache needs no filtering. */
+   if (png_ptr->encode_cache != NULL && png_encode_band_reused(png_ptr,
+       png_ptr->row_number / png_ptr->encode_cache->band_rows) != 0)
+   {
+      png_write_filtered_row(png_ptr, png_ptr->row_buf, row_bytes + 1);
+      return;
+   }
+
+   /* The trial tiers filter the rows themselves once they have them all. */
+   if (png_ptr->trial != NULL)
+   {
+      png_write_filtered_row(png_ptr, png_ptr->row_buf, row_bytes + 1);
+      return;
+   }
+
+   stat_start = png_stats_begin(png_ptr);
+
    /* Find out how many bytes offset each pixel is */
    bpp = (row_info->pixel_depth + 7) >> 3;
 
@@ -2554,6 +2969,8 @@ png_write_find_filter(png_structrp png_ptr, png_row_infop row_info)
       }
    }
 
+   png_stats_end(png_ptr, PNG_STAT_FILTER, stat_start, row_bytes);
+
    /* Do the actual writing of the filtered row data from the chosen filter. */
    png_write_filtered_row(png_ptr, best_row, row_info->rowbytes+1);
 }
@@ -2568,7 +2985,14 @@ png_write_filtered_row(png_structrp png_ptr, png_bytep filtered_row,
 
    png_debug1(2, "filter = %d", filtered_row[0]);
 
-   png_compress_IDAT(png_ptr, filtered_row, full_row_length, Z_NO_FLUSH);
+   if (png_ptr->encode_cache != NULL)
+      png_encode_row(png_ptr, filtered_row, full_row_length);
+
+   else if (png_ptr->trial != NULL)
+      png_trial_row(png_ptr, png_ptr->trial, filtered_row, full_row_length);
+
+   else
+      png_compress_IDAT(png_ptr, filtered_row, full_row_length, Z_NO_FLUSH);
 
    /* Swap the current and previous rows */
    if (png_ptr->prev_row != NULL)
@@ -2591,3 +3015,35 @@ png_write_filtered_row(png_structrp png_ptr, png_bytep filtered_row,
       png_write_flush(png_ptr);
    }
 }
+
+void /* PRIVATE */
+png_write_encoded_row(png_structrp png_ptr, png_bytep row, size_t row_bytes,
+    int refilter)
+{
+   png_debug(1, "in png_write_encoded_row");
+
+   /* The pass geometry of the two datastreams must agree. */
+   if (row_bytes != PNG_ROWBYTES(png_ptr->pixel_depth, png_ptr->usr_width) + 1)
+      png_error(png_ptr, "encoded row length mismatch");
+
+   if (refilter != 0)
+   {
+      png_row_info row_info;
+
+      row_info.color_type = png_ptr->color_type;
+      row_info.width = png_ptr->usr_width;
+      row_info.channels = png_ptr->usr_channels;
+      row_info.bit_depth = png_ptr->usr_bit_depth;
+      row_info.pixel_depth = png_ptr->pixel_depth;
+      row_info.rowbytes = row_bytes - 1;
+
+      memcpy(png_ptr->row_buf, row, row_bytes);
+      png_write_find_filter(png_ptr, &row_info);
+   }
+
+   else
+      png_write_filtered_row(png_ptr, row, row_bytes);
+
+   if (png_ptr->write_row_fn != NULL)
+      (*(png_ptr->write_row_fn))(png_ptr, png_ptr->row_number, png_ptr->pass);
+}
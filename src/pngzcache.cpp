@@ -0,0 +1,592 @@
+/* pngzcache.cpp - compression of the iCCP, zTXt and iTXt chunk data
+ *
+ * This code is released under the libpng license.
+ * For conditions of distribution and use, see the disclaimer
+ * and license in png.h
+ *
+ * iCCP must come before IDAT, but zTXt and iTXt may come before or after it;
+ * which is up to the application, which sets the text it wants first before
+ * png_write_info and the rest before png_write_end.  Each call must finish
+ * compressing its own chunks before writing them in order, so instead of
+ * compressing each in turn through png_ptr->zstream as it is written,
+ * png_zchunk_prepare compresses all of a call's chunks at once on worker
+ * threads and keeps the results in a list on the png_struct.  The output is
+ * the same as the serial compression gave: the same zlib parameters and the
+ * same window size reduction for short data.
+ *
+ * The output buffers and the memory of the workers' z_streams are allocated
+ * through the png_struct before the workers start, so png_set_mem_budget
+ * covers them.  A png_compress_cache outlives the png_structs that use it and
+ * is allocated with malloc, outside any budget.
+ */
+
+#include <pngmem.h>
+#include <pngerror.h>
+#include <pngdebug.h>
+#include <wutil.h>
+#include <pngthread.h>
+#include <zcache.h>
+
+#include "pngpriv.h"
+
+/* The text compression parameters, from png_set_text_compression_*. */
+typedef struct
+{
+   int level;
+   int method;
+   int window_bits;
+   int mem_level;
+   int strategy;
+} png_zparams;
+
+struct png_zchunk_def
+{
+   png_zchunkp next;
+   png_const_bytep input;  /* the application's data, not a copy */
+   size_t input_len;
+   png_zparams params;
+   png_bytep output;       /* png_malloc'ed */
+   size_t output_len;
+   int ret;                /* Z_STREAM_END when 'output' is complete */
+};
+
+typedef struct png_compress_entry_def png_compress_entry;
+
+/* An entry of the compress cache, with the input and then the output data
+ * following it in the same block.
+ */
+struct png_compress_entry_def
+{
+   png_compress_entry *next;
+   png_uint_32 crc;        /* of the input */
+   size_t input_len;
+   size_t output_len;
+   png_zparams params;
+};
+
+#define png_compress_entry_input(e) ((png_bytep)((e) + 1))
+#define png_compress_entry_output(e) (png_compress_entry_input(e) + \
+   (e)->input_len)
+
+struct png_compress_cache_def
+{
+   png_compress_entry *first;   /* the most recently used first */
+   size_t bytes;                /* of all the entries */
+   size_t max_bytes;
+};
+
+png_compress_cachep PNGAPI
+png_create_compress_cache(size_t max_bytes)
+{
+   png_compress_cachep cache =
+      (png_compress_cachep)malloc(sizeof *cache);
+
+   if (cache != NULL)
+   {
+      cache->first = NULL;
+      cache->bytes = 0;
+      cache->max_bytes = max_bytes == 0 ? 4*1024*1024 :
+         max_bytes > PNG_SIZE_MAX/2 ? PNG_SIZE_MAX/2 : max_bytes;
+   }
+
+   return cache;
+}
+
+void PNGAPI
+png_destroy_compress_cache(png_compress_cachep cache)
+{
+   if (cache != NULL)
+   {
+      png_compress_entry *entry = cache->first;
+
+      while (entry != NULL)
+      {
+         png_compress_entry *next = entry->next;
+
+         free(entry);
+         entry = next;
+      }
+
+      free(cache);
+   }
+}
+
+void PNGAPI
+png_set_compress_cache(png_structrp png_ptr, png_compress_cachep cache)
+{
+   png_debug(1, "in png_set_compress_cache");
+
+   if (png_ptr == NULL)
+      return;
+
+   if ((png_ptr->mode & PNG_HAVE_IHDR) != 0)
+   {
+      png_app_error(png_ptr,
+          "png_set_compress_cache: cannot be set after writing has started");
+      return;
+   }
+
+   png_ptr->compress_cache = cache;
+}
+
+static int
+png_zparams_equal(const png_zparams *a, const png_zparams *b)
+{
+   return a->level == b->level && a->method == b->method &&
+      a->window_bits == b->window_bits && a->mem_level == b->mem_level &&
+      a->strategy == b->strategy;
+}
+
+static png_uint_32
+png_zchunk_crc(png_const_bytep input, size_t input_len)
+{
+   uLong crc = crc32(0, Z_NULL, 0);
+
+   while (input_len > 0)
+   {
+      uInt n = ZLIB_IO_MAX;
+
+      if (n > input_len)
+         n = (uInt)input_len;
+
+      crc = crc32(crc, input, n);
+      input += n;
+      input_len -= n;
+   }
+
+   return (png_uint_32)crc;
+}
+
+/* Look 'chunk' up in the cache and, if found, copy the output and make the
+ * entry the most recently used.
+ */
+static int
+png_compress_cache_find(png_const_structrp png_ptr, png_compress_cachep cache,
+    png_zchunkp chunk, png_uint_32 crc)
+{
+   png_compress_entry **link = &cache->first;
+   png_compress_entry *entry;
+
+   while ((entry = *link) != NULL)
+   {
+      if (entry->crc == crc && entry->input_len == chunk->input_len &&
+          png_zparams_equal(&entry->params, &chunk->params) &&
+          (chunk->input_len == 0 || memcmp(png_compress_entry_input(entry),
+          chunk->input, chunk->input_len) == 0))
+      {
+         chunk->output = (png_bytep)png_malloc_warn(png_ptr,
+             entry->output_len);
+
+         if (chunk->output == NULL)
+            return 0;
+
+         memcpy(chunk->output, png_compress_entry_output(entry),
+             entry->output_len);
+         chunk->output_len = entry->output_len;
+         chunk->ret = Z_STREAM_END;
+
+         *link = entry->next;
+         entry->next = cache->first;
+         cache->first = entry;
+         return 1;
+      }
+
+      link = &entry->next;
+   }
+
+   return 0;
+}
+
+static void
+png_compress_cache_add(png_compress_cachep cache, const png_zchunk *chunk,
+    png_uint_32 crc)
+{
+   png_compress_entry *entry;
+   size_t size;
+
+   if (chunk->input_len > cache->max_bytes ||
+       chunk->output_len > cache->max_bytes - chunk->input_len)
+      return; /* too big to keep */
+
+   size = sizeof *entry + chunk->input_len + chunk->output_len;
+   entry = (png_compress_entry*)malloc(size);
+
+   if (entry == NULL)
+      return;
+
+   entry->crc = crc;
+   entry->input_len = chunk->input_len;
+   entry->output_len = chunk->output_len;
+   entry->params = chunk->params;
+
+   if (chunk->input_len > 0)
+      memcpy(png_compress_entry_input(entry), chunk->input, chunk->input_len);
+
+   memcpy(png_compress_entry_output(entry), chunk->output, chunk->output_len);
+
+   entry->next = cache->first;
+   cache->first = entry;
+   cache->bytes += size;
+
+   /* Drop the least recently used entries, but never the new one. */
+   while (cache->bytes > cache->max_bytes && entry->next != NULL)
+   {
+      png_compress_entry **link = &entry->next;
+
+      while ((*link)->next != NULL)
+         link = &(*link)->next;
+
+      cache->bytes -= sizeof **link + (*link)->input_len +
+         (*link)->output_len;
+      free(*link);
+      *link = NULL;
+   }
+}
+
+typedef struct
+{
+   png_zchunkp *chunks;
+   png_zarena *arenas;     /* one for each worker */
+} png_zchunk_job;
+
+/* Compress one chunk with its own z_stream into the output allocated for it;
+ * this runs on a worker thread so it reports errors in chunk->ret.
+ */
+static void
+png_zchunk_compress(png_voidp arg, unsigned int worker, png_uint_32 index)
+{
+   png_zchunk_job *job = (png_zchunk_job*)arg;
+   png_zchunkp chunk = job->chunks[index];
+   size_t in_left = chunk->input_len;
+   size_t out_left = chunk->output_len;
+   z_stream z;
+   int ret;
+
+   memset(&z, 0, sizeof z);
+   png_zarena_use(&z, job->arenas + worker);
+   ret = deflateInit2(&z, chunk->params.level, chunk->params.method,
+       chunk->params.window_bits, chunk->params.mem_level,
+       chunk->params.strategy);
+
+   if (ret != Z_OK)
+   {
+      chunk->ret = ret;
+      return;
+   }
+
+   z.next_in = PNGZ_INPUT_CAST(chunk->input);
+   z.next_out = chunk->output;
+
+   do
+   {
+      if (z.avail_in == 0)
+      {
+         uInt n = in_left > ZLIB_IO_MAX ? ZLIB_IO_MAX : (uInt)in_left;
+
+         z.avail_in = n;
+         in_left -= n;
+      }
+
+      if (z.avail_out == 0)
+      {
+         uInt n = out_left > ZLIB_IO_MAX ? ZLIB_IO_MAX : (uInt)out_left;
+
+         z.avail_out = n;
+         out_left -= n;
+      }
+
+      ret = deflate(&z, in_left > 0 ? Z_NO_FLUSH : Z_FINISH);
+   }
+   while (ret == Z_OK);
+
+   chunk->output_len = (size_t)(z.next_out - chunk->output);
+   deflateEnd(&z);
+   chunk->ret = ret;
+}
+
+/* Add a chunk for 'input' to the list, or return NULL if the data is already
+ * there.
+ */
+static png_zchunkp
+png_zchunk_add(png_structrp png_ptr, png_const_bytep input, size_t input_len)
+{
+   png_zchunkp *link = &png_ptr->zchunks;
+   png_zchunkp chunk;
+
+   while ((chunk = *link) != NULL)
+   {
+      if (chunk->input == input && chunk->input_len == input_len)
+         return NULL;
+
+      link = &chunk->next;
+   }
+
+   chunk = (png_zchunkp)png_malloc(png_ptr, sizeof *chunk);
+   memset(chunk, 0, sizeof *chunk);
+   chunk->input = input;
+   chunk->input_len = input_len;
+   chunk->ret = Z_STREAM_ERROR; /* not compressed yet */
+
+   chunk->params.level = png_ptr->zlib_text_level;
+   chunk->params.method = png_ptr->zlib_text_method;
+   chunk->params.window_bits = png_ptr->zlib_text_window_bits;
+   chunk->params.mem_level = png_ptr->zlib_text_mem_level;
+   chunk->params.strategy = png_ptr->zlib_text_strategy;
+
+   /* As png_deflate_claim: a smaller window for short data, allowing for the
+    * 262 bytes zlib needs beyond the data.
+    */
+   if (input_len <= 16384)
+   {
+      unsigned int half_window_size = 1U << (chunk->params.window_bits-1);
+
+      while (input_len + 262 <= half_window_size)
+      {
+         half_window_size >>= 1;
+         --chunk->params.window_bits;
+      }
+   }
+
+   *link = chunk;
+   return chunk;
+}
+
+/* Allocate the output of every chunk, deflateBound without a stream being a
+ * bound for any parameters, and a z_stream's memory for each worker.  A chunk
+ * whose output cannot be had fails with Z_MEM_ERROR; without the memory for
+ * more than one stream the chunks are compressed in turn.  Returns the number
+ * of workers, 0 if none can run.
+ */
+static unsigned int
+png_zchunk_alloc(png_structrp png_ptr, png_zchunkp *chunks, png_uint_32 count,
+    png_zarena **arenas)
+{
+   unsigned int workers = png_thread_count();
+   size_t arena_size = 0;
+   png_bytep mem;
+   png_uint_32 i;
+
+   for (i = 0; i < count; ++i)
+   {
+      png_zchunkp chunk = chunks[i];
+      size_t size = png_zarena_size(chunk->params.window_bits,
+          chunk->params.mem_level);
+
+      chunk->output_len = deflateBound(Z_NULL, (uLong)chunk->input_len);
+      chunk->output = (png_bytep)png_malloc_warn(png_ptr, chunk->output_len);
+
+      if (chunk->output == NULL)
+      {
+         chunk->output_len = 0;
+         chunk->ret = Z_MEM_ERROR;
+      }
+
+      if (size > arena_size)
+         arena_size = size;
+   }
+
+   if (workers > count)
+      workers = count;
+
+   for (;;)
+   {
+      *arenas = (png_zarena*)png_malloc_warn(png_ptr,
+          workers * (sizeof **arenas + arena_size));
+
+      if (*arenas != NULL || workers == 1)
+         break;
+
+      workers = 1;
+   }
+
+   if (*arenas == NULL)
+      return 0;
+
+   mem = (png_bytep)(*arenas + workers);
+
+   for (i = 0; i < workers; ++i)
+   {
+      (*arenas)[i].base = mem + i * arena_size;
+      (*arenas)[i].size = arena_size;
+      (*arenas)[i].used = 0;
+   }
+
+   return workers;
+}
+
+/* Compress 'count' chunks, taking what it can from the compress cache. */
+static void
+png_zchunk_run(png_structrp png_ptr, png_zchunkp *chunks, png_uint_32 count)
+{
+   png_compress_cachep cache = png_ptr->compress_cache;
+   png_uint_32 *crc = NULL;
+   png_uint_32 i, misses = 0;
+   png_zchunk_job job;
+   unsigned int workers;
+
+   if (cache != NULL)
+      crc = (png_uint_32*)png_malloc(png_ptr, count * (sizeof *crc));
+
+   for (i = 0; i < count; ++i)
+   {
+      png_zchunkp chunk = chunks[i];
+
+      if (cache != NULL)
+      {
+         crc[i] = png_zchunk_crc(chunk->input, chunk->input_len);
+
+         if (png_compress_cache_find(png_ptr, cache, chunk, crc[i]))
+            continue;
+
+         crc[misses] = crc[i];
+      }
+
+      chunks[misses++] = chunk;
+   }
+
+   if (misses == 0)
+   {
+      png_free(png_ptr, crc);
+      return;
+   }
+
+   /* The chunks without output are left out of the jobs. */
+   workers = png_zchunk_alloc(png_ptr, chunks, misses, &job.arenas);
+   job.chunks = chunks;
+   count = 0;
+
+   for (i = 0; i < misses; ++i)
+   {
+      png_zchunkp chunk = chunks[i];
+
+      if (chunk->output == NULL)
+         continue;
+
+      if (workers == 0)
+         chunk->ret = Z_MEM_ERROR;
+
+      if (cache != NULL)
+         crc[count] = crc[i];
+
+      chunks[count++] = chunk;
+   }
+
+   if (workers == 1)
+   {
+      for (i = 0; i < count; ++i)
+         png_zchunk_compress(&job, 0, i);
+   }
+
+   else if (workers > 1)
+      png_parallel_for_worker(count, png_zchunk_compress, &job);
+
+   png_free(png_ptr, job.arenas);
+
+   for (i = 0; i < count; ++i)
+   {
+      png_zchunkp chunk = chunks[i];
+
+      if (chunk->ret == Z_STREAM_END)
+      {
+         optimize_cmf(chunk->output, chunk->input_len);
+
+         if (cache != NULL)
+            png_compress_cache_add(cache, chunk, crc[i]);
+      }
+   }
+
+   png_free(png_ptr, crc);
+}
+
+void /* PRIVATE */
+png_zchunk_prepare(png_structrp png_ptr, png_const_inforp info_ptr)
+{
+   png_zchunkp chunks[16];
+   png_uint_32 count = 0;
+   int i;
+
+   png_debug(1, "in png_zchunk_prepare");
+
+   /* The chunks are compressed in batches of at most 16, which limits the
+    * memory used by the z_streams when there are many text chunks.
+    */
+   if ((png_ptr->mode & PNG_WROTE_INFO_BEFORE_PLTE) == 0 &&
+       (info_ptr->colorspace.flags & PNG_COLORSPACE_INVALID) == 0 &&
+       (info_ptr->valid & PNG_INFO_iCCP) != 0 &&
+       info_ptr->iccp_profile != NULL)
+   {
+      png_zchunkp chunk = png_zchunk_add(png_ptr, info_ptr->iccp_profile,
+          png_get_uint_32(info_ptr->iccp_profile));
+
+      if (chunk != NULL)
+         chunks[count++] = chunk;
+   }
+
+   for (i = 0; i < info_ptr->num_text; ++i)
+   {
+      png_const_textp text = info_ptr->text + i;
+
+      if ((text->compression == PNG_TEXT_COMPRESSION_zTXt ||
+          text->compression == PNG_ITXT_COMPRESSION_zTXt) &&
+          text->text != NULL)
+      {
+         png_zchunkp chunk = png_zchunk_add(png_ptr,
+             (png_const_bytep)text->text, strlen(text->text));
+
+         if (chunk != NULL)
+         {
+            chunks[count++] = chunk;
+
+            if (count == (sizeof chunks) / (sizeof chunks[0]))
+            {
+               png_zchunk_run(png_ptr, chunks, count);
+               count = 0;
+            }
+         }
+      }
+   }
+
+   if (count > 0)
+      png_zchunk_run(png_ptr, chunks, count);
+}
+
+int /* PRIVATE */
+png_zchunk_get(png_structrp png_ptr, png_const_bytep input, size_t input_len,
+    png_const_bytep *output, size_t *output_len)
+{
+   png_zchunkp chunk = png_ptr->zchunks;
+
+   while (chunk != NULL &&
+       (chunk->input != input || chunk->input_len != input_len))
+      chunk = chunk->next;
+
+   /* Data png_zchunk_prepare did not see, such as the empty text of a zTXt
+    * chunk with a NULL text pointer, is compressed here on this thread.
+    */
+   if (chunk == NULL)
+   {
+      chunk = png_zchunk_add(png_ptr, input, input_len);
+      png_zchunk_run(png_ptr, &chunk, 1);
+   }
+
+   *output = chunk->output;
+   *output_len = chunk->output_len;
+   return chunk->ret;
+}
+
+void /* PRIVATE */
+png_zchunk_free(png_structrp png_ptr)
+{
+   png_zchunkp chunk = png_ptr->zchunks;
+
+   png_ptr->zchunks = NULL;
+
+   while (chunk != NULL)
+   {
+      png_zchunkp next = chunk->next;
+
+      png_free(png_ptr, chunk->output);
+      png_free(png_ptr, chunk);
+      chunk = next;
+   }
+}
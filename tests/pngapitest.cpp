@@ -0,0 +1,2104 @@
+/* pngapitest.cpp - test the read and write functions added to libpng
+ *
+ * This code is released under the libpng license.
+ * For conditions of distribution and use, see the disclaimer
+ * and license in png.h
+ *
+ * Images are encoded into memory, run through one of the functions below and
+ * decoded again, and the pixels compared with those encoded:
+ *
+ *    png_read_metadata, png_get_chunk_locations and png_set_seek_fn
+ *    png_probe_header
+ *    png_read_verify, on intact and on damaged data
+ *    png_read_build_index and png_read_indexed_rows
+ *    png_set_encode_cache
+ *    png_set_quantize, png_set_quantize_dither and PNG_IMAGE_FLAG_QUANTIZE
+ *    PNG_IMAGE_FLAG_REDUCE
+ *    png_set_encode_speed
+ *    png_rewrite_chunks
+ *    png_rewrite_recompress
+ *    png_transcode
+ *    png_set_compress_cache
+ *    png_set_icc_cache_size
+ *    png_set_stats and png_get_stats
+ *    png_set_mem_budget, also with png_transcode
+ *    png_set_work_limits
+ *    png_write_image of interlaced images, serially and on worker threads
+ *    png_image_batch_read, also in a forked child
+ *
+ * libpng errors are thrown as png::error from the error callback, so nothing
+ * here uses setjmp.  Exits with 0 and prints "pngapitest: passed" if every
+ * check passes.
+ */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#  include <sys/wait.h>
+#  include <unistd.h>
+#endif
+
+#include <png/png.h>
+#include <pngthread.h> /* png_thread_set_count */
+
+static int failures = 0;
+
+#define CHECK(cond) \
+   do { if (!(cond)) { ++failures; \
+      fprintf(stderr, "pngapitest: %s:%d: check failed: %s\n", __FILE__, \
+          __LINE__, #cond); } } while (0)
+
+typedef std::vector<png_byte> bytes;
+
+static void
+throw_error (png_struct *png_ptr, png_const_charp message)
+{
+   (void)png_ptr;
+   throw png::error(message);
+}
+
+static void
+ignore_warning (png_struct *png_ptr, png_const_charp message)
+{
+   (void)png_ptr;
+   (void)message;
+}
+
+/* Input from memory, counting what is read and allowing seeks. */
+struct memory_input
+{
+   explicit memory_input (const bytes &file) : data(file), pos(0), read(0),
+      seeks(0) {}
+
+   const bytes &data;
+   size_t pos;
+   size_t read;
+   int seeks;
+};
+
+static void
+read_data (png_struct *png_ptr, png_bytep out, size_t length)
+{
+   memory_input *in = (memory_input*)png_get_io_ptr(png_ptr);
+
+   if (length > in->data.size() - in->pos)
+      png_error(png_ptr, "read beyond the end of the data");
+
+   memcpy(out, in->data.data() + in->pos, length);
+   in->pos += length;
+   in->read += length;
+}
+
+static int
+seek_data (png_struct *png_ptr, png_off_t offset)
+{
+   memory_input *in = (memory_input*)png_get_io_ptr(png_ptr);
+
+   if (offset > in->data.size())
+      return 0;
+
+   in->pos = (size_t)offset;
+   ++in->seeks;
+   return 1;
+}
+
+static void
+write_data (png_struct *png_ptr, png_const_bytep data, size_t length)
+{
+   bytes *out = (bytes*)png_get_io_ptr(png_ptr);
+
+   out->insert(out->end(), data, data + length);
+}
+
+static void
+flush_data (png_struct *png_ptr)
+{
+   (void)png_ptr;
+}
+
+/* A read struct over 'in'; destroyed however the test leaves. */
+class read_png
+{
+public:
+   explicit read_png (memory_input &in)
+   {
+      png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr,
+          throw_error, ignore_warning);
+      info_ptr = png_ptr != nullptr ? png_create_info_struct(png_ptr) :
+          nullptr;
+
+      if (info_ptr == nullptr)
+      {
+         png_destroy_read_struct(&png_ptr, nullptr, nullptr);
+         throw png::error("pngapitest: out of memory");
+      }
+
+      png_set_read_fn(png_ptr, &in, read_data);
+   }
+
+   ~read_png () { png_destroy_read_struct(&png_ptr, &info_ptr, nullptr); }
+
+   png_struct *png_ptr;
+   png_info *info_ptr;
+};
+
+class write_png
+{
+public:
+   explicit write_png (bytes &out)
+   {
+      png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr,
+          throw_error, ignore_warning);
+      info_ptr = png_ptr != nullptr ? png_create_info_struct(png_ptr) :
+          nullptr;
+
+      if (info_ptr == nullptr)
+      {
+         png_destroy_write_struct(&png_ptr, nullptr);
+         throw png::error("pngapitest: out of memory");
+      }
+
+      png_set_write_fn(png_ptr, &out, write_data, flush_data);
+   }
+
+   ~write_png () { png_destroy_write_struct(&png_ptr, &info_ptr); }
+
+   png_struct *png_ptr;
+   png_info *info_ptr;
+};
+
+/* What to encode and how. */
+struct image_spec
+{
+   png_uint_32 width, height;
+   int bit_depth, color_type, interlace;
+   int speed;          /* png_set_encode_speed, 0 to leave the default */
+   size_t idat_size;   /* png_set_compression_buffer_size, 0 for the default */
+   int text;           /* a tEXt chunk before the image and a zTXt after */
+   int whole_image;    /* png_write_image rather than png_write_row */
+   png_const_colorp palette; /* the PLTE of a palette image */
+   int num_palette;
+};
+
+static image_spec
+spec (png_uint_32 width, png_uint_32 height, int bit_depth, int color_type,
+    int interlace = PNG_INTERLACE_NONE)
+{
+   image_spec s;
+
+   memset(&s, 0, sizeof s);
+   s.width = width;
+   s.height = height;
+   s.bit_depth = bit_depth;
+   s.color_type = color_type;
+   s.interlace = interlace;
+   return s;
+}
+
+static size_t
+row_bits (const image_spec &s)
+{
+   int channels = s.color_type == PNG_COLOR_TYPE_RGB ? 3 :
+      s.color_type == PNG_COLOR_TYPE_RGB_ALPHA ? 4 :
+      s.color_type == PNG_COLOR_TYPE_GRAY_ALPHA ? 2 : 1;
+
+   return (size_t)s.width * channels * s.bit_depth;
+}
+
+static size_t
+rowbytes (const image_spec &s)
+{
+   return (row_bits(s) + 7) / 8;
+}
+
+/* Gradients with a little noise, so the filters and strategies differ.  The
+ * bits after the last pixel of a row are 0, as libpng reads them.
+ */
+static bytes
+make_pixels (const image_spec &s, png_uint_32 seed)
+{
+   size_t row = rowbytes(s);
+   unsigned int unused = (unsigned int)(row * 8 - row_bits(s));
+   bytes pixels(row * s.height);
+
+   for (png_uint_32 y = 0; y < s.height; ++y)
+   {
+      for (size_t x = 0; x < row; ++x)
+      {
+         seed = seed * 1103515245U + 12345U;
+         pixels[y * row + x] = (png_byte)((x * 3 + y * 5) / 4 +
+             ((seed >> 28) & 3));
+      }
+
+      pixels[y * row + row - 1] &= (png_byte)(0xff << unused);
+   }
+
+   return pixels;
+}
+
+static void
+add_text (png_struct *png_ptr, png_info *info_ptr, const char *key,
+    const char *text, int compression)
+{
+   png_text t;
+
+   memset(&t, 0, sizeof t);
+   t.compression = compression;
+   t.key = const_cast<char*>(key);
+   t.text = const_cast<char*>(text);
+   png_set_text(png_ptr, info_ptr, &t, 1);
+}
+
+static void
+write_rows (png_struct *png_ptr, const image_spec &s, const bytes &pixels)
+{
+   size_t row = rowbytes(s);
+
+   if (s.whole_image)
+   {
+      std::vector<png_bytep> rows(s.height);
+
+      for (png_uint_32 y = 0; y < s.height; ++y)
+         rows[y] = const_cast<png_bytep>(pixels.data()) + y * row;
+
+      png_write_image(png_ptr, rows.data());
+   }
+
+   else
+   {
+      int passes = png_set_interlace_handling(png_ptr);
+
+      for (int pass = 0; pass < passes; ++pass)
+         for (png_uint_32 y = 0; y < s.height; ++y)
+            png_write_row(png_ptr, pixels.data() + y * row);
+   }
+}
+
+static bytes
+encode (const image_spec &s, const bytes &pixels,
+    png_encode_cachep cache = nullptr, png_uint_32 first_row = 0,
+    png_uint_32 num_rows = 0)
+{
+   bytes out;
+   write_png w(out);
+
+   png_set_IHDR(w.png_ptr, w.info_ptr, s.width, s.height, s.bit_depth,
+       s.color_type, s.interlace, PNG_COMPRESSION_TYPE_BASE,
+       PNG_FILTER_TYPE_BASE);
+
+   if (s.palette != nullptr)
+      png_set_PLTE(w.png_ptr, w.info_ptr, s.palette, s.num_palette);
+
+   if (s.speed != 0)
+      png_set_encode_speed(w.png_ptr, s.speed);
+
+   if (s.idat_size != 0)
+      png_set_compression_buffer_size(w.png_ptr, s.idat_size);
+
+   if (cache != nullptr)
+      png_set_encode_cache(w.png_ptr, cache, first_row, num_rows);
+
+   if (s.text)
+      add_text(w.png_ptr, w.info_ptr, "Comment", "before the image",
+          PNG_TEXT_COMPRESSION_NONE);
+
+   png_write_info(w.png_ptr, w.info_ptr);
+   write_rows(w.png_ptr, s, pixels);
+
+   if (s.text)
+      add_text(w.png_ptr, w.info_ptr, "Description",
+          "after the image, after the image, after the image",
+          PNG_TEXT_COMPRESSION_zTXt);
+
+   png_write_end(w.png_ptr, w.info_ptr);
+   return out;
+}
+
+/* The rows as stored, without transformations, with png_read_image or row by
+ * row.
+ */
+static bytes
+decode (const bytes &file, int whole_image = 0)
+{
+   memory_input in(file);
+   read_png r(in);
+   png_uint_32 height;
+   size_t row;
+   bytes pixels;
+
+   png_read_info(r.png_ptr, r.info_ptr);
+   height = png_get_image_height(r.png_ptr, r.info_ptr);
+
+   if (whole_image)
+   {
+      std::vector<png_bytep> rows(height);
+
+      png_read_update_info(r.png_ptr, r.info_ptr);
+      row = png_get_rowbytes(r.png_ptr, r.info_ptr);
+      pixels.resize(row * height);
+
+      for (png_uint_32 y = 0; y < height; ++y)
+         rows[y] = pixels.data() + y * row;
+
+      png_read_image(r.png_ptr, rows.data());
+   }
+
+   else
+   {
+      int passes = png_set_interlace_handling(r.png_ptr);
+
+      png_read_update_info(r.png_ptr, r.info_ptr);
+      row = png_get_rowbytes(r.png_ptr, r.info_ptr);
+      pixels.resize(row * height);
+
+      for (int pass = 0; pass < passes; ++pass)
+         for (png_uint_32 y = 0; y < height; ++y)
+            png_read_row(r.png_ptr, pixels.data() + y * row, nullptr);
+   }
+
+   png_read_end(r.png_ptr, nullptr);
+   return pixels;
+}
+
+/* The chunks of a datastream, found by walking the chunk headers. */
+struct chunk
+{
+   char name[5];
+   png_uint_32 length;
+   size_t offset;      /* of the length field */
+};
+
+static png_uint_32
+get_uint_32 (const png_byte *p)
+{
+   return ((png_uint_32)p[0] << 24) | ((png_uint_32)p[1] << 16) |
+      ((png_uint_32)p[2] << 8) | p[3];
+}
+
+
+static std::vector<chunk>
+list_chunks (const bytes &file)
+{
+   std::vector<chunk> chunks;
+   size_t pos = 8;
+
+   while (pos + 12 <= file.size())
+   {
+      chunk c;
+
+      c.length = get_uint_32(file.data() + pos);
+      memcpy(c.name, file.data() + pos + 4, 4);
+      c.name[4] = 0;
+      c.offset = pos;
+      chunks.push_back(c);
+      pos += 12 + (size_t)c.length;
+   }
+
+   return chunks;
+}
+
+
+/* The data of every chunk called 'name', one after the other. */
+static bytes
+chunk_data (const bytes &file, const char *name)
+{
+   std::vector<chunk> chunks = list_chunks(file);
+   bytes data;
+
+   for (size_t i = 0; i < chunks.size(); ++i)
+      if (strcmp(chunks[i].name, name) == 0)
+         data.insert(data.end(), file.begin() + chunks[i].offset + 8,
+             file.begin() + chunks[i].offset + 8 + chunks[i].length);
+
+   return data;
+}
+
+static size_t
+count_chunks (const bytes &file, const char *name)
+{
+   std::vector<chunk> chunks = list_chunks(file);
+   size_t count = 0;
+
+   for (size_t i = 0; i < chunks.size(); ++i)
+      count += strcmp(chunks[i].name, name) == 0;
+
+   return count;
+}
+
+/* png_read_metadata, with and without a seek function. */
+static void
+test_metadata (void)
+{
+   image_spec s = spec(64, 48, 8, PNG_COLOR_TYPE_RGB);
+   s.idat_size = 512;
+   s.text = 1;
+
+   bytes pixels = make_pixels(s, 1);
+   bytes file = encode(s, pixels);
+   std::vector<chunk> chunks = list_chunks(file);
+   size_t idat = 0;
+
+   CHECK(count_chunks(file, "IDAT") > 1);
+   CHECK(decode(file) == pixels);
+
+   for (size_t i = 0; i < chunks.size(); ++i)
+      if (strcmp(chunks[i].name, "IDAT") == 0)
+         idat += 12 + chunks[i].length;
+
+   for (int seek = 0; seek < 2; ++seek)
+   {
+      memory_input in(file);
+      read_png r(in);
+      png_const_chunk_locationp locations;
+      png_uint_32 count;
+      png_textp text;
+
+      if (seek)
+         png_set_seek_fn(r.png_ptr, seek_data);
+
+      png_read_metadata(r.png_ptr, r.info_ptr);
+
+      CHECK(png_get_image_width(r.png_ptr, r.info_ptr) == s.width);
+      CHECK(png_get_image_height(r.png_ptr, r.info_ptr) == s.height);
+      CHECK(png_get_text(r.png_ptr, r.info_ptr, &text, nullptr) == 2);
+
+      count = png_get_chunk_locations(r.png_ptr, &locations);
+      CHECK(count == chunks.size());
+
+      for (png_uint_32 i = 0; i < count && i < chunks.size(); ++i)
+      {
+         CHECK(strcmp((const char*)locations[i].name, chunks[i].name) == 0);
+         CHECK(locations[i].length == chunks[i].length);
+         CHECK(locations[i].offset == (png_off_t)chunks[i].offset);
+      }
+
+      /* With a seek function the IDAT chunks (but for their headers) are
+       * never read; without one they are read and discarded.
+       */
+      if (seek)
+      {
+         CHECK(in.seeks > 0);
+         CHECK(in.read <= file.size() - idat + 8 * count_chunks(file, "IDAT"));
+      }
+
+      else
+         CHECK(in.read == file.size());
+   }
+}
+
+
+static void
+put_uint_32 (png_byte *p, png_uint_32 value)
+{
+   p[0] = (png_byte)(value >> 24);
+   p[1] = (png_byte)(value >> 16);
+   p[2] = (png_byte)(value >> 8);
+   p[3] = (png_byte)value;
+}
+
+/* Recompute the CRC of the chunk at 'offset' after its data was changed. */
+static void
+fix_crc (bytes &file, size_t offset)
+{
+   png_uint_32 length = get_uint_32(file.data() + offset);
+   png_uint_32 crc = 0xffffffffU;
+
+   for (size_t i = offset + 4; i < offset + 8 + length; ++i)
+   {
+      crc ^= file[i];
+
+      for (int k = 0; k < 8; ++k)
+         crc = (crc >> 1) ^ (0xedb88320U & (0U - (crc & 1)));
+   }
+
+   put_uint_32(file.data() + offset + 8 + length, crc ^ 0xffffffffU);
+}
+
+/* png_probe_header on whole, short, damaged and foreign data. */
+static void
+test_probe (void)
+{
+   image_spec s = spec(31, 17, 8, PNG_COLOR_TYPE_RGB);
+   image_spec sa = spec(19, 23, 16, PNG_COLOR_TYPE_GRAY_ALPHA,
+       PNG_INTERLACE_ADAM7);
+   bytes file = encode(s, make_pixels(s, 2));
+   bytes alpha = encode(sa, make_pixels(sa, 3));
+   png_header_summary summary;
+
+   CHECK(png_probe_header(file.data(), file.size(), &summary) == PNG_PROBE_OK);
+   CHECK(summary.width == s.width && summary.height == s.height);
+   CHECK(summary.bit_depth == 8);
+   CHECK(summary.color_type == PNG_COLOR_TYPE_RGB);
+   CHECK(summary.interlace_type == PNG_INTERLACE_NONE);
+   CHECK((summary.flags & PNG_HEADER_COMPLETE) != 0);
+   CHECK((summary.flags & PNG_HEADER_HAVE_ALPHA) == 0);
+
+   CHECK(png_probe_header(alpha.data(), alpha.size(), &summary) ==
+       PNG_PROBE_OK);
+   CHECK(summary.bit_depth == 16);
+   CHECK(summary.interlace_type == PNG_INTERLACE_ADAM7);
+   CHECK((summary.flags & PNG_HEADER_HAVE_ALPHA) != 0);
+
+   /* The signature and IHDR but not the whole of the IDAT header. */
+   CHECK(png_probe_header(file.data(), 40, &summary) == PNG_PROBE_OK);
+   CHECK((summary.flags & PNG_HEADER_COMPLETE) == 0);
+
+   CHECK(png_probe_header(file.data(), 20, &summary) == PNG_PROBE_TRUNCATED);
+
+   {
+      static const png_byte junk[64] = { 'G', 'I', 'F', '8', '9', 'a' };
+
+      CHECK(png_probe_header(junk, sizeof junk, &summary) ==
+          PNG_PROBE_NOT_PNG);
+   }
+
+   {
+      bytes damaged(file);
+
+      put_uint_32(damaged.data() + 16, 0); /* width */
+      CHECK(png_probe_header(damaged.data(), damaged.size(), &summary) ==
+          PNG_PROBE_INVALID);
+
+      fix_crc(damaged, 8);
+      CHECK(png_probe_header(damaged.data(), damaged.size(), &summary) ==
+          PNG_PROBE_INVALID);
+   }
+}
+
+static int
+throws (void (*fn)(const bytes &), const bytes &file, const char *message)
+{
+   try
+   {
+      fn(file);
+   }
+
+   catch (const png::error &e)
+   {
+      return message == nullptr || strstr(e.what(), message) != nullptr;
+   }
+
+   return 0;
+}
+
+static png_verify_result verify_result;
+
+static void
+verify (const bytes &file)
+{
+   memory_input in(file);
+   read_png r(in);
+
+   memset(&verify_result, 0, sizeof verify_result);
+   png_read_verify(r.png_ptr, r.info_ptr, &verify_result, 0);
+}
+
+/* png_read_verify on an intact file and with a bad CRC or Adler-32. */
+static void
+test_verify (void)
+{
+   image_spec s = spec(45, 30, 8, PNG_COLOR_TYPE_RGB);
+   s.idat_size = 1024;
+
+   bytes file = encode(s, make_pixels(s, 4));
+   std::vector<chunk> chunks = list_chunks(file);
+   size_t first = 0, last = 0;
+   png_uint_32 filtered = 0;
+
+   verify(file);
+   CHECK((verify_result.flags & PNG_VERIFY_COMPLETE) != 0);
+   CHECK(verify_result.rows == s.height);
+   CHECK(verify_result.image_bytes ==
+       (png_off_t)((rowbytes(s) + 1) * s.height));
+   CHECK(verify_result.file_bytes == (png_off_t)file.size());
+
+   for (int f = 0; f < 5; ++f)
+      filtered += verify_result.filter_count[f];
+
+   CHECK(filtered == s.height);
+
+   for (size_t i = 0; i < chunks.size(); ++i)
+      if (strcmp(chunks[i].name, "IDAT") == 0)
+      {
+         if (first == 0)
+            first = i;
+
+         last = i;
+      }
+
+   /* A changed byte of image data with the CRC left alone. */
+   {
+      bytes damaged(file);
+
+      damaged[chunks[first].offset + 8 + chunks[first].length / 2] ^= 0x10;
+      CHECK(throws(verify, damaged, nullptr));
+      CHECK((verify_result.flags & PNG_VERIFY_COMPLETE) == 0);
+   }
+
+   /* A bad Adler-32 at the end of the zlib stream, with a good CRC. */
+   {
+      bytes damaged(file);
+
+      damaged[chunks[last].offset + 8 + chunks[last].length - 1] ^= 0x01;
+      fix_crc(damaged, chunks[last].offset);
+      CHECK(throws(verify, damaged, "incorrect data check"));
+      CHECK((verify_result.flags & PNG_VERIFY_COMPLETE) == 0);
+   }
+
+   /* Data missing from the end. */
+   CHECK(throws(verify, bytes(file.begin(), file.end() - 20), nullptr));
+}
+
+/* png_read_build_index then png_read_indexed_rows, in any order. */
+static void
+test_index (void)
+{
+   static const png_uint_32 ranges[][2] =
+   {
+      { 390, 400 }, { 0, 3 }, { 201, 250 }, { 57, 58 }, { 0, 400 }
+   };
+
+   image_spec s = spec(97, 400, 8, PNG_COLOR_TYPE_GRAY);
+   bytes pixels = make_pixels(s, 5);
+   bytes file = encode(s, pixels);
+   size_t row = rowbytes(s);
+   bytes index;
+
+   {
+      memory_input in(file);
+      read_png r(in);
+      png_bytep data;
+      size_t size;
+
+      png_read_info(r.png_ptr, r.info_ptr);
+      png_read_build_index(r.png_ptr, 2048, &data, &size);
+      index.assign(data, data + size);
+      png_free(r.png_ptr, data);
+      png_read_end(r.png_ptr, nullptr);
+   }
+
+   CHECK(!index.empty());
+
+   for (size_t i = 0; i < sizeof ranges / sizeof ranges[0]; ++i)
+   {
+      png_uint_32 y0 = ranges[i][0], y1 = ranges[i][1];
+      memory_input in(file);
+      read_png r(in);
+      bytes out(row * (y1 - y0));
+      std::vector<png_bytep> rows(y1 - y0);
+
+      for (png_uint_32 y = y0; y < y1; ++y)
+         rows[y - y0] = out.data() + (y - y0) * row;
+
+      png_set_seek_fn(r.png_ptr, seek_data);
+      png_read_info(r.png_ptr, r.info_ptr);
+      png_read_indexed_rows(r.png_ptr, index.data(), index.size(), y0, y1,
+          rows.data());
+
+      CHECK(memcmp(out.data(), pixels.data() + y0 * row, out.size()) == 0);
+   }
+}
+
+/* An encode cache: changed bands are encoded again and the rest copied. */
+static void
+test_encode_cache (void)
+{
+   image_spec s = spec(80, 100, 8, PNG_COLOR_TYPE_RGB);
+   image_spec small = spec(80, 50, 8, PNG_COLOR_TYPE_RGB);
+   bytes a = make_pixels(s, 6);
+   bytes b(a);
+   bytes c = make_pixels(small, 7);
+   bytes changed = make_pixels(spec(80, 5, 8, PNG_COLOR_TYPE_RGB), 8);
+   png_encode_cachep cache = png_create_encode_cache(16);
+   bytes file_a, file_b, again;
+
+   CHECK(cache != nullptr);
+
+   if (cache == nullptr)
+      return;
+
+   memcpy(b.data() + 40 * rowbytes(s), changed.data(), changed.size());
+
+   try
+   {
+      file_a = encode(s, a, cache, 0, s.height);
+      CHECK(decode(file_a) == a);
+
+      file_b = encode(s, b, cache, 40, 5);
+      CHECK(decode(file_b) == b);
+
+      /* Nothing changed: every band comes from the cache. */
+      again = encode(s, b, cache, 0, 0);
+      CHECK(again == file_b);
+
+      /* A new size discards the cache, whatever the rows said. */
+      CHECK(decode(encode(small, c, cache, 0, 0)) == c);
+   }
+
+   catch (...)
+   {
+      png_destroy_encode_cache(cache);
+      throw;
+   }
+
+   png_destroy_encode_cache(cache);
+}
+
+/* png_image_write_to_memory, with 'flags' in png_image::flags. */
+static bytes
+write_simplified (png_uint_32 width, png_uint_32 height, png_uint_32 format,
+    png_uint_32 flags, png_uint_32 entries, const bytes &pixels)
+{
+   png_image image;
+   bytes file;
+   size_t size = 0;
+
+   memset(&image, 0, sizeof image);
+   image.version = PNG_IMAGE_VERSION;
+   image.width = width;
+   image.height = height;
+   image.format = format;
+   image.flags = flags;
+   image.colormap_entries = entries;
+
+   CHECK(png_image_write_get_memory_size(image, size, 0, pixels.data(), 0,
+       nullptr));
+   file.resize(size);
+   CHECK(png_image_write_to_memory(&image, file.data(), &size, 0,
+       pixels.data(), 0, nullptr));
+   file.resize(size);
+   return file;
+}
+
+/* png_image_finish_read into 'format'. */
+static bytes
+read_simplified (const bytes &file, png_uint_32 format)
+{
+   png_image image;
+   bytes pixels;
+
+   memset(&image, 0, sizeof image);
+   image.version = PNG_IMAGE_VERSION;
+   CHECK(png_image_begin_read_from_memory(&image, file.data(), file.size()));
+   image.format = format;
+   pixels.resize(PNG_IMAGE_SIZE(image));
+   CHECK(png_image_finish_read(&image, nullptr, pixels.data(), 0, nullptr));
+   return pixels;
+}
+
+/* The squared distance between two colors. */
+static int
+distance (const png_color &a, const png_color &b)
+{
+   int r = a.red - b.red, g = a.green - b.green, bl = a.blue - b.blue;
+
+   return r * r + g * g + bl * bl;
+}
+
+/* The corners of the RGB cube. */
+static png_color
+corner (int k)
+{
+   png_color c;
+
+   c.red = (png_byte)(k & 1 ? 255 : 0);
+   c.green = (png_byte)(k & 2 ? 255 : 0);
+   c.blue = (png_byte)(k & 4 ? 255 : 0);
+   return c;
+}
+
+/* The color of pixel 'i' of an RGB image. */
+static png_color
+color_at (const bytes &rgb, size_t i)
+{
+   png_color c;
+
+   c.red = rgb[3*i];
+   c.green = rgb[3*i+1];
+   c.blue = rgb[3*i+2];
+   return c;
+}
+
+/* Decode with png_set_quantize and png_set_quantize_dither; one index a
+ * pixel.
+ */
+static bytes
+decode_quantized (const bytes &file, png_colorp palette, int num_palette,
+    int maximum_colors, int full_quantize, int dither)
+{
+   memory_input in(file);
+   read_png r(in);
+   png_uint_32 height;
+   size_t row;
+   bytes indices;
+
+   png_read_info(r.png_ptr, r.info_ptr);
+   png_set_quantize(r.png_ptr, palette, num_palette, maximum_colors, nullptr,
+       full_quantize);
+   png_set_quantize_dither(r.png_ptr, dither);
+   png_read_update_info(r.png_ptr, r.info_ptr);
+
+   height = png_get_image_height(r.png_ptr, r.info_ptr);
+   row = png_get_rowbytes(r.png_ptr, r.info_ptr);
+   CHECK(row == png_get_image_width(r.png_ptr, r.info_ptr));
+   indices.resize(row * height);
+
+   for (png_uint_32 y = 0; y < height; ++y)
+      png_read_row(r.png_ptr, indices.data() + y * row, nullptr);
+
+   png_read_end(r.png_ptr, nullptr);
+   return indices;
+}
+
+/* The number of PLTE entries in a file, 0 if there is no PLTE. */
+static int
+palette_size (const bytes &file)
+{
+   return (int)(chunk_data(file, "PLTE").size() / 3);
+}
+
+/* png_set_quantize on RGB and palette images, and PNG_IMAGE_FLAG_QUANTIZE. */
+static void
+test_quantize (void)
+{
+   image_spec s = spec(64, 48, 8, PNG_COLOR_TYPE_RGB);
+   bytes noisy = make_pixels(s, 20);
+   bytes corners(noisy.size());
+
+   for (png_uint_32 y = 0; y < s.height; ++y)
+      for (png_uint_32 x = 0; x < s.width; ++x)
+      {
+         png_color c = corner((int)(x / 5 + y / 3) % 8);
+         png_bytep p = corners.data() + 3 * (y * s.width + x);
+
+         p[0] = c.red;
+         p[1] = c.green;
+         p[2] = c.blue;
+      }
+
+   /* RGB: a 64 color cube cut down to 16, with and without dithering, then
+    * the eight colors of an image given as its palette, which must map to
+    * themselves.
+    */
+   for (int dither = 0; dither < 2; ++dither)
+   {
+      png_color palette[64];
+      bytes indices;
+
+      for (int k = 0; k < 64; ++k)
+      {
+         palette[k].red = (png_byte)(85 * (k & 3));
+         palette[k].green = (png_byte)(85 * ((k >> 2) & 3));
+         palette[k].blue = (png_byte)(85 * (k >> 4));
+      }
+
+      indices = decode_quantized(encode(s, noisy), palette, 64, 16, 1, dither);
+
+      for (size_t i = 0; i < indices.size(); ++i)
+         CHECK(indices[i] < 16);
+
+      for (int k = 0; k < 8; ++k)
+         palette[k] = corner(k);
+
+      indices = decode_quantized(encode(s, corners), palette, 8, 8, 1, dither);
+
+      for (size_t i = 0; i < indices.size(); ++i)
+         CHECK(indices[i] < 8 &&
+             distance(palette[indices[i]], color_at(corners, i)) == 0);
+   }
+
+   /* Palette images (full_quantize 0): unchanged when the palette fits, else
+    * each color becomes the nearest color of the reduced palette.
+    */
+   {
+      image_spec sp = spec(64, 48, 8, PNG_COLOR_TYPE_PALETTE);
+      png_color original[64], palette[64];
+      bytes pixels(sp.width * sp.height);
+      bytes file;
+
+      for (int k = 0; k < 64; ++k)
+      {
+         original[k].red = (png_byte)(4 * k);
+         original[k].green = (png_byte)(255 - 3 * k);
+         original[k].blue = (png_byte)(k * k / 16);
+      }
+
+      for (size_t i = 0; i < pixels.size(); ++i)
+         pixels[i] = (png_byte)((i % sp.width + i / sp.width) % 64);
+
+      sp.palette = original;
+      sp.num_palette = 64;
+      file = encode(sp, pixels);
+
+      memcpy(palette, original, sizeof palette);
+      CHECK(decode_quantized(file, palette, 64, 64, 0, 0) == pixels);
+
+      memcpy(palette, original, sizeof palette);
+      bytes indices = decode_quantized(file, palette, 64, 16, 0, 0);
+
+      for (size_t i = 0; i < indices.size(); ++i)
+      {
+         const png_color &c = original[pixels[i]];
+         int best = distance(c, palette[0]);
+
+         for (int k = 1; k < 16; ++k)
+            if (distance(c, palette[k]) < best)
+               best = distance(c, palette[k]);
+
+         CHECK(indices[i] < 16 && distance(c, palette[indices[i]]) == best);
+      }
+   }
+
+   /* The simplified writer: at most colormap_entries colors, and exact when
+    * the image has no more colors than that.
+    */
+   for (png_uint_32 dither = 0; dither < 2; ++dither)
+   {
+      png_uint_32 flags = PNG_IMAGE_FLAG_QUANTIZE |
+         (dither ? PNG_IMAGE_FLAG_QUANTIZE_DITHER : 0);
+      bytes file;
+      int entries;
+
+      file = write_simplified(s.width, s.height, PNG_FORMAT_RGB, flags, 20,
+          noisy);
+      entries = palette_size(file);
+      CHECK(entries > 0 && entries <= 20);
+      CHECK(read_simplified(file, PNG_FORMAT_RGB).size() == noisy.size());
+
+      entries = palette_size(write_simplified(s.width, s.height,
+          PNG_FORMAT_RGB, flags, 0, noisy));
+      CHECK(entries > 20 && entries <= 256);
+
+      file = write_simplified(s.width, s.height, PNG_FORMAT_RGB, flags, 8,
+          corners);
+      entries = palette_size(file);
+      CHECK(entries > 0 && entries <= 8);
+      CHECK(read_simplified(file, PNG_FORMAT_RGB) == corners);
+   }
+}
+
+/* Write 'pixels' with PNG_IMAGE_FLAG_REDUCE, check the IHDR and the presence
+ * of tRNS, and read the file back in the original format.
+ */
+static void
+check_reduce (png_uint_32 width, png_uint_32 height, png_uint_32 format,
+    const bytes &pixels, int bit_depth, int color_type, int trns)
+{
+   bytes file = write_simplified(width, height, format, PNG_IMAGE_FLAG_REDUCE,
+       0, pixels);
+   png_header_summary summary;
+
+   CHECK(png_probe_header(file.data(), file.size(), &summary) == PNG_PROBE_OK);
+   CHECK(summary.bit_depth == bit_depth);
+   CHECK(summary.color_type == color_type);
+   CHECK((count_chunks(file, "tRNS") != 0) == (trns != 0));
+
+   /* The simplified reader does not add an alpha channel, so where the alpha
+    * was dropped the file is read without it.
+    */
+   if ((format & PNG_FORMAT_FLAG_ALPHA) != 0 &&
+       (color_type & PNG_COLOR_MASK_ALPHA) == 0 && trns == 0)
+   {
+      unsigned int channels = PNG_IMAGE_PIXEL_CHANNELS(format);
+      bytes opaque;
+
+      for (size_t i = 0; i < pixels.size(); i += channels)
+      {
+         CHECK(pixels[i + channels - 1] == 255);
+         opaque.insert(opaque.end(), pixels.begin() + i,
+             pixels.begin() + i + channels - 1);
+      }
+
+      CHECK(read_simplified(file, format & ~PNG_FORMAT_FLAG_ALPHA) == opaque);
+   }
+
+   else
+      CHECK(read_simplified(file, format) == pixels);
+}
+
+/* PNG_IMAGE_FLAG_REDUCE: each reduction, and an image that has none. */
+static void
+test_reduce (void)
+{
+   static const png_uint_32 width = 50, height = 40;
+   static const size_t count = (size_t)width * height;
+   image_spec s = spec(width, height, 8, PNG_COLOR_TYPE_RGB_ALPHA);
+   bytes rgba = make_pixels(s, 21);
+   bytes rgb(3 * count), gray_rgb(3 * count), ga(2 * count), gray(count);
+
+   for (size_t i = 0; i < count; ++i)
+   {
+      png_byte level = (png_byte)(i * 7 + i / width);
+
+      memcpy(rgb.data() + 3 * i, rgba.data() + 4 * i, 3);
+      rgba[4*i+3] = 255;
+      memset(gray_rgb.data() + 3 * i, level, 3);
+      ga[2*i] = level;
+      ga[2*i+1] = 255;
+   }
+
+   /* More than 256 colors, so no palette. */
+   check_reduce(width, height, PNG_FORMAT_RGBA, rgba, 8, PNG_COLOR_TYPE_RGB, 0);
+   check_reduce(width, height, PNG_FORMAT_RGB, rgb, 8, PNG_COLOR_TYPE_RGB, 0);
+
+   /* All 256 gray levels. */
+   check_reduce(width, height, PNG_FORMAT_RGB, gray_rgb, 8,
+       PNG_COLOR_TYPE_GRAY, 0);
+   check_reduce(width, height, PNG_FORMAT_GA, ga, 8, PNG_COLOR_TYPE_GRAY, 0);
+
+   /* Levels that fit in 4, 2 and 1 bits. */
+   for (int depth = 4; depth > 0; depth /= 2)
+   {
+      unsigned int levels = 1U << depth;
+
+      for (size_t i = 0; i < count; ++i)
+         gray[i] = (png_byte)(255 / (levels - 1) * ((i + i / width) % levels));
+
+      check_reduce(width, height, PNG_FORMAT_GRAY, gray, depth,
+          PNG_COLOR_TYPE_GRAY, 0);
+   }
+
+   /* Few colors: a palette, with tRNS when some are not opaque. */
+   for (size_t i = 0; i < count; ++i)
+   {
+      int k = (int)((i / 3 + i / width) % 12);
+
+      rgba[4*i+0] = (png_byte)(20 * k);
+      rgba[4*i+1] = (png_byte)(255 - 20 * k);
+      rgba[4*i+2] = (png_byte)(k & 1 ? 200 : 40);
+      rgba[4*i+3] = (png_byte)(k < 3 ? 60 * k : 255);
+      memcpy(rgb.data() + 3 * i, rgba.data() + 4 * i, 3);
+   }
+
+   check_reduce(width, height, PNG_FORMAT_RGBA, rgba, 4,
+       PNG_COLOR_TYPE_PALETTE, 1);
+   check_reduce(width, height, PNG_FORMAT_RGB, rgb, 4, PNG_COLOR_TYPE_PALETTE,
+       0);
+}
+
+/* Every encode speed tier, plain and interlaced. */
+static void
+test_tiers (void)
+{
+   image_spec s = spec(120, 90, 8, PNG_COLOR_TYPE_RGB);
+   image_spec g = spec(77, 41, 4, PNG_COLOR_TYPE_GRAY);
+   bytes pixels = make_pixels(s, 9);
+   bytes gray = make_pixels(g, 10);
+   size_t size[PNG_ENCODE_SPEED_SMALLEST + 1];
+
+   for (int speed = PNG_ENCODE_SPEED_REALTIME;
+       speed <= PNG_ENCODE_SPEED_SMALLEST; ++speed)
+   {
+      bytes file;
+
+      s.speed = g.speed = speed;
+      s.interlace = PNG_INTERLACE_NONE;
+      file = encode(s, pixels);
+      size[speed] = file.size();
+      CHECK(decode(file) == pixels);
+
+      s.interlace = PNG_INTERLACE_ADAM7;
+      CHECK(decode(encode(s, pixels)) == pixels);
+
+      CHECK(decode(encode(g, gray)) == gray);
+   }
+
+   /* The trial tiers try what SMALL does and more; SMALLEST tries everything
+    * ARCHIVE does.
+    */
+   CHECK(size[PNG_ENCODE_SPEED_ARCHIVE] <= size[PNG_ENCODE_SPEED_SMALL]);
+   CHECK(size[PNG_ENCODE_SPEED_SMALLEST] <= size[PNG_ENCODE_SPEED_ARCHIVE]);
+}
+
+typedef struct
+{
+   int calls;
+   int idat;       /* calls for IDAT */
+} rewrite_count;
+
+/* Drop tEXt and put a private chunk before the image data. */
+static int
+rewrite_chunk (png_struct *write_ptr, png_voidp arg, png_const_bytep name,
+    png_const_bytep data, png_uint_32 length)
+{
+   rewrite_count *count = (rewrite_count*)arg;
+
+   (void)length;
+   ++count->calls;
+
+   if (strcmp((const char*)name, "IDAT") == 0)
+   {
+      ++count->idat;
+      CHECK(data == nullptr);
+      png_write_chunk(write_ptr, (png_const_bytep)"teSt",
+          (png_const_bytep)"pngapitest", 10);
+   }
+
+   return strcmp((const char*)name, "tEXt") == 0 ? PNG_REWRITE_DROP :
+      PNG_REWRITE_KEEP;
+}
+
+/* png_rewrite_chunks, with rewrite_chunk if 'count' is given. */
+static bytes
+copy_chunks (const bytes &file, png_uint_32 idat_size,
+    rewrite_count *count = nullptr)
+{
+   memory_input in(file);
+   read_png r(in);
+   bytes out;
+   write_png w(out);
+
+   png_rewrite_chunks(r.png_ptr, r.info_ptr, w.png_ptr,
+       count != nullptr ? rewrite_chunk : nullptr, count, idat_size);
+   return out;
+}
+
+static void
+copy_bad_crc (const bytes &file)
+{
+   copy_chunks(file, 0);
+}
+
+/* png_rewrite_chunks: the IDAT data copied, chunks dropped and added. */
+static void
+test_rewrite (void)
+{
+   image_spec s = spec(60, 40, 8, PNG_COLOR_TYPE_RGB);
+   s.idat_size = 300;
+   s.text = 1;
+
+   bytes pixels = make_pixels(s, 11);
+   bytes file = encode(s, pixels);
+   rewrite_count count;
+
+   /* IDAT copied as it is, chunks dropped and added. */
+   {
+      bytes out;
+      std::vector<chunk> chunks;
+
+      memset(&count, 0, sizeof count);
+      out = copy_chunks(file, 0, &count);
+      chunks = list_chunks(out);
+
+      CHECK(count.idat == 1);
+      CHECK(count.calls > 2);
+      CHECK(count_chunks(out, "tEXt") == 0);
+      CHECK(count_chunks(out, "zTXt") == 1);
+      CHECK(count_chunks(out, "teSt") == 1);
+      CHECK(count_chunks(out, "IDAT") == count_chunks(file, "IDAT"));
+      CHECK(chunk_data(out, "IDAT") == chunk_data(file, "IDAT"));
+
+      for (size_t i = 0; i + 1 < chunks.size(); ++i)
+         if (strcmp(chunks[i].name, "teSt") == 0)
+            CHECK(strcmp(chunks[i+1].name, "IDAT") == 0);
+
+      CHECK(decode(out) == pixels);
+   }
+
+   /* The same compressed data in chunks of 100 bytes. */
+   {
+      bytes out = copy_chunks(file, 100);
+      std::vector<chunk> chunks = list_chunks(out);
+
+      for (size_t i = 0; i < chunks.size(); ++i)
+         if (strcmp(chunks[i].name, "IDAT") == 0)
+            CHECK(chunks[i].length <= 100);
+
+      CHECK(chunk_data(out, "IDAT") == chunk_data(file, "IDAT"));
+      CHECK(decode(out) == pixels);
+   }
+
+   /* A verbatim copy still checks the IDAT CRCs. */
+   {
+      std::vector<chunk> chunks = list_chunks(file);
+      bytes damaged(file);
+
+      for (size_t i = 0; i < chunks.size(); ++i)
+         if (strcmp(chunks[i].name, "IDAT") == 0)
+         {
+            damaged[chunks[i].offset + 8] ^= 0x20;
+            break;
+         }
+
+      CHECK(throws(copy_bad_crc, damaged, nullptr));
+   }
+}
+
+/* png_rewrite_recompress at level 9, with rewrite_chunk if 'count' is given. */
+static bytes
+recompress (const bytes &file, int flags, rewrite_count *count = nullptr)
+{
+   memory_input in(file);
+   read_png r(in);
+   bytes out;
+   write_png w(out);
+
+   png_set_compression_level(w.png_ptr, 9);
+   png_rewrite_recompress(r.png_ptr, r.info_ptr, w.png_ptr,
+       count != nullptr ? rewrite_chunk : nullptr, count, flags);
+   return out;
+}
+
+/* png_rewrite_recompress with the original filters and refiltered. */
+static void
+test_recompress (void)
+{
+   image_spec s = spec(60, 40, 8, PNG_COLOR_TYPE_RGB);
+   s.idat_size = 300;
+   s.text = 1;
+
+   bytes pixels = make_pixels(s, 11);
+   bytes file = encode(s, pixels);
+   rewrite_count count;
+   bytes out;
+
+   memset(&count, 0, sizeof count);
+   out = recompress(file, 0, &count);
+
+   CHECK(count.idat == 1);
+   CHECK(count_chunks(out, "tEXt") == 0);
+   CHECK(count_chunks(out, "teSt") == 1);
+   CHECK(decode(out) == pixels);
+   CHECK(decode(recompress(file, PNG_RECOMPRESS_REFILTER)) == pixels);
+}
+
+/* png_transcode with the alpha channel stripped. */
+static bytes
+transcode (const bytes &file, int interlace)
+{
+   memory_input in(file);
+   read_png r(in);
+   bytes out;
+   write_png w(out);
+
+   png_read_info(r.png_ptr, r.info_ptr);
+
+   if ((png_get_color_type(r.png_ptr, r.info_ptr) & PNG_COLOR_MASK_ALPHA) != 0)
+      png_set_strip_alpha(r.png_ptr);
+
+   png_transcode(r.png_ptr, r.info_ptr, w.png_ptr, interlace);
+   return out;
+}
+
+/* png_transcode: alpha stripped, then interlaced and back. */
+static void
+test_transcode (void)
+{
+   image_spec sa = spec(60, 40, 8, PNG_COLOR_TYPE_RGB_ALPHA);
+   bytes rgba = make_pixels(sa, 12);
+   bytes rgb(rgba.size() / 4 * 3);
+   bytes out = transcode(encode(sa, rgba), -1);
+   bytes interlaced;
+   png_header_summary summary;
+
+   for (size_t i = 0; i < rgb.size() / 3; ++i)
+      memcpy(rgb.data() + 3 * i, rgba.data() + 4 * i, 3);
+
+   CHECK(png_probe_header(out.data(), out.size(), &summary) == PNG_PROBE_OK);
+   CHECK(summary.color_type == PNG_COLOR_TYPE_RGB);
+   CHECK(decode(out) == rgb);
+
+   interlaced = transcode(out, PNG_INTERLACE_ADAM7);
+   CHECK(png_probe_header(interlaced.data(), interlaced.size(), &summary) ==
+       PNG_PROBE_OK);
+   CHECK(summary.interlace_type == PNG_INTERLACE_ADAM7);
+   CHECK(decode(interlaced) == rgb);
+   CHECK(decode(transcode(interlaced, PNG_INTERLACE_NONE)) == rgb);
+}
+
+/* An RGB monitor profile of 'length' bytes (a multiple of 4, at least 160)
+ * that passes libpng's checks: the header and one tag holding filler.
+ */
+static bytes
+make_profile (png_uint_32 length, png_uint_32 seed)
+{
+   static const png_byte d50[12] =
+   {
+      0x00, 0x00, 0xf6, 0xd6, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0xd3, 0x2d
+   };
+   bytes profile(length);
+
+   put_uint_32(profile.data(), length);
+   put_uint_32(profile.data() + 8, 0x02100000U);     /* version 2.1 */
+   memcpy(profile.data() + 12, "mntrRGB XYZ ", 12);
+   memcpy(profile.data() + 36, "acsp", 4);
+   memcpy(profile.data() + 68, d50, sizeof d50);
+   put_uint_32(profile.data() + 128, 1);             /* tag count */
+   memcpy(profile.data() + 132, "desc", 4);
+   put_uint_32(profile.data() + 136, 144);
+   put_uint_32(profile.data() + 140, length - 144);
+
+   for (png_uint_32 i = 144; i < length; ++i)
+   {
+      seed = seed * 1103515245U + 12345U;
+      profile[i] = (png_byte)("profile data "[i % 13] + ((seed >> 29) & 1));
+   }
+
+   return profile;
+}
+
+/* Allocations through a png_struct, counted by png_set_mem_fn. */
+static png_voidp
+count_malloc (const png_struct *png_ptr, size_t size)
+{
+   *(size_t*)png_get_mem_ptr(png_ptr) += size;
+   return malloc(size);
+}
+
+static void
+count_free (const png_struct *png_ptr, png_voidp ptr)
+{
+   (void)png_ptr;
+   free(ptr);
+}
+
+/* An image with an iCCP chunk, zTXt and compressed iTXt before the image and
+ * zTXt after it, written with 'cache' if not NULL; 'allocated' is set to the
+ * bytes allocated.
+ */
+static bytes
+encode_compressed_chunks (const bytes &profile, const char *text,
+    png_compress_cachep cache, size_t *allocated)
+{
+   image_spec s = spec(40, 30, 8, PNG_COLOR_TYPE_RGB);
+   bytes pixels = make_pixels(s, 15);
+   bytes out;
+   write_png w(out);
+   png_text t[2];
+
+   *allocated = 0;
+   png_set_mem_fn(w.png_ptr, allocated, count_malloc, count_free);
+   png_set_IHDR(w.png_ptr, w.info_ptr, s.width, s.height, s.bit_depth,
+       s.color_type, s.interlace, PNG_COMPRESSION_TYPE_BASE,
+       PNG_FILTER_TYPE_BASE);
+   png_set_iCCP(w.png_ptr, w.info_ptr, "test profile", 0, profile.data(),
+       (png_uint_32)profile.size());
+
+   if (cache != nullptr)
+      png_set_compress_cache(w.png_ptr, cache);
+
+   memset(t, 0, sizeof t);
+   t[0].compression = PNG_TEXT_COMPRESSION_zTXt;
+   t[0].key = const_cast<char*>("Description");
+   t[0].text = const_cast<char*>(text);
+   t[1].compression = PNG_ITXT_COMPRESSION_zTXt;
+   t[1].key = const_cast<char*>("XML:com.adobe.xmp");
+   t[1].text = const_cast<char*>(text + 100);
+   png_set_text(w.png_ptr, w.info_ptr, t, 2);
+
+   png_write_info(w.png_ptr, w.info_ptr);
+   write_rows(w.png_ptr, s, pixels);
+   add_text(w.png_ptr, w.info_ptr, "Comment", text + 200,
+       PNG_TEXT_COMPRESSION_zTXt);
+   png_write_end(w.png_ptr, w.info_ptr);
+   return out;
+}
+
+/* A compress cache gives the same output, and a second image with the same
+ * chunks compresses none of them.
+ */
+static void
+test_compress_cache (void)
+{
+   bytes profile = make_profile(4000, 16);
+   std::string text;
+   png_compress_cachep cache = png_create_compress_cache(0);
+   size_t plain_bytes, first_bytes, second_bytes;
+   bytes plain, first, second;
+
+   for (int i = 0; text.size() < 12000; ++i)
+      text += "word" + std::to_string(i * 7919 % 1000) + (i % 11 ? " " : "\n");
+
+   CHECK(cache != nullptr);
+
+   if (cache == nullptr)
+      return;
+
+   try
+   {
+      plain = encode_compressed_chunks(profile, text.c_str(), nullptr,
+          &plain_bytes);
+      first = encode_compressed_chunks(profile, text.c_str(), cache,
+          &first_bytes);
+      second = encode_compressed_chunks(profile, text.c_str(), cache,
+          &second_bytes);
+   }
+
+   catch (...)
+   {
+      png_destroy_compress_cache(cache);
+      throw;
+   }
+
+   png_destroy_compress_cache(cache);
+
+   CHECK(count_chunks(plain, "iCCP") == 1);
+   CHECK(count_chunks(plain, "zTXt") == 2);
+   CHECK(count_chunks(plain, "iTXt") == 1);
+   CHECK(first == plain);
+   CHECK(second == plain);
+
+   /* The hits need no z_streams, which are much larger than the data. */
+   CHECK(first_bytes >= plain_bytes);
+   CHECK(second_bytes + 65536 < first_bytes);
+
+   {
+      memory_input in(plain);
+      read_png r(in);
+      png_charp name;
+      int compression;
+      png_bytep data;
+      png_uint_32 length;
+      png_textp t;
+      int n;
+
+      png_read_info(r.png_ptr, r.info_ptr);
+      CHECK(png_get_iCCP(r.png_ptr, r.info_ptr, &name, &compression, &data,
+          &length) != 0);
+      CHECK(length == profile.size() &&
+          memcmp(data, profile.data(), length) == 0);
+
+      n = png_get_text(r.png_ptr, r.info_ptr, &t, nullptr);
+      CHECK(n == 2 && strcmp(t[1].text, text.c_str() + 100) == 0);
+   }
+}
+
+/* The bytes allocated by png_read_info, which decompresses an iCCP profile
+ * unless the ICC cache has it.
+ */
+static size_t
+read_info_allocated (const bytes &file, const bytes &profile)
+{
+   memory_input in(file);
+   read_png r(in);
+   size_t allocated = 0;
+   png_charp name;
+   int compression;
+   png_bytep data;
+   png_uint_32 length;
+
+   png_set_mem_fn(r.png_ptr, &allocated, count_malloc, count_free);
+   png_read_info(r.png_ptr, r.info_ptr);
+
+   CHECK(png_get_iCCP(r.png_ptr, r.info_ptr, &name, &compression, &data,
+       &length) != 0);
+   CHECK(length == profile.size() && memcmp(data, profile.data(), length) == 0);
+
+   return allocated;
+}
+
+/* png_set_icc_cache_size: hits, the least recently used profile dropped, and
+ * the cache disabled.  A miss allocates an inflate stream, a hit does not.
+ */
+static void
+test_icc_cache (void)
+{
+   std::string text(300, 'x');
+   bytes a = make_profile(4000, 17), b = make_profile(4000, 18);
+   bytes file_a, file_b;
+   size_t allocated, miss, hit, previous;
+
+   file_a = encode_compressed_chunks(a, text.c_str(), nullptr, &allocated);
+   file_b = encode_compressed_chunks(b, text.c_str(), nullptr, &allocated);
+
+   /* Start empty, with room for both. */
+   previous = png_set_icc_cache_size(0);
+   CHECK(png_set_icc_cache_size(1024 * 1024) == 0);
+
+   miss = read_info_allocated(file_a, a);
+   hit = read_info_allocated(file_a, a);
+   CHECK(hit + 2048 < miss);
+   CHECK(read_info_allocated(file_b, b) >= miss);
+   CHECK(read_info_allocated(file_a, a) + 2048 < miss);
+   CHECK(read_info_allocated(file_b, b) + 2048 < miss);
+
+   /* Room for one: b drops a, then a drops b. */
+   CHECK(png_set_icc_cache_size(2 * chunk_data(file_a, "iCCP").size() +
+       a.size()) == 1024 * 1024);
+   CHECK(read_info_allocated(file_b, b) + 2048 < miss);
+   CHECK(read_info_allocated(file_a, a) >= miss);
+   CHECK(read_info_allocated(file_a, a) + 2048 < miss);
+   CHECK(read_info_allocated(file_b, b) >= miss);
+
+   /* Disabled; the compressed data is not copied either, so compare with a
+    * hit.
+    */
+   png_set_icc_cache_size(0);
+   CHECK(read_info_allocated(file_a, a) > hit + 2048);
+   CHECK(read_info_allocated(file_a, a) > hit + 2048);
+
+   png_set_icc_cache_size(previous);
+}
+
+/* The bytes checksummed in 'file': each chunk's type and data. */
+static png_off_t
+crc_bytes (const bytes &file)
+{
+   return (png_off_t)(file.size() - 8 - 8 * list_chunks(file).size());
+}
+
+/* png_set_stats and png_get_stats on a write and a read of the same image,
+ * and with the counters left off or turned off.
+ */
+static void
+test_stats (void)
+{
+   image_spec s = spec(97, 61, 8, PNG_COLOR_TYPE_RGB);
+   bytes pixels = make_pixels(s, 23), file;
+   png_off_t filtered = (png_off_t)s.height * (rowbytes(s) + 1);
+   png_stage_stats stats[PNG_STAT_COUNT + 1];
+
+   {
+      write_png w(file);
+
+      CHECK(png_get_stats(w.png_ptr, stats, PNG_STAT_COUNT) == 0);
+      png_set_stats(w.png_ptr, 1);
+      png_set_IHDR(w.png_ptr, w.info_ptr, s.width, s.height, s.bit_depth,
+          s.color_type, s.interlace, PNG_COMPRESSION_TYPE_BASE,
+          PNG_FILTER_TYPE_BASE);
+      png_write_info(w.png_ptr, w.info_ptr);
+      write_rows(w.png_ptr, s, pixels);
+      png_write_end(w.png_ptr, w.info_ptr);
+
+      CHECK(png_get_stats(w.png_ptr, stats, PNG_STAT_COUNT + 1) ==
+          PNG_STAT_COUNT);
+      CHECK(stats[PNG_STAT_WRITE_DATA].calls > 0);
+      CHECK(stats[PNG_STAT_WRITE_DATA].bytes == (png_off_t)file.size());
+      CHECK(stats[PNG_STAT_CRC].bytes == crc_bytes(file));
+      CHECK(stats[PNG_STAT_DEFLATE].bytes == filtered);
+      CHECK(stats[PNG_STAT_FILTER].calls == s.height);
+      CHECK(stats[PNG_STAT_FILTER].bytes == filtered - s.height);
+
+      /* Nothing read. */
+      CHECK(stats[PNG_STAT_READ_DATA].calls == 0);
+      CHECK(stats[PNG_STAT_INFLATE].calls == 0);
+
+      png_set_stats(w.png_ptr, 0);
+      CHECK(png_get_stats(w.png_ptr, stats, PNG_STAT_COUNT) == 0);
+   }
+
+   CHECK(decode(file) == pixels);
+
+   {
+      memory_input in(file);
+      read_png r(in);
+      bytes row(rowbytes(s));
+
+      png_set_stats(r.png_ptr, 1);
+      png_read_info(r.png_ptr, r.info_ptr);
+
+      for (png_uint_32 y = 0; y < s.height; ++y)
+         png_read_row(r.png_ptr, row.data(), nullptr);
+
+      png_read_end(r.png_ptr, nullptr);
+
+      CHECK(png_get_stats(r.png_ptr, stats, 3) == 3);
+      CHECK(stats[PNG_STAT_READ_DATA].bytes == (png_off_t)file.size());
+      CHECK(stats[PNG_STAT_CRC].bytes == crc_bytes(file));
+      CHECK(stats[PNG_STAT_INFLATE].bytes == filtered);
+
+      CHECK(png_get_stats(r.png_ptr, stats, PNG_STAT_COUNT) ==
+          PNG_STAT_COUNT);
+      CHECK(stats[PNG_STAT_COMBINE_ROW].calls == s.height);
+      CHECK(stats[PNG_STAT_UNFILTER].bytes <= filtered);
+      CHECK(stats[PNG_STAT_WRITE_DATA].calls == 0);
+      CHECK(stats[PNG_STAT_DEFLATE].calls == 0);
+
+      /* Turned on again, the counters start from 0. */
+      png_set_stats(r.png_ptr, 1);
+      CHECK(png_get_stats(r.png_ptr, stats, PNG_STAT_COUNT) ==
+          PNG_STAT_COUNT);
+      CHECK(stats[PNG_STAT_READ_DATA].calls == 0);
+   }
+
+   {
+      memory_input in(file);
+      read_png r(in);
+
+      png_read_info(r.png_ptr, r.info_ptr);
+      CHECK(png_get_stats(r.png_ptr, stats, PNG_STAT_COUNT) == 0);
+   }
+}
+
+static void
+read_tight (const bytes &file)
+{
+   memory_input in(file);
+   read_png r(in);
+   png_uint_32 height;
+   bytes row;
+
+   png_set_mem_budget(r.png_ptr, 4096);
+   png_read_info(r.png_ptr, r.info_ptr);
+   height = png_get_image_height(r.png_ptr, r.info_ptr);
+   row.resize(png_get_rowbytes(r.png_ptr, r.info_ptr));
+
+   for (png_uint_32 y = 0; y < height; ++y)
+      png_read_row(r.png_ptr, row.data(), nullptr);
+}
+
+static size_t write_budget;
+
+static void
+write_tight (const bytes &pixels)
+{
+   image_spec s = spec(120, 90, 8, PNG_COLOR_TYPE_RGB);
+   bytes out;
+   write_png w(out);
+
+   png_set_mem_budget(w.png_ptr, write_budget);
+   png_set_IHDR(w.png_ptr, w.info_ptr, s.width, s.height, s.bit_depth,
+       s.color_type, s.interlace, PNG_COMPRESSION_TYPE_BASE,
+       PNG_FILTER_TYPE_BASE);
+   png_set_encode_speed(w.png_ptr, PNG_ENCODE_SPEED_SMALLEST);
+   png_write_info(w.png_ptr, w.info_ptr);
+   write_rows(w.png_ptr, s, pixels);
+   png_write_end(w.png_ptr, w.info_ptr);
+
+   {
+      png_mem_stats stats;
+
+      CHECK(png_get_mem_stats(w.png_ptr, &stats) == 1);
+      CHECK(stats.peak > 0 && stats.peak <= write_budget);
+      CHECK(stats.budget == write_budget);
+   }
+
+   CHECK(decode(out) == pixels);
+}
+
+/* png_transcode to Adam7, which holds the whole image, under a budget of
+ * 200000 bytes; with 'interlace' PNG_INTERLACE_NONE it streams rows instead.
+ */
+static int transcode_interlace;
+
+static void
+transcode_tight (const bytes &file)
+{
+   memory_input in(file);
+   read_png r(in);
+   bytes out;
+   write_png w(out);
+
+   png_set_mem_budget(r.png_ptr, 200000);
+   png_read_info(r.png_ptr, r.info_ptr);
+   png_transcode(r.png_ptr, r.info_ptr, w.png_ptr, transcode_interlace);
+   CHECK(decode(out) == decode(file));
+}
+
+/* png_set_mem_budget: counting, and failing reads and writes over it. */
+static void
+test_budget (void)
+{
+   image_spec s = spec(120, 90, 8, PNG_COLOR_TYPE_RGB);
+   bytes pixels = make_pixels(s, 14);
+   bytes file = encode(s, pixels);
+
+   {
+      memory_input in(file);
+      read_png r(in);
+      png_mem_stats stats;
+      bytes row(rowbytes(s));
+
+      CHECK(png_get_mem_stats(r.png_ptr, &stats) == 0);
+
+      png_set_mem_budget(r.png_ptr, 0);
+      png_read_info(r.png_ptr, r.info_ptr);
+
+      for (png_uint_32 y = 0; y < s.height; ++y)
+         png_read_row(r.png_ptr, row.data(), nullptr);
+
+      png_read_end(r.png_ptr, nullptr);
+
+      CHECK(png_get_mem_stats(r.png_ptr, &stats) == 1);
+      CHECK(stats.budget == 0);
+      CHECK(stats.allocs > 0);
+      CHECK(stats.peak > 0 && stats.current <= stats.peak);
+   }
+
+   /* Too little even for zlib, which reports the failed allocation. */
+   CHECK(throws(read_tight, file, "insufficient memory"));
+
+   /* The trial compressions of the smallest tier, workers included. */
+   write_budget = 64 * 1024;
+
+   try
+   {
+      write_tight(pixels);
+      CHECK(0);
+   }
+
+   catch (const png::error &e)
+   {
+      CHECK(strstr(e.what(), "budget") != nullptr);
+   }
+
+   write_budget = 256 * 1024 * 1024;
+   write_tight(pixels);
+
+   /* A 300x300 RGB image is 270000 bytes. */
+   {
+      image_spec big = spec(300, 300, 8, PNG_COLOR_TYPE_RGB);
+
+      file = encode(big, make_pixels(big, 15));
+      transcode_interlace = PNG_INTERLACE_ADAM7;
+      CHECK(throws(transcode_tight, file, "memory budget"));
+      transcode_interlace = PNG_INTERLACE_NONE;
+      transcode_tight(file);
+   }
+}
+
+/* The limits read_limited passes to png_set_work_limits, and whether it reads
+ * the file slowly.
+ */
+static png_off_t limit_inflated, limit_pixels;
+static png_uint_32 limit_chunks, limit_milliseconds;
+static int limit_slow;
+
+static void
+slow_read_data (png_struct *png_ptr, png_bytep out, size_t length)
+{
+   std::this_thread::sleep_for(std::chrono::milliseconds(2));
+   read_data(png_ptr, out, length);
+}
+
+/* A whole read with the alpha channel stripped, so every pixel goes through
+ * the read transformations.
+ */
+static void
+read_limited (const bytes &file)
+{
+   memory_input in(file);
+   read_png r(in);
+   bytes row;
+
+   if (limit_slow)
+      png_set_read_fn(r.png_ptr, &in, slow_read_data);
+
+   png_set_work_limits(r.png_ptr, limit_inflated, limit_chunks, limit_pixels,
+       limit_milliseconds);
+   png_read_info(r.png_ptr, r.info_ptr);
+   png_set_strip_alpha(r.png_ptr);
+   png_read_update_info(r.png_ptr, r.info_ptr);
+   row.resize(png_get_rowbytes(r.png_ptr, r.info_ptr));
+
+   for (png_uint_32 y = 0; y < png_get_image_height(r.png_ptr, r.info_ptr);
+        ++y)
+      png_read_row(r.png_ptr, row.data(), nullptr);
+
+   png_read_end(r.png_ptr, nullptr);
+}
+
+/* Whether read_limited, with only the given limits, fails with 'message'. */
+static int
+exceeds (const bytes &file, png_off_t inflated, png_uint_32 chunks,
+    png_off_t pixels, png_uint_32 milliseconds, const char *message)
+{
+   limit_inflated = inflated;
+   limit_chunks = chunks;
+   limit_pixels = pixels;
+   limit_milliseconds = milliseconds;
+   return throws(read_limited, file, message);
+}
+
+/* png_set_work_limits: each limit reached exactly, then passed. */
+static void
+test_work_limits (void)
+{
+   image_spec s = spec(50, 30, 8, PNG_COLOR_TYPE_RGB_ALPHA);
+   bytes file;
+   png_off_t inflated = (png_off_t)s.height * (rowbytes(s) + 1);
+   png_off_t pixels = (png_off_t)s.width * s.height;
+   png_uint_32 chunks;
+
+   s.idat_size = 1000;
+   file = encode(s, make_pixels(s, 16));
+   chunks = (png_uint_32)list_chunks(file).size();
+   CHECK(count_chunks(file, "IDAT") > 2);
+
+   CHECK(!exceeds(file, inflated, 0, 0, 0, nullptr));
+   CHECK(exceeds(file, inflated - 1, 0, 0, 0,
+       "inflated data exceeds the work limit"));
+
+   CHECK(!exceeds(file, 0, chunks, 0, 0, nullptr));
+   CHECK(exceeds(file, 0, chunks - 1, 0, 0,
+       "number of chunks exceeds the work limit"));
+
+   CHECK(!exceeds(file, 0, 0, pixels, 0, nullptr));
+   CHECK(exceeds(file, 0, 0, pixels - 1, 0,
+       "transformed pixels exceed the work limit"));
+
+   CHECK(!exceeds(file, 0, 0, 0, 60000, nullptr));
+   limit_slow = 1;
+   CHECK(exceeds(file, 0, 0, 0, 1, "decode deadline exceeded"));
+   limit_slow = 0;
+
+   /* All 0 removes the limits. */
+   CHECK(!exceeds(file, 0, 0, 0, 0, nullptr));
+}
+
+/* The calls to filter rows of 's' written whole: one when the passes are
+ * filtered on worker threads, one per pass row otherwise.
+ */
+static png_off_t
+adam7_filter_calls (const image_spec &s, const bytes &pixels)
+{
+   bytes out;
+   png_stage_stats stats[PNG_STAT_COUNT];
+
+   {
+      write_png w(out);
+      std::vector<png_bytep> rows(s.height);
+
+      png_set_stats(w.png_ptr, 1);
+      png_set_IHDR(w.png_ptr, w.info_ptr, s.width, s.height, s.bit_depth,
+          s.color_type, s.interlace, PNG_COMPRESSION_TYPE_BASE,
+          PNG_FILTER_TYPE_BASE);
+      png_write_info(w.png_ptr, w.info_ptr);
+
+      for (png_uint_32 y = 0; y < s.height; ++y)
+         rows[y] = const_cast<png_bytep>(pixels.data()) + y * rowbytes(s);
+
+      png_write_image(w.png_ptr, rows.data());
+      png_write_end(w.png_ptr, w.info_ptr);
+      CHECK(png_get_stats(w.png_ptr, stats, PNG_STAT_COUNT) == PNG_STAT_COUNT);
+   }
+
+   CHECK(decode(out, 1) == pixels);
+   return stats[PNG_STAT_FILTER].calls;
+}
+
+/* Interlaced images written whole, where the passes may be encoded on worker
+ * threads, and read whole and row by row.
+ */
+static void
+test_adam7 (void)
+{
+   static const int formats[][2] =
+   {
+      { 1, PNG_COLOR_TYPE_GRAY },
+      { 4, PNG_COLOR_TYPE_GRAY },
+      { 8, PNG_COLOR_TYPE_RGB },
+      { 8, PNG_COLOR_TYPE_GRAY_ALPHA },
+      { 16, PNG_COLOR_TYPE_RGB_ALPHA }
+   };
+   static const png_uint_32 sizes[][2] =
+   {
+      { 1, 1 }, { 7, 3 }, { 33, 17 }, { 257, 190 }
+   };
+
+   for (size_t f = 0; f < sizeof formats / sizeof formats[0]; ++f)
+      for (size_t n = 0; n < sizeof sizes / sizeof sizes[0]; ++n)
+      {
+         image_spec s = spec(sizes[n][0], sizes[n][1], formats[f][0],
+             formats[f][1], PNG_INTERLACE_ADAM7);
+         bytes pixels = make_pixels(s, (png_uint_32)(f * 10 + n));
+         bytes file;
+
+         s.whole_image = 1;
+         file = encode(s, pixels);
+         CHECK(decode(file, 1) == pixels);
+         CHECK(decode(file, 0) == pixels);
+      }
+
+   /* Over the 1MB below which the passes are written serially, with the
+    * thread count forced so that the bands are spread whatever the machine.
+    */
+   {
+      image_spec s = spec(640, 480, 16, PNG_COLOR_TYPE_RGB_ALPHA,
+          PNG_INTERLACE_ADAM7);
+      bytes pixels = make_pixels(s, 99);
+      unsigned int threads = png_thread_set_count(4);
+      bytes file;
+
+      s.whole_image = 1;
+      file = encode(s, pixels);
+      CHECK(decode(file, 1) == pixels);
+      CHECK(decode(file, 0) == pixels);
+      CHECK(adam7_filter_calls(s, pixels) == 1);
+
+      png_thread_set_count(1);
+      CHECK(adam7_filter_calls(s, pixels) > s.height);
+      CHECK(encode(s, pixels) != file);
+
+      png_thread_set_count(threads);
+   }
+}
+
+/* One png_image_batch_read of 'files', with a job that is not a PNG and one
+ * whose buffer is too small after them, checked against 'expect'.
+ */
+static void
+batch_run (const std::vector<bytes> &files, const std::vector<bytes> &expect,
+    const std::vector<int> &status)
+{
+   static const png_byte junk[16] = { 'n', 'o', 't', ' ', 'p', 'n', 'g' };
+   size_t count = files.size();
+   std::vector<png_image_batch_job> jobs(count + 2);
+   std::vector<bytes> out(count);
+   png_byte tiny[4];
+
+   memset(jobs.data(), 0, jobs.size() * sizeof jobs[0]);
+
+   for (size_t i = 0; i < count; ++i)
+   {
+      png_image_batch_job *job = &jobs[i];
+
+      out[i].assign(expect[i].size(), 0);
+      job->memory = files[i].data();
+      job->memory_size = files[i].size();
+      job->image.version = PNG_IMAGE_VERSION;
+      job->image.format = i % 3 == 2 ? PNG_FORMAT_LINEAR_Y : PNG_FORMAT_RGB;
+      job->buffer = out[i].data();
+      job->buffer_size = out[i].size();
+   }
+
+   jobs[count].memory = junk;
+   jobs[count].memory_size = sizeof junk;
+   jobs[count].image.version = PNG_IMAGE_VERSION;
+   jobs[count].buffer = tiny;
+   jobs[count].buffer_size = sizeof tiny;
+
+   jobs[count+1].memory = files[count-1].data();
+   jobs[count+1].memory_size = files[count-1].size();
+   jobs[count+1].image.version = PNG_IMAGE_VERSION;
+   jobs[count+1].image.format = PNG_FORMAT_RGB;
+   jobs[count+1].buffer = tiny;
+   jobs[count+1].buffer_size = sizeof tiny;
+
+   CHECK(png_image_batch_read(jobs.data(), jobs.size()) == (int)count);
+
+   for (size_t i = 0; i < count; ++i)
+   {
+      CHECK(jobs[i].status == status[i]);
+      CHECK(out[i] == expect[i]);
+   }
+
+   CHECK(jobs[count].status == 0);
+
+   /* Too small: the size is there for a second try. */
+   CHECK(jobs[count+1].status == 0);
+   CHECK(jobs[count+1].image.width == 10 + 23 * (count - 1));
+   CHECK(jobs[count+1].image.height == 7 + 11 * (count - 1));
+}
+
+/* png_image_batch_read against png_image_finish_read one image at a time,
+ * also in a child process after the parent has started the pool threads.
+ */
+static void
+test_batch (void)
+{
+   static const size_t count = 12;
+   std::vector<bytes> files(count), expect(count);
+   std::vector<int> status(count);
+   int done = 0;
+   unsigned int threads;
+
+   for (size_t i = 0; i < count; ++i)
+   {
+      image_spec s = spec((png_uint_32)(10 + 23 * i), (png_uint_32)(7 + 11 * i),
+          i % 3 == 2 ? 16 : 8,
+          i % 3 == 2 ? PNG_COLOR_TYPE_GRAY : PNG_COLOR_TYPE_RGB,
+          i % 4 == 1 ? PNG_INTERLACE_ADAM7 : PNG_INTERLACE_NONE);
+      png_image image;
+
+      files[i] = encode(s, make_pixels(s, (png_uint_32)(100 + i)));
+
+      memset(&image, 0, sizeof image);
+      image.version = PNG_IMAGE_VERSION;
+      CHECK(png_image_begin_read_from_memory(&image, files[i].data(),
+          files[i].size()));
+      image.format = s.bit_depth == 16 ? PNG_FORMAT_LINEAR_Y :
+         PNG_FORMAT_RGB;
+      expect[i].resize(PNG_IMAGE_SIZE(image));
+      status[i] = png_image_finish_read(&image, nullptr, expect[i].data(), 0,
+          nullptr);
+      done += status[i] != 0;
+   }
+
+   CHECK(done == (int)count);
+
+   /* Twice, so the second batch runs on threads kept from the first; the
+    * thread count is forced so that there are pool threads on any machine.
+    */
+   threads = png_thread_set_count(4);
+   batch_run(files, expect, status);
+   batch_run(files, expect, status);
+
+#ifndef _WIN32
+   /* A child process has none of the pool threads and must start its own.
+    * The alarm ends the child if it waits for the parent's.
+    */
+   {
+      pid_t child;
+      int child_status = 0;
+
+      fflush(stderr);
+      child = fork();
+      CHECK(child >= 0);
+
+      if (child == 0)
+      {
+         int before = failures;
+
+         alarm(30);
+         batch_run(files, expect, status);
+         _exit(failures != before);
+      }
+
+      if (child > 0)
+      {
+         CHECK(waitpid(child, &child_status, 0) == child);
+         CHECK(WIFEXITED(child_status) && WEXITSTATUS(child_status) == 0);
+      }
+   }
+
+   /* The parent's pool still works. */
+   batch_run(files, expect, status);
+#endif
+
+   png_thread_set_count(threads);
+}
+
+int
+main (void)
+{
+   static void (*const tests[])(void) =
+   {
+      test_metadata, test_probe, test_verify, test_index, test_encode_cache,
+      test_quantize, test_reduce, test_tiers, test_rewrite, test_recompress,
+      test_transcode, test_compress_cache, test_icc_cache, test_stats,
+      test_budget, test_work_limits, test_adam7, test_batch
+   };
+
+   for (size_t i = 0; i < sizeof tests / sizeof tests[0]; ++i)
+   {
+      try
+      {
+         tests[i]();
+      }
+
+      catch (const std::exception &e)
+      {
+         fprintf(stderr, "pngapitest: unexpected exception: %s\n", e.what());
+         ++failures;
+      }
+   }
+
+   if (failures > 0)
+   {
+      fprintf(stderr, "pngapitest: %d checks failed\n", failures);
+      return 1;
+   }
+
+   printf("pngapitest: passed\n");
+   return 0;
+}
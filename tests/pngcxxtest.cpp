@@ -0,0 +1,350 @@
+/* pngcxxtest.cpp - test the C++ interface in pngcxx.h
+ *
+ * This code is released under the libpng license.
+ * For conditions of distribution and use, see the disclaimer
+ * and license in png.h
+ *
+ * Images are encoded with png::writer into memory and decoded again with
+ * png::reader, from memory and from a png::source, both plain and
+ * interlaced, and with a counting png::allocator.  The errors libpng reports
+ * must arrive as png::error and leave nothing allocated.
+ *
+ * Exits with 0 and prints "pngcxxtest: passed" if every check passes.
+ */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <string.h>
+
+#include <utility>
+#include <vector>
+
+#include <png/pngcxx.h>
+
+static int failures = 0;
+
+#define CHECK(cond) \
+   do { if (!(cond)) { ++failures; \
+      fprintf(stderr, "pngcxxtest: %s:%d: check failed: %s\n", __FILE__, \
+          __LINE__, #cond); } } while (0)
+
+class memory_sink : public png::sink
+{
+public:
+   memory_sink () : flushes(0) {}
+   void write (png_const_bytep data, size_t length) override
+      { bytes.insert(bytes.end(), data, data + length); }
+   void flush () override { ++flushes; }
+
+   std::vector<png_byte> bytes;
+   int flushes;
+};
+
+class memory_source : public png::source
+{
+public:
+   explicit memory_source (const std::vector<png_byte> &data)
+      : data_(data), pos_(0) {}
+   void read (png_bytep data, size_t length) override
+   {
+      if (length > data_.size() - pos_)
+         throw png::error("memory_source: end of data");
+
+      memcpy(data, data_.data() + pos_, length);
+      pos_ += length;
+   }
+
+private:
+   const std::vector<png_byte> &data_;
+   size_t pos_;
+};
+
+class counting_allocator : public png::allocator
+{
+public:
+   counting_allocator () : live(0), total(0) {}
+   void *allocate (size_t size) override
+   {
+      void *ptr = malloc(size);
+
+      if (ptr != nullptr)
+         ++live, ++total;
+
+      return ptr;
+   }
+   void deallocate (void *ptr) override
+   {
+      if (ptr != nullptr)
+         --live;
+
+      free(ptr);
+   }
+
+   long live, total;
+};
+
+static const png_uint_32 width = 37, height = 23;
+
+static std::vector<png_byte>
+make_pixels (void)
+{
+   std::vector<png_byte> pixels(width * height * 4);
+
+   for (size_t i = 0; i < pixels.size(); ++i)
+      pixels[i] = (png_byte)(i * 7 + (i >> 5));
+
+   return pixels;
+}
+
+static std::vector<png_byte>
+encode (const std::vector<png_byte> &pixels, int interlace,
+    png::allocator *alloc)
+{
+   memory_sink out;
+   png::writer w(out, alloc);
+   png_text text[1];
+
+   memset(text, 0, sizeof text);
+   text[0].compression = PNG_TEXT_COMPRESSION_NONE;
+   text[0].key = const_cast<char*>("Comment");
+   text[0].text = const_cast<char*>("pngcxxtest");
+
+   w.set_header(width, height, 8, PNG_COLOR_TYPE_RGB_ALPHA, interlace);
+   w.set_text(png::view<const png_text>(text, 1));
+   w.write_info();
+
+   if (w.passes() == 1)
+      for (png_uint_32 y = 0; y < height; ++y)
+         w.write_row(pixels.data() + y * width * 4, width * 4);
+
+   else
+      w.write_image(pixels.data(), pixels.size());
+
+   w.finish();
+   return out.bytes;
+}
+
+static void
+check_decode (png::reader &r, const std::vector<png_byte> &pixels,
+    int interlace)
+{
+   std::vector<png_byte> image(pixels.size());
+
+   r.read_info();
+   CHECK(r.width() == width);
+   CHECK(r.height() == height);
+   CHECK(r.color_type() == PNG_COLOR_TYPE_RGB_ALPHA);
+   CHECK(r.interlace_type() == interlace);
+   CHECK(r.rowbytes() == width * 4);
+   CHECK(r.passes() == (interlace != PNG_INTERLACE_NONE ? 7 : 1));
+
+   r.read_image(image.data(), image.size());
+   r.read_end();
+   CHECK(image == pixels);
+
+   png::view<const png_text> text = r.text();
+   CHECK(text.size() == 1);
+
+   if (text.size() == 1)
+   {
+      CHECK(strcmp(text[0].key, "Comment") == 0);
+      CHECK(strcmp(text[0].text, "pngcxxtest") == 0);
+   }
+}
+
+static void
+test_round_trip (int interlace)
+{
+   std::vector<png_byte> pixels = make_pixels();
+   std::vector<png_byte> file = encode(pixels, interlace, nullptr);
+
+   {
+      png::reader r(file.data(), file.size());
+      check_decode(r, pixels, interlace);
+   }
+
+   {
+      memory_source in(file);
+      png::reader r(in);
+      check_decode(r, pixels, interlace);
+   }
+
+   /* A moved reader carries on where the original stopped. */
+   {
+      png::reader a(file.data(), file.size());
+      a.read_info();
+
+      png::reader b(std::move(a));
+      CHECK(a.get() == nullptr);
+
+      std::vector<png_byte> row(width * 4);
+      b.read_row(row.data(), row.size());
+
+      if (interlace == PNG_INTERLACE_NONE)
+         CHECK(memcmp(row.data(), pixels.data(), row.size()) == 0);
+   }
+}
+
+static void
+test_errors (void)
+{
+   std::vector<png_byte> pixels = make_pixels();
+   std::vector<png_byte> file = encode(pixels, PNG_INTERLACE_NONE, nullptr);
+   int thrown;
+
+   /* Truncated data: the memory reader's png_error arrives as png::error. */
+   thrown = 0;
+
+   try
+   {
+      png::reader r(file.data(), file.size() / 2);
+      std::vector<png_byte> image(pixels.size());
+
+      r.read_info();
+      r.read_image(image.data(), image.size());
+   }
+
+   catch (const png::error &)
+   {
+      thrown = 1;
+   }
+
+   CHECK(thrown);
+
+   /* A row buffer that is too small. */
+   thrown = 0;
+
+   try
+   {
+      png::reader r(file.data(), file.size());
+      png_byte row[8];
+
+      r.read_info();
+      r.read_row(row, sizeof row);
+   }
+
+   catch (const png::error &e)
+   {
+      thrown = strstr(e.what(), "too small") != nullptr;
+   }
+
+   CHECK(thrown);
+
+   /* Not a PNG at all. */
+   thrown = 0;
+
+   try
+   {
+      static const png_byte junk[64] = { 'n', 'o', 't', ' ', 'p', 'n', 'g' };
+      png::reader r(junk, sizeof junk);
+
+      r.read_info();
+   }
+
+   catch (const png::error &)
+   {
+      thrown = 1;
+   }
+
+   CHECK(thrown);
+
+   /* An exception from the source passes through libpng unchanged. */
+   thrown = 0;
+
+   try
+   {
+      std::vector<png_byte> part(file.begin(), file.begin() + 40);
+      memory_source in(part);
+      png::reader r(in);
+
+      r.read_info();
+   }
+
+   catch (const png::error &e)
+   {
+      thrown = strstr(e.what(), "memory_source") != nullptr;
+   }
+
+   CHECK(thrown);
+
+   /* An invalid header is reported by the writer. */
+   thrown = 0;
+
+   try
+   {
+      memory_sink out;
+      png::writer w(out);
+
+      w.set_header(0, height, 8, PNG_COLOR_TYPE_RGB_ALPHA);
+      w.write_info();
+   }
+
+   catch (const png::error &)
+   {
+      thrown = 1;
+   }
+
+   CHECK(thrown);
+}
+
+static void
+test_allocator (void)
+{
+   counting_allocator alloc;
+   std::vector<png_byte> pixels = make_pixels();
+   std::vector<png_byte> file = encode(pixels, PNG_INTERLACE_NONE, &alloc);
+
+   CHECK(alloc.total > 0);
+   CHECK(alloc.live == 0);
+
+   {
+      png::reader r(file.data(), file.size(), &alloc);
+      check_decode(r, pixels, PNG_INTERLACE_NONE);
+   }
+
+   CHECK(alloc.live == 0);
+
+   /* Unwinding out of libpng frees everything. */
+   try
+   {
+      png::reader r(file.data(), file.size() / 2, &alloc);
+      std::vector<png_byte> image(pixels.size());
+
+      r.read_info();
+      r.read_image(image.data(), image.size());
+   }
+
+   catch (const png::error &)
+   {
+   }
+
+   CHECK(alloc.live == 0);
+}
+
+int
+main (void)
+{
+   try
+   {
+      test_round_trip(PNG_INTERLACE_NONE);
+      test_round_trip(PNG_INTERLACE_ADAM7);
+      test_errors();
+      test_allocator();
+   }
+
+   catch (const std::exception &e)
+   {
+      fprintf(stderr, "pngcxxtest: unexpected exception: %s\n", e.what());
+      ++failures;
+   }
+
+   if (failures > 0)
+   {
+      fprintf(stderr, "pngcxxtest: %d checks failed\n", failures);
+      return 1;
+   }
+
+   printf("pngcxxtest: passed\n");
+   return 0;
+}
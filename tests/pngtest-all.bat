@@ -9,6 +9,12 @@ set BINDIR=%1
 set DATADIR=tests\crashers
 %BINDIR%\pngtest.exe --strict data\pngtest.png
 
+rem the C++ interface
+%BINDIR%\pngcxxtest.exe
+
+rem the metadata, verify, index, rewrite and encode APIs
+%BINDIR%\pngapitest.exe
+
 rem various crashers
 rem using --relaxed because some come from fuzzers that don't maintain CRC's
 